@@ -89,14 +89,9 @@ extern float EULER = 2.718281828459045235360287471352;
 #undef abs
 #endif
 
-#define min(a,b) ((a)<(b)?(a):(b))
-#define max(a,b) ((a)>(b)?(a):(b))
-#define abs(x) ((x)>0?(x):-(x))
-#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+// min, max, abs, constrain, radians, degrees and sq are declared as templates further down
+// (after the extern "C" block) so that calls to them show up in the AST.
 #define round(x)     ((x)>=0?(long)((x)+0.5):(long)((x)-0.5))
-#define radians(deg) ((deg)*DEG_TO_RAD)
-#define degrees(rad) ((rad)*RAD_TO_DEG)
-#define sq(x) ((x)*(x))
 
 #define interrupts() sei()
 #define noInterrupts() cli()
@@ -105,14 +100,7 @@ extern float EULER = 2.718281828459045235360287471352;
 #define clockCyclesToMicroseconds(a) ( (a) / clockCyclesPerMicrosecond() )
 #define microsecondsToClockCycles(a) ( (a) * clockCyclesPerMicrosecond() )
 
-#define lowByte(w) ((uint8_t) ((w) & 0xff))
-#define highByte(w) ((uint8_t) ((w) >> 8))
-
-#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
-#define bitSet(value, bit) ((value) |= (1UL << (bit)))
-#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
-#define bitToggle(value, bit) ((value) ^= (1UL << (bit)))
-#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+// lowByte, highByte and the bit macros are declared as templates further down as well.
 
 // avr-libc defines _NOP() since 1.6.2
 #ifndef _NOP
@@ -121,8 +109,6 @@ extern float EULER = 2.718281828459045235360287471352;
 
 typedef unsigned int word;
 
-#define bit(b) (1UL << (b))
-
 typedef bool boolean;
 typedef uint8_t byte;
 
@@ -253,6 +239,26 @@ long random(long, long);
 void randomSeed(unsigned long);
 long map(long, long, long, long, long);
 
+// Arduino defines these as macros. They are templates here so the converter sees them as calls;
+// each body is the original macro.
+template<class T, class U> constexpr auto min(T a, U b) -> decltype(a < b ? a : b) { return a < b ? a : b; }
+template<class T, class U> constexpr auto max(T a, U b) -> decltype(a > b ? a : b) { return a > b ? a : b; }
+template<class T> constexpr auto abs(T x) -> decltype(x > 0 ? x : -x) { return x > 0 ? x : -x; }
+template<class T, class L, class H> constexpr auto constrain(T amt, L low, H high) -> decltype(amt < low ? low : (amt > high ? high : amt)) { return amt < low ? low : (amt > high ? high : amt); }
+template<class T> constexpr double radians(T deg) { return deg * 0.017453292519943295769236907684886; }
+template<class T> constexpr double degrees(T rad) { return rad * 57.295779513082320876798154814105; }
+template<class T> constexpr auto sq(T x) -> decltype(x * x) { return x * x; }
+
+template<class T> constexpr uint8_t lowByte(T w) { return (uint8_t) (w & 0xff); }
+template<class T> constexpr uint8_t highByte(T w) { return (uint8_t) (w >> 8); }
+
+template<class T, class U> constexpr T bitRead(T value, U bit) { return (value >> bit) & 0x01; }
+template<class T, class U> T bitSet(T &value, U bit) { return value |= (1UL << bit); }
+template<class T, class U> T bitClear(T &value, U bit) { return value &= ~(1UL << bit); }
+template<class T, class U> T bitToggle(T &value, U bit) { return value ^= (1UL << bit); }
+template<class T, class U, class V> T bitWrite(T &value, U bit, V bitvalue) { return bitvalue ? bitSet(value, bit) : bitClear(value, bit); }
+template<class T> constexpr unsigned long bit(T b) { return 1UL << b; }
+
 #endif
 
 #include "pins_arduino.h"
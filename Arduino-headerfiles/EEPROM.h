@@ -22,6 +22,12 @@
 #define EEPROM_h
 
 #include <inttypes.h>
+
+// There is no device header to give the EEPROM size; this is the ATmega328P's 1 KB.
+#ifndef E2END
+#define E2END 0x3FF
+#endif
+
 #include "eeprom.h"
 #include "io.h"
 
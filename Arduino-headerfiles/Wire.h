@@ -53,6 +53,7 @@ class TwoWire : public Stream
     void begin();
     void begin(uint8_t);
     void begin(int);
+    void begin(int, int, uint32_t = 0); // sda, scl, frequency: the ESP32 core's pin selection
     void end();
     void setClock(uint32_t);
     void setWireTimeout(uint32_t timeout = 25000, bool reset_with_timeout = false);
@@ -0,0 +1,31 @@
+#include "Arduino.h"
+#include "atomic.h"
+
+volatile unsigned long pulses = 0;
+volatile byte lastState = 0;
+
+void countPulse() {
+  pulses++;
+  lastState = digitalRead(2);
+}
+
+void setup() {
+  pinMode(2, INPUT);
+  attachInterrupt(0, countPulse, RISING);
+}
+
+void loop() {
+  unsigned long count;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    count = pulses;
+    pulses = 0;
+  }
+  byte state;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    state = lastState;          // one byte: dropped
+  }
+  noInterrupts();
+  unsigned long snapshot = pulses;
+  interrupts();
+  delay(100);
+}
@@ -0,0 +1,30 @@
+#include "Arduino.h"
+
+// Run with --cost to see what each converted statement costs and which lines of loop() are hottest.
+const int ledPin = 13;
+const int buttonPin = 7;
+int presses = 0;
+float angle = 0;
+
+int blinkTimes(int times) {
+  for (int i = 0; i < times; i++) {
+    digitalWrite(ledPin, HIGH);
+    digitalWrite(ledPin, LOW);
+  }
+  return times;
+}
+
+void setup() {
+  pinMode(ledPin, OUTPUT);
+  pinMode(buttonPin, INPUT);
+}
+
+void loop() {
+  if (digitalRead(buttonPin) == HIGH)
+    presses = blinkTimes(presses + 1);
+  char c = analogRead(0) / 100 + '0';
+  if (isDigit(c))
+    angle = angle + 0.1;
+  analogWrite(9, 127 + 127 * sin(angle));
+  delay(10);
+}
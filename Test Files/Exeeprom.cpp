@@ -0,0 +1,28 @@
+#include "Arduino.h"
+#include "EEPROM.h"
+
+struct Config {
+  int threshold;
+  float scale;
+  char name[8];
+  bool enabled;
+};
+
+Config config;
+int boots = 0;
+
+void setup() {
+  EEPROM.get(0, config);
+  boots = EEPROM.read(32);
+  EEPROM.update(32, boots + 1);
+}
+
+void loop() {
+  int reading = analogRead(0);
+  if (reading > config.threshold) {
+    config.threshold = reading;
+    EEPROM.put(0, config);
+  }
+  EEPROM[33] = reading / 4;
+  delay(1000);
+}
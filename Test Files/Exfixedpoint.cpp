@@ -0,0 +1,20 @@
+#include "Arduino.h"
+
+int sensorPin = 3;
+int ledPin = 9;
+byte step = 0;
+
+void setup() {
+  pinMode(ledPin, OUTPUT);
+}
+
+void loop() {
+  float level = constrain(analogRead(sensorPin) * 0.25, 0.0, 255.0);
+  float phase = step * 0.0245;             // 0 .. 6.25 rad
+  float wave = sin(phase) * 0.5 + 0.5;
+  if (level > 127.5) {
+    analogWrite(ledPin, level * wave);
+  }
+  step++;
+  delay(10);
+}
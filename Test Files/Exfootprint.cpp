@@ -0,0 +1,27 @@
+#include "Arduino.h"
+
+// Run with --footprint (or --ram-budget=<bytes>) to see where the converted sketch keeps RAM.
+const int sensorPin = 2;
+float average = 0;
+unsigned long total = 0;
+int readings[32];
+String label = "temp";
+
+float smooth(float value) {
+  average = average * 0.9 + value * 0.1;
+  return average;
+}
+
+void setup() {
+  Serial.begin(9600);
+}
+
+void loop() {
+  int samples[4];
+  for (int i = 0; i < 4; i++)
+    samples[i] = analogRead(sensorPin);
+  total += samples[0];
+  String line = label + ": " + String(smooth(samples[0]));
+  Serial.println(line);
+  delay(500);
+}
@@ -0,0 +1,24 @@
+#include "Arduino.h"
+
+int sensorPin = 3;
+int ledPin = 9;
+byte flags = 0;
+
+void setup() {
+  pinMode(ledPin, OUTPUT);
+}
+
+void loop() {
+  int raw = analogRead(sensorPin);
+  int level = map(raw, 0, 1023, 0, 255);      // constant ranges: multiply and shift
+  level = constrain(level, 10, 240);
+  int diff = abs(level - 128);
+  int bigger = max(diff, 16);
+  if (bitRead(raw, 9)) {
+    bitSet(flags, 0);
+  } else {
+    bitClear(flags, 0);
+  }
+  analogWrite(ledPin, lowByte(level));
+  delay(min(bigger, 50));
+}
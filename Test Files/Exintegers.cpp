@@ -0,0 +1,25 @@
+#include "Arduino.h"
+
+int sensorPin = 3;
+byte counter = 0;
+unsigned long lastBlink = 0;
+
+void setup() {
+  pinMode(13, OUTPUT);
+}
+
+void loop() {
+  int raw = analogRead(sensorPin);
+  byte level = raw / 4;                 // 0..255: no mask
+  byte reading = raw;                   // 0..1023 into a byte: masked
+  counter++;                            // byte counter wraps at 256
+  for (byte i = 0; i < 10; i++) {       // bounded by the condition: no mask
+    level += i;
+  }
+  int scaled = raw * 40;                // up to 40920 in a 16 bit int
+  if (millis() - lastBlink > 500) {     // millis() rollover
+    lastBlink = millis();
+    digitalWrite(13, counter & 1);
+  }
+  delay(reading + scaled / 1000);
+}
@@ -0,0 +1,23 @@
+#include "Arduino.h"
+
+// loop() runs in a function that binds digitalWrite, delay, sin and the pins to locals before the loop.
+const int ledPin = 13;
+const int sensorPin = 2;
+const int pwmPin = 9;
+float phase = 0;
+
+void setup() {
+  pinMode(ledPin, OUTPUT);
+  pinMode(sensorPin, INPUT);
+}
+
+void loop() {
+  if (digitalRead(sensorPin) == HIGH) {
+    digitalWrite(ledPin, HIGH);
+  } else {
+    digitalWrite(ledPin, LOW);
+  }
+  phase = phase + 0.05;
+  analogWrite(pwmPin, 127 + 127 * sin(phase));
+  delay(5);
+}
@@ -0,0 +1,16 @@
+#include "Arduino.h"
+
+int bits = 10;       // ADC resolution, never changes
+float angle = 0;
+
+void setup() {
+  Serial.begin(9600);
+}
+
+void loop() {
+  float full_scale = pow(2, bits) - 1;   // loop invariant, computed once before the loop
+  float step = PI / 180.0;               // constant, folded at conversion time
+  angle = angle + step;
+  double level = sin(angle) * full_scale;
+  delay(10);
+}
@@ -0,0 +1,23 @@
+#include "Arduino.h"
+
+const int trigPin = 9;
+const int echoPin = 10;
+const int receiverPin = 11;
+
+void setup() {
+  pinMode(trigPin, OUTPUT);
+  pinMode(echoPin, INPUT);
+  pinMode(receiverPin, INPUT);
+}
+
+void loop() {
+  digitalWrite(trigPin, LOW);
+  delayMicroseconds(2);
+  digitalWrite(trigPin, HIGH);
+  delayMicroseconds(10);
+  digitalWrite(trigPin, LOW);
+  long duration = pulseIn(echoPin, HIGH, 30000);   // 0 when no echo comes back within 30 ms
+  long distance = duration / 58;
+  unsigned long channel = pulseIn(receiverPin, HIGH);
+  delay(100);
+}
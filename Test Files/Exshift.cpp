@@ -0,0 +1,37 @@
+#include "Arduino.h"
+
+const int latchPin = 8;
+const int clockPin = 10;
+const int dataPin = 11;
+const int loadPin = 5;
+const int inputPin = 12;
+byte frame[8] = {0x3C, 0x42, 0xA5, 0x81, 0xA5, 0x99, 0x42, 0x3C};
+byte counter = 0;
+byte switches;
+
+void setup() {
+  pinMode(latchPin, OUTPUT);
+  pinMode(clockPin, OUTPUT);
+  pinMode(dataPin, OUTPUT);
+  pinMode(loadPin, OUTPUT);
+}
+
+void loop() {
+  digitalWrite(latchPin, LOW);
+  shiftOut(dataPin, clockPin, MSBFIRST, counter);      // two chained 74HC595s
+  shiftOut(dataPin, clockPin, MSBFIRST, 0xFF);
+  digitalWrite(latchPin, HIGH);
+
+  digitalWrite(latchPin, LOW);
+  for (int row = 0; row < 8; row++) {
+    shiftOut(dataPin, clockPin, LSBFIRST, frame[row]);
+  }
+  digitalWrite(latchPin, HIGH);
+
+  digitalWrite(loadPin, LOW);                          // 74HC165 parallel load
+  digitalWrite(loadPin, HIGH);
+  switches = shiftIn(inputPin, clockPin, MSBFIRST);
+
+  counter++;
+  delay(100);
+}
@@ -0,0 +1,11 @@
+// A sketch in two tabs: blinkTimes() is called before it is defined, in the blink tab.
+const int ledPin = 13;
+
+void setup() {
+  pinMode(ledPin, OUTPUT);
+}
+
+void loop() {
+  blinkTimes(3);
+  delay(1000);
+}
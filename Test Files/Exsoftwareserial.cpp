@@ -0,0 +1,29 @@
+#include "Arduino.h"
+#include "SoftwareSerial.h"
+
+SoftwareSerial gps(5, 4);       // RX, TX
+SoftwareSerial modem(10, 11);
+
+int sentences = 0;
+
+void setup() {
+  gps.begin(9600);
+  modem.begin(9600);
+  modem.println("AT");
+}
+
+void loop() {
+  while (gps.available() > 0) {
+    char c = gps.read();
+    if (c == '$') {
+      sentences++;
+    }
+  }
+  if (modem.available()) {
+    int reply = modem.read();
+    modem.write(reply);
+  }
+  modem.print("sentences: ");
+  modem.println(sentences);
+  delay(1000);
+}
@@ -0,0 +1,37 @@
+#include "Arduino.h"
+#include "SPI.h"
+
+int csPin = 10;
+byte status;
+byte pattern = 0;
+
+void setup() {
+  pinMode(csPin, OUTPUT);
+  SPI.begin();
+}
+
+void loop() {
+  SPI.beginTransaction(SPISettings(8000000, MSBFIRST, SPI_MODE0));
+
+  digitalWrite(csPin, LOW);
+  SPI.transfer(0x06);                      // write enable
+  digitalWrite(csPin, HIGH);
+
+  digitalWrite(csPin, LOW);
+  SPI.transfer(0x05);                      // read status register
+  status = SPI.transfer(0);
+  digitalWrite(csPin, HIGH);
+
+  digitalWrite(csPin, LOW);
+  SPI.transfer(0x02);                      // page program at 0x000100
+  SPI.transfer16(0x0001);
+  SPI.transfer(0x00);
+  for (int i = 0; i < 256; i++) {
+    SPI.transfer(pattern + i);
+  }
+  digitalWrite(csPin, HIGH);
+
+  SPI.endTransaction();
+  pattern++;
+  delay(1000);
+}
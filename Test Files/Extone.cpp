@@ -0,0 +1,20 @@
+#include "Arduino.h"
+
+const int buzzerPin = 8;
+int sensorPin = 0;
+
+void setup() {
+  pinMode(buzzerPin, OUTPUT);
+}
+
+void loop() {
+  int reading = analogRead(sensorPin);
+  if (reading > 600) {
+    tone(buzzerPin, 880, 200);             // beep without blocking
+  } else if (reading > 300) {
+    tone(buzzerPin, 440);
+  } else {
+    noTone(buzzerPin);
+  }
+  delay(50);
+}
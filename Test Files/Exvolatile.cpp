@@ -0,0 +1,36 @@
+#include "Arduino.h"
+
+const int encoderPin = 2;
+const int buttonPin = 3;
+
+volatile byte pressed = 0;
+volatile unsigned long lastPress = 0;
+volatile long position = 0;
+volatile int history[4] = {0, 0, 0, 0};
+volatile byte slot = 0;
+
+void step() {
+  position++;
+}
+
+void press() {
+  pressed = 1;
+  lastPress = millis();
+  history[slot] = position;
+  slot = (slot + 1) & 3;
+}
+
+void setup() {
+  pinMode(encoderPin, INPUT);
+  pinMode(buttonPin, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(encoderPin), step, RISING);
+  attachInterrupt(1, press, FALLING);
+}
+
+void loop() {
+  if (pressed) {
+    pressed = 0;
+    delay(lastPress % 10);
+  }
+  delay(10);
+}
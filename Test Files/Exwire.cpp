@@ -0,0 +1,31 @@
+#include "Arduino.h"
+#include "Wire.h"
+
+int mpuAddress = 0x68;
+int16_t accelX, accelY, accelZ;
+byte sampleRate = 7;
+
+void setup() {
+  Wire.begin();
+  Wire.beginTransmission(mpuAddress);
+  Wire.write(0x6B);                        // PWR_MGMT_1
+  Wire.write(0);                           // wake up
+  Wire.endTransmission();
+}
+
+void loop() {
+  Wire.beginTransmission(mpuAddress);
+  Wire.write(0x19);                        // SMPLRT_DIV
+  Wire.write(sampleRate);
+  Wire.endTransmission();
+
+  Wire.beginTransmission(mpuAddress);
+  Wire.write(0x3B);                        // ACCEL_XOUT_H
+  Wire.endTransmission(false);
+  Wire.requestFrom(mpuAddress, 6);
+  while (Wire.available() < 6);
+  accelX = Wire.read() << 8 | Wire.read();
+  accelY = Wire.read() << 8 | Wire.read();
+  accelZ = Wire.read() << 8 | Wire.read();
+  delay(100);
+}
@@ -0,0 +1,18 @@
+# Writes the headers in HEADERS (separated by |) to OUTPUT as byte arrays and a table of
+# {name, data, size} that micropyconvert.cpp serves from memory as the Arduino header shim.
+string(REPLACE "|" ";" HEADERS "${HEADERS}")
+set(arrays "")
+set(table "")
+set(index 0)
+foreach(header ${HEADERS})
+  get_filename_component(name "${header}" NAME)
+  file(READ "${header}" bytes HEX)
+  string(LENGTH "${bytes}" digits)
+  math(EXPR size "${digits} / 2")
+  string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," bytes "${bytes}")
+  string(APPEND arrays "static const unsigned char ArduinoHeader${index}[] = {${bytes}0};\n")
+  string(APPEND table "    {\"${name}\", ArduinoHeader${index}, ${size}},\n")
+  math(EXPR index "${index} + 1")
+endforeach()
+file(WRITE "${OUTPUT}" "// Generated by EmbedHeaders.cmake from the Arduino-headerfiles folder; do not edit.\n\n"
+     "${arrays}\nstatic const EmbeddedHeader EmbeddedHeaders[] = {\n${table}};\n")
@@ -0,0 +1,109 @@
+#!/bin/sh
+# Differential harness: runs each example sketch natively against a host stub of the Arduino API
+# (host/arduino_host.cpp) and its conversion on the MicroPython unix port with a matching machine
+# stub (host/host_machine.py), compares the pin and serial traces of both runs, and reports how many
+# traced operations per second each one manages.
+#
+# Usage: diff-bench.sh PATH/TO/micropy-convert [SKETCH.cpp...]
+# Needs a C++ compiler ($CXX, default c++) and the MicroPython unix port ($MICROPYTHON, default
+# micropython). MAX_EVENTS (default 2000) is the length of the traces compared. Without sketches it
+# uses everything in "Test Files". A sketch using an API the host stub lacks, or with no loop(), is
+# skipped and the API named.
+#
+# Exits with 1 when a sketch fails to build natively, a conversion fails to run or its trace differs
+# from the native one. A failed native build prints the compiler's messages.
+
+TOOL=$1
+if [ -z "$TOOL" ] || [ ! -x "$TOOL" ]; then
+  echo "usage: $0 PATH/TO/micropy-convert [SKETCH.cpp...]" >&2
+  exit 1
+fi
+shift
+TOOL=$(cd "$(dirname "$TOOL")" && pwd)/$(basename "$TOOL")
+CXX=${CXX:-c++}
+MICROPYTHON=${MICROPYTHON:-micropython}
+MAX_EVENTS=${MAX_EVENTS:-2000}
+export MAX_EVENTS
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+HEADERS=$HERE/../../Arduino-headerfiles
+[ -d "$HEADERS" ] || HEADERS=$HERE/../../../Arduino-headerfiles
+if [ $# -eq 0 ]; then
+  set -- "$HERE"/../../"Test Files"/*.cpp
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# What the host stub can't run a sketch without, or nothing when it has everything the sketch uses.
+unsupported() {
+  if ! grep -Eq 'void[[:space:]]+loop[[:space:]]*\(' "$1"; then
+    echo "no loop()"
+    return
+  fi
+  while read -r api pattern; do
+    if grep -Eq "$pattern" "$1"; then
+      echo "$api"
+      return
+    fi
+  done <<EOF
+Wire Wire\.
+SPI SPI\.
+shiftOut (^|[^[:alnum:]_])shift(Out|In)[[:space:]]*\(
+SoftwareSerial SoftwareSerial
+tone (^|[^[:alnum:]_])(tone|noTone)[[:space:]]*\(
+EEPROM EEPROM
+attachInterrupt (attach|detach)Interrupt
+interrupts ATOMIC_BLOCK|(^|[^[:alnum:]_])(interrupts|noInterrupts)[[:space:]]*\(
+EOF
+}
+
+# Operations per second from an "ops <events> <seconds>" line.
+rate() {
+  awk '/^ops / { if ($3 > 0) printf "%d", $2 / $3; else print "-" }' "$1"
+}
+
+printf "%-24s %-22s %14s %14s\n" "sketch" "result" "native ops/s" "python ops/s"
+failed=0
+for sketch in "$@"; do
+  sketch=$(cd "$(dirname "$sketch")" && pwd)/$(basename "$sketch")
+  name=$(basename "$sketch")
+  rm -rf "$WORK"/*
+
+  missing=$(unsupported "$sketch")
+  if [ -n "$missing" ]; then
+    printf "%-24s %-22s\n" "$name" "skipped ($missing)"
+    continue
+  fi
+  if ! "$CXX" -std=c++17 -w -fpermissive -DUBRR0H=0 -DSKETCH="\"$sketch\"" -I "$HEADERS" \
+      "$HERE/host/arduino_host.cpp" -o "$WORK/native" 2>"$WORK/native.log"; then
+    printf "%-24s %-22s\n" "$name" "native build failed"
+    sed 's/^/  /' "$WORK/native.log" >&2
+    failed=1
+    continue
+  fi
+  (cd "$WORK" && timeout 10 "$TOOL" "$sketch" -- >/dev/null 2>&1)
+  if [ ! -s "$WORK/output.txt" ]; then
+    printf "%-24s %-22s\n" "$name" "conversion failed"
+    failed=1
+    continue
+  fi
+
+  timeout 10 "$WORK/native" >"$WORK/native.trace" 2>"$WORK/native.ops"
+  (cd "$HERE/host" && MICROPYPATH="$HERE/host" timeout 10 "$MICROPYTHON" run.py "$WORK/output.txt" "$MAX_EVENTS") \
+    >"$WORK/python.trace" 2>"$WORK/python.ops"
+  status=$?
+
+  if [ $status -ne 0 ]; then
+    result="python failed ($status)"
+    failed=1
+  elif cmp -s "$WORK/native.trace" "$WORK/python.trace"; then
+    result="same"
+  else
+    line=$(cmp "$WORK/native.trace" "$WORK/python.trace" 2>/dev/null | sed -n 's/.* line \([0-9]*\).*/\1/p')
+    result="differs at line ${line:-?}"
+    failed=1
+  fi
+  printf "%-24s %-22s %14s %14s\n" "$name" "$result" "$(rate "$WORK/native.ops")" "$(rate "$WORK/python.ops")"
+done
+exit $failed
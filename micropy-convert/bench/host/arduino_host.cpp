@@ -0,0 +1,182 @@
+// Runs a sketch natively against a host stub of the Arduino API, for diff-bench.sh.
+//
+// Built as one translation unit, since the shim's Arduino.h defines its constants in the header:
+//   g++ -fpermissive -DUBRR0H=0 -DSKETCH='"sketch.cpp"' -I Arduino-headerfiles arduino_host.cpp
+//
+// Prints the same trace as host/machine.py on the MicroPython side: serial output as plain lines,
+// and "@" lines for pin writes and reads. Inputs are a fixed sequence and the clock only moves in
+// delay(), so both runs see the same values. After MAX_EVENTS trace events (default 2000) it stops
+// and prints "ops <events> <seconds>" to stderr.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// avr-libc conversions the shim's WString.cpp relies on.
+extern "C" {
+char *ltoa(long value, char *buf, int base);
+char *ultoa(unsigned long value, char *buf, int base);
+char *itoa(int value, char *buf, int base) { return ltoa(value, buf, base); }
+char *utoa(unsigned value, char *buf, int base) { return ultoa(value, buf, base); }
+char *dtostrf(double value, signed char width, unsigned char precision, char *buf);
+}
+
+#include "Arduino.h"
+#include "HardwareSerial.h"
+
+// Flash is ordinary memory on the host.
+#undef pgm_read_byte
+#undef pgm_read_word
+#define pgm_read_byte(address) (*reinterpret_cast<const unsigned char *>(address))
+#define pgm_read_word(address) (*reinterpret_cast<const unsigned short *>(address))
+extern "C" char *strcpy_P(char *dest, const char *src) { return std::strcpy(dest, src); }
+extern "C" size_t __strlen_P(const char *s) { return std::strlen(s); }
+
+#include "Print.cpp"
+#include "Stream.cpp"
+#include "WString.cpp"
+
+static unsigned long Events = 0;
+static unsigned long MaxEvents = 2000;
+static unsigned long long ClockUs = 0;
+static unsigned long Reads = 0;
+static std::string SerialLine;
+static std::chrono::steady_clock::time_point Started;
+
+static void event() {
+  if (++Events < MaxEvents)
+    return;
+  if (!SerialLine.empty())
+    std::printf("%s\n", SerialLine.c_str());
+  std::fflush(stdout);
+  double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Started).count();
+  std::fprintf(stderr, "ops %lu %.6f\n", Events, Seconds);
+  std::exit(0);
+}
+
+extern "C" {
+char *ltoa(long value, char *buf, int base) {
+  if (value < 0 && base == 10) {
+    buf[0] = '-';
+    ultoa(-static_cast<unsigned long>(value), buf + 1, base);
+  } else {
+    ultoa(static_cast<unsigned long>(value), buf, base);
+  }
+  return buf;
+}
+
+char *ultoa(unsigned long value, char *buf, int base) {
+  char digits[sizeof(long) * 8 + 1];
+  int n = 0;
+  do {
+    digits[n++] = "0123456789abcdefghijklmnopqrstuvwxyz"[value % base];
+    value /= base;
+  } while (value);
+  for (int i = 0; i < n; ++i)
+    buf[i] = digits[n - 1 - i];
+  buf[n] = '\0';
+  return buf;
+}
+
+char *dtostrf(double value, signed char width, unsigned char precision, char *buf) {
+  std::sprintf(buf, "%*.*f", width, precision, value);
+  return buf;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  std::printf("@digitalWrite %u %u\n", pin, val ? 1 : 0);
+  event();
+}
+
+int digitalRead(uint8_t pin) {
+  int value = static_cast<int>((++Reads + pin) % 2);
+  std::printf("@digitalRead %u %d\n", pin, value);
+  event();
+  return value;
+}
+
+int analogRead(uint8_t pin) {
+  int value = static_cast<int>((++Reads * 97 + pin * 31) % 1024);
+  std::printf("@analogRead %u %d\n", pin, value);
+  event();
+  return value;
+}
+
+void analogReference(uint8_t mode) {}
+
+void analogWrite(uint8_t pin, int val) {
+  std::printf("@analogWrite %u %d\n", pin, val & 0xff);
+  event();
+}
+
+unsigned long pulseIn(uint8_t pin, uint8_t state, unsigned long timeout) {
+  unsigned long width = (++Reads * 53) % 20000 + 1;
+  std::printf("@pulseIn %u %u %lu\n", pin, state ? 1 : 0, width);
+  event();
+  return width;
+}
+
+unsigned long pulseInLong(uint8_t pin, uint8_t state, unsigned long timeout) { return pulseIn(pin, state, timeout); }
+
+unsigned long millis(void) { return static_cast<unsigned long>(ClockUs / 1000); }
+unsigned long micros(void) { return static_cast<unsigned long>(ClockUs); }
+void delay(unsigned long ms) { ClockUs += ms * 1000ULL; }
+void delayMicroseconds(unsigned int us) { ClockUs += us; }
+void yield(void) {}
+}
+
+// WMath, with a fixed seed so both runs draw the same numbers.
+static unsigned long Seed = 1;
+void randomSeed(unsigned long seed) { Seed = seed ? seed : 1; }
+long random(long howbig) {
+  Seed = Seed * 1103515245UL + 12345UL;
+  return howbig ? static_cast<long>((Seed >> 16) % howbig) : 0;
+}
+long random(long howsmall, long howbig) { return howsmall >= howbig ? howsmall : howsmall + random(howbig - howsmall); }
+long map(long x, long in_min, long in_max, long out_min, long out_max) {
+  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+uint16_t makeWord(uint16_t w) { return w; }
+uint16_t makeWord(byte h, byte l) { return (h << 8) | l; }
+
+HardwareSerial::HardwareSerial(volatile uint8_t *ubrrh, volatile uint8_t *ubrrl, volatile uint8_t *ucsra,
+                               volatile uint8_t *ucsrb, volatile uint8_t *ucsrc, volatile uint8_t *udr)
+    : _ubrrh(ubrrh), _ubrrl(ubrrl), _ucsra(ucsra), _ucsrb(ucsrb), _ucsrc(ucsrc), _udr(udr) {}
+void HardwareSerial::begin(unsigned long, uint8_t) {}
+void HardwareSerial::end() {}
+int HardwareSerial::available(void) { return 0; }
+int HardwareSerial::peek(void) { return -1; }
+int HardwareSerial::read(void) { return -1; }
+int HardwareSerial::availableForWrite(void) { return 64; }
+void HardwareSerial::flush(void) {}
+
+// Serial output is traced a line at a time, as print() writes it on the MicroPython side.
+size_t HardwareSerial::write(uint8_t c) {
+  if (c == '\r')
+    return 1;
+  if (c != '\n') {
+    SerialLine += static_cast<char>(c);
+    return 1;
+  }
+  std::printf("%s\n", SerialLine.c_str());
+  SerialLine.clear();
+  event();
+  return 1;
+}
+
+HardwareSerial Serial(nullptr, nullptr, nullptr, nullptr, nullptr, nullptr);
+
+#include SKETCH
+
+int main() {
+  if (const char *Limit = std::getenv("MAX_EVENTS"))
+    MaxEvents = std::strtoul(Limit, nullptr, 10);
+  Started = std::chrono::steady_clock::now();
+  setup();
+  while (true)
+    loop();
+}
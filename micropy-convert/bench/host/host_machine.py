@@ -0,0 +1,181 @@
+# The machine module for running a converted sketch on the MicroPython unix port, for
+# diff-bench.sh. It prints the same trace as arduino_host.cpp does for the native sketch: print()
+# output as plain lines, and "@" lines for pin writes and reads. Inputs follow the same fixed
+# sequence, and after MAX_EVENTS trace events Done is raised to end the run.
+import sys
+import time
+
+MAX_EVENTS = 2000
+_events = 0
+_reads = 0
+_started = 0
+_serial = ""
+
+
+class Done(BaseException):
+    pass
+
+
+def start(max_events):
+    global MAX_EVENTS, _started
+    MAX_EVENTS = max_events
+    _started = time.ticks_us()
+
+
+def seconds():
+    return time.ticks_diff(time.ticks_us(), _started) / 1000000
+
+
+def event():
+    global _events
+    _events += 1
+    if _events >= MAX_EVENTS:
+        raise Done()
+
+
+def trace(line):
+    print(line)
+    event()
+
+
+# print() for the converted module: what Serial.print() became, traced a line at a time.
+def serial_print(*args, sep=" ", end="\n"):
+    global _serial
+    _serial += sep.join(str(a) for a in args) + end
+    while "\n" in _serial:
+        line, _serial = _serial.split("\n", 1)
+        trace(line.rstrip("\r"))
+
+
+# Prints what is left of an unfinished line and the "ops <events> <seconds>" summary.
+def finish():
+    if _serial:
+        print(_serial)
+    sys.stderr.write("ops %d %f\n" % (_events, seconds()))
+
+
+def _read():
+    global _reads
+    _reads += 1
+    return _reads
+
+
+def _id(pin):
+    return pin.id if isinstance(pin, Pin) else pin
+
+
+class Pin:
+    IN = 0
+    OUT = 1
+    OPEN_DRAIN = 2
+    PULL_UP = 1
+    PULL_DOWN = 2
+    IRQ_RISING = 1
+    IRQ_FALLING = 2
+
+    def __init__(self, id, mode=-1, pull=-1, value=None):
+        self.id = id
+
+    def init(self, mode=-1, pull=-1, value=None):
+        pass
+
+    def value(self, v=None):
+        if v is None:
+            value = (_read() + self.id) % 2
+            trace("@digitalRead %d %d" % (self.id, value))
+            return value
+        trace("@digitalWrite %d %d" % (self.id, 1 if v else 0))
+
+    __call__ = value
+
+    def on(self):
+        self.value(1)
+
+    def off(self):
+        self.value(0)
+
+    def irq(self, handler=None, trigger=3):
+        return None
+
+
+class ADC:
+    def __init__(self, pin, *args, **kwargs):
+        # The converter passes the analog channel, A0 (pin 14) being channel 0 as on the Uno; the
+        # trace names the Arduino pin, like the native stub.
+        self.id = pin.id if isinstance(pin, Pin) else pin + 14
+
+    def read_u16(self):
+        value = (_read() * 97 + self.id * 31) % 1024
+        trace("@analogRead %d %d" % (self.id, value))
+        return value << 6
+
+
+class PWM:
+    def __init__(self, pin, freq=None, duty_u16=None):
+        self.id = _id(pin)
+
+    def freq(self, f=None):
+        return 500 if f is None else None
+
+    def duty_u16(self, v=None):
+        if v is not None:
+            trace("@analogWrite %d %d" % (self.id, (v >> 8) & 0xFF))
+
+    def deinit(self):
+        pass
+
+
+class UART:
+    def __init__(self, id, baudrate=9600, **kwargs):
+        pass
+
+    def init(self, *args, **kwargs):
+        pass
+
+    def deinit(self):
+        pass
+
+    def any(self):
+        return 0
+
+    def read(self, n=-1):
+        return None
+
+    def readinto(self, buf, n=-1):
+        return None
+
+    def write(self, data):
+        serial_print(bytes(data).decode(), end="")
+        return len(data)
+
+
+class Timer:
+    ONE_SHOT = 0
+    PERIODIC = 1
+
+    def __init__(self, id=-1, **kwargs):
+        pass
+
+    def init(self, **kwargs):
+        pass
+
+    def deinit(self):
+        pass
+
+
+def time_pulse_us(pin, level, timeout=1000000):
+    width = (_read() * 53) % 20000 + 1
+    trace("@pulseIn %d %d %d" % (_id(pin), 1 if level else 0, width))
+    return width
+
+
+def disable_irq():
+    return 0
+
+
+def enable_irq(state):
+    pass
+
+
+def freq(hz=None):
+    return 125000000
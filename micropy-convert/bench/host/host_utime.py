@@ -0,0 +1,42 @@
+# The utime module for diff-bench.sh: a clock that only moves in sleeps, as the native stub's
+# delay() does, so both runs read the same times.
+_us = 0
+
+
+def sleep_ms(ms):
+    global _us
+    _us += int(ms) * 1000
+
+
+def sleep_us(us):
+    global _us
+    _us += int(us)
+
+
+def sleep(s):
+    global _us
+    _us += int(s * 1000000)
+
+
+def ticks_us():
+    return _us
+
+
+def ticks_ms():
+    return _us // 1000
+
+
+def ticks_cpu():
+    return _us
+
+
+def ticks_add(ticks, delta):
+    return ticks + delta
+
+
+def ticks_diff(end, start):
+    return end - start
+
+
+def time():
+    return _us // 1000000
@@ -0,0 +1,19 @@
+# Runs a converted sketch on the MicroPython unix port with the host machine and utime modules,
+# for diff-bench.sh: micropython run.py MODULE.py [MAX_EVENTS]
+import sys
+
+import host_machine
+import host_utime
+
+sys.modules["machine"] = host_machine
+sys.modules["utime"] = host_utime
+sys.modules["time"] = host_utime
+
+with open(sys.argv[1]) as f:
+    source = f.read()
+host_machine.start(int(sys.argv[2]) if len(sys.argv) > 2 else 2000)
+try:
+    exec(source, {"__name__": "__main__", "print": host_machine.serial_print})
+except host_machine.Done:
+    pass
+host_machine.finish()
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Converts each example sketch with and without --skip-header-bodies and reports the wall time
+# and peak memory of both runs, so the cost of parsing the header shim can be compared.
+#
+# Usage: parse-bench.sh PATH/TO/micropy-convert [SKETCH.cpp...]
+# Needs GNU time (/usr/bin/time). RUNS (default 5) is how many times each sketch is converted in
+# each mode; the best time is kept. Without sketches it uses everything in "Test Files".
+
+TOOL=$1
+RUNS=${RUNS:-5}
+if [ -z "$TOOL" ] || [ ! -x "$TOOL" ]; then
+  echo "usage: $0 PATH/TO/micropy-convert [SKETCH.cpp...]" >&2
+  exit 1
+fi
+shift
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+if [ $# -eq 0 ]; then
+  set -- "$HERE"/../../"Test Files"/*.cpp
+fi
+
+# The tool writes output.txt into the working directory; keep that out of the tree.
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Prints "<best seconds> <peak KiB>" over RUNS conversions of one sketch.
+measure() {
+  sketch=$1
+  skip=$2
+  best=
+  peak=0
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    (cd "$WORK" && /usr/bin/time -f "%e %M" -o "$WORK/time" \
+      "$TOOL" --skip-header-bodies="$skip" "$sketch" -- >/dev/null 2>&1)
+    read -r secs kib < "$WORK/time"
+    best=$(awk -v a="$secs" -v b="$best" 'BEGIN { print (b == "" || a < b) ? a : b }')
+    [ "$kib" -gt "$peak" ] && peak=$kib
+    i=$((i + 1))
+  done
+  echo "$best $peak"
+}
+
+printf "%-28s %10s %10s %10s %10s\n" "sketch" "full s" "skip s" "full KiB" "skip KiB"
+total_full=0
+total_skip=0
+for sketch in "$@"; do
+  sketch=$(cd "$(dirname "$sketch")" && pwd)/$(basename "$sketch")
+  read -r full_s full_kib <<EOF
+$(measure "$sketch" false)
+EOF
+  read -r skip_s skip_kib <<EOF
+$(measure "$sketch" true)
+EOF
+  printf "%-28s %10s %10s %10s %10s\n" "$(basename "$sketch")" "$full_s" "$skip_s" "$full_kib" "$skip_kib"
+  total_full=$(awk -v a="$total_full" -v b="$full_s" 'BEGIN { print a + b }')
+  total_skip=$(awk -v a="$total_skip" -v b="$skip_s" 'BEGIN { print a + b }')
+done
+printf "%-28s %10s %10s\n" "total" "$total_full" "$total_skip"
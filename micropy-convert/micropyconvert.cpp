@@ -8,17 +8,42 @@
 // Ashutosh Pandey (ashutoshpandey123456@gmail.com)
 // This code is in the public domain
 //------------------------------------------------------------------------------
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "clang/AST/AST.h"
 #include "clang/AST/ASTConsumer.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Analysis/CallGraph.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
+#include "clang/Frontend/ASTUnit.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Frontend/Utils.h"
+#include "clang/Lex/Lexer.h"
 #include "clang/Rewrite/Core/Rewriter.h"
+#include "clang/Tooling/ArgumentsAdjusters.h"
 #include "clang/Tooling/CommonOptionsParser.h"
+#include "clang/Tooling/Core/Replacement.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/VirtualFileSystem.h"
 #include "llvm/Support/raw_ostream.h"
 #include "clang/AST/Expr.h"
 
@@ -30,319 +55,5470 @@ using namespace clang::tooling;
 
 static llvm::cl::OptionCategory MatcherSampleCategory("Matcher Sample");
 
+static llvm::cl::opt<bool> OptimiseMath(
+    "optimise-math",
+    llvm::cl::desc("Fold constant math at conversion time and hoist loop-invariant math out of loop()"),
+    llvm::cl::init(true), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<bool> WrapIntegers(
+    "wrap-integers",
+    llvm::cl::desc("Mask integer arithmetic that can overflow its C type, so it wraps the way it does on the board"),
+    llvm::cl::init(true), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<bool> FixedPointMath(
+    "fixed-point",
+    llvm::cl::desc("Keep float variables with a known range as scaled integers, for boards without an FPU"),
+    llvm::cl::init(false), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<unsigned> TargetIntWidth(
+    "int-width",
+    llvm::cl::desc("Width in bits of int on the board the sketch was written for (16 on AVR, 32 on ARM)"),
+    llvm::cl::init(16), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<std::string> TargetBoard(
+    "target",
+    llvm::cl::desc("MicroPython port the converted code runs on (rp2, esp32 or stm32), for pin specific peripherals"),
+    llvm::cl::init(""), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<unsigned> EepromSize(
+    "eeprom-size",
+    llvm::cl::desc("Size in bytes of the EEPROM image kept in RAM and in eeprom.bin (1024 on an ATmega328P)"),
+    llvm::cl::init(1024), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<bool> PulseCapture(
+    "pulse-capture",
+    llvm::cl::desc("Time pulseIn() pulses with a pin interrupt so loop() reads the pulses measured in the background instead of blocking in machine.time_pulse_us"),
+    llvm::cl::init(false), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<bool> SkipHeaderBodies(
+    "skip-header-bodies",
+    llvm::cl::desc("Parse only the declarations of functions defined outside the sketch; nothing is converted there, so their bodies are not needed"),
+    llvm::cl::init(true), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<bool> Footprint(
+    "footprint",
+    llvm::cl::desc("Report the RAM the converted module needs: globals, preallocated buffers, string constants and what each function allocates"),
+    llvm::cl::init(false), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<unsigned> RamBudget(
+    "ram-budget",
+    llvm::cl::desc("Fail the conversion when the heap estimate of --footprint is over this many bytes"),
+    llvm::cl::init(0), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<bool> CacheLookups(
+    "cache-lookups",
+    llvm::cl::desc("Run loop() in a function whose prologue binds the functions, bound methods and read-only globals it uses to locals"),
+    llvm::cl::init(true), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<bool> Cost(
+    "cost",
+    llvm::cl::desc("Annotate each statement that runs repeatedly with an estimate of what it costs the MicroPython VM, and list the hottest lines of each function and of the While True: body"),
+    llvm::cl::init(false), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<unsigned> Jobs(
+    "j",
+    llvm::cl::desc("Number of files to convert at the same time, 0 for one per core; the output stays in input order"),
+    llvm::cl::init(1), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<bool> Watch(
+    "watch",
+    llvm::cl::desc("Keep running and convert the sketch again each time it is saved, reusing the parsed Arduino headers"),
+    llvm::cl::init(false), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<bool> EmitMpy(
+    "mpy",
+    llvm::cl::desc("Also write each converted file as <name>.py and precompile it to <name>.mpy with mpy-cross, so the board doesn't compile it at import"),
+    llvm::cl::init(false), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<std::string> MpyCross(
+    "mpy-cross",
+    llvm::cl::desc("The mpy-cross program to precompile with; it has to match the MicroPython version on the board"),
+    llvm::cl::init("mpy-cross"), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<std::string> MpyArch(
+    "mpy-arch",
+    llvm::cl::desc("Architecture of the board for native code in the .mpy (armv6m, armv7emsp, xtensawin...)"),
+    llvm::cl::init(""), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<std::string> MpyEmit(
+    "mpy-emit",
+    llvm::cl::desc("Code mpy-cross emits for the functions: bytecode, native or viper; native and viper need --mpy-arch"),
+    llvm::cl::init("bytecode"), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<std::string> FrozenManifest(
+    "frozen-manifest",
+    llvm::cl::desc("Write a manifest that freezes the converted files into a firmware build, so their bytecode stays in flash"),
+    llvm::cl::init(""), llvm::cl::cat(MatcherSampleCategory));
+
+// Where handlers report on the conversion running on this thread. Each file converted with -j
+// collects its notes here and they are printed in input order; otherwise they go to stderr.
+static thread_local llvm::raw_ostream *NotesStream = nullptr;
+
+static llvm::raw_ostream &notes() {
+  return NotesStream ? *NotesStream : llvm::errs();
+}
+
+// Removes a range that other handlers may already have rewritten. Text inserted
+// at the very start of the range belongs to an enclosing node, so it is kept and
+// left out of the size that gets erased.
+static void removeConverted(Rewriter &Rewrite, CharSourceRange Range) {
+  Rewriter::RewriteOptions Opts;
+  Opts.IncludeInsertsAtBeginOfRange = false;
+  int Size = Rewrite.getRangeSize(Range, Opts);
+  if (Size >= 0)
+    Rewrite.RemoveText(Range.getBegin(), Size, Opts);
+}
+
+// Replaces a range that other handlers may already have rewritten, see removeConverted().
+static void replaceConverted(Rewriter &Rewrite, CharSourceRange Range, StringRef Text) {
+  Rewriter::RewriteOptions Opts;
+  Opts.IncludeInsertsAtBeginOfRange = false;
+  int Size = Rewrite.getRangeSize(Range, Opts);
+  if (Size >= 0)
+    Rewrite.ReplaceText(Range.getBegin(), Size, Text);
+}
+
+// Just past the ';' of a statement that needs one, or past the end of any other statement. A statement
+// written by a macro, like ATOMIC_BLOCK() or cli(), ends where the macro's expansion does.
+static SourceLocation statementEnd(const ASTContext &Context, const clang::Stmt* stmt) {
+  const SourceManager &SM = Context.getSourceManager();
+  SourceLocation end = SM.getExpansionRange(stmt->getEndLoc()).getEnd();
+  if (isa<clang::Expr>(stmt) || isa<clang::AsmStmt>(stmt))
+    return Lexer::findLocationAfterToken(end, tok::semi, SM, Context.getLangOpts(), false);
+  return Lexer::getLocForEndOfToken(end, 0, SM, Context.getLangOpts());
+}
+
+// The statements from first to last, with the ';' that ends the last one.
+static CharSourceRange statementRange(const ASTContext &Context, const clang::Stmt* first, const clang::Stmt* last) {
+  const SourceManager &SM = Context.getSourceManager();
+  return CharSourceRange::getCharRange(SM.getExpansionLoc(first->getBeginLoc()), statementEnd(Context, last));
+}
+
+static std::string indentOf(const ASTContext &Context, const clang::Stmt* stmt) {
+  const SourceManager &SM = Context.getSourceManager();
+  return Lexer::getIndentationForLine(SM.getExpansionLoc(stmt->getBeginLoc()), SM).str();
+}
+
+//TokenEdits Class: Collects the edits of the handlers that only rename a token or put text in front of
+//one (pinMode, INPUT, millis, isAlpha...) as tooling::Replacements. They are applied to the Rewriter
+//together, in offset order, before any other handler runs, so the result doesn't depend on the order
+//the callbacks came in: pinModePinHandler's "p" in front of a pin lands the same way inside the call
+//pinModeVariableHandler renames. Edits that can't both apply are reported and the later one is dropped.
+
+class TokenEdits {
+public:
+  void replaceToken(const MatchFinder::MatchResult &Results, SourceLocation Loc, StringRef Text) {
+    if (isEditable(*Results.SourceManager, Loc))
+      Edits.insert(tooling::Replacement(*Results.SourceManager, CharSourceRange::getTokenRange(Loc), Text, Results.Context->getLangOpts()));
+  }
+
+  void insertBefore(const MatchFinder::MatchResult &Results, SourceLocation Loc, StringRef Text) {
+    if (isEditable(*Results.SourceManager, Loc))
+      Edits.insert(tooling::Replacement(*Results.SourceManager, Loc, 0, Text));
+  }
+
+  void apply(Rewriter &Rewrite, raw_ostream &OS) {
+    tooling::Replacements Merged;
+    for (const tooling::Replacement &Edit : Edits)
+      if (llvm::Error Err = Merged.add(Edit))
+        OS << "edits: " << llvm::toString(std::move(Err)) << "\n";
+    SourceManager &SM = Rewrite.getSourceMgr();
+    SourceLocation Start = SM.getLocForStartOfFile(SM.getMainFileID());
+    for (const tooling::Replacement &Edit : Merged) {
+      SourceLocation Loc = Start.getLocWithOffset(Edit.getOffset());
+      // An insertion stays an insertion, so a range removed later from that point keeps it.
+      if (Edit.getLength())
+        Rewrite.ReplaceText(Loc, Edit.getLength(), Edit.getReplacementText());
+      else
+        Rewrite.InsertText(Loc, Edit.getReplacementText(), true, true);
+    }
+    Edits.clear();
+  }
+
+private:
+  // Text inside a macro isn't rewritten, like the Rewriter refuses it.
+  static bool isEditable(const SourceManager &SM, SourceLocation Loc) {
+    return Loc.isFileID() && SM.isInMainFile(Loc);
+  }
+
+  // A set, so a token matched twice is edited once and the edits come out in offset order.
+  std::set<tooling::Replacement> Edits;
+};
+
+//ReferencedDeclCollector Class: Collects every function and variable a piece of code refers to,
+//including functions that are only passed by address (e.g. to attachInterrupt).
+
+class ReferencedDeclCollector : public RecursiveASTVisitor<ReferencedDeclCollector> {
+public:
+  bool VisitDeclRefExpr(DeclRefExpr *E) {
+    Referenced.push_back(E->getDecl());
+    return true;
+  }
+
+  std::vector<const Decl *> Referenced;
+};
+
+//ModuleFinaliser Class: Handlers record the modules they need here instead of leaving an
+//"import at start of code" comment at every call site. Once all matchers have run, one
+//deduplicated import block, followed by any module-level definitions, is emitted at the top of
+//the module, and functions and globals
+//that can never be reached from setup() or loop() are dropped so they don't cost RAM on the device.
+
+class ModuleFinaliser {
+public:
+  // Records "import Module", or "from Module import Name" when a Name is given.
+  void addImport(StringRef Module, StringRef Name = "") {
+    ImportEntry &Entry = Imports[Module.str()];
+    if (Name.empty())
+      Entry.WholeModule = true;
+    else
+      Entry.Names.insert(Name.str());
+  }
+
+  // Records a module-level definition (a lookup table, a preallocated buffer, a bus object) that
+  // is emitted once, after the imports. The first definition given for a Name wins.
+  void addDefinition(StringRef Name, StringRef Python) {
+    if (DefinedNames.insert({Name.str(), Definitions.size()}).second)
+      Definitions.push_back(Python.str());
+  }
+
+  // Records a definition or replaces the one given for Name before, keeping its place; for tables
+  // that grow as handlers find their entries.
+  void replaceDefinition(StringRef Name, StringRef Python) {
+    auto Found = DefinedNames.find(Name.str());
+    if (Found == DefinedNames.end())
+      addDefinition(Name, Python);
+    else
+      Definitions[Found->second] = Python.str();
+  }
+
+  bool hasDefinition(StringRef Name) const { return DefinedNames.count(Name.str()) != 0; }
+
+  // Records that a definition preallocates Bytes of buffer, for the footprint report. Recording a
+  // Name again replaces its size, as replaceDefinition() does.
+  void addBuffer(StringRef Name, size_t Bytes) { Buffers[Name.str()] = Bytes; }
+
+  const std::map<std::string, size_t> &buffers() const { return Buffers; }
+
+  // The module-level definitions in the order they are emitted, for the footprint report.
+  const std::vector<std::string> &definitions() const { return Definitions; }
+
+  // Whether every import, definition and buffer recorded here was recorded the same way in Full,
+  // so text converted with this module can go into the module Full was built for.
+  bool isWithin(const ModuleFinaliser &Full) const {
+    for (const auto &Import : Imports) {
+      auto Found = Full.Imports.find(Import.first);
+      if (Found == Full.Imports.end() || (Import.second.WholeModule && !Found->second.WholeModule) ||
+          !std::includes(Found->second.Names.begin(), Found->second.Names.end(), Import.second.Names.begin(), Import.second.Names.end()))
+        return false;
+    }
+    for (const auto &Name : DefinedNames) {
+      auto Found = Full.DefinedNames.find(Name.first);
+      if (Found == Full.DefinedNames.end() || Full.Definitions[Found->second] != Definitions[Name.second])
+        return false;
+    }
+    for (const auto &Buffer : Buffers) {
+      auto Found = Full.Buffers.find(Buffer.first);
+      if (Found == Full.Buffers.end() || Found->second != Buffer.second)
+        return false;
+    }
+    return true;
+  }
+
+  // The names the import block and the module-level definitions bind: modules, imported names,
+  // functions, classes and objects created once.
+  std::set<std::string> boundNames() const {
+    std::set<std::string> Names;
+    for (const auto &Import : Imports) {
+      if (Import.second.WholeModule)
+        Names.insert(Import.first);
+      Names.insert(Import.second.Names.begin(), Import.second.Names.end());
+    }
+    for (const std::string &Definition : Definitions) {
+      StringRef Rest = Definition;
+      while (!Rest.empty()) {
+        StringRef Line;
+        std::tie(Line, Rest) = Rest.split('\n');
+        if (Line.startswith("def ") || Line.startswith("class "))
+          Line = Line.split(' ').second;
+        else if (!Line.contains(" = ") || isspace(static_cast<unsigned char>(Line.front())))
+          continue;
+        StringRef Name = Line.take_until([](char C) { return !isalnum(static_cast<unsigned char>(C)) && C != '_'; });
+        if (!Name.empty())
+          Names.insert(Name.str());
+      }
+    }
+    return Names;
+  }
+
+  // The machine.PWM or machine.ADC object (Class) for a pin, created once at module level. A
+  // constant pin gets a name of its own; any other pin is looked up in a dict filled on first use.
+  // ByNumber passes the number itself (an ADC channel) instead of a machine.Pin; a constant is
+  // already the channel, and a pin looked up at run time counts from A0 (pin 14) as on the Uno.
+  std::string addPinObject(StringRef Class, StringRef Pin, bool Constant, bool ByNumber = false) {
+    addImport("machine");
+    std::string Prefix = "_" + Class.str();
+    auto Construct = [&](StringRef Arg) {
+      return "machine." + Class.str() + "(" + (ByNumber ? Arg.str() : "machine.Pin(" + Arg.str() + ")") + ")";
+    };
+    if (Constant) {
+      std::string Name = Prefix + Pin.str();
+      addDefinition(Name, Name + " = " + Construct(Pin));
+      return Name;
+    }
+    std::string Lookup = Class.lower();
+    addDefinition(Prefix, Prefix + " = {}\n"
+                  "def _" + Lookup + "(pin):\n"
+                  "    obj = " + Prefix + ".get(pin)\n"
+                  "    if obj is None:\n"
+                  "        obj = " + Prefix + "[pin] = " + Construct(ByNumber ? "pin - 14 if pin >= 14 else pin" : "pin") + "\n"
+                  "    return obj");
+    return "_" + Lookup + "(" + Pin.str() + ")";
+  }
+
+  // Rewrites of a whole expression that need the converted text of its subexpressions. Build gets
+  // called after all matchers have run, innermost (shortest) range first, so the text it reads back
+  // from the Rewriter is final. Order breaks ties between rewrites of the same range.
+  enum DeferredOrder { InlineHelpers, IntegerWrapping, FixedPoint, BusTransactions, Peripherals };
+
+  void deferRewrite(CharSourceRange Range, DeferredOrder Order, std::function<std::string(Rewriter &)> Build) {
+    if (Range.isValid())
+      Deferred.push_back({Range, Order, std::move(Build)});
+  }
+
+  void finalise(ASTContext &Context, Rewriter &Rewrite) {
+    runDeferredRewrites(Context, Rewrite);
+    removeDeadCode(Context, Rewrite);
+    emitModuleHeader(Context, Rewrite);
+  }
+
+private:
+  struct DeferredRewrite {
+    CharSourceRange Range;
+    DeferredOrder Order;
+    std::function<std::string(Rewriter &)> Build;
+  };
+
+  void runDeferredRewrites(ASTContext &Context, Rewriter &Rewrite) {
+    SourceManager &SM = Context.getSourceManager();
+    auto Length = [&](const DeferredRewrite &D) {
+      return SM.getFileOffset(D.Range.getEnd()) - SM.getFileOffset(D.Range.getBegin());
+    };
+    std::stable_sort(Deferred.begin(), Deferred.end(), [&](const DeferredRewrite &A, const DeferredRewrite &B) {
+      return Length(A) != Length(B) ? Length(A) < Length(B) : A.Order < B.Order;
+    });
+    for (DeferredRewrite &D : Deferred) {
+      std::string Text = D.Build(Rewrite);
+      if (!Text.empty())
+        replaceConverted(Rewrite, D.Range, Text);
+    }
+    Deferred.clear();
+  }
+
+  struct ImportEntry {
+    bool WholeModule = false;
+    std::set<std::string> Names;
+  };
+
+  static bool isEntryPoint(const FunctionDecl *FD) {
+    std::string Name = FD->getNameAsString();
+    return Name == "setup" || Name == "loop";
+  }
+
+  void emitModuleHeader(ASTContext &Context, Rewriter &Rewrite) {
+    if (Imports.empty() && Definitions.empty())
+      return;
+    std::string Block;
+    for (const auto &Import : Imports) {
+      if (Import.second.WholeModule)
+        Block += "import " + Import.first + "\n";
+      if (!Import.second.Names.empty()) {
+        Block += "from " + Import.first + " import ";
+        for (auto Name = Import.second.Names.begin(); Name != Import.second.Names.end(); ++Name)
+          Block += (Name == Import.second.Names.begin() ? "" : ", ") + *Name;
+        Block += "\n";
+      }
+    }
+    if (!Imports.empty() && !Definitions.empty())
+      Block += "\n";
+    for (const std::string &Definition : Definitions)
+      Block += Definition + "\n";
+    SourceManager &SM = Context.getSourceManager();
+    Rewrite.InsertText(SM.getLocForStartOfFile(SM.getMainFileID()), Block + "\n", false, true);
+  }
+
+  // Walks Clang's call graph from setup() and loop(). Functions that are only referenced by
+  // address and the globals the reachable code reads or writes are followed too.
+  std::set<const Decl *> findReachable(ASTContext &Context) {
+    CallGraph CG;
+    CG.addToCallGraph(Context.getTranslationUnitDecl());
+
+    std::set<const Decl *> Reachable;
+    std::vector<const Decl *> Worklist;
+    auto Enqueue = [&](const Decl *D) {
+      if (!isa<FunctionDecl>(D) && !isa<VarDecl>(D))
+        return;
+      D = D->getCanonicalDecl();
+      if (Reachable.insert(D).second)
+        Worklist.push_back(D);
+    };
+
+    for (const Decl *D : Context.getTranslationUnitDecl()->decls())
+      if (const auto *FD = dyn_cast<FunctionDecl>(D))
+        if (isEntryPoint(FD))
+          Enqueue(FD);
+    HasEntryPoint = !Reachable.empty();
+
+    while (!Worklist.empty()) {
+      const Decl *D = Worklist.back();
+      Worklist.pop_back();
+      ReferencedDeclCollector Collector;
+      if (const auto *FD = dyn_cast<FunctionDecl>(D)) {
+        if (CallGraphNode *Node = CG.getNode(FD))
+          for (CallGraphNode *Callee : *Node)
+            if (Callee && Callee->getDecl())
+              Enqueue(Callee->getDecl());
+        const FunctionDecl *Definition = nullptr;
+        if (FD->hasBody(Definition))
+          Collector.TraverseDecl(const_cast<FunctionDecl *>(Definition));
+      } else if (const auto *VD = dyn_cast<VarDecl>(D)) {
+        if (const Expr *Init = VD->getAnyInitializer())
+          Collector.TraverseStmt(const_cast<Expr *>(Init));
+      }
+      for (const Decl *Ref : Collector.Referenced)
+        Enqueue(Ref);
+    }
+    return Reachable;
+  }
+
+  void removeDeadCode(ASTContext &Context, Rewriter &Rewrite) {
+    SourceManager &SM = Context.getSourceManager();
+    const LangOptions &LangOpts = Context.getLangOpts();
+    std::set<const Decl *> Reachable = findReachable(Context);
+    // A file without setup() or loop() is a fragment, not a sketch; nothing in it is dead.
+    if (!HasEntryPoint)
+      return;
+
+    // "int a, b;" shares one declaration statement; those are left alone rather than split.
+    std::map<SourceLocation, unsigned> DeclsStartingAt;
+    for (const Decl *D : Context.getTranslationUnitDecl()->decls())
+      ++DeclsStartingAt[D->getBeginLoc()];
+
+    for (const Decl *D : Context.getTranslationUnitDecl()->decls()) {
+      if (D->isImplicit() || !SM.isInMainFile(SM.getExpansionLoc(D->getLocation())))
+        continue;
+      if (Reachable.count(D->getCanonicalDecl()) || D->hasAttr<UsedAttr>())
+        continue;
+
+      SourceLocation End;
+      if (const auto *FD = dyn_cast<FunctionDecl>(D)) {
+        if (isEntryPoint(FD) || FD->isMain())
+          continue;
+        End = FD->doesThisDeclarationHaveABody()
+                  ? Lexer::getLocForEndOfToken(FD->getEndLoc(), 0, SM, LangOpts)
+                  : Lexer::findLocationAfterToken(FD->getEndLoc(), tok::semi, SM, LangOpts, true);
+      } else if (const auto *VD = dyn_cast<VarDecl>(D)) {
+        if (!VD->isFileVarDecl() || DeclsStartingAt[VD->getBeginLoc()] > 1)
+          continue;
+        End = Lexer::findLocationAfterToken(VD->getEndLoc(), tok::semi, SM, LangOpts, true);
+      } else {
+        continue;
+      }
+      if (End.isInvalid() || D->getBeginLoc().isMacroID())
+        continue;
+      removeConverted(Rewrite, CharSourceRange::getCharRange(D->getBeginLoc(), End));
+    }
+  }
+
+  std::map<std::string, ImportEntry> Imports;
+  std::vector<DeferredRewrite> Deferred;
+  std::vector<std::string> Definitions;
+  std::map<std::string, size_t> DefinedNames;
+  std::map<std::string, size_t> Buffers;
+  bool HasEntryPoint = false;
+};
+
+// Arduino math functions and core helpers without side effects. Calls to these with constant
+// arguments can be evaluated at conversion time. Python is the MicroPython spelling, see
+// expandPythonTemplate(). The helper macros are spelled out inline instead of becoming calls,
+// since in MicroPython the call costs far more than the arithmetic. Inline spellings name an
+// argument more than once, so Once is used instead when such an argument is more than a name or
+// a number: a call in it must run once, as it does on the board.
+struct PureMathFunction {
+  const char *Name;
+  unsigned Arity;
+  const char *Python;
+  const char *Once;
+};
+
+static const PureMathFunction PureMathFunctions[] = {
+    {"pow", 2, "math.pow($0, $1)", nullptr},
+    {"sqrt", 1, "math.sqrt($0)", nullptr},
+    {"sin", 1, "math.sin($0)", nullptr},
+    {"cos", 1, "math.cos($0)", nullptr},
+    {"tan", 1, "math.tan($0)", nullptr},
+    {"map", 5, "_map($0, $1, $2, $3, $4)", nullptr},
+    {"min", 2, "($0 if $0 < $1 else $1)", "min($0, $1)"},
+    {"max", 2, "($0 if $0 > $1 else $1)", "max($0, $1)"},
+    {"abs", 1, "($0 if $0 > 0 else -$0)", "abs($0)"},
+    {"constrain", 3, "($1 if $0 < $1 else ($2 if $0 > $2 else $0))", "_constrain($0, $1, $2)"},
+    {"sq", 1, "($0 * $0)", "($0 ** 2)"},
+    {"radians", 1, "($0 * 0.01745329252)", nullptr},
+    {"degrees", 1, "($0 * 57.29577951)", nullptr},
+    {"lowByte", 1, "($0 & 0xff)", nullptr},
+    {"highByte", 1, "(($0 >> 8) & 0xff)", nullptr},
+    {"bitRead", 2, "(($0 >> $1) & 1)", nullptr},
+    {"bit", 1, "(1 << $0)", nullptr},
+};
+
+// Module-level helpers the math spellings call, for what has no inline MicroPython equivalent.
+// Needs lists the helpers a definition calls itself.
+struct MathHelper {
+  const char *Name;
+  const char *Needs;
+  const char *Python;
+};
+
+static const MathHelper MathHelpers[] = {
+    {"_cdiv", "", "def _cdiv(a, b):\n"
+                  "    q = a // b\n"
+                  "    return q + 1 if q < 0 and q * b != a else q"},
+    {"_cmod", "_cdiv", "def _cmod(a, b):\n"
+                       "    return a - b * _cdiv(a, b)"},
+    {"_map", "_cdiv", "def _map(x, in_min, in_max, out_min, out_max):\n"
+                      "    return _cdiv((x - in_min) * (out_max - out_min), in_max - in_min) + out_min"},
+    {"_constrain", "", "def _constrain(x, low, high):\n"
+                       "    return low if x < low else (high if x > high else x)"},
+};
+
+// Adds the definitions of the helpers that converted math in Python calls.
+static void requireMathHelpers(ModuleFinaliser &Module, StringRef Python) {
+  std::function<void(StringRef)> Require = [&](StringRef Name) {
+    for (const MathHelper &Helper : MathHelpers)
+      if (Name == Helper.Name && !Module.hasDefinition(Name)) {
+        if (*Helper.Needs)
+          Require(Helper.Needs);
+        Module.addDefinition(Name, Helper.Python);
+      }
+  };
+  for (const MathHelper &Helper : MathHelpers)
+    if (Python.contains(std::string(Helper.Name) + "("))
+      Require(Helper.Name);
+}
+
+// Returns the index of the bracket closing the one at Open, or StringRef::npos.
+static size_t findClosingBracket(StringRef Text, size_t Open) {
+  int Depth = 0;
+  for (size_t I = Open; I < Text.size(); ++I) {
+    if (Text[I] == '(' || Text[I] == '[')
+      ++Depth;
+    else if ((Text[I] == ')' || Text[I] == ']') && --Depth == 0)
+      return I;
+  }
+  return StringRef::npos;
+}
+
+// Wraps a converted expression in parentheses unless it is already a single operand: a name,
+// a number, a call or subscript, or something already in parentheses.
+static std::string parenthesize(StringRef Text) {
+  Text = Text.trim();
+  size_t I = 0;
+  while (I < Text.size() && (isalnum(static_cast<unsigned char>(Text[I])) || Text[I] == '_' || Text[I] == '.'))
+    ++I;
+  while (I < Text.size() && (Text[I] == '(' || Text[I] == '[')) {
+    size_t Close = findClosingBracket(Text, I);
+    if (Close == StringRef::npos)
+      break;
+    I = Close + 1;
+  }
+  if (!Text.empty() && I == Text.size())
+    return Text.str();
+  return "(" + Text.str() + ")";
+}
+
+// Fills in a Python template: $N is the N-th argument, parenthesized where an operator touches it,
+// and @N is the N-th argument as is (for assignment targets).
+static std::string expandPythonTemplate(StringRef Template, const std::vector<std::string> &Args) {
+  std::string Out;
+  for (size_t I = 0; I < Template.size(); ++I) {
+    char C = Template[I];
+    if ((C != '$' && C != '@') || I + 1 == Template.size() || !isdigit(static_cast<unsigned char>(Template[I + 1]))) {
+      Out += C;
+      continue;
+    }
+    unsigned Index = Template[++I] - '0';
+    StringRef Arg = Index < Args.size() ? StringRef(Args[Index]).trim() : StringRef();
+    StringRef Before = StringRef(Out).rtrim();
+    char Next = I + 1 < Template.size() ? Template[I + 1] : ')';
+    bool Delimited = !Before.empty() && (Before.back() == '(' || Before.back() == ',') && (Next == ')' || Next == ',');
+    Out += C == '@' || Delimited ? Arg.str() : parenthesize(Arg);
+  }
+  return Out;
+}
+
+// The shim turns these macros into extern floats so they show up in the AST. They are not const,
+// so Clang's constant evaluator will not fold them on its own.
+struct ArduinoConstant {
+  const char *Name;
+  double Value;
+};
+
+static const ArduinoConstant ArduinoConstants[] = {
+    {"PI", 3.14159265358979323846},         {"HALF_PI", 1.57079632679489661923},
+    {"TWO_PI", 6.28318530717958647692},     {"DEG_TO_RAD", 0.01745329251994329577},
+    {"RAD_TO_DEG", 57.2957795130823208768}, {"EULER", 2.71828182845904523536},
+};
+
+//TargetInfo: What the converter knows about the peripherals of each port --target can name. Arduino
+//pin numbers are taken to be GPIO numbers on the target.
+
+struct SPIBusPins {
+  int Id;
+  std::vector<int> Sck, Mosi, Miso;
+};
+
+// The GPIOs the board's Arduino core gives Wire, Wire1...
+struct I2CPins {
+  int Scl, Sda;
+};
+
+// The bus and GPIOs the board's Arduino core gives SPI; a pin of -1 is the bus's default.
+struct SPIDefault {
+  int Id, Sck, Mosi, Miso;
+};
+
+// A UART and the GPIOs it can use for TX and RX; an empty list is any GPIO.
+struct UARTPins {
+  int Id;
+  std::vector<int> Tx, Rx;
+};
+
+struct TargetInfo {
+  const char *Name;
+  // Hardware SPI buses and the GPIOs each can use. AnySPIBus, when not -1, is a bus that can be
+  // routed to any GPIO.
+  std::vector<SPIBusPins> SPIBuses;
+  int AnySPIBus;
+  bool SPILsbFirst;
+  // Registers that set, clear and read GPIOs 0-31 with one access, for @micropython.viper code.
+  // 0 when the GPIOs aren't laid out that way.
+  uint32_t GpioSet, GpioClear, GpioIn;
+  // Id of a machine.Timer that is free for the converted code; -1 is a software timer.
+  int TimerId;
+  // machine.ADC takes the analog channel number, like analogRead(), rather than a machine.Pin.
+  bool AdcChannels;
+  // UARTs the converted code may take for SoftwareSerial ports; the one the REPL uses is left out.
+  std::vector<UARTPins> UARTs;
+  // Wire's pins, indexed by bus number. MicroPython's own defaults differ from the Arduino ones.
+  std::vector<I2CPins> I2CBuses;
+  SPIDefault SPIBus;
+};
+
+static const TargetInfo Targets[] = {
+    {"rp2", {{0, {2, 6, 18, 22}, {3, 7, 19, 23}, {0, 4, 16, 20}}, {1, {10, 14, 26}, {11, 15, 27}, {8, 12, 24, 28}}},
+     -1, false, 0xd0000014, 0xd0000018, 0xd0000004, -1, true,
+     {{0, {0, 12, 16, 28}, {1, 13, 17, 29}}, {1, {4, 8, 20, 24}, {5, 9, 21, 25}}}, {{5, 4}, {27, 26}}, {0, 18, 19, 16}},
+    {"esp32", {}, 1, true, 0x3ff44008, 0x3ff4400c, 0x3ff4403c, 0, false, {{1, {}, {}}, {2, {}, {}}}, {{22, 21}}, {2, 18, 23, 19}},
+    {"stm32", {}, -1, true, 0, 0, 0, -1, true, {}, {}, {1, -1, -1, -1}},
+};
+
+// The port given with --target, or null when the code has to run on any port.
+static const TargetInfo *targetInfo() {
+  for (const TargetInfo &Info : Targets)
+    if (TargetBoard == Info.Name)
+      return &Info;
+  return nullptr;
+}
+
+// Width of an integer type on the board the sketch was written for rather than on the host:
+// int follows --int-width and long is always 32 bits.
+static unsigned targetIntegerWidth(const ASTContext &Context, QualType T) {
+  T = T.getCanonicalType();
+  if (T->isEnumeralType())
+    return TargetIntWidth == 32 ? 32 : 16;
+  if (const auto *BT = T->getAs<BuiltinType>()) {
+    switch (BT->getKind()) {
+    case BuiltinType::Int:
+    case BuiltinType::UInt:
+      return TargetIntWidth == 32 ? 32 : 16;
+    case BuiltinType::Long:
+    case BuiltinType::ULong:
+      return 32;
+    default:
+      break;
+    }
+  }
+  return Context.getIntWidth(T);
+}
+
+//WriteCollector Class: Collects the variables a function assigns, increments, takes the address of
+//or passes by non-const reference.
+
+class WriteCollector : public RecursiveASTVisitor<WriteCollector> {
+public:
+  bool VisitBinaryOperator(BinaryOperator *BO) {
+    if (BO->isAssignmentOp())
+      markWritten(BO->getLHS());
+    return true;
+  }
+
+  bool VisitUnaryOperator(UnaryOperator *UO) {
+    if (UO->isIncrementDecrementOp() || UO->getOpcode() == UO_AddrOf)
+      markWritten(UO->getSubExpr());
+    return true;
+  }
+
+  bool VisitCallExpr(CallExpr *CE) {
+    const FunctionDecl *Callee = CE->getDirectCallee();
+    if (!Callee)
+      return true;
+    for (unsigned I = 0; I < CE->getNumArgs() && I < Callee->getNumParams(); ++I) {
+      QualType ParamType = Callee->getParamDecl(I)->getType();
+      if (ParamType->isReferenceType() && !ParamType->getPointeeType().isConstQualified())
+        markWritten(CE->getArg(I));
+    }
+    return true;
+  }
+
+  std::set<const VarDecl *> Written;
+
+private:
+  void markWritten(const Expr *E) {
+    E = E->IgnoreParenImpCasts();
+    if (const auto *DRE = dyn_cast<DeclRefExpr>(E)) {
+      if (const auto *VD = dyn_cast<VarDecl>(DRE->getDecl()))
+        Written.insert(VD->getCanonicalDecl());
+    } else if (const auto *ME = dyn_cast<MemberExpr>(E)) {
+      markWritten(ME->getBase());
+    } else if (const auto *ASE = dyn_cast<ArraySubscriptExpr>(E)) {
+      markWritten(ASE->getBase());
+    }
+  }
+};
+
+//MathOptimiser Class: Decides which expressions are rewritten by the constant folding and
+//loop-invariant code motion handlers. Pure math with constant arguments (pow(2, 8), PI / 180.0,
+//map() of constants) is evaluated here and emitted as a literal. Pure math in loop() whose inputs
+//never change once setup() has run is moved in front of the While True: as a module-level constant.
+//The other math handlers ask isOptimised() so they leave these expressions alone.
+
+class MathOptimiser {
+public:
+  struct Value {
+    bool IsFloat = false;
+    double Float = 0;
+    int64_t Int = 0;
+
+    double asFloat() const { return IsFloat ? Float : static_cast<double>(Int); }
+  };
+
+  // Finds setup() and loop() and works out which globals stay fixed while loop() runs. Writes in
+  // setup() don't count as long as setup() comes first, since its body runs before the hoisted constants.
+  void analyse(ASTContext &Ctx) {
+    Context = &Ctx;
+    SourceManager &SM = Ctx.getSourceManager();
+    const FunctionDecl *Setup = nullptr;
+    for (const Decl *D : Ctx.getTranslationUnitDecl()->decls()) {
+      const auto *FD = dyn_cast<FunctionDecl>(D);
+      if (!FD || !FD->doesThisDeclarationHaveABody() || !SM.isInMainFile(FD->getLocation()))
+        continue;
+      if (FD->getNameAsString() == "loop" && FD->getNumParams() == 0)
+        Loop = FD;
+      else if (FD->getNameAsString() == "setup")
+        Setup = FD;
+    }
+
+    WriteCollector Writes, SetupWrites;
+    for (const Decl *D : Ctx.getTranslationUnitDecl()->decls()) {
+      const auto *FD = dyn_cast<FunctionDecl>(D);
+      if (!FD || !FD->doesThisDeclarationHaveABody())
+        continue;
+      if (FD == Setup && Loop && SM.isBeforeInTranslationUnit(Setup->getBeginLoc(), Loop->getBeginLoc())) {
+        SetupWrites.TraverseDecl(const_cast<FunctionDecl *>(FD));
+        continue;
+      }
+      Writes.TraverseDecl(const_cast<FunctionDecl *>(FD));
+    }
+    for (const Decl *D : Ctx.getTranslationUnitDecl()->decls())
+      if (const auto *VD = dyn_cast<VarDecl>(D))
+        if (VD->isFileVarDecl() && SM.isInMainFile(VD->getLocation()) &&
+            !VD->getType().isVolatileQualified() && !Writes.Written.count(VD->getCanonicalDecl())) {
+          InvariantGlobals.insert(VD->getCanonicalDecl());
+          if (!SetupWrites.Written.count(VD->getCanonicalDecl()))
+            UnwrittenGlobals.insert(VD->getCanonicalDecl());
+        }
+  }
+
+  const FunctionDecl *getLoop() const { return Loop; }
+
+  // Whether a global keeps its value while loop() runs: only setup() writes it, before loop().
+  bool isInvariantGlobal(const VarDecl *VD) const { return InvariantGlobals.count(VD->getCanonicalDecl()); }
+
+  // Like evaluate(), but a global that is never assigned also counts, with its initial value. Pin
+  // numbers are usually declared that way.
+  bool evaluateOrInitial(const Expr *E, Value &V) {
+    if (evaluate(E, V))
+      return true;
+    const auto *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+    const auto *VD = DRE ? dyn_cast<VarDecl>(DRE->getDecl()) : nullptr;
+    const Expr *Init = VD ? VD->getAnyInitializer() : nullptr;
+    return Init && UnwrittenGlobals.count(VD->getCanonicalDecl()) && evaluate(Init, V);
+  }
+
+  // Evaluates E if it only depends on literals, Arduino constants and pure math calls.
+  bool evaluate(const Expr *E, Value &V) {
+    E = E->IgnoreParens();
+    if (const auto *Cast = dyn_cast<CastExpr>(E)) {
+      switch (Cast->getCastKind()) {
+      case CK_LValueToRValue:
+      case CK_NoOp:
+      case CK_FloatingCast:
+        return evaluate(Cast->getSubExpr(), V);
+      case CK_IntegralToFloating:
+        if (!evaluate(Cast->getSubExpr(), V))
+          return false;
+        V.Float = V.asFloat();
+        V.IsFloat = true;
+        return true;
+      case CK_FloatingToIntegral:
+        if (!evaluate(Cast->getSubExpr(), V) || std::fabs(V.asFloat()) >= 9.2e18)
+          return false;
+        V.Int = static_cast<int64_t>(V.asFloat());
+        V.IsFloat = false;
+        return wrapToType(V, Cast->getType());
+      case CK_IntegralCast:
+        return evaluate(Cast->getSubExpr(), V) && wrapToType(V, Cast->getType());
+      default:
+        break;
+      }
+    }
+
+    if (const auto *DRE = dyn_cast<DeclRefExpr>(E))
+      if (const ArduinoConstant *Constant = getArduinoConstant(DRE)) {
+        V.IsFloat = true;
+        V.Float = Constant->Value;
+        return true;
+      }
+
+    if (const auto *BO = dyn_cast<BinaryOperator>(E))
+      if (isArithmetic(BO))
+        return evaluateBinary(BO, V);
+
+    if (const auto *UO = dyn_cast<UnaryOperator>(E)) {
+      if (!isArithmetic(UO) || !evaluate(UO->getSubExpr(), V))
+        return false;
+      if (UO->getOpcode() == UO_Minus) {
+        V.Float = -V.Float;
+        V.Int = -V.Int;
+      } else if (UO->getOpcode() == UO_Not) {
+        if (V.IsFloat)
+          return false;
+        V.Int = ~V.Int;
+      }
+      return V.IsFloat || wrapToType(V, UO->getType());
+    }
+
+    if (const auto *Call = dyn_cast<CallExpr>(E))
+      if (const PureMathFunction *Function = getPureMathFunction(Call))
+        return evaluateCall(Call, Function, V);
+
+    // Anything else has to be something Clang's own constant evaluator can fold
+    // (literals, const integers, enumerators, sizeof).
+    Expr::EvalResult Result;
+    if (E->isValueDependent() || !E->EvaluateAsRValue(Result, *Context) || Result.HasSideEffects)
+      return false;
+    if (Result.Val.isInt()) {
+      V.IsFloat = false;
+      V.Int = Result.Val.getInt().getExtValue();
+      return true;
+    }
+    if (Result.Val.isFloat()) {
+      llvm::APFloat F = Result.Val.getFloat();
+      bool LosesInfo;
+      F.convert(llvm::APFloat::IEEEdouble(), llvm::APFloat::rmNearestTiesToEven, &LosesInfo);
+      V.IsFloat = true;
+      V.Float = F.convertToDouble();
+      return std::isfinite(V.Float);
+    }
+    return false;
+  }
+
+  // E is the outermost constant expression around it and is replaced by its value.
+  bool isFoldRoot(const Expr *E) {
+    auto Cached = FoldRoots.find(E);
+    if (Cached != FoldRoots.end())
+      return Cached->second;
+    bool Result = false;
+    Value V;
+    if (OptimiseMath && isCandidate(E) && hasMathWork(E) && evaluate(climbCasts(E), V) && !insideHoistRoot(E) &&
+        !isClaimed(E)) {
+      Result = true;
+      for (const Expr *P = getParentExpr(climbCasts(E)); P && Result; P = getParentExpr(P))
+        if (isCandidate(P) && evaluate(P, V))
+          Result = false;
+    }
+    FoldRoots[E] = Result;
+    return Result;
+  }
+
+  // E is the outermost loop-invariant math inside loop() and is replaced by a module-level constant.
+  bool isHoistRoot(const Expr *E) {
+    auto Cached = HoistRoots.find(E);
+    if (Cached != HoistRoots.end())
+      return Cached->second;
+    bool Result = false;
+    Value V;
+    std::string Python;
+    if (OptimiseMath && Loop && isCandidate(E) && hasMathWork(E) && !evaluate(climbCasts(E), V) &&
+        isInLoop(E) && isInvariant(climbCasts(E)) && toPython(climbCasts(E), Python) && !isClaimed(E)) {
+      Result = true;
+      for (const Expr *P = getParentExpr(climbCasts(E)); P && Result; P = getParentExpr(P))
+        if (isCandidate(P) && isInvariant(P) && toPython(P, Python))
+          Result = false;
+    }
+    HoistRoots[E] = Result;
+    return Result;
+  }
+
+  // True when S lies inside an expression the optimiser rewrites as a whole.
+  bool isOptimised(const Stmt *S) {
+    const Expr *E = dyn_cast<Expr>(S);
+    if (!E)
+      E = getParentExpr(S);
+    if (E && isClaimed(E))
+      return true;
+    for (; E; E = getParentExpr(E))
+      if (isFoldRoot(E) || isHoistRoot(E))
+        return true;
+    return false;
+  }
+
+  // Another rewrite spells the float math under Root itself (the fixed-point mode), so none of it
+  // is folded or hoisted and isOptimised() holds for it. Integer operands converted to float inside
+  // Root are not part of the claim; they keep their own conversion.
+  void claim(const Expr *Root) {
+    Claimed.insert(Root);
+    FoldRoots.clear();
+    HoistRoots.clear();
+  }
+
+  bool isClaimed(const Expr *E) {
+    for (const Expr *P = E; P; P = getParentExpr(P)) {
+      if (P != E)
+        if (const auto *Cast = dyn_cast<CastExpr>(P))
+          if (Cast->getCastKind() == CK_IntegralToFloating)
+            return false;
+      if (Claimed.count(P))
+        return true;
+    }
+    return false;
+  }
+
+  // The outermost node with the same value as E: the parens and casts wrapped around it.
+  const Expr *climbCasts(const Expr *E) {
+    while (const Expr *P = getParentExpr(E)) {
+      if (!isa<ParenExpr>(P) && !isa<ImplicitCastExpr>(P) && !isa<ExplicitCastExpr>(P))
+        break;
+      E = P;
+    }
+    return E;
+  }
+
+  CharSourceRange getFileRange(const Expr *E) {
+    return Lexer::makeFileCharRange(CharSourceRange::getTokenRange(E->getSourceRange()),
+                                    Context->getSourceManager(), Context->getLangOpts());
+  }
+
+  static std::string formatValue(const Value &V) {
+    if (!V.IsFloat)
+      return std::to_string(V.Int);
+    std::string S;
+    llvm::raw_string_ostream OS(S);
+    OS << llvm::format("%.10g", V.Float);
+    OS.flush();
+    if (S.find_first_of(".e") == std::string::npos)
+      S += ".0";
+    return S;
+  }
+
+  // Spells a pure expression as MicroPython so it can be moved out of the loop.
+  bool toPython(const Expr *E, std::string &Out) {
+    Value V;
+    if (evaluate(E, V)) {
+      Out = formatValue(V);
+      return true;
+    }
+    E = E->IgnoreParens();
+    if (const auto *Cast = dyn_cast<CastExpr>(E)) {
+      if (!isValuePreserving(Cast))
+        return false;
+      std::string Sub;
+      if (!toPython(Cast->getSubExpr(), Sub))
+        return false;
+      Out = Cast->getCastKind() == CK_FloatingToIntegral ? "int(" + Sub + ")" : Sub;
+      return true;
+    }
+    if (const auto *DRE = dyn_cast<DeclRefExpr>(E)) {
+      if (!isa<VarDecl>(DRE->getDecl()))
+        return false;
+      Out = DRE->getDecl()->getNameAsString();
+      return true;
+    }
+    if (const auto *BO = dyn_cast<BinaryOperator>(E)) {
+      std::string LHS, RHS;
+      if (!isArithmetic(BO) || !toPython(BO->getLHS(), LHS) || !toPython(BO->getRHS(), RHS))
+        return false;
+      // C truncates integer division towards zero where Python's // and % floor, so they go
+      // through helpers that do it the C way.
+      if ((BO->getOpcode() == BO_Div || BO->getOpcode() == BO_Rem) && !BO->getType()->isRealFloatingType()) {
+        Out = std::string(BO->getOpcode() == BO_Div ? "_cdiv(" : "_cmod(") + LHS + ", " + RHS + ")";
+        return true;
+      }
+      Out = "(" + LHS + " " + BO->getOpcodeStr().str() + " " + RHS + ")";
+      return true;
+    }
+    if (const auto *UO = dyn_cast<UnaryOperator>(E)) {
+      std::string Sub;
+      if (!isArithmetic(UO) || !toPython(UO->getSubExpr(), Sub))
+        return false;
+      Out = UnaryOperator::getOpcodeStr(UO->getOpcode()).str() + Sub;
+      return true;
+    }
+    if (const auto *Call = dyn_cast<CallExpr>(E)) {
+      std::vector<std::string> Args(Call->getNumArgs());
+      for (unsigned I = 0; I < Call->getNumArgs(); ++I)
+        if (!toPython(Call->getArg(I), Args[I]))
+          return false;
+      return spellCall(Call, Args, Out);
+    }
+    return false;
+  }
+
+  // Spells a call to a pure math function or core helper given its converted arguments.
+  bool spellCall(const CallExpr *Call, const std::vector<std::string> &Args, std::string &Out) {
+    const PureMathFunction *Function = getPureMathFunction(Call);
+    if (!Function || Args.size() != Function->Arity)
+      return false;
+    if (StringRef(Function->Name) == "map" && spellConstantRangeMap(Call, Args, Out))
+      return true;
+    bool Simple = true;
+    for (const std::string &Arg : Args)
+      Simple &= isSimpleOperand(Arg);
+    Out = expandPythonTemplate(Function->Once && !Simple ? Function->Once : Function->Python, Args);
+    return true;
+  }
+
+private:
+  // map(x, in_min, in_max, out_min, out_max) with constant ranges is (x - in_min) * A // N + out_min
+  // for fixed A and N. The division is replaced by a multiply and shift, (n * M) >> S, using the
+  // smallest S that gives the same result for every n in [0, N] while n * M stays a small int, so
+  // the hot path never allocates. Outside the input range the result can be off by one.
+  bool spellConstantRangeMap(const CallExpr *Call, const std::vector<std::string> &Args, std::string &Out) {
+    Value InMin, InMax, OutMin, OutMax;
+    if (!evaluate(Call->getArg(1), InMin) || !evaluate(Call->getArg(2), InMax) ||
+        !evaluate(Call->getArg(3), OutMin) || !evaluate(Call->getArg(4), OutMax) ||
+        InMin.IsFloat || InMax.IsFloat || OutMin.IsFloat || OutMax.IsFloat)
+      return false;
+    int64_t Span = InMax.Int - InMin.Int;
+    int64_t Scale = OutMax.Int - OutMin.Int;
+    if (Span <= 0 || Scale == 0 || Span >= (1 << 30) || std::llabs(Scale) >= (1 << 30))
+      return false;
+    uint64_t N = Span, A = std::llabs(Scale);
+    for (unsigned Shift = 0; Shift <= 30; ++Shift) {
+      uint64_t M = ((A << Shift) + N - 1) / N;
+      uint64_t Error = M * N - (A << Shift);
+      if (Error * N >= (uint64_t(1) << Shift))
+        continue;
+      if (N * M >= (uint64_t(1) << 30))
+        return false;
+      std::string X = InMin.Int == 0 ? parenthesize(Args[0]) : "(" + Args[0] + " - " + std::to_string(InMin.Int) + ")";
+      std::string Scaled = "(" + X + " * " + std::to_string(M) + (Shift ? " >> " + std::to_string(Shift) : "") + ")";
+      if (Scale < 0)
+        Out = "(" + std::to_string(OutMin.Int) + " - " + Scaled + ")";
+      else if (OutMin.Int != 0)
+        Out = "(" + Scaled + " + " + std::to_string(OutMin.Int) + ")";
+      else
+        Out = Scaled;
+      return true;
+    }
+    return false;
+  }
+
+  // A name, an attribute or a number: naming it twice does no work twice.
+  static bool isSimpleOperand(StringRef Text) {
+    Text = Text.trim();
+    if (Text.startswith("-"))
+      Text = Text.drop_front().ltrim();
+    return !Text.empty() && llvm::all_of(Text, [](char C) { return isalnum(static_cast<unsigned char>(C)) || C == '_' || C == '.'; });
+  }
+
+  const Expr *getParentExpr(const Stmt *S) {
+    auto Parents = Context->getParents(*S);
+    return Parents.empty() ? nullptr : Parents[0].get<Expr>();
+  }
+
+  bool isInLoop(const Expr *E) {
+    SourceManager &SM = Context->getSourceManager();
+    const Stmt *Body = Loop->getBody();
+    if (!Body)
+      return false;
+    SourceLocation Loc = SM.getExpansionLoc(E->getBeginLoc());
+    return !SM.isBeforeInTranslationUnit(Loc, SM.getExpansionLoc(Body->getBeginLoc())) &&
+           !SM.isBeforeInTranslationUnit(SM.getExpansionLoc(Body->getEndLoc()), Loc);
+  }
+
+  static bool isArithmetic(const BinaryOperator *BO) {
+    return BO->isAdditiveOp() || BO->isMultiplicativeOp() || BO->isShiftOp() || BO->isBitwiseOp();
+  }
+
+  static bool isArithmetic(const UnaryOperator *UO) {
+    return UO->getOpcode() == UO_Minus || UO->getOpcode() == UO_Plus || UO->getOpcode() == UO_Not;
+  }
+
+  static bool isValuePreserving(const CastExpr *Cast) {
+    switch (Cast->getCastKind()) {
+    case CK_LValueToRValue:
+    case CK_NoOp:
+    case CK_FloatingCast:
+    case CK_IntegralCast:
+    case CK_IntegralToFloating:
+    case CK_FloatingToIntegral:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  bool isCandidate(const Expr *E) {
+    if (const auto *BO = dyn_cast<BinaryOperator>(E))
+      return isArithmetic(BO);
+    if (const auto *UO = dyn_cast<UnaryOperator>(E))
+      return isArithmetic(UO);
+    if (const auto *Call = dyn_cast<CallExpr>(E))
+      return getPureMathFunction(Call) != nullptr;
+    return false;
+  }
+
+  // Integer arithmetic on literals is left alone; MicroPython's compiler folds that itself.
+  bool hasMathWork(const Stmt *S) {
+    if (const auto *Call = dyn_cast<CallExpr>(S))
+      if (getPureMathFunction(Call))
+        return true;
+    if (const auto *DRE = dyn_cast<DeclRefExpr>(S))
+      if (getArduinoConstant(DRE))
+        return true;
+    if (const auto *BO = dyn_cast<BinaryOperator>(S))
+      if (BO->getType()->isRealFloatingType())
+        return true;
+    for (const Stmt *Child : S->children())
+      if (Child && hasMathWork(Child))
+        return true;
+    return false;
+  }
+
+  bool insideHoistRoot(const Expr *E) {
+    for (const Expr *P = getParentExpr(E); P; P = getParentExpr(P))
+      if (isHoistRoot(P))
+        return true;
+    return false;
+  }
+
+  bool isInvariant(const Expr *E) {
+    Value V;
+    if (evaluate(E, V))
+      return true;
+    E = E->IgnoreParens();
+    if (const auto *Cast = dyn_cast<CastExpr>(E))
+      return isValuePreserving(Cast) && isInvariant(Cast->getSubExpr());
+    if (const auto *DRE = dyn_cast<DeclRefExpr>(E)) {
+      const auto *VD = dyn_cast<VarDecl>(DRE->getDecl());
+      return VD && InvariantGlobals.count(VD->getCanonicalDecl()) && !isClaimed(DRE);
+    }
+    if (const auto *BO = dyn_cast<BinaryOperator>(E)) {
+      if (!isArithmetic(BO))
+        return false;
+      // Moving a division in front of the loop must not introduce a ZeroDivisionError.
+      if (BO->getOpcode() == BO_Div || BO->getOpcode() == BO_Rem)
+        if (!evaluate(BO->getRHS(), V) || V.asFloat() == 0)
+          return false;
+      return isInvariant(BO->getLHS()) && isInvariant(BO->getRHS());
+    }
+    if (const auto *UO = dyn_cast<UnaryOperator>(E))
+      return isArithmetic(UO) && isInvariant(UO->getSubExpr());
+    if (const auto *Call = dyn_cast<CallExpr>(E)) {
+      if (!getPureMathFunction(Call))
+        return false;
+      for (const Expr *Arg : Call->arguments())
+        if (!isInvariant(Arg))
+          return false;
+      return true;
+    }
+    return false;
+  }
+
+  // Only the Arduino declarations count; a sketch may define its own map() or PI.
+  bool isFromShim(const Decl *D) {
+    SourceManager &SM = Context->getSourceManager();
+    return !SM.isInMainFile(SM.getExpansionLoc(D->getLocation()));
+  }
+
+  const PureMathFunction *getPureMathFunction(const CallExpr *Call) {
+    const FunctionDecl *Callee = Call->getDirectCallee();
+    if (!Callee || !Callee->getIdentifier() || !isFromShim(Callee))
+      return nullptr;
+    for (const PureMathFunction &Function : PureMathFunctions)
+      if (Callee->getName() == Function.Name && Call->getNumArgs() == Function.Arity)
+        return &Function;
+    return nullptr;
+  }
+
+  const ArduinoConstant *getArduinoConstant(const DeclRefExpr *DRE) {
+    const auto *VD = dyn_cast<VarDecl>(DRE->getDecl());
+    if (!VD || !VD->getIdentifier() || !isFromShim(VD))
+      return nullptr;
+    for (const ArduinoConstant &Constant : ArduinoConstants)
+      if (VD->getName() == Constant.Name)
+        return &Constant;
+    return nullptr;
+  }
+
+  bool wrapToType(Value &V, QualType T) {
+    if (!T->isIntegerType())
+      return false;
+    unsigned Width = targetIntegerWidth(*Context, T);
+    if (Width >= 64)
+      return true;
+    uint64_t Mask = (uint64_t(1) << Width) - 1;
+    uint64_t Bits = static_cast<uint64_t>(V.Int) & Mask;
+    if (T->isSignedIntegerOrEnumerationType() && (Bits >> (Width - 1)))
+      Bits |= ~Mask;
+    V.Int = static_cast<int64_t>(Bits);
+    return true;
+  }
+
+  bool evaluateBinary(const BinaryOperator *BO, Value &V) {
+    Value L, R;
+    if (!evaluate(BO->getLHS(), L) || !evaluate(BO->getRHS(), R))
+      return false;
+    BinaryOperatorKind Op = BO->getOpcode();
+    if (BO->getType()->isRealFloatingType()) {
+      double A = L.asFloat(), B = R.asFloat();
+      V.IsFloat = true;
+      switch (Op) {
+      case BO_Add: V.Float = A + B; break;
+      case BO_Sub: V.Float = A - B; break;
+      case BO_Mul: V.Float = A * B; break;
+      case BO_Div:
+        if (B == 0)
+          return false;
+        V.Float = A / B;
+        break;
+      default:
+        return false;
+      }
+      return std::isfinite(V.Float);
+    }
+    if (L.IsFloat || R.IsFloat)
+      return false;
+    int64_t A = L.Int, B = R.Int;
+    V.IsFloat = false;
+    switch (Op) {
+    case BO_Add: V.Int = A + B; break;
+    case BO_Sub: V.Int = A - B; break;
+    case BO_Mul: V.Int = A * B; break;
+    case BO_Div:
+    case BO_Rem:
+      if (B == 0)
+        return false;
+      V.Int = Op == BO_Div ? A / B : A % B;
+      break;
+    case BO_Shl:
+    case BO_Shr:
+      if (B < 0 || B >= 63)
+        return false;
+      V.Int = Op == BO_Shl ? A << B : A >> B;
+      break;
+    case BO_And: V.Int = A & B; break;
+    case BO_Or: V.Int = A | B; break;
+    case BO_Xor: V.Int = A ^ B; break;
+    default:
+      return false;
+    }
+    return wrapToType(V, BO->getType());
+  }
+
+  bool evaluateCall(const CallExpr *Call, const PureMathFunction *Function, Value &V) {
+    std::vector<Value> Args(Call->getNumArgs());
+    for (unsigned I = 0; I < Call->getNumArgs(); ++I)
+      if (!evaluate(Call->getArg(I), Args[I]))
+        return false;
+    StringRef Name = Function->Name;
+    if (Name == "map") {
+      // long map(long x, long in_min, long in_max, long out_min, long out_max) from WMath.cpp.
+      int64_t InRange = Args[2].Int - Args[1].Int;
+      if (InRange == 0)
+        return false;
+      V.IsFloat = false;
+      V.Int = (Args[0].Int - Args[1].Int) * (Args[4].Int - Args[3].Int) / InRange + Args[3].Int;
+      return wrapToType(V, Call->getType());
+    }
+    if (Name == "min" || Name == "max" || Name == "abs" || Name == "constrain" || Name == "sq") {
+      bool IsFloat = false;
+      for (const Value &Arg : Args)
+        IsFloat |= Arg.IsFloat;
+      if (IsFloat) {
+        double X = Args[0].asFloat();
+        if (Name == "min")
+          X = X < Args[1].asFloat() ? X : Args[1].asFloat();
+        else if (Name == "max")
+          X = X > Args[1].asFloat() ? X : Args[1].asFloat();
+        else if (Name == "abs")
+          X = X > 0 ? X : -X;
+        else if (Name == "constrain")
+          X = X < Args[1].asFloat() ? Args[1].asFloat() : (X > Args[2].asFloat() ? Args[2].asFloat() : X);
+        else
+          X = X * X;
+        V.IsFloat = true;
+        V.Float = X;
+      } else {
+        int64_t X = Args[0].Int;
+        if (Name == "min")
+          X = X < Args[1].Int ? X : Args[1].Int;
+        else if (Name == "max")
+          X = X > Args[1].Int ? X : Args[1].Int;
+        else if (Name == "abs")
+          X = X > 0 ? X : -X;
+        else if (Name == "constrain")
+          X = X < Args[1].Int ? Args[1].Int : (X > Args[2].Int ? Args[2].Int : X);
+        else
+          X = X * X;
+        V.IsFloat = false;
+        V.Int = X;
+      }
+      if (!Call->getType()->isRealFloatingType())
+        return !V.IsFloat && wrapToType(V, Call->getType());
+      V.Float = V.asFloat();
+      V.IsFloat = true;
+      return std::isfinite(V.Float);
+    }
+    if (Name == "lowByte" || Name == "highByte" || Name == "bitRead" || Name == "bit") {
+      for (const Value &Arg : Args)
+        if (Arg.IsFloat)
+          return false;
+      int64_t X = Args[0].Int;
+      V.IsFloat = false;
+      if (Name == "lowByte")
+        V.Int = X & 0xff;
+      else if (Name == "highByte")
+        V.Int = (X >> 8) & 0xff;
+      else if (Name == "bit")
+        V.Int = X >= 0 && X < 32 ? int64_t(1) << X : -1;
+      else
+        V.Int = Args[1].Int >= 0 && Args[1].Int < 63 ? (X >> Args[1].Int) & 1 : -1;
+      return V.Int >= 0 && wrapToType(V, Call->getType());
+    }
+    double X = Args[0].asFloat();
+    V.IsFloat = true;
+    if (Name == "radians")
+      V.Float = X * 0.01745329251994329577;
+    else if (Name == "degrees")
+      V.Float = X * 57.2957795130823208768;
+    else if (Name == "pow")
+      V.Float = std::pow(X, Args[1].asFloat());
+    else if (Name == "sqrt")
+      V.Float = X < 0 ? NAN : std::sqrt(X);
+    else if (Name == "sin")
+      V.Float = std::sin(X);
+    else if (Name == "cos")
+      V.Float = std::cos(X);
+    else if (Name == "tan")
+      V.Float = std::tan(X);
+    else
+      return false;
+    return std::isfinite(V.Float);
+  }
+
+  ASTContext *Context = nullptr;
+  const FunctionDecl *Loop = nullptr;
+  std::set<const VarDecl *> InvariantGlobals;
+  std::set<const VarDecl *> UnwrittenGlobals;
+  std::map<const Expr *, bool> FoldRoots;
+  std::map<const Expr *, bool> HoistRoots;
+  std::set<const Expr *> Claimed;
+};
+
+//IntegerRanges Class: Works out the values each integer expression can take, so the integer
+//wrapping handler only masks the places where a narrow C type would actually overflow. Sizes are
+//the sketch's board ones (--int-width), not the host's. Variables get the union of everything
+//stored in them, iterated to a fixed point; counters of a for loop are bounded by its condition.
+//float variables are tracked the same way for the fixed-point mode.
+
+class IntegerRanges {
+public:
+  struct Range {
+    double Lo = 1;
+    double Hi = 0;
+
+    bool isEmpty() const { return Lo > Hi; }
+    bool within(const Range &Other) const { return isEmpty() || (Other.Lo <= Lo && Hi <= Other.Hi); }
+    static Range of(double Lo, double Hi) {
+      Range R;
+      R.Lo = Lo < -Limit ? -Limit : Lo;
+      R.Hi = Hi > Limit ? Limit : Hi;
+      return R;
+    }
+    Range join(const Range &Other) const {
+      if (isEmpty())
+        return Other;
+      if (Other.isEmpty())
+        return *this;
+      return of(std::min(Lo, Other.Lo), std::max(Hi, Other.Hi));
+    }
+    // Doubles hold every bound below 2^53 exactly; anything past Limit never fits a C type anyway.
+    static constexpr double Limit = 9007199254740992.0;
+  };
+
+  void analyse(ASTContext &Ctx, MathOptimiser &Math) {
+    Context = &Ctx;
+    Optimiser = &Math;
+    StoreCollector Collector(*this);
+    Collector.TraverseDecl(Ctx.getTranslationUnitDecl());
+
+    // A variable holds ticks once anything stores ticks in it; previous = millis() is the usual one.
+    for (bool Changed = true; Changed;) {
+      Changed = false;
+      for (const Store &S : Stores)
+        if (!TickVariables.count(S.Var) && isTicks(S.Value))
+          Changed = TickVariables.insert(S.Var).second;
+    }
+
+    // Widen a variable to its whole type once it keeps growing; counters that are never bounded
+    // (x++ in loop()) get there after a few rounds.
+    for (unsigned Round = 0; Round < 16; ++Round) {
+      bool Changed = false;
+      for (const Store &S : Stores) {
+        if (Unknown.count(S.Var))
+          continue;
+        Range Old = Variables[S.Var];
+        Range New = Old.join(storedRange(S));
+        if (New.Lo == Old.Lo && New.Hi == Old.Hi)
+          continue;
+        Variables[S.Var] = Round < 4 ? New : typeRange(S.Var->getType());
+        Changed = true;
+      }
+      if (!Changed)
+        break;
+    }
+    Analysed = true;
+  }
+
+  static bool isWrappable(QualType T) { return T->isIntegerType() && !T->isBooleanType(); }
+
+  // millis() and micros() become utime.ticks_ms() and ticks_us(), which wrap at 2^30 rather than at
+  // 2^32 like an unsigned long. Masking their arithmetic to 32 bits would be wrong at that rollover
+  // and turn small ints into long ints, so a tick minus a tick is utime.ticks_diff() and a tick plus
+  // or minus a duration is utime.ticks_add(), and neither is wrapped.
+  enum TickOp { NotTicks, TicksAdd, TicksDiff };
+
+  TickOp tickOp(const BinaryOperator *BO) const {
+    bool L = isTicks(BO->getLHS()), R = isTicks(BO->getRHS());
+    switch (BO->getOpcode()) {
+    case BO_Add: case BO_AddAssign:
+      return L != R ? TicksAdd : NotTicks;
+    case BO_Sub: case BO_SubAssign:
+      return L && !R ? TicksAdd : (R ? TicksDiff : NotTicks);
+    default:
+      return NotTicks;
+    }
+  }
+
+  // E is a millis() or micros() reading, a variable holding one, or one moved by a duration.
+  bool isTicks(const Expr *E) const {
+    E = E->IgnoreParenCasts();
+    if (const auto *Call = dyn_cast<CallExpr>(E)) {
+      const FunctionDecl *Callee = Call->getDirectCallee();
+      return Callee && Callee->getIdentifier() && !isInMainFile(Callee) &&
+             (Callee->getName() == "millis" || Callee->getName() == "micros");
+    }
+    if (const auto *DRE = dyn_cast<DeclRefExpr>(E))
+      return isa<VarDecl>(DRE->getDecl()) && TickVariables.count(cast<VarDecl>(DRE->getDecl())->getCanonicalDecl());
+    if (const auto *BO = dyn_cast<BinaryOperator>(E))
+      return tickOp(BO) == TicksAdd;
+    return false;
+  }
+
+  static bool isTracked(QualType T) { return isWrappable(T) || T->isRealFloatingType(); }
+
+  Range variableRange(const VarDecl *Var) {
+    auto Known = Variables.find(Var->getCanonicalDecl());
+    return Known == Variables.end() ? Range() : Known->second;
+  }
+
+  // Every value Var can hold is known and no bigger than Limit either way.
+  bool isBounded(const VarDecl *Var, double Limit) {
+    Range R = variableRange(Var);
+    return !Unknown.count(Var->getCanonicalDecl()) && !R.isEmpty() && R.Lo >= -Limit && R.Hi <= Limit;
+  }
+
+  static unsigned targetWidth(const ASTContext &Ctx, QualType T) { return targetIntegerWidth(Ctx, T); }
+
+  Range typeRange(QualType T) const {
+    if (T->isBooleanType())
+      return Range::of(0, 1);
+    if (!T->isIntegerType())
+      return Range::of(-Range::Limit, Range::Limit);
+    double Size = std::ldexp(1.0, targetWidth(*Context, T));
+    if (T->isSignedIntegerOrEnumerationType())
+      return Range::of(-Size / 2, Size / 2 - 1);
+    return Range::of(0, Size - 1);
+  }
+
+  // The values E can take once every wrap the handler emits below it is in place.
+  Range range(const Expr *E) {
+    E = E->IgnoreParens();
+    Range Exact = exactRange(E);
+    return wrapsAt(E, Exact) ? typeRange(E->getType()) : Exact;
+  }
+
+  bool needsWrap(const Expr *E) {
+    E = E->IgnoreParens();
+    return isWrapPoint(E) && wrapsAt(E, exactRange(E));
+  }
+
+  // Arithmetic that leaves its C type has to be wrapped where it is, unless the expression using
+  // it wraps to the same or a narrower width anyway: modular arithmetic gives the same low bits
+  // whether the wrap comes early or late. Comparisons, division, right shifts, wider variables
+  // and calls see the value itself, so those consumers need it wrapped first.
+  bool wrapsAt(const Expr *E, const Range &Exact) {
+    if (!isWrapPoint(E) || Exact.within(typeRange(E->getType())) || Optimiser->isOptimised(E))
+      return false;
+    if (isa<CastExpr>(E))
+      return true;
+    const Expr *Parent = getParentExpr(E);
+    while (Parent && isa<ParenExpr>(Parent))
+      Parent = getParentExpr(Parent);
+    if (!Parent)
+      return true;
+    unsigned Width = targetWidth(*Context, E->getType());
+    if (const auto *Cast = dyn_cast<CastExpr>(Parent))
+      return !(Cast->getCastKind() == CK_IntegralCast && targetWidth(*Context, Cast->getType()) <= Width);
+    if (const auto *BO = dyn_cast<BinaryOperator>(Parent)) {
+      if (BO->isCompoundAssignmentOp())
+        return !(BO->getRHS()->IgnoreParenImpCasts() == E && isModular(BO->getOpcode()) &&
+                 targetWidth(*Context, BO->getLHS()->getType()) <= Width);
+      if (BO->getOpcode() == BO_Shl)
+        return BO->getLHS()->IgnoreParens() != E || targetWidth(*Context, BO->getType()) != Width;
+      return !(isModular(BO->getOpcode()) && targetWidth(*Context, BO->getType()) == Width);
+    }
+    if (const auto *UO = dyn_cast<UnaryOperator>(Parent))
+      return !((UO->getOpcode() == UO_Minus || UO->getOpcode() == UO_Not) && targetWidth(*Context, UO->getType()) == Width);
+    return true;
+  }
+
+  // x++ and x += v store back into x; these say whether the stored value needs wrapping.
+  bool stepNeedsWrap(const UnaryOperator *UO) {
+    QualType T = UO->getSubExpr()->getType();
+    return isWrappable(T) && !steppedRange(UO, getVar(UO->getSubExpr())).within(typeRange(T));
+  }
+
+  bool compoundNeedsWrap(const CompoundAssignOperator *CAO) {
+    QualType T = CAO->getLHS()->getType();
+    return isWrappable(T) && isModular(CAO->getOpcode()) && !tickOp(CAO) &&
+           !applyBinary(CAO->getOpcode(), exactRange(CAO->getLHS()), range(CAO->getRHS()), CAO->getComputationResultType())
+                .within(typeRange(T));
+  }
+
+  static bool isModular(BinaryOperatorKind Op) {
+    switch (Op) {
+    case BO_Add: case BO_Sub: case BO_Mul: case BO_Shl: case BO_And: case BO_Or: case BO_Xor:
+    case BO_AddAssign: case BO_SubAssign: case BO_MulAssign: case BO_ShlAssign:
+    case BO_AndAssign: case BO_OrAssign: case BO_XorAssign:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  bool isWrapPoint(const Expr *E) {
+    if (!isWrappable(E->getType()) || targetWidth(*Context, E->getType()) >= 64)
+      return false;
+    if (const auto *Cast = dyn_cast<CastExpr>(E))
+      return Cast->getCastKind() == CK_IntegralCast;
+    if (const auto *BO = dyn_cast<BinaryOperator>(E))
+      return isModular(BO->getOpcode()) && !BO->isCompoundAssignmentOp() && !tickOp(BO);
+    if (const auto *UO = dyn_cast<UnaryOperator>(E))
+      return UO->getOpcode() == UO_Minus || UO->getOpcode() == UO_Not;
+    return false;
+  }
+
+  // Python spelling of Text reduced to Width bits, two's complement when Signed.
+  static std::string wrap(StringRef Text, unsigned Width, bool Signed) {
+    std::string Mask = "0x" + llvm::utohexstr((uint64_t(1) << Width) - 1, true);
+    if (!Signed)
+      return "(" + parenthesize(Text) + " & " + Mask + ")";
+    std::string Bias = "0x" + llvm::utohexstr(uint64_t(1) << (Width - 1), true);
+    return "((" + parenthesize(Text) + " + " + Bias + " & " + Mask + ") - " + Bias + ")";
+  }
+
+  std::string wrap(StringRef Text, QualType T) {
+    return wrap(Text, targetWidth(*Context, T), T->isSignedIntegerOrEnumerationType());
+  }
+
+private:
+  struct Store {
+    const VarDecl *Var;
+    const Expr *Value;
+  };
+
+  class StoreCollector : public RecursiveASTVisitor<StoreCollector> {
+  public:
+    StoreCollector(IntegerRanges &Ranges) : Ranges(Ranges) {}
+
+    bool VisitVarDecl(VarDecl *VD) {
+      if (!isTracked(VD->getType()))
+        return true;
+      const VarDecl *Var = VD->getCanonicalDecl();
+      if (isa<ParmVarDecl>(VD) || VD->getType().isVolatileQualified() || !VD->isThisDeclarationADefinition())
+        Ranges.Unknown.insert(Var);
+      else if (VD->getInit())
+        Ranges.Stores.push_back({Var, VD->getInit()});
+      else if (VD->hasGlobalStorage())
+        Ranges.Variables[Var] = Range::of(0, 0);
+      return true;
+    }
+
+    bool VisitBinaryOperator(BinaryOperator *BO) {
+      if (BO->isAssignmentOp())
+        if (const VarDecl *Var = getVar(BO->getLHS()))
+          Ranges.Stores.push_back({Var, BO->getOpcode() == BO_Assign ? BO->getRHS() : BO});
+      return true;
+    }
+
+    bool VisitUnaryOperator(UnaryOperator *UO) {
+      if (UO->isIncrementDecrementOp()) {
+        if (const VarDecl *Var = getVar(UO->getSubExpr()))
+          Ranges.Stores.push_back({Var, UO});
+      } else if (UO->getOpcode() == UO_AddrOf) {
+        if (const VarDecl *Var = getVar(UO->getSubExpr()))
+          Ranges.Unknown.insert(Var);
+      }
+      return true;
+    }
+
+    bool VisitCallExpr(CallExpr *CE) {
+      const FunctionDecl *Callee = CE->getDirectCallee();
+      for (unsigned I = 0; I < CE->getNumArgs(); ++I)
+        if (!Callee || I >= Callee->getNumParams() || Callee->getParamDecl(I)->getType()->isReferenceType())
+          if (const VarDecl *Var = getVar(CE->getArg(I)))
+            Ranges.Unknown.insert(Var);
+      return true;
+    }
+
+  private:
+    IntegerRanges &Ranges;
+  };
+
+  static const VarDecl *getVar(const Expr *E) {
+    if (const auto *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts()))
+      if (const auto *VD = dyn_cast<VarDecl>(DRE->getDecl()))
+        if (isTracked(VD->getType()))
+          return VD->getCanonicalDecl();
+    return nullptr;
+  }
+
+  const Expr *getParentExpr(const Stmt *S) {
+    auto Parents = Context->getParents(*S);
+    return Parents.empty() ? nullptr : Parents[0].get<Expr>();
+  }
+
+  // The value a store leaves in its variable: C converts it to the variable's type, which wraps.
+  Range storedRange(const Store &S) {
+    QualType T = S.Var->getType();
+    Range Value;
+    if (const auto *UO = dyn_cast<UnaryOperator>(S.Value))
+      Value = steppedRange(UO, S.Var);
+    else if (const auto *CAO = dyn_cast<CompoundAssignOperator>(S.Value))
+      Value = tickOp(CAO) ? ticksRange(tickOp(CAO)) : applyBinary(CAO->getOpcode(), exactRange(CAO->getLHS()), range(CAO->getRHS()), CAO->getComputationResultType());
+    else
+      Value = range(S.Value->IgnoreImpCasts());
+    return Value.within(typeRange(T)) ? Value : typeRange(T);
+  }
+
+  // x + 1 or x - 1 for an increment. When it is the step of for (...; x < N; x++) the value
+  // before the step already satisfied the condition.
+  Range steppedRange(const UnaryOperator *UO, const VarDecl *Var) {
+    Range Before = exactRange(UO->getSubExpr());
+    Range Bound;
+    if (getLoopBound(UO, Var, Bound))
+      Before = Range::of(std::max(Before.Lo, Bound.Lo), std::min(Before.Hi, Bound.Hi));
+    if (Before.isEmpty())
+      return Before;
+    double Step = UO->isIncrementOp() ? 1 : -1;
+    return Range::of(Before.Lo + Step, Before.Hi + Step);
+  }
+
+  bool getLoopBound(const UnaryOperator *UO, const VarDecl *Var, Range &Bound) {
+    if (!Var)
+      return false;
+    auto Parents = Context->getParents(*UO);
+    const ForStmt *For = Parents.empty() ? nullptr : Parents[0].get<ForStmt>();
+    if (!For || For->getInc() != UO)
+      return false;
+    const auto *Cond = dyn_cast_or_null<BinaryOperator>(For->getCond() ? For->getCond()->IgnoreParenImpCasts() : nullptr);
+    if (!Cond || getVar(Cond->getLHS()) != Var)
+      return false;
+    MathOptimiser::Value Limit;
+    if (!Optimiser->evaluate(Cond->getRHS(), Limit) || Limit.IsFloat)
+      return false;
+    double N = static_cast<double>(Limit.Int);
+    switch (Cond->getOpcode()) {
+    case BO_LT: Bound = Range::of(-Range::Limit, N - 1); return UO->isIncrementOp();
+    case BO_LE: Bound = Range::of(-Range::Limit, N); return UO->isIncrementOp();
+    case BO_GT: Bound = Range::of(N + 1, Range::Limit); return UO->isDecrementOp();
+    case BO_GE: Bound = Range::of(N, Range::Limit); return UO->isDecrementOp();
+    default: return false;
+    }
+  }
+
+  // The values E takes as a plain Python int, before any wrap at E itself.
+  Range exactRange(const Expr *E) {
+    E = E->IgnoreParens();
+    // Only leaves go through the evaluator: it wraps arithmetic to its C type, which is exactly
+    // what the Python spelling doesn't do.
+    MathOptimiser::Value V;
+    if (!isa<CastExpr>(E) && !isa<BinaryOperator>(E) && !isa<UnaryOperator>(E) && !isa<CallExpr>(E) &&
+        !E->isValueDependent() && Optimiser->evaluate(E, V))
+      return Range::of(V.asFloat(), V.asFloat());
+    QualType T = E->getType();
+    if (!T->isIntegerType() && !T->isRealFloatingType())
+      return typeRange(T);
+
+    if (const auto *Cast = dyn_cast<CastExpr>(E)) {
+      switch (Cast->getCastKind()) {
+      case CK_LValueToRValue:
+      case CK_NoOp:
+        return exactRange(Cast->getSubExpr());
+      case CK_IntegralCast:
+      case CK_FloatingCast:
+      case CK_IntegralToFloating:
+        return range(Cast->getSubExpr());
+      case CK_FloatingToIntegral: {
+        Range Sub = range(Cast->getSubExpr());
+        Range Truncated = Sub.isEmpty() ? Sub : Range::of(std::trunc(Sub.Lo), std::trunc(Sub.Hi));
+        return Truncated.within(typeRange(T)) ? Truncated : typeRange(T);
+      }
+      default:
+        return typeRange(T);
+      }
+    }
+    if (const auto *DRE = dyn_cast<DeclRefExpr>(E)) {
+      const auto *VD = dyn_cast<VarDecl>(DRE->getDecl());
+      if (!VD || Unknown.count(VD->getCanonicalDecl()))
+        return typeRange(T);
+      auto Known = Variables.find(VD->getCanonicalDecl());
+      if (Known != Variables.end() && !Known->second.isEmpty())
+        return Known->second;
+      // Until the fixed point is reached a sketch variable with no stores yet contributes nothing.
+      return Analysed || !isInMainFile(VD) ? typeRange(T) : Range();
+    }
+    if (const auto *BO = dyn_cast<BinaryOperator>(E)) {
+      if (BO->isComparisonOp() || BO->isLogicalOp())
+        return Range::of(0, 1);
+      if (BO->getOpcode() == BO_Comma)
+        return range(BO->getRHS());
+      if (BO->isAssignmentOp())
+        return typeRange(T);
+      if (TickOp Op = tickOp(BO))
+        return ticksRange(Op);
+      return applyBinary(BO->getOpcode(), range(BO->getLHS()), range(BO->getRHS()), T);
+    }
+    if (const auto *UO = dyn_cast<UnaryOperator>(E)) {
+      Range Sub = range(UO->getSubExpr());
+      if (Sub.isEmpty())
+        return Sub;
+      switch (UO->getOpcode()) {
+      case UO_Minus: return Range::of(-Sub.Hi, -Sub.Lo);
+      case UO_Not: return Range::of(-Sub.Hi - 1, -Sub.Lo - 1);
+      case UO_Plus: return Sub;
+      case UO_LNot: return Range::of(0, 1);
+      default: return typeRange(T);
+      }
+    }
+    if (const auto *CO = dyn_cast<ConditionalOperator>(E))
+      return range(CO->getTrueExpr()).join(range(CO->getFalseExpr()));
+    if (const auto *Call = dyn_cast<CallExpr>(E))
+      return callRange(Call);
+    return typeRange(T);
+  }
+
+  bool isInMainFile(const Decl *D) const {
+    return Context->getSourceManager().isInMainFile(D->getLocation());
+  }
+
+  // utime.ticks_add() stays within the tick period; utime.ticks_diff() is signed, within half of it.
+  static Range ticksRange(TickOp Op) {
+    return Op == TicksDiff ? Range::of(-TicksPeriod / 2, TicksPeriod / 2 - 1) : Range::of(0, TicksPeriod - 1);
+  }
+
+  static constexpr double TicksPeriod = 1073741824.0;
+
+  // Interval arithmetic in Python semantics: ints never overflow, // and % truncate like C here
+  // because the operands the handler sees are the C ones. Float division doesn't truncate.
+  Range applyBinary(BinaryOperatorKind Op, Range A, Range B, QualType T) {
+    if (A.isEmpty() || B.isEmpty())
+      return Range();
+    auto Hull = [](double W, double X, double Y, double Z) {
+      return Range::of(std::min(std::min(W, X), std::min(Y, Z)), std::max(std::max(W, X), std::max(Y, Z)));
+    };
+    switch (Op) {
+    case BO_Add: case BO_AddAssign: return Range::of(A.Lo + B.Lo, A.Hi + B.Hi);
+    case BO_Sub: case BO_SubAssign: return Range::of(A.Lo - B.Hi, A.Hi - B.Lo);
+    case BO_Mul: case BO_MulAssign: return Hull(A.Lo * B.Lo, A.Lo * B.Hi, A.Hi * B.Lo, A.Hi * B.Hi);
+    case BO_Div: case BO_DivAssign:
+      if ((B.Lo > 0 || B.Hi < 0) && T->isRealFloatingType())
+        return Hull(A.Lo / B.Lo, A.Lo / B.Hi, A.Hi / B.Lo, A.Hi / B.Hi);
+      if (B.Lo > 0 || B.Hi < 0)
+        return Hull(std::trunc(A.Lo / B.Lo), std::trunc(A.Lo / B.Hi), std::trunc(A.Hi / B.Lo), std::trunc(A.Hi / B.Hi));
+      if (T->isRealFloatingType())
+        return typeRange(T);
+      return Range::of(-std::max(std::fabs(A.Lo), std::fabs(A.Hi)), std::max(std::fabs(A.Lo), std::fabs(A.Hi)));
+    case BO_Rem: case BO_RemAssign: {
+      double Mod = std::max(std::fabs(B.Lo), std::fabs(B.Hi)) - 1;
+      return Range::of(A.Lo < 0 ? -Mod : 0, A.Hi > 0 ? Mod : 0);
+    }
+    case BO_Shl: case BO_ShlAssign:
+    case BO_Shr: case BO_ShrAssign: {
+      if (B.Lo < 0 || B.Hi > 31)
+        return typeRange(T);
+      int Min = static_cast<int>(B.Lo), Max = static_cast<int>(B.Hi);
+      if (Op == BO_Shl || Op == BO_ShlAssign)
+        return Hull(std::ldexp(A.Lo, Min), std::ldexp(A.Lo, Max), std::ldexp(A.Hi, Min), std::ldexp(A.Hi, Max));
+      return Hull(std::floor(std::ldexp(A.Lo, -Min)), std::floor(std::ldexp(A.Lo, -Max)),
+                  std::floor(std::ldexp(A.Hi, -Min)), std::floor(std::ldexp(A.Hi, -Max)));
+    }
+    case BO_And: case BO_AndAssign:
+      if (A.Lo >= 0 && B.Lo >= 0)
+        return Range::of(0, std::min(A.Hi, B.Hi));
+      if (A.Lo >= 0 || B.Lo >= 0)
+        return Range::of(0, A.Lo >= 0 ? A.Hi : B.Hi);
+      return typeRange(T);
+    case BO_Or: case BO_OrAssign:
+    case BO_Xor: case BO_XorAssign:
+      if (A.Lo >= 0 && B.Lo >= 0) {
+        int Bits;
+        std::frexp(std::max(A.Hi, B.Hi), &Bits);
+        return Range::of(0, std::ldexp(1.0, Bits) - 1);
+      }
+      return typeRange(T);
+    default:
+      return typeRange(T);
+    }
+  }
+
+  // Results of the Arduino core calls whose range is known, whatever their declared type.
+  Range callRange(const CallExpr *Call) {
+    QualType T = Call->getType();
+    const FunctionDecl *Callee = Call->getDirectCallee();
+    if (!Callee || !Callee->getIdentifier() || isInMainFile(Callee))
+      return typeRange(T);
+    StringRef Name = Callee->getName();
+    std::vector<Range> Args;
+    for (const Expr *Arg : Call->arguments())
+      Args.push_back(range(Arg));
+    if (Name == "analogRead")
+      return Range::of(0, 1023);
+    if (Name == "millis" || Name == "micros")
+      return ticksRange(TicksAdd);
+    if (const auto *Method = dyn_cast<CXXMethodDecl>(Callee)) {
+      StringRef Class = Method->getParent()->getIdentifier() ? Method->getParent()->getName() : "";
+      if ((Class == "TwoWire" && Name == "read") || (Class == "SPIClass" && Name == "transfer"))
+        return Range::of(0, 255);
+      if (Class == "SPIClass" && Name == "transfer16")
+        return Range::of(0, 65535);
+    }
+    if (Name == "digitalRead" || Name == "bitRead")
+      return Range::of(0, 1);
+    if (Name == "lowByte" || Name == "highByte" || Name == "shiftIn")
+      return Range::of(0, 255);
+    if (Name == "sin" || Name == "cos")
+      return Range::of(-1, 1);
+    if (Name == "sqrt" && Args.size() == 1 && !Args[0].isEmpty() && Args[0].Lo >= 0)
+      return Range::of(std::sqrt(Args[0].Lo), std::sqrt(Args[0].Hi));
+    if ((Name == "abs" || Name == "sq") && Args.size() == 1 && !Args[0].isEmpty()) {
+      double Lo = Args[0].Lo > 0 ? Args[0].Lo : (Args[0].Hi < 0 ? -Args[0].Hi : 0);
+      double Hi = std::max(std::fabs(Args[0].Lo), std::fabs(Args[0].Hi));
+      return Name == "abs" ? Range::of(Lo, Hi) : Range::of(Lo * Lo, Hi * Hi);
+    }
+    if (Name == "random" && Args.size() == 1 && !Args[0].isEmpty())
+      return Range::of(0, std::max(Args[0].Hi - 1, 0.0));
+    if (Name == "random" && Args.size() == 2 && !Args[0].isEmpty() && !Args[1].isEmpty())
+      return Range::of(Args[0].Lo, std::max(Args[1].Hi - 1, Args[0].Lo));
+    if (Name == "constrain" && Args.size() == 3)
+      return Args[1].join(Args[2]);
+    if ((Name == "min" || Name == "max") && Args.size() == 2 && !Args[0].isEmpty() && !Args[1].isEmpty()) {
+      if (Name == "min")
+        return Range::of(std::min(Args[0].Lo, Args[1].Lo), std::min(Args[0].Hi, Args[1].Hi));
+      return Range::of(std::max(Args[0].Lo, Args[1].Lo), std::max(Args[0].Hi, Args[1].Hi));
+    }
+    return typeRange(T);
+  }
+
+  ASTContext *Context = nullptr;
+  MathOptimiser *Optimiser = nullptr;
+  bool Analysed = false;
+  std::vector<Store> Stores;
+  std::set<const VarDecl *> Unknown;
+  std::set<const VarDecl *> TickVariables;
+  std::map<const VarDecl *, Range> Variables;
+};
+
+//FixedPointLowering Class: The --fixed-point mode for boards without an FPU. float variables whose
+//every store has a known range (literals, analogRead(), map(), constrain(), sin() ...) are kept as
+//integers scaled by 2^F. F is picked from those ranges, between 4 and 16, so values and products
+//stay small ints; when that leaves fewer than 4 bits the floats are kept. Math on them is rewritten
+//as integer math, and sin() and cos() read a 256 entry table emitted at module level. Where a value
+//becomes an int it is shifted back; a variable whose value is needed as a float (a float parameter,
+//a print) stays a float. The error bound for each variable is printed when the conversion runs.
+
+class FixedPointLowering {
+public:
+  // ToFloat is a read that needs the value as a float. plan() keeps those variables floats, so it
+  // never becomes a Root.
+  enum RootKind { Store, ToInt, Compare, ToFloat };
+
+  // One rewrite: Replaced is the text that changes, Value the fixed-point expression behind it.
+  struct Root {
+    RootKind Kind;
+    const Expr *Replaced;
+    const Expr *Value;
+    const VarDecl *Var;
+  };
+
+  void plan(ASTContext &Ctx, MathOptimiser &Math, IntegerRanges &ValueRanges, ModuleFinaliser &ModuleRef) {
+    if (!FixedPointMath)
+      return;
+    Context = &Ctx;
+    Optimiser = &Math;
+    Ranges = &ValueRanges;
+    Module = &ModuleRef;
+    Collector Finder(*this);
+    Finder.TraverseDecl(Ctx.getTranslationUnitDecl());
+
+    // A variable stays fixed only if every store to it can be computed in fixed point, which in
+    // turn depends on which other variables are fixed. A variable read where a float is needed
+    // would be turned back into a float, allocating one, on every such read; it stays a float.
+    std::set<const VarDecl *> ReadAsFloat;
+    for (bool Changed = true; Changed;) {
+      Changed = false;
+      for (const StoreSite &S : Stores)
+        if (Fixed.count(S.Var) && !isLowerable(S)) {
+          Fixed.erase(S.Var);
+          Changed = true;
+        }
+      for (const DeclRefExpr *Read : Reads)
+        if (const VarDecl *Var = getFixedVar(Read))
+          if (!insideFixedStore(Read) && classify(Read).Kind == ToFloat) {
+            Fixed.erase(Var);
+            ReadAsFloat.insert(Var);
+            Changed = true;
+          }
+    }
+    for (const VarDecl *Var : ReadAsFloat)
+      notes() << "fixed-point: " << Var->getName() << " stays a float, its value is needed as a float\n";
+    if (Fixed.empty())
+      return;
+
+    for (const StoreSite &S : Stores)
+      if (Fixed.count(S.Var))
+        addRoot({Store, S.Replaced, S.Value, S.Var}, S.Site);
+    for (const DeclRefExpr *Read : Reads)
+      addRead(Read);
+    if (!chooseScale()) {
+      notes() << "fixed-point: products of these values need more than a small int with " << MinFrac
+              << " fraction bits, floats kept\n";
+      Fixed.clear();
+      Roots.clear();
+      RootOf.clear();
+      return;
+    }
+    for (const Root &R : Roots)
+      Optimiser->claim(R.Replaced);
+    computeErrors();
+    report(notes());
+  }
+
+  // The rewrites a sketch variable or a reference to one takes part in.
+  const Root *getRoot(const Stmt *Site) const { return lookup(Site); }
+  const Root *getRoot(const Decl *Site) const { return lookup(Site); }
+
+  std::string spell(const Root &R, Rewriter &Rewrite) {
+    double Error;
+    switch (R.Kind) {
+    case Store:
+      return spellStore(R, Rewrite);
+    case ToInt: {
+      std::string Value = lower(R.Value, &Rewrite, Error);
+      if (Ranges->range(R.Value).Lo >= 0)
+        return "(" + Value + " >> " + std::to_string(Frac) + ")";
+      requireMathHelpers(*Module, "_cdiv(");
+      return "_cdiv(" + Value + ", " + std::to_string(1 << Frac) + ")";
+    }
+    case Compare: {
+      const auto *BO = cast<BinaryOperator>(R.Value);
+      return lower(BO->getLHS(), &Rewrite, Error) + " " + BO->getOpcodeStr().str() + " " + lower(BO->getRHS(), &Rewrite, Error);
+    }
+    case ToFloat:
+      break;
+    }
+    return "";
+  }
+
+private:
+  struct StoreSite {
+    const VarDecl *Var;
+    const void *Site;
+    const Expr *Replaced;
+    const Expr *Value;
+  };
+
+  class Collector : public RecursiveASTVisitor<Collector> {
+  public:
+    Collector(FixedPointLowering &Lowering) : Lowering(Lowering) {}
+
+    bool VisitVarDecl(VarDecl *VD) {
+      if (!VD->getType()->isRealFloatingType() || !Lowering.isInMainFile(VD->getLocation()))
+        return true;
+      const VarDecl *Var = VD->getCanonicalDecl();
+      if (!isa<ParmVarDecl>(VD) && !VD->getType().isVolatileQualified() && VD->isThisDeclarationADefinition() &&
+          Lowering.Ranges->isBounded(Var, MaxMagnitude))
+        Lowering.Fixed.insert(Var);
+      if (VD->getInit())
+        Lowering.Stores.push_back({Var, VD, VD->getInit(), VD->getInit()});
+      return true;
+    }
+
+    bool VisitDeclRefExpr(DeclRefExpr *DRE) {
+      const auto *VD = dyn_cast<VarDecl>(DRE->getDecl());
+      if (!VD || !VD->getType()->isRealFloatingType() || !Lowering.isInMainFile(DRE->getLocation()))
+        return true;
+      const VarDecl *Var = VD->getCanonicalDecl();
+      auto Parents = Lowering.Context->getParents(*DRE);
+      const auto *BO = Parents.empty() ? nullptr : Parents[0].get<BinaryOperator>();
+      const auto *UO = Parents.empty() ? nullptr : Parents[0].get<UnaryOperator>();
+      if (BO && BO->isAssignmentOp() && BO->getLHS()->IgnoreParens() == DRE) {
+        bool Scaled = BO->getOpcode() == BO_MulAssign || BO->getOpcode() == BO_DivAssign;
+        Lowering.Stores.push_back({Var, DRE, Scaled ? BO : BO->getRHS(), BO});
+      } else if (UO && UO->isIncrementDecrementOp()) {
+        Lowering.Stores.push_back({Var, DRE, UO, UO});
+      } else {
+        Lowering.Reads.push_back(DRE);
+      }
+      return true;
+    }
+
+  private:
+    FixedPointLowering &Lowering;
+  };
+
+  // Values up to 2^20 still leave 8 fraction bits inside a 29 bit small int.
+  static constexpr double MaxMagnitude = 1048576.0;
+  // Fewer fraction bits than this are too coarse to be worth it; the sketch keeps its floats.
+  static constexpr unsigned MinFrac = 4;
+  // sin() and cos() index the table with (x * 256) * 10430 >> 16; that has to stay a small int too.
+  static constexpr double MaxAngle = 400.0;
+  static constexpr double Pi = 3.14159265358979323846;
+
+  const Root *lookup(const void *Site) const {
+    auto Found = RootOf.find(Site);
+    return Found == RootOf.end() ? nullptr : &Roots[Found->second];
+  }
+
+  bool isInMainFile(SourceLocation Loc) const {
+    SourceManager &SM = Context->getSourceManager();
+    return SM.isInMainFile(SM.getExpansionLoc(Loc));
+  }
+
+  bool isStatement(const Stmt *S) const {
+    auto Parents = Context->getParents(*S);
+    return !Parents.empty() && !Parents[0].get<Expr>();
+  }
+
+  const Expr *getParentExpr(const Stmt *S) const {
+    auto Parents = Context->getParents(*S);
+    return Parents.empty() ? nullptr : Parents[0].get<Expr>();
+  }
+
+  static double magnitude(const IntegerRanges::Range &R) {
+    return R.isEmpty() ? 0 : std::max(std::fabs(R.Lo), std::fabs(R.Hi));
+  }
+
+  bool isBounded(const Expr *E, double Limit = MaxMagnitude) {
+    IntegerRanges::Range R = Ranges->range(E);
+    return !R.isEmpty() && magnitude(R) <= Limit;
+  }
+
+  bool excludesZero(const Expr *E) {
+    IntegerRanges::Range R = Ranges->range(E);
+    return !R.isEmpty() && (R.Lo > 0 || R.Hi < 0);
+  }
+
+  bool isLowerable(const StoreSite &S) {
+    if (const auto *UO = dyn_cast<UnaryOperator>(S.Value))
+      return isStatement(UO);
+    if (const auto *BO = dyn_cast<BinaryOperator>(S.Value)) {
+      if (!isStatement(BO) || !isFixable(BO->getRHS()))
+        return false;
+      return BO->getOpcode() != BO_DivAssign || excludesZero(BO->getRHS());
+    }
+    return isFixable(S.Value);
+  }
+
+  const VarDecl *getFixedVar(const Expr *E) const {
+    if (const auto *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts()))
+      if (const auto *VD = dyn_cast<VarDecl>(DRE->getDecl()))
+        if (Fixed.count(VD->getCanonicalDecl()))
+          return VD->getCanonicalDecl();
+    return nullptr;
+  }
+
+  bool mentionsFixed(const Stmt *S) const {
+    if (const auto *E = dyn_cast<Expr>(S))
+      if (getFixedVar(E))
+        return true;
+    for (const Stmt *Child : S->children())
+      if (Child && mentionsFixed(Child))
+        return true;
+    return false;
+  }
+
+  bool isConstant(const Expr *E, MathOptimiser::Value &V) {
+    return !mentionsFixed(E) && !E->isValueDependent() && Optimiser->evaluate(E, V);
+  }
+
+  // An integer converted to float; its own conversion is kept and shifted into place.
+  static const Expr *getIntegerOperand(const Expr *E) {
+    E = E->IgnoreParens();
+    while (const auto *Cast = dyn_cast<CastExpr>(E)) {
+      if (Cast->getCastKind() == CK_IntegralToFloating)
+        return Cast->getSubExpr();
+      if (Cast->getCastKind() != CK_FloatingCast && Cast->getCastKind() != CK_NoOp)
+        return nullptr;
+      E = Cast->getSubExpr()->IgnoreParens();
+    }
+    return nullptr;
+  }
+
+  const FunctionDecl *getShimCallee(const CallExpr *Call) const {
+    const FunctionDecl *Callee = Call->getDirectCallee();
+    if (!Callee || !Callee->getIdentifier() || isInMainFile(Callee->getLocation()))
+      return nullptr;
+    return Callee;
+  }
+
+  bool isFixable(const Expr *E) {
+    E = E->IgnoreParens();
+    if (!E->getType()->isRealFloatingType() || !isBounded(E))
+      return false;
+    MathOptimiser::Value V;
+    if (isConstant(E, V))
+      return true;
+    if (const auto *Cast = dyn_cast<CastExpr>(E)) {
+      switch (Cast->getCastKind()) {
+      case CK_IntegralToFloating:
+        return isBounded(Cast->getSubExpr());
+      case CK_LValueToRValue:
+      case CK_NoOp:
+      case CK_FloatingCast:
+        return isFixable(Cast->getSubExpr());
+      default:
+        return false;
+      }
+    }
+    if (isa<DeclRefExpr>(E))
+      return getFixedVar(E) != nullptr;
+    if (const auto *BO = dyn_cast<BinaryOperator>(E)) {
+      switch (BO->getOpcode()) {
+      case BO_Add:
+      case BO_Sub:
+      case BO_Mul:
+        return isFixable(BO->getLHS()) && isFixable(BO->getRHS());
+      case BO_Div:
+        return isFixable(BO->getLHS()) && isFixable(BO->getRHS()) && excludesZero(BO->getRHS());
+      default:
+        return false;
+      }
+    }
+    if (const auto *UO = dyn_cast<UnaryOperator>(E))
+      return (UO->getOpcode() == UO_Minus || UO->getOpcode() == UO_Plus) && isFixable(UO->getSubExpr());
+    if (const auto *Call = dyn_cast<CallExpr>(E)) {
+      const FunctionDecl *Callee = getShimCallee(Call);
+      if (!Callee)
+        return false;
+      StringRef Name = Callee->getName();
+      if ((Name == "sin" || Name == "cos") && Call->getNumArgs() == 1)
+        return isFixable(Call->getArg(0)) && isBounded(Call->getArg(0), MaxAngle);
+      if (!((Name == "abs" || Name == "sq") && Call->getNumArgs() == 1) &&
+          !((Name == "min" || Name == "max") && Call->getNumArgs() == 2) &&
+          !(Name == "constrain" && Call->getNumArgs() == 3))
+        return false;
+      for (const Expr *Arg : Call->arguments())
+        if (!isFixable(Arg))
+          return false;
+      return true;
+    }
+    return false;
+  }
+
+  void addRoot(const Root &R, const void *Site) {
+    for (size_t I = 0; I < Roots.size(); ++I)
+      if (Roots[I].Replaced == R.Replaced) {
+        RootOf[Site] = I;
+        return;
+      }
+    RootOf[Site] = Roots.size();
+    Roots.push_back(R);
+  }
+
+  // E is part of the value stored in a fixed variable, which its store spells as a whole.
+  bool insideFixedStore(const Expr *E) const {
+    for (const Expr *P = E; P; P = getParentExpr(P))
+      for (const StoreSite &S : Stores)
+        if (S.Replaced == P && Fixed.count(S.Var))
+          return true;
+    return false;
+  }
+
+  // Grows a read into the largest fixed-point expression around it and decides how its value
+  // leaves fixed point.
+  Root classify(const DeclRefExpr *Read) {
+    const Expr *Value = Read;
+    const Expr *Parent = getParentExpr(Value);
+    while (Parent && (isa<ParenExpr>(Parent) || isFixable(Parent))) {
+      Value = Parent;
+      Parent = getParentExpr(Value);
+    }
+    if (const auto *Cast = dyn_cast_or_null<CastExpr>(Parent))
+      if (Cast->getCastKind() == CK_FloatingToIntegral)
+        return {ToInt, Cast, Value, nullptr};
+    if (const auto *BO = dyn_cast_or_null<BinaryOperator>(Parent))
+      if (BO->isComparisonOp() && isFixable(BO->getLHS()) && isFixable(BO->getRHS()))
+        return {Compare, BO, BO, nullptr};
+    return {ToFloat, Value, Value, nullptr};
+  }
+
+  void addRead(const DeclRefExpr *Read) {
+    if (getFixedVar(Read) && !insideFixedStore(Read))
+      addRoot(classify(Read), Read);
+  }
+
+  // The largest F that keeps every fixed value below 2^29, and the products and divisions the
+  // rewrites spell below 2^30. Fails when that leaves fewer than MinFrac bits.
+  bool chooseScale() {
+    double Limit = 16;
+    for (const VarDecl *Var : Fixed)
+      Limit = std::min(Limit, 29 - std::log2(magnitude(Ranges->variableRange(Var)) + 1));
+    for (const Root &R : Roots)
+      limitScale(R.Kind == Compare ? cast<BinaryOperator>(R.Value)->getLHS() : R.Value, Limit);
+    for (const Root &R : Roots)
+      if (R.Kind == Compare)
+        limitScale(cast<BinaryOperator>(R.Value)->getRHS(), Limit);
+    if (Limit < MinFrac)
+      return false;
+    Frac = static_cast<unsigned>(std::floor(Limit));
+
+    // sin(x) is _SIN[round(x * 256 / 2pi)] with x first cut to 8 fraction bits (or the Frac it
+    // has); measure how far that is from the real thing over every angle the sketch uses.
+    TableError = 0;
+    if (MaxSinArgument < 0)
+      return true;
+    double Scale = std::ldexp(1.0, Frac);
+    unsigned AngleBits = std::min(Frac, 8u);
+    double Step = std::ldexp(1.0, -static_cast<int>(AngleBits));
+    int64_t Steps = static_cast<int64_t>(std::ceil(MaxSinArgument / Step)) + 1;
+    for (int64_t K = -Steps; K <= Steps; ++K) {
+      int64_t X8 = K * (int64_t(1) << (8 - AngleBits));
+      int64_t Index = static_cast<int64_t>(std::floor((X8 * 10430.0 + 32768) / 65536)) & 255;
+      double Table = std::round(std::sin(Index * 2 * Pi / 256) * Scale) / Scale;
+      for (double X : {K * Step, (K + 1) * Step})
+        TableError = std::max(TableError, std::fabs(Table - std::sin(X)));
+    }
+    return true;
+  }
+
+  void limitScale(const Expr *E, double &Limit) {
+    E = E->IgnoreParens();
+    MathOptimiser::Value V;
+    if (isConstant(E, V) || getIntegerOperand(E) || isa<DeclRefExpr>(E))
+      return;
+    if (const auto *BO = dyn_cast<BinaryOperator>(E)) {
+      double A = magnitude(Ranges->range(BO->getLHS())) + 1, B = magnitude(Ranges->range(BO->getRHS())) + 1;
+      bool Multiply = BO->getOpcode() == BO_Mul || BO->getOpcode() == BO_MulAssign;
+      bool Divide = BO->getOpcode() == BO_Div || BO->getOpcode() == BO_DivAssign;
+      if (Multiply && !getIntegerOperand(BO->getLHS()) && !getIntegerOperand(BO->getRHS()))
+        Limit = std::min(Limit, (30 - std::log2(A * B)) / 2);
+      else if (Divide && !getIntegerOperand(BO->getRHS()))
+        Limit = std::min(Limit, (30 - std::log2(A)) / 2);
+    }
+    if (const auto *Call = dyn_cast<CallExpr>(E)) {
+      const FunctionDecl *Callee = getShimCallee(Call);
+      if (Callee && (Callee->getName() == "sin" || Callee->getName() == "cos"))
+        MaxSinArgument = std::max(MaxSinArgument, magnitude(Ranges->range(Call->getArg(0))));
+      if (Callee && Callee->getName() == "sq")
+        Limit = std::min(Limit, (30 - 2 * std::log2(magnitude(Ranges->range(Call->getArg(0))) + 1)) / 2);
+    }
+    for (const Stmt *Child : E->children())
+      if (const auto *ChildExpr = dyn_cast_or_null<Expr>(Child))
+        limitScale(ChildExpr, Limit);
+  }
+
+  // Error bounds of the variables, iterated like the ranges. A variable still growing after a few
+  // rounds accumulates error on every update (x += 0.1 in loop()).
+  void computeErrors() {
+    for (unsigned Round = 0; Round < 8; ++Round) {
+      Growing.clear();
+      for (const Root &R : Roots) {
+        if (R.Kind != Store)
+          continue;
+        double Error = storeError(R);
+        if (Error > VarError[R.Var] * (1 + 1e-9) + 1e-12) {
+          VarError[R.Var] = Error;
+          Growing.insert(R.Var);
+        }
+      }
+      if (Growing.empty())
+        break;
+    }
+  }
+
+  double storeError(const Root &R) {
+    double Error = 0;
+    if (const auto *BO = dyn_cast<BinaryOperator>(R.Value)) {
+      if (BO->getOpcode() == BO_MulAssign || BO->getOpcode() == BO_DivAssign) {
+        lowerBinary(BO->getOpcode() == BO_MulAssign ? BO_Mul : BO_Div, BO->getLHS(), BO->getRHS(), nullptr, Error);
+        return Error;
+      }
+      lower(BO->getRHS(), nullptr, Error);
+      return BO->getOpcode() == BO_Assign ? Error : VarError[R.Var] + Error;
+    }
+    if (isa<UnaryOperator>(R.Value))
+      return VarError[R.Var];
+    lower(R.Value, nullptr, Error);
+    return Error;
+  }
+
+  void report(raw_ostream &OS) {
+    double Scale = std::ldexp(1.0, Frac);
+    double Worst = TableError;
+    OS << "fixed-point: values scaled by 2^" << Frac << " (Q" << (31 - Frac) << "." << Frac << ")\n";
+    for (const VarDecl *Var : Fixed) {
+      IntegerRanges::Range R = Ranges->variableRange(Var);
+      OS << "fixed-point: " << Var->getName() << " in [" << llvm::format("%g", R.Lo) << ", "
+         << llvm::format("%g", R.Hi) << "], ";
+      if (Growing.count(Var))
+        OS << "error grows with every update (" << llvm::format("%.3g", VarError[Var]) << " after 8)\n";
+      else
+        OS << "error <= " << llvm::format("%.3g", std::max(VarError[Var], 0.5 / Scale)) << "\n";
+      Worst = std::max(Worst, VarError[Var]);
+    }
+    if (MaxSinArgument >= 0)
+      OS << "fixed-point: sin/cos table error <= " << llvm::format("%.3g", TableError) << "\n";
+    OS << "fixed-point: max error " << llvm::format("%.3g", std::max(Worst, 0.5 / Scale))
+       << (Growing.empty() ? "" : " per update") << "\n";
+  }
+
+  std::string spellStore(const Root &R, Rewriter &Rewrite) {
+    double Error;
+    std::string Name = R.Var->getNameAsString();
+    if (const auto *UO = dyn_cast<UnaryOperator>(R.Value))
+      return Name + (UO->isIncrementOp() ? " += " : " -= ") + std::to_string(1 << Frac);
+    const auto *BO = dyn_cast<BinaryOperator>(R.Value);
+    if (!BO)
+      return lower(R.Value, &Rewrite, Error);
+    // x = v, x += v and x -= v only change their right-hand side; x *= v and x /= v are spelled out.
+    if (BO->getOpcode() == BO_MulAssign || BO->getOpcode() == BO_DivAssign)
+      return Name + " = " + lowerBinary(BO->getOpcode() == BO_MulAssign ? BO_Mul : BO_Div, BO->getLHS(), BO->getRHS(), &Rewrite, Error);
+    return lower(BO->getRHS(), &Rewrite, Error);
+  }
+
+  std::string integerText(const Expr *E, Rewriter *Rewrite) {
+    if (!Rewrite)
+      return "";
+    return parenthesize(Rewrite->getRewrittenText(Optimiser->getFileRange(E)));
+  }
+
+  // Spells E as an integer scaled by 2^Frac. Error gets a bound on how far the scaled value can
+  // be from the real one. Without a Rewriter only the error is worked out.
+  std::string lower(const Expr *E, Rewriter *Rewrite, double &Error) {
+    E = E->IgnoreParens();
+    double Scale = std::ldexp(1.0, Frac);
+    MathOptimiser::Value V;
+    if (isConstant(E, V)) {
+      double Scaled = std::round(V.asFloat() * Scale);
+      Error = std::fabs(Scaled / Scale - V.asFloat());
+      return std::to_string(static_cast<int64_t>(Scaled));
+    }
+    Error = 0;
+    if (const Expr *Integer = getIntegerOperand(E))
+      return "(" + integerText(Integer, Rewrite) + " << " + std::to_string(Frac) + ")";
+    if (const auto *Cast = dyn_cast<CastExpr>(E))
+      return lower(Cast->getSubExpr(), Rewrite, Error);
+    if (const VarDecl *Var = getFixedVar(E)) {
+      Error = VarError[Var];
+      return Var->getNameAsString();
+    }
+    if (const auto *BO = dyn_cast<BinaryOperator>(E)) {
+      if (BO->getOpcode() == BO_Mul || BO->getOpcode() == BO_Div)
+        return lowerBinary(BO->getOpcode(), BO->getLHS(), BO->getRHS(), Rewrite, Error);
+      double Other;
+      std::string LHS = lower(BO->getLHS(), Rewrite, Error);
+      std::string RHS = lower(BO->getRHS(), Rewrite, Other);
+      Error += Other;
+      return "(" + LHS + " " + BO->getOpcodeStr().str() + " " + RHS + ")";
+    }
+    if (const auto *UO = dyn_cast<UnaryOperator>(E)) {
+      std::string Sub = lower(UO->getSubExpr(), Rewrite, Error);
+      return UO->getOpcode() == UO_Minus ? "-" + parenthesize(Sub) : Sub;
+    }
+    const auto *Call = cast<CallExpr>(E);
+    StringRef Name = Call->getDirectCallee()->getName();
+    std::vector<std::string> Args;
+    for (const Expr *Arg : Call->arguments()) {
+      double ArgError;
+      Args.push_back(lower(Arg, Rewrite, ArgError));
+      Error = std::max(Error, ArgError);
+    }
+    if (Name == "sin" || Name == "cos") {
+      Error += TableError;
+      if (Rewrite)
+        emitSineTable();
+      std::string Angle = Frac == 8 ? Args[0]
+                          : Frac > 8 ? "(" + Args[0] + " >> " + std::to_string(Frac - 8) + ")"
+                                     : "(" + Args[0] + " << " + std::to_string(8 - Frac) + ")";
+      return "_SIN[(" + Angle + " * 10430 + 32768 >> 16)" + (Name == "cos" ? " + 64" : "") + " & 255]";
+    }
+    if (Name == "sq") {
+      double M = magnitude(Ranges->range(Call->getArg(0)));
+      Error = 2 * M * Error + Error * Error + 1 / Scale;
+      return "(" + Args[0] + " * " + Args[0] + " >> " + std::to_string(Frac) + ")";
+    }
+    if (Name == "abs")
+      return "abs(" + Args[0] + ")";
+    if (Name == "constrain")
+      return "min(max(" + Args[0] + ", " + Args[1] + "), " + Args[2] + ")";
+    return Name.str() + "(" + Args[0] + ", " + Args[1] + ")";
+  }
+
+  // a * b and a / b. An integer operand multiplies or divides the scaled value directly; two
+  // scaled values need a shift to come back to scale.
+  std::string lowerBinary(BinaryOperatorKind Op, const Expr *L, const Expr *R, Rewriter *Rewrite, double &Error) {
+    double Scale = std::ldexp(1.0, Frac);
+    double LeftError, RightError;
+    std::string F = std::to_string(Frac);
+    IntegerRanges::Range LRange = Ranges->range(L), RRange = Ranges->range(R);
+    double MinDivisor = std::min(std::fabs(RRange.Lo), std::fabs(RRange.Hi));
+    if (Op == BO_Mul && getIntegerOperand(L)) {
+      std::swap(L, R);
+      std::swap(LRange, RRange);
+    }
+    if (getIntegerOperand(R)) {
+      std::string LHS = lower(L, Rewrite, LeftError);
+      std::string Integer = integerText(getIntegerOperand(R), Rewrite);
+      if (Op == BO_Mul) {
+        Error = LeftError * magnitude(RRange);
+        return "(" + LHS + " * " + Integer + ")";
+      }
+      Error = LeftError / MinDivisor + 1 / Scale;
+      return "(" + LHS + " // " + Integer + ")";
+    }
+    std::string LHS = lower(L, Rewrite, LeftError);
+    std::string RHS = lower(R, Rewrite, RightError);
+    if (Op == BO_Mul) {
+      Error = magnitude(LRange) * RightError + magnitude(RRange) * LeftError + LeftError * RightError + 1 / Scale;
+      return "(" + LHS + " * " + RHS + " >> " + F + ")";
+    }
+    Error = (LeftError + magnitude(LRange) / MinDivisor * RightError) / MinDivisor + 1 / Scale;
+    return "((" + LHS + " << " + F + ") // " + RHS + ")";
+  }
+
+  void emitSineTable() {
+    if (Module->hasDefinition("_SIN"))
+      return;
+    double Scale = std::ldexp(1.0, Frac);
+    std::string Table = "_SIN = (";
+    for (int I = 0; I < 256; ++I) {
+      Table += I % 16 ? " " : "\n    ";
+      Table += std::to_string(static_cast<int64_t>(std::round(std::sin(I * 2 * Pi / 256) * Scale))) + ",";
+    }
+    Module->addDefinition("_SIN", Table + "\n)");
+  }
+
+  ASTContext *Context = nullptr;
+  MathOptimiser *Optimiser = nullptr;
+  IntegerRanges *Ranges = nullptr;
+  ModuleFinaliser *Module = nullptr;
+  unsigned Frac = 16;
+  double MaxSinArgument = -1;
+  double TableError = 0;
+  std::set<const VarDecl *> Fixed;
+  std::set<const VarDecl *> Growing;
+  std::vector<StoreSite> Stores;
+  std::vector<const DeclRefExpr *> Reads;
+  std::vector<Root> Roots;
+  std::map<const void *, size_t> RootOf;
+  std::map<const VarDecl *, double> VarError;
+};
+
 //IfStatementHandler Class: All Rewriting For IF statements done here.
 
-class IfStmtHandler : public MatchFinder::MatchCallback {
+class IfStmtHandler : public MatchFinder::MatchCallback {
+public:
+  IfStmtHandler(Rewriter &Rewrite) : Rewrite(Rewrite) {}
+
+  virtual void run(const MatchFinder::MatchResult &Result) {
+    // The matched 'if' statement was bound to 'ifStmt'.
+    if (const IfStmt *IfS = Result.Nodes.getNodeAs<clang::IfStmt>("ifStmt")) {
+      const Stmt *Then = IfS->getThen();
+      Rewrite.InsertText(Then->getBeginLoc(), "#if part\n", true, true);
+
+      if (const Stmt *Else = IfS->getElse()) {
+        Rewrite.InsertText(Else->getBeginLoc(), "#else part\n", true, true);
+      }
+    }
+  }
+
+private:
+  Rewriter &Rewrite;
+};
+
+//ForLoopHandler Class: All Rewriting For For Loop statements done here.
+
+class IncrementForLoopHandler : public MatchFinder::MatchCallback {
+public:
+  IncrementForLoopHandler(Rewriter &Rewrite) : Rewrite(Rewrite) {}
+
+  virtual void run(const MatchFinder::MatchResult &Result) {
+    const VarDecl *IncVar = Result.Nodes.getNodeAs<VarDecl>("incVarName");
+    Rewrite.InsertText(IncVar->getBeginLoc(), "#incvar/n", true, true);
+  }
+
+private:
+  Rewriter &Rewrite;
+};
+
+//PinMode Class: All Rewriting For PinMode statements done here.
+
+class pinModeVariableHandler : public MatchFinder::MatchCallback {
+public:
+   pinModeVariableHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::CallExpr* pm = Results.Nodes.getNodeAs<clang::CallExpr>("pinMode");
+    Edits.replaceToken(Results, pm->getBeginLoc(), "Pin.mode");
+    Module.addImport("machine", "Pin");
+  }
+
+private:
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
+};
+
+//Handler for Void Loop() Class: All Rewriting For void loop statements done here. Void loop() is rewritten as While True:
+
+class loopExprHandler : public MatchFinder::MatchCallback {
+public:
+   loopExprHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::FunctionDecl* loop = Results.Nodes.getNodeAs<clang::FunctionDecl>("loopexpr");
+    Rewrite.RemoveText(loop->getLocation()); 
+    Rewrite.ReplaceText(loop->getBeginLoc(), "While True:");
+    Rewrite.ReplaceText(loop->getLocation(), " ");
+  }
+
+private:
+  Rewriter &Rewrite;
+};
+
+//Handler for delay() function: delay() is rewritten as time.sleep_ms
+
+class delayHandler : public MatchFinder::MatchCallback {
+public:
+   delayHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::CallExpr* delayfinder = Results.Nodes.getNodeAs<clang::CallExpr>("delay");
+    Edits.replaceToken(Results, delayfinder->getBeginLoc(), "utime.sleep_ms");
+    Module.addImport("utime");
+  }
+
+private:
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
+};
+
+//Handler for Void Setup() Class: Void Setup is Deleted as It does not occur in Micropython Statements
+
+class setupHandler : public MatchFinder::MatchCallback {
+public:
+   setupHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::FunctionDecl* setupfinder = Results.Nodes.getNodeAs<clang::FunctionDecl>("setupfunc"); 
+    Rewrite.RemoveText(setupfinder->getLocation());
+    Rewrite.RemoveText(setupfinder->getBeginLoc());
+    Rewrite.ReplaceText(setupfinder->getBeginLoc(), " ");
+  }
+
+private:
+  Rewriter &Rewrite;
+};
+
+
+//Handler for CompoundStatements: Curly Braces are not required in Micropython and Can be removed. Since  project with improper indentation might become hard to understand
+// it will insert a # (comment statement) before each {}
+
+class compoundStmtHandler : public MatchFinder::MatchCallback {
+public:
+   compoundStmtHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::Stmt* compoundstmtfinder = Results.Nodes.getNodeAs<clang::Stmt>("compoundstmt");
+    Rewrite.InsertText(compoundstmtfinder->getBeginLoc(), "#", true, true);
+    Rewrite.InsertText(compoundstmtfinder->getEndLoc(), "#", true, true);
+  }
+
+private:
+  Rewriter &Rewrite;
+};
+
+//Handler for power expression. converts pow to math.pow
+
+class powerHandler : public MatchFinder::MatchCallback {
+public:
+   powerHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser) : Rewrite(Rewrite), Module(Module), Optimiser(Optimiser)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::Stmt* powfinder = Results.Nodes.getNodeAs<clang::Stmt>("pow");
+    if (Optimiser.isOptimised(powfinder))
+      return;
+    Rewrite.InsertText(powfinder->getBeginLoc(), "math.", true, true);
+    Module.addImport("math");
+  }
+
+private:
+  Rewriter &Rewrite;
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+};
+
+//Handler for square root expression. converts sqrt to math.sqrt
+
+class sqrtHandler : public MatchFinder::MatchCallback {
+public:
+   sqrtHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser) : Rewrite(Rewrite), Module(Module), Optimiser(Optimiser)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::Stmt* sqrtfinder = Results.Nodes.getNodeAs<clang::Stmt>("sqrt");
+    if (Optimiser.isOptimised(sqrtfinder))
+      return;
+    Rewrite.InsertText(sqrtfinder->getBeginLoc(), "math.", true, true);
+    Module.addImport("math");
+  }
+
+private:
+  Rewriter &Rewrite;
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+};
+
+//Handler for sin expression. converts sin to math.sin
+
+class sinHandler : public MatchFinder::MatchCallback {
+public:
+   sinHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser) : Rewrite(Rewrite), Module(Module), Optimiser(Optimiser)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::Stmt* sinfinder = Results.Nodes.getNodeAs<clang::Stmt>("sin");
+    if (Optimiser.isOptimised(sinfinder))
+      return;
+    Rewrite.InsertText(sinfinder->getBeginLoc(), "math.", true, true);
+    Module.addImport("math");
+  }
+
+private:
+  Rewriter &Rewrite;
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+};
+
+//Handler for cos expression. converts cos to math.cos
+
+class cosHandler : public MatchFinder::MatchCallback {
+public:
+   cosHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser) : Rewrite(Rewrite), Module(Module), Optimiser(Optimiser)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::Stmt* cosfinder = Results.Nodes.getNodeAs<clang::Stmt>("cos");
+    if (Optimiser.isOptimised(cosfinder))
+      return;
+    Rewrite.InsertText(cosfinder->getBeginLoc(), "math.", true, true);
+    Module.addImport("math");
+  }
+
+private:
+  Rewriter &Rewrite;
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+};
+
+//Handler for tan expression. converts tan to math.tan
+
+class tanHandler : public MatchFinder::MatchCallback {
+public:
+   tanHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser) : Rewrite(Rewrite), Module(Module), Optimiser(Optimiser)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::Stmt* tanfinder = Results.Nodes.getNodeAs<clang::Stmt>("tan");
+    if (Optimiser.isOptimised(tanfinder))
+      return;
+    Rewrite.InsertText(tanfinder->getBeginLoc(), "math.", true, true);
+    Module.addImport("math");
+  }
+
+private:
+  Rewriter &Rewrite;
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+};
+
+//Handler for constant math: pure math with constant arguments is evaluated now and replaced by its value,
+//e.g. pow(2, 8) becomes 256.0 and PI / 180.0 becomes 0.01745329252
+
+class constantFoldHandler : public MatchFinder::MatchCallback {
+public:
+   constantFoldHandler(Rewriter &Rewrite, MathOptimiser &Optimiser) : Rewrite(Rewrite), Optimiser(Optimiser)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::Expr* foldfinder = Results.Nodes.getNodeAs<clang::Expr>("foldable");
+    if (!Optimiser.isFoldRoot(foldfinder))
+      return;
+    const clang::Expr* root = Optimiser.climbCasts(foldfinder);
+    CharSourceRange range = Optimiser.getFileRange(root);
+    MathOptimiser::Value value;
+    if (range.isValid() && Optimiser.evaluate(root, value))
+      replaceConverted(Rewrite, range, MathOptimiser::formatValue(value));
+  }
+
+private:
+  Rewriter &Rewrite;
+  MathOptimiser &Optimiser;
+};
+
+//Handler for loop invariant math: pure math inside void loop() whose inputs don't change is computed once
+//in front of While True: and the loop body refers to the precomputed constant instead.
+
+class loopInvariantHandler : public MatchFinder::MatchCallback {
+public:
+   loopInvariantHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser) : Rewrite(Rewrite), Module(Module), Optimiser(Optimiser)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::Expr* invariantfinder = Results.Nodes.getNodeAs<clang::Expr>("invariant");
+    if (!Optimiser.isHoistRoot(invariantfinder))
+      return;
+    const clang::Expr* root = Optimiser.climbCasts(invariantfinder);
+    CharSourceRange range = Optimiser.getFileRange(root);
+    std::string python;
+    if (range.isInvalid() || !Optimiser.toPython(root, python))
+      return;
+    // The same expression used twice in the loop shares one constant.
+    auto hoisted = Hoisted.find(python);
+    if (hoisted == Hoisted.end()) {
+      hoisted = Hoisted.insert({python, "_K" + std::to_string(Order.size())}).first;
+      Order.push_back(python);
+    }
+    replaceConverted(Rewrite, range, hoisted->second);
+    if (python.find("math.") != std::string::npos)
+      Module.addImport("math");
+    requireMathHelpers(Module, python);
+  }
+
+  void onEndOfTranslationUnit() override {
+    if (Order.empty() || !Optimiser.getLoop())
+      return;
+    std::string definitions;
+    for (const std::string &python : Order)
+      definitions += Hoisted[python] + " = " + python + "\n";
+    Rewrite.InsertText(Optimiser.getLoop()->getBeginLoc(), definitions, false, true);
+    Hoisted.clear();
+    Order.clear();
+  }
+
+private:
+  Rewriter &Rewrite;
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+  std::map<std::string, std::string> Hoisted;
+  std::vector<std::string> Order;
+};
+
+//Handler for the Arduino core helpers (min, max, abs, constrain, map, sq, radians, degrees, lowByte, highByte
+//and the bit macros): each call is spelled out as an inline expression, e.g. constrain(v, 0, 255) becomes
+//(0 if v < 0 else (255 if v > 255 else v)). map() and a helper whose argument calls something become calls,
+//see PureMathFunction. The arguments are taken after every other handler has converted them, and nested
+//helpers are done innermost first.
+
+class coreHelperHandler : public MatchFinder::MatchCallback {
+public:
+   coreHelperHandler(ModuleFinaliser &Module, MathOptimiser &Optimiser) : Module(Module), Optimiser(Optimiser)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::CallExpr* helperfinder = Results.Nodes.getNodeAs<clang::CallExpr>("coreHelper");
+    Context = Results.Context;
+    if (Optimiser.isOptimised(helperfinder))
+      return;
+    Module.deferRewrite(Optimiser.getFileRange(helperfinder), ModuleFinaliser::InlineHelpers, [this, helperfinder](Rewriter &Rewrite) {
+      std::vector<std::string> args;
+      for (const clang::Expr* arg : helperfinder->arguments()) {
+        CharSourceRange argRange = Optimiser.getFileRange(arg);
+        if (argRange.isInvalid())
+          return std::string();
+        args.push_back(Rewrite.getRewrittenText(argRange));
+      }
+      std::string python;
+      if (!spell(helperfinder, args, python))
+        return std::string();
+      return python;
+    });
+  }
+
+private:
+  // bitSet, bitClear, bitToggle and bitWrite assign to their first argument. As a statement that is an
+  // augmented assignment; inside an expression it needs := and so only works on a plain name.
+  bool spell(const clang::CallExpr* call, const std::vector<std::string> &args, std::string &python) {
+    static const struct {
+      const char *Name;
+      const char *Statement;
+      const char *Value;
+    } BitUpdates[] = {
+        {"bitSet", "@0 |= 1 << $1", "$0 | (1 << $1)"},
+        {"bitClear", "@0 &= ~(1 << $1)", "$0 & ~(1 << $1)"},
+        {"bitToggle", "@0 ^= 1 << $1", "$0 ^ (1 << $1)"},
+        {"bitWrite", "@0 = ($0 | (1 << $1)) if $2 else ($0 & ~(1 << $1))", "($0 | (1 << $1)) if $2 else ($0 & ~(1 << $1))"},
+    };
+    if (Optimiser.spellCall(call, args, python)) {
+      requireMathHelpers(Module, python);
+      return true;
+    }
+    const clang::FunctionDecl* callee = call->getDirectCallee();
+    if (!callee || !callee->getIdentifier())
+      return false;
+    for (const auto &update : BitUpdates) {
+      if (callee->getName() != update.Name)
+        continue;
+      auto parents = Context->getParents(*call);
+      if (!parents.empty() && !parents[0].get<clang::Expr>()) {
+        python = expandPythonTemplate(update.Statement, args);
+        return true;
+      }
+      if (parenthesize(args[0]) != StringRef(args[0]).trim() || args[0].find_first_of(".[") != std::string::npos)
+        return false;
+      python = "(" + StringRef(args[0]).trim().str() + " := " + expandPythonTemplate(update.Value, args) + ")";
+      return true;
+    }
+    return false;
+  }
+
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+  ASTContext *Context = nullptr;
+};
+
+//Handler for integer arithmetic on narrow C types. Python ints never overflow, so arithmetic and
+//stores that can leave the range of their uint8_t, int or unsigned long are reduced with a mask;
+//whatever IntegerRanges proves in range stays a plain small-int operation. x++ and x-- become
+//augmented assignments, with the same wrap when the variable can overflow.
+
+class integerWrapHandler : public MatchFinder::MatchCallback {
+public:
+   integerWrapHandler(ModuleFinaliser &Module, MathOptimiser &Optimiser, IntegerRanges &Ranges) : Module(Module), Optimiser(Optimiser), Ranges(Ranges)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::Expr* integerfinder = Results.Nodes.getNodeAs<clang::Expr>("integerOp");
+    Context = Results.Context;
+    if (Optimiser.isOptimised(integerfinder))
+      return;
+    CharSourceRange range = Optimiser.getFileRange(integerfinder);
+
+    if (const auto *ticks = dyn_cast<clang::BinaryOperator>(integerfinder)) {
+      if (IntegerRanges::TickOp op = Ranges.tickOp(ticks)) {
+        rewriteTicks(ticks, op, range);
+        return;
+      }
+    }
+    if (!WrapIntegers)
+      return;
+
+    if (const auto *step = dyn_cast<clang::UnaryOperator>(integerfinder)) {
+      if (step->isIncrementDecrementOp()) {
+        rewriteStep(step, range);
+        return;
+      }
+    }
+    if (const auto *compound = dyn_cast<clang::CompoundAssignOperator>(integerfinder)) {
+      if (isStatement(compound) && Ranges.compoundNeedsWrap(compound) && !compound->getLHS()->HasSideEffects(*Context))
+        Module.deferRewrite(range, ModuleFinaliser::IntegerWrapping, [this, compound](Rewriter &Rewrite) {
+          std::string lhs = Rewrite.getRewrittenText(Optimiser.getFileRange(compound->getLHS()));
+          std::string rhs = Rewrite.getRewrittenText(Optimiser.getFileRange(compound->getRHS()));
+          StringRef op = clang::BinaryOperator::getOpcodeStr(clang::BinaryOperator::getOpForCompoundAssignment(compound->getOpcode()));
+          return lhs + " = " + Ranges.wrap(lhs + " " + op.str() + " " + parenthesize(rhs), compound->getLHS()->getType());
+        });
+      return;
+    }
+    if (!Ranges.needsWrap(integerfinder))
+      return;
+
+    // A cast keeps the value of its operand and only the wrap is spelled out; constants are
+    // wrapped here already.
+    const clang::Expr* value = integerfinder;
+    if (const auto *cast = dyn_cast<clang::CastExpr>(integerfinder))
+      value = cast->getSubExpr();
+    Module.deferRewrite(range, ModuleFinaliser::IntegerWrapping, [this, integerfinder, value](Rewriter &Rewrite) {
+      MathOptimiser::Value constant;
+      if (isa<clang::CastExpr>(integerfinder) && Optimiser.evaluate(integerfinder, constant) && !constant.IsFloat)
+        return MathOptimiser::formatValue(constant);
+      CharSourceRange valueRange = Optimiser.getFileRange(value);
+      if (valueRange.isInvalid())
+        return std::string();
+      return Ranges.wrap(Rewrite.getRewrittenText(valueRange), integerfinder->getType());
+    });
+  }
+
+private:
+  // Arithmetic on millis() and micros() readings, see IntegerRanges::tickOp(). The tick comes first
+  // in utime.ticks_add() and a duration subtracted from it is negated.
+  void rewriteTicks(const clang::BinaryOperator* ticks, IntegerRanges::TickOp op, CharSourceRange range) {
+    bool compound = ticks->isCompoundAssignmentOp();
+    if (compound && (!isStatement(ticks) || ticks->getLHS()->HasSideEffects(*Context)))
+      return;
+    Module.addImport("utime");
+    Module.deferRewrite(range, ModuleFinaliser::IntegerWrapping, [this, ticks, op, compound](Rewriter &Rewrite) {
+      std::string lhs = StringRef(Rewrite.getRewrittenText(Optimiser.getFileRange(ticks->getLHS()))).trim().str();
+      std::string rhs = StringRef(Rewrite.getRewrittenText(Optimiser.getFileRange(ticks->getRHS()))).trim().str();
+      std::string python;
+      if (op == IntegerRanges::TicksDiff)
+        python = "utime.ticks_diff(" + lhs + ", " + rhs + ")";
+      else if (!Ranges.isTicks(ticks->getLHS()))
+        python = "utime.ticks_add(" + rhs + ", " + lhs + ")";
+      else if (ticks->getOpcode() == clang::BO_Sub || ticks->getOpcode() == clang::BO_SubAssign)
+        python = "utime.ticks_add(" + lhs + ", -" + parenthesize(rhs) + ")";
+      else
+        python = "utime.ticks_add(" + lhs + ", " + rhs + ")";
+      return compound ? lhs + " = " + python : python;
+    });
+  }
+
+  void rewriteStep(const clang::UnaryOperator* step, CharSourceRange range) {
+    if (!isStatement(step) || step->getSubExpr()->HasSideEffects(*Context) ||
+        !IntegerRanges::isWrappable(step->getSubExpr()->getType()))
+      return;
+    bool wraps = Ranges.stepNeedsWrap(step);
+    Module.deferRewrite(range, ModuleFinaliser::IntegerWrapping, [this, step, wraps](Rewriter &Rewrite) {
+      std::string var = Rewrite.getRewrittenText(Optimiser.getFileRange(step->getSubExpr()));
+      std::string op = step->isIncrementOp() ? "+" : "-";
+      if (!wraps)
+        return var + " " + op + "= 1";
+      return var + " = " + Ranges.wrap(var + " " + op + " 1", step->getSubExpr()->getType());
+    });
+  }
+
+  // Only a statement of its own (or the step of a for loop) can turn into an assignment.
+  bool isStatement(const clang::Expr* expr) {
+    auto parents = Context->getParents(*expr);
+    return !parents.empty() && !parents[0].get<clang::Expr>();
+  }
+
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+  IntegerRanges &Ranges;
+  ASTContext *Context = nullptr;
+};
+
+//Handler for the --fixed-point mode: each store, comparison and conversion FixedPointLowering
+//planned around a float variable is rewritten once, as integer math.
+
+class fixedPointHandler : public MatchFinder::MatchCallback {
+public:
+   fixedPointHandler(ModuleFinaliser &Module, MathOptimiser &Optimiser, FixedPointLowering &Lowering) : Module(Module), Optimiser(Optimiser), Lowering(Lowering)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const FixedPointLowering::Root* root = nullptr;
+    if (const clang::DeclRefExpr* reffinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("fixedRef"))
+      root = Lowering.getRoot(reffinder);
+    else if (const clang::VarDecl* varfinder = Results.Nodes.getNodeAs<clang::VarDecl>("fixedVar"))
+      root = Lowering.getRoot(varfinder);
+    if (!root || !Done.insert(root).second)
+      return;
+    Module.deferRewrite(Optimiser.getFileRange(root->Replaced), ModuleFinaliser::FixedPoint, [this, root](Rewriter &Rewrite) {
+      return Lowering.spell(*root, Rewrite);
+    });
+  }
+
+private:
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+  FixedPointLowering &Lowering;
+  std::set<const FixedPointLowering::Root*> Done;
+};
+
+//busTransferHandler Class: Shared by the Wire, SPI and SoftwareSerial handlers. They turn runs of statements that
+//each move one byte into a single bus call on a preallocated buffer, so they need to find a
+//statement within its block, read back the converted text of arguments and spell byte buffers.
+
+class busTransferHandler : public MatchFinder::MatchCallback {
+protected:
+  busTransferHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser, IntegerRanges &Ranges) : Rewrite(Rewrite), Module(Module), Optimiser(Optimiser), Ranges(Ranges)  {}
+
+  // The block a call is a statement of its own in, and its index there.
+  bool findStatement(const clang::Expr* call, const clang::CompoundStmt*& block, size_t &index) {
+    const clang::Stmt* stmt = call;
+    auto parents = Context->getParents(*stmt);
+    while (!parents.empty() && parents[0].get<clang::Expr>()) {
+      stmt = parents[0].get<clang::Expr>();
+      parents = Context->getParents(*stmt);
+    }
+    block = parents.empty() ? nullptr : parents[0].get<clang::CompoundStmt>();
+    if (!block || !isa<clang::Expr>(stmt))
+      return false;
+    index = 0;
+    for (const clang::Stmt* child : block->body()) {
+      if (child == stmt)
+        return true;
+      ++index;
+    }
+    return false;
+  }
+
+  static std::string joinLines(const std::vector<std::string> &lines, StringRef indent) {
+    std::string joined;
+    for (size_t i = 0; i < lines.size(); ++i)
+      joined += (i ? "\n" + indent.str() : "") + lines[i];
+    return joined;
+  }
+
+  std::string text(Rewriter &rewrite, const clang::Expr* expr) {
+    return rewrite.getRewrittenText(Optimiser.getFileRange(expr));
+  }
+
+  // A bytearray slot rejects anything outside 0..255, so only values proven in range stay as they are.
+  std::string byteText(Rewriter &rewrite, const clang::Expr* expr) {
+    std::string value = text(rewrite, expr);
+    if (Ranges.range(expr).within(IntegerRanges::Range::of(0, 255)))
+      return value;
+    return IntegerRanges::wrap(value, 8, false);
+  }
+
+  // Bytes as a Python bytes literal. Bytes that aren't known are 0 here and stored before each send.
+  static std::string byteLiteral(const std::vector<int64_t> &bytes) {
+    std::string literal = "b'";
+    for (int64_t byte : bytes) {
+      literal += "\\x";
+      literal += llvm::hexdigit((byte >> 4) & 0xf, true);
+      literal += llvm::hexdigit(byte & 0xf, true);
+    }
+    return literal + "'";
+  }
+
+  // for (i = first; i < end; i++) with constant bounds, stepping by one.
+  bool countedLoop(const clang::ForStmt* loop, const clang::VarDecl*& var, int64_t &first, int64_t &count) {
+    MathOptimiser::Value start, end;
+    const clang::Expr* init = nullptr;
+    var = nullptr;
+    if (const auto *decl = dyn_cast_or_null<clang::DeclStmt>(loop->getInit())) {
+      if (decl->isSingleDecl() && (var = dyn_cast<clang::VarDecl>(decl->getSingleDecl())))
+        init = var->getInit();
+    } else if (const auto *assign = dyn_cast_or_null<clang::BinaryOperator>(loop->getInit())) {
+      if (assign->getOpcode() == BO_Assign)
+        if (const auto *ref = dyn_cast<clang::DeclRefExpr>(assign->getLHS()->IgnoreParens())) {
+          var = dyn_cast<clang::VarDecl>(ref->getDecl());
+          init = assign->getRHS();
+        }
+    }
+    const auto *cond = dyn_cast_or_null<clang::BinaryOperator>(loop->getCond());
+    if (!var || !init || !cond || !var->getType()->isIntegerType() || !isVar(cond->getLHS(), var) ||
+        !Optimiser.evaluate(init, start) || start.IsFloat || !Optimiser.evaluate(cond->getRHS(), end) || end.IsFloat)
+      return false;
+    if (cond->getOpcode() == BO_LT || cond->getOpcode() == BO_NE)
+      count = end.Int - start.Int;
+    else if (cond->getOpcode() == BO_LE)
+      count = end.Int - start.Int + 1;
+    else
+      return false;
+    first = start.Int;
+    MathOptimiser::Value one;
+    if (const auto *step = dyn_cast_or_null<clang::UnaryOperator>(loop->getInc()))
+      return step->isIncrementOp() && isVar(step->getSubExpr(), var);
+    if (const auto *step = dyn_cast_or_null<clang::CompoundAssignOperator>(loop->getInc()))
+      return step->getOpcode() == BO_AddAssign && isVar(step->getLHS(), var) && Optimiser.evaluate(step->getRHS(), one) &&
+             !one.IsFloat && one.Int == 1;
+    return false;
+  }
+
+  // The for loop whose whole body is the statement a call makes up, if there is one.
+  const clang::ForStmt* loopAround(const clang::Expr* call, const clang::Stmt*& body) {
+    body = call;
+    auto parents = Context->getParents(*call);
+    if (!parents.empty())
+      if (const auto *block = parents[0].get<clang::CompoundStmt>()) {
+        if (block->size() != 1)
+          return nullptr;
+        body = block;
+        parents = Context->getParents(*block);
+      }
+    const clang::ForStmt* loop = parents.empty() ? nullptr : parents[0].get<clang::ForStmt>();
+    return loop && loop->getBody() == body ? loop : nullptr;
+  }
+
+  // Just past the end of a loop, including the ';' of a body without braces.
+  SourceLocation loopEnd(const clang::ForStmt* loop) {
+    return statementEnd(*Context, isa<clang::Expr>(loop->getBody()) ? loop->getBody() : loop);
+  }
+
+  static bool isVar(const clang::Expr* expr, const clang::VarDecl* var) {
+    const auto *ref = dyn_cast<clang::DeclRefExpr>(expr->IgnoreParenImpCasts());
+    return ref && ref->getDecl() == var;
+  }
+
+  // A fresh module-level name such as _I2C_TX0 for a buffer.
+  std::string bufferName(StringRef prefix, StringRef kind) {
+    return prefix.str() + "_" + kind.str() + std::to_string(BufferCount++);
+  }
+
+  // Defines a module-level transmit buffer: a bytes constant, shared between identical sends, when
+  // every byte is known, otherwise a bytearray of its own.
+  std::string defineTxBuffer(StringRef prefix, const std::vector<int64_t> &bytes, bool allConstant) {
+    std::string literal = byteLiteral(bytes);
+    auto shared = ConstantBuffers.find(literal);
+    if (allConstant && shared != ConstantBuffers.end())
+      return shared->second;
+    std::string name = bufferName(prefix, "TX");
+    Module.addDefinition(name, name + " = " + (allConstant ? literal : "bytearray(" + literal + ")"));
+    Module.addBuffer(name, bytes.size());
+    if (allConstant)
+      ConstantBuffers[literal] = name;
+    return name;
+  }
+
+  std::string defineRxBuffer(StringRef prefix, int64_t size) {
+    std::string name = bufferName(prefix, "RX");
+    Module.addDefinition(name, name + " = bytearray(" + std::to_string(size) + ")");
+    Module.addBuffer(name, size);
+    return name;
+  }
+
+  Rewriter &Rewrite;
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+  IntegerRanges &Ranges;
+  ASTContext *Context = nullptr;
+
+private:
+  std::map<std::string, std::string> ConstantBuffers;
+  unsigned BufferCount = 0;
+};
+
+//Handler for Wire (I2C). One Python call per byte is slow, so a beginTransmission() / write() /
+//endTransmission() block becomes a single i2c.writeto() of a module-level buffer, and a register
+//write ended with endTransmission(false), followed by requestFrom() and its read() calls, becomes one
+//i2c.readfrom_mem_into() into a preallocated bytearray that the read() calls index; that is the same
+//repeated start. Wire.begin() defines the machine.I2C bus at module level, on the pins and clock the
+//sketch gives or the board's Arduino core uses. Sequences that don't have this shape (reads in a
+//loop, write(buf, len)) are left alone.
+
+class wireHandler : public busTransferHandler {
 public:
-  IfStmtHandler(Rewriter &Rewrite) : Rewrite(Rewrite) {}
+   wireHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser, IntegerRanges &Ranges) : busTransferHandler(Rewrite, Module, Optimiser, Ranges)  {}
 
-  virtual void run(const MatchFinder::MatchResult &Result) {
-    // The matched 'if' statement was bound to 'ifStmt'.
-    if (const IfStmt *IfS = Result.Nodes.getNodeAs<clang::IfStmt>("ifStmt")) {
-      const Stmt *Then = IfS->getThen();
-      Rewrite.InsertText(Then->getBeginLoc(), "#if part\n", true, true);
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::CXXMemberCallExpr* wirefinder = Results.Nodes.getNodeAs<clang::CXXMemberCallExpr>("wire");
+    Context = Results.Context;
+    if (Consumed.count(wirefinder) || !isWire(wirefinder))
+      return;
+    StringRef method = wirefinder->getMethodDecl()->getName();
+    const clang::CompoundStmt* block;
+    size_t index;
+    if (!findStatement(wirefinder, block, index) || cast<clang::Expr>(block->body_begin()[index])->IgnoreImplicit() != wirefinder)
+      return;
+    if ((method == "begin" && wirefinder->getNumArgs() != 1) || (method == "setClock" && busConfig(wirefinder).FixedClock)) {
+      defineBus(wirefinder);
+      removeConverted(Rewrite, statementRange(*Context, wirefinder, wirefinder));
+    } else if (method == "beginTransmission" || method == "requestFrom") {
+      coalesce(wirefinder, block, index);
+    }
+  }
 
-      if (const Stmt *Else = IfS->getElse()) {
-        Rewrite.InsertText(Else->getBeginLoc(), "#else part\n", true, true);
+private:
+  // The call on a TwoWire object that a statement consists of, if it is that method.
+  const clang::CXXMemberCallExpr* wireCall(const clang::Stmt* s, StringRef method) {
+    const auto *expr = dyn_cast_or_null<clang::Expr>(s);
+    const auto *call = expr ? dyn_cast<clang::CXXMemberCallExpr>(expr->IgnoreImplicit()) : nullptr;
+    if (!call || !isWire(call) || call->getMethodDecl()->getName() != method)
+      return nullptr;
+    return call;
+  }
+
+  static bool isWire(const clang::CXXMemberCallExpr* call) {
+    const clang::CXXRecordDecl* record = call->getRecordDecl();
+    return record && record->getIdentifier() && record->getName() == "TwoWire" && call->getMethodDecl() &&
+           call->getMethodDecl()->getIdentifier();
+  }
+
+  static const clang::ValueDecl* busObject(const clang::CXXMemberCallExpr* call) {
+    const auto *ref = dyn_cast<clang::DeclRefExpr>(call->getImplicitObjectArgument()->IgnoreImpCasts());
+    return ref ? ref->getDecl() : nullptr;
+  }
+
+  static std::string busNumber(const clang::ValueDecl* object) {
+    std::string name = object ? object->getNameAsString() : "Wire";
+    return StringRef(name).startswith("Wire") ? name.substr(4) : "";
+  }
+
+  // The pins and clock of a bus: begin(sda, scl[, frequency]) and setClock() with constant
+  // arguments anywhere in the sketch, else the Arduino core's pins for --target and 100 kHz.
+  // FixedClock is set when the clock never changes, so setClock() can go into the definition.
+  struct BusConfig {
+    int64_t Scl = -1, Sda = -1;
+    int64_t Frequency = 100000;
+    bool FixedClock = true;
+    bool ConstantPins = true;
+  };
+
+  BusConfig busConfig(const clang::CXXMemberCallExpr* call) {
+    BusConfig config;
+    const clang::ValueDecl* object = busObject(call);
+    unsigned index = 0;
+    std::string number = busNumber(object);
+    const TargetInfo *target = targetInfo();
+    if (target && (number.empty() || !StringRef(number).getAsInteger(10, index)) && index < target->I2CBuses.size()) {
+      config.Scl = target->I2CBuses[index].Scl;
+      config.Sda = target->I2CBuses[index].Sda;
+    }
+    SourceManager &SM = Context->getSourceManager();
+    std::vector<const clang::CXXMemberCallExpr*> calls;
+    for (const clang::Decl* decl : Context->getTranslationUnitDecl()->decls())
+      if (const auto *function = dyn_cast<clang::FunctionDecl>(decl))
+        if (function->doesThisDeclarationHaveABody() && SM.isInMainFile(SM.getExpansionLoc(function->getLocation())))
+          collectWireCalls(function->getBody(), calls);
+    std::set<int64_t> clocks;
+    for (const clang::CXXMemberCallExpr* other : calls) {
+      if (busObject(other) != object)
+        continue;
+      StringRef method = other->getMethodDecl()->getName();
+      MathOptimiser::Value sda, scl, frequency;
+      if (method == "begin" && other->getNumArgs() >= 2) {
+        if (Optimiser.evaluateOrInitial(other->getArg(0), sda) && Optimiser.evaluateOrInitial(other->getArg(1), scl) &&
+            !sda.IsFloat && !scl.IsFloat) {
+          config.Sda = sda.Int;
+          config.Scl = scl.Int;
+        } else {
+          config.ConstantPins = false;
+        }
+        if (other->getNumArgs() == 3 && Optimiser.evaluateOrInitial(other->getArg(2), frequency) && !frequency.IsFloat &&
+            frequency.Int > 0)
+          clocks.insert(frequency.Int);
+      } else if (method == "setClock") {
+        if (Optimiser.evaluateOrInitial(other->getArg(0), frequency) && !frequency.IsFloat)
+          clocks.insert(frequency.Int);
+        else
+          config.FixedClock = false;
       }
     }
+    config.FixedClock &= clocks.size() <= 1;
+    if (config.FixedClock && !clocks.empty())
+      config.Frequency = *clocks.begin();
+    return config;
   }
 
-private:
-  Rewriter &Rewrite;
+  // Wire is i2c, Wire1 is i2c1 and so on; each becomes machine.I2C(n) at module level.
+  std::string defineBus(const clang::CXXMemberCallExpr* call) {
+    std::string number = busNumber(busObject(call));
+    std::string bus = "i2c" + number;
+    if (Module.hasDefinition(bus))
+      return bus;
+    BusConfig config = busConfig(call);
+    if (!config.ConstantPins)
+      notes() << "wire: the pins given to " << (number.empty() ? "Wire" : "Wire" + number)
+              << ".begin() aren't constant, the bus uses the board's default pins\n";
+    std::string args = number.empty() ? "0" : number;
+    if (config.Scl >= 0 && config.Sda >= 0)
+      args += ", scl=machine.Pin(" + std::to_string(config.Scl) + "), sda=machine.Pin(" + std::to_string(config.Sda) + ")";
+    args += ", freq=" + std::to_string(config.Frequency);
+    Module.addImport("machine");
+    Module.addDefinition(bus, bus + " = machine.I2C(" + args + ")");
+    return bus;
+  }
+
+  // Finds write() calls for every byte of a transmission and read() calls for every requested byte.
+  void coalesce(const clang::CXXMemberCallExpr* first, const clang::CompoundStmt* block, size_t index) {
+    std::vector<const clang::Stmt*> stmts(block->body_begin(), block->body_end());
+    std::vector<const clang::CXXMemberCallExpr*> calls;
+    size_t next = index;
+
+    const clang::Expr* address = nullptr;
+    std::vector<const clang::Expr*> values;
+    std::vector<int64_t> bytes;
+    bool allConstant = true;
+    bool stop = true;
+    if (const clang::CXXMemberCallExpr* begin = wireCall(stmts[next], "beginTransmission")) {
+      address = begin->getArg(0);
+      calls.push_back(begin);
+      for (++next; next < stmts.size(); ++next) {
+        const clang::CXXMemberCallExpr* write = wireCall(stmts[next], "write");
+        if (!write || write->getNumArgs() != 1 || !write->getArg(0)->getType()->isIntegerType())
+          break;
+        MathOptimiser::Value value;
+        bool constant = Optimiser.evaluate(write->getArg(0), value) && !value.IsFloat;
+        values.push_back(constant ? nullptr : write->getArg(0));
+        bytes.push_back(constant ? value.Int & 0xff : 0);
+        allConstant &= constant;
+        calls.push_back(write);
+      }
+      const clang::CXXMemberCallExpr* end = next < stmts.size() ? wireCall(stmts[next], "endTransmission") : nullptr;
+      if (!end || bytes.empty())
+        return;
+      if (end->getNumArgs() == 1) {
+        MathOptimiser::Value value;
+        if (!Optimiser.evaluate(end->getArg(0), value) || value.IsFloat)
+          return;
+        stop = value.Int != 0;
+      }
+      calls.push_back(end);
+      ++next;
+    }
+    size_t headerEnd = next;
+
+    // requestFrom(address, count) and exactly count read() calls in the statements after it.
+    const clang::CXXMemberCallExpr* request = next < stmts.size() ? wireCall(stmts[next], "requestFrom") : nullptr;
+    std::vector<const clang::CXXMemberCallExpr*> reads;
+    MathOptimiser::Value count;
+    if (request && request->getNumArgs() >= 2 && Optimiser.evaluate(request->getArg(1), count) && !count.IsFloat &&
+        count.Int > 0 && count.Int <= 32 && (!address || sameAddress(address, request->getArg(0)))) {
+      size_t after = next + 1;
+      if (after < stmts.size() && isAvailableWait(stmts[after]))
+        ++after;
+      size_t readEnd = after;
+      while (readEnd < stmts.size() && reads.size() < static_cast<size_t>(count.Int)) {
+        std::vector<const clang::CXXMemberCallExpr*> found;
+        if (!collectReads(stmts[readEnd], found) || found.empty())
+          break;
+        reads.insert(reads.end(), found.begin(), found.end());
+        ++readEnd;
+      }
+      if (reads.size() == static_cast<size_t>(count.Int)) {
+        calls.push_back(request);
+        headerEnd = after;
+      } else {
+        request = nullptr;
+        reads.clear();
+      }
+    } else {
+      request = nullptr;
+    }
+    if (!address && !request)
+      return;
+
+    for (const clang::CXXMemberCallExpr* call : calls)
+      Consumed.insert(call);
+    for (const clang::CXXMemberCallExpr* read : reads)
+      Consumed.insert(read);
+    std::string bus = defineBus(first);
+
+    std::string rx;
+    if (request) {
+      rx = defineRxBuffer("_I2C", count.Int);
+      for (size_t i = 0; i < reads.size(); ++i)
+        replaceConverted(Rewrite, Optimiser.getFileRange(reads[i]), rx + "[" + std::to_string(i) + "]");
+    }
+
+    // readfrom_mem_into() always reads after a repeated start; after endTransmission() with a stop
+    // the write and the read stay two transfers.
+    bool registerRead = request && bytes.size() == 1 && !stop;
+    std::string tx = address && !registerRead ? defineTxBuffer("_I2C", bytes, allConstant) : "";
+    const clang::Expr* requestAddress = request ? request->getArg(0) : nullptr;
+    std::string indent = indentOf(*Context, stmts[index]);
+    Module.deferRewrite(statementRange(*Context, stmts[index], stmts[headerEnd - 1]), ModuleFinaliser::BusTransactions,
+                        [this, bus, rx, tx, registerRead, address, requestAddress, values, bytes, stop, indent](Rewriter &rewrite) {
+      std::vector<std::string> lines;
+      if (registerRead) {
+        std::string reg = values[0] ? byteText(rewrite, values[0]) : "0x" + llvm::utohexstr(bytes[0], true);
+        lines.push_back(bus + ".readfrom_mem_into(" + text(rewrite, address) + ", " + reg + ", " + rx + ")");
+      } else {
+        if (address) {
+          for (size_t i = 0; i < values.size(); ++i)
+            if (values[i])
+              lines.push_back(tx + "[" + std::to_string(i) + "] = " + byteText(rewrite, values[i]));
+          lines.push_back(bus + ".writeto(" + text(rewrite, address) + ", " + tx + (stop ? "" : ", False") + ")");
+        }
+        if (requestAddress)
+          lines.push_back(bus + ".readfrom_into(" + text(rewrite, requestAddress) + ", " + rx + ")");
+      }
+      return joinLines(lines, indent);
+    });
+  }
+
+  // Both addresses have the same value: as constants (a global that is never assigned counts), or
+  // as the same variable, which nothing between the two calls can change.
+  bool sameAddress(const clang::Expr* a, const clang::Expr* b) {
+    MathOptimiser::Value first, second;
+    if (Optimiser.evaluateOrInitial(a, first) && Optimiser.evaluateOrInitial(b, second))
+      return !first.IsFloat && !second.IsFloat && first.Int == second.Int;
+    const auto *refA = dyn_cast<clang::DeclRefExpr>(a->IgnoreParenImpCasts());
+    const auto *refB = dyn_cast<clang::DeclRefExpr>(b->IgnoreParenImpCasts());
+    return refA && refB && refA->getDecl() == refB->getDecl();
+  }
+
+  // while (Wire.available() < n); waits for bytes readfrom_mem_into() has already delivered.
+  bool isAvailableWait(const clang::Stmt* stmt) {
+    const auto *loop = dyn_cast<clang::WhileStmt>(stmt);
+    if (!loop || !isa<clang::NullStmt>(loop->getBody()))
+      return false;
+    std::vector<const clang::CXXMemberCallExpr*> calls;
+    collectWireCalls(loop->getCond(), calls);
+    return calls.size() == 1 && calls[0]->getMethodDecl()->getName() == "available";
+  }
+
+  // The read() calls of one statement in source order; false if it makes any other Wire call.
+  bool collectReads(const clang::Stmt* stmt, std::vector<const clang::CXXMemberCallExpr*> &reads) {
+    if (!isa<clang::Expr>(stmt) && !isa<clang::DeclStmt>(stmt))
+      return false;
+    std::vector<const clang::CXXMemberCallExpr*> calls;
+    collectWireCalls(stmt, calls);
+    for (const clang::CXXMemberCallExpr* call : calls) {
+      if (call->getMethodDecl()->getName() != "read" || call->getNumArgs() != 0)
+        return false;
+      reads.push_back(call);
+    }
+    return true;
+  }
+
+  void collectWireCalls(const clang::Stmt* stmt, std::vector<const clang::CXXMemberCallExpr*> &calls) {
+    if (!stmt)
+      return;
+    if (const auto *call = dyn_cast<clang::CXXMemberCallExpr>(stmt))
+      if (isWire(call))
+        calls.push_back(call);
+    for (const clang::Stmt* child : stmt->children())
+      collectWireCalls(child, calls);
+  }
+
+  std::set<const clang::CXXMemberCallExpr*> Consumed;
 };
 
-//ForLoopHandler Class: All Rewriting For For Loop statements done here.
+//Handler for SPI. SPI.begin() defines the machine.SPI bus at module level, and SPISettings become
+//its baudrate, polarity, phase and firstbit. When every beginTransaction() uses the same constant
+//settings they go into the bus definition once, otherwise each transaction calls spi.init(). Runs
+//of transfer() / transfer16() statements become one spi.write() or spi.write_readinto() on
+//module-level buffers, and a counted loop around a single transfer() fills a buffer that is sent
+//once after the loop. A transfer() inside a larger expression calls a helper with a 1 byte buffer.
 
-class IncrementForLoopHandler : public MatchFinder::MatchCallback {
+class spiHandler : public busTransferHandler {
 public:
-  IncrementForLoopHandler(Rewriter &Rewrite) : Rewrite(Rewrite) {}
+   spiHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser, IntegerRanges &Ranges) : busTransferHandler(Rewrite, Module, Optimiser, Ranges)  {}
 
-  virtual void run(const MatchFinder::MatchResult &Result) {
-    const VarDecl *IncVar = Result.Nodes.getNodeAs<VarDecl>("incVarName");
-    Rewrite.InsertText(IncVar->getBeginLoc(), "#incvar/n", true, true);
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::CallExpr* spifinder = Results.Nodes.getNodeAs<clang::CallExpr>("spi");
+    Context = Results.Context;
+    const auto *method = dyn_cast_or_null<clang::CXXMethodDecl>(spifinder->getDirectCallee());
+    if (Consumed.count(spifinder) || !method || !isSPI(method))
+      return;
+    if (!Scanned)
+      scanTransactions();
+    StringRef name = method->getName();
+    const clang::CompoundStmt* block;
+    size_t index;
+    bool statement = findStatement(spifinder, block, index);
+    const clang::Stmt* stmt = statement ? block->body_begin()[index] : nullptr;
+    bool alone = statement && cast<clang::Expr>(stmt)->IgnoreImplicit() == spifinder;
+
+    if (name == "begin" && alone) {
+      defineBus();
+      removeConverted(Rewrite, statementRange(*Context, stmt, stmt));
+    } else if (name == "endTransaction" && alone) {
+      removeConverted(Rewrite, statementRange(*Context, stmt, stmt));
+    } else if (name == "beginTransaction" && alone) {
+      beginTransaction(spifinder, stmt);
+    } else if (name == "transfer" && spifinder->getNumArgs() == 2) {
+      if (alone)
+        transferBuffer(spifinder, stmt);
+    } else if ((name == "transfer" || name == "transfer16") && spifinder->getNumArgs() == 1) {
+      if (!transferLoop(spifinder) && !(statement && transferRun(block, index)))
+        transferCall(spifinder, name == "transfer16");
+    }
   }
 
 private:
-  Rewriter &Rewrite;
+  // Which bytes of the transmit buffer a transfer() or transfer16() argument goes into.
+  enum Part { Byte, HighByte, LowByte };
+
+  struct Transfer {
+    const clang::CallExpr* Call;
+    bool Wide;
+    const clang::Expr* Target;
+  };
+
+  class TransactionCollector : public RecursiveASTVisitor<TransactionCollector> {
+  public:
+    bool VisitCallExpr(CallExpr *Call) {
+      if (const auto *Method = dyn_cast_or_null<CXXMethodDecl>(Call->getDirectCallee()))
+        if (isSPI(Method) && Method->getName() == "beginTransaction" && Call->getNumArgs() == 1)
+          Calls.push_back(Call);
+      return true;
+    }
+
+    std::vector<const CallExpr *> Calls;
+  };
+
+  static bool isSPI(const clang::CXXMethodDecl* method) {
+    const clang::CXXRecordDecl* record = method->getParent();
+    return method->getIdentifier() && record->getIdentifier() && record->getName() == "SPIClass";
+  }
+
+  // Settings that are the same constant for every transaction in the sketch go into the bus definition.
+  void scanTransactions() {
+    Scanned = true;
+    TransactionCollector collector;
+    collector.TraverseDecl(Context->getTranslationUnitDecl());
+    std::string common;
+    for (const clang::CallExpr* call : collector.Calls) {
+      if (!Context->getSourceManager().isInMainFile(Context->getSourceManager().getExpansionLoc(call->getBeginLoc())))
+        continue;
+      const clang::CXXConstructExpr* settings = settingsOf(call->getArg(0));
+      std::string kwargs = settings ? spellSettings(settings, nullptr) : "";
+      if (kwargs.empty() || (!common.empty() && kwargs != common))
+        return;
+      common = kwargs;
+    }
+    Hoisted = common;
+  }
+
+  // SPI is the bus the Arduino core for --target uses, on its pins, or bus 1 when the port is unknown.
+  std::string defineBus() {
+    const TargetInfo *target = targetInfo();
+    SPIDefault bus = target ? target->SPIBus : SPIDefault{1, -1, -1, -1};
+    std::string args = std::to_string(bus.Id);
+    for (std::pair<const char*, int> pin : {std::make_pair("sck", bus.Sck), std::make_pair("mosi", bus.Mosi), std::make_pair("miso", bus.Miso)})
+      if (pin.second >= 0)
+        args += ", " + std::string(pin.first) + "=machine.Pin(" + std::to_string(pin.second) + ")";
+    if (!Hoisted.empty())
+      args += ", " + Hoisted;
+    Module.addImport("machine");
+    Module.addDefinition("spi", "spi = machine.SPI(" + args + ")");
+    return "spi";
+  }
+
+  // The SPISettings constructor behind a beginTransaction() argument, looking through copies and
+  // variables it was initialised in.
+  const clang::CXXConstructExpr* settingsOf(const clang::Expr* expr) {
+    while (expr) {
+      expr = expr->IgnoreImplicit();
+      if (const auto *functional = dyn_cast<clang::CXXFunctionalCastExpr>(expr)) {
+        expr = functional->getSubExpr();
+        continue;
+      }
+      if (const auto *ref = dyn_cast<clang::DeclRefExpr>(expr)) {
+        const auto *var = dyn_cast<clang::VarDecl>(ref->getDecl());
+        expr = var ? var->getAnyInitializer() : nullptr;
+        continue;
+      }
+      const auto *construct = dyn_cast<clang::CXXConstructExpr>(expr);
+      if (construct && construct->getConstructor()->isCopyOrMoveConstructor() && construct->getNumArgs() == 1) {
+        expr = construct->getArg(0);
+        continue;
+      }
+      return construct;
+    }
+    return nullptr;
+  }
+
+  // Keyword arguments of machine.SPI for an SPISettings(clock, bitOrder, dataMode). Without a
+  // Rewriter only constant settings can be spelled, and "" is returned for any other.
+  std::string spellSettings(const clang::CXXConstructExpr* settings, Rewriter* rewrite) {
+    int64_t constants[3] = {4000000, 1, 0};
+    std::string texts[3];
+    if (settings->getNumArgs() != 0 && settings->getNumArgs() != 3)
+      return "";
+    for (unsigned i = 0; i < settings->getNumArgs(); ++i) {
+      MathOptimiser::Value value;
+      if (Optimiser.evaluate(settings->getArg(i), value) && !value.IsFloat)
+        constants[i] = value.Int;
+      else if (rewrite)
+        texts[i] = parenthesize(text(*rewrite, settings->getArg(i)));
+      else
+        return "";
+    }
+    // SPI_MODE0..3 keep CPOL in bit 3 and CPHA in bit 2, as on the AVR's SPCR.
+    std::string kwargs = "baudrate=" + (texts[0].empty() ? std::to_string(constants[0]) : texts[0]);
+    kwargs += ", polarity=" + (texts[2].empty() ? std::to_string(constants[2] >> 3 & 1) : texts[2] + " >> 3 & 1");
+    kwargs += ", phase=" + (texts[2].empty() ? std::to_string(constants[2] >> 2 & 1) : texts[2] + " >> 2 & 1");
+    if (!texts[1].empty())
+      kwargs += ", firstbit=machine.SPI.MSB if " + texts[1] + " else machine.SPI.LSB";
+    else
+      kwargs += constants[1] ? ", firstbit=machine.SPI.MSB" : ", firstbit=machine.SPI.LSB";
+    return kwargs;
+  }
+
+  void beginTransaction(const clang::CallExpr* call, const clang::Stmt* stmt) {
+    defineBus();
+    if (!Hoisted.empty()) {
+      removeConverted(Rewrite, statementRange(*Context, stmt, stmt));
+      return;
+    }
+    const clang::CXXConstructExpr* settings = settingsOf(call->getArg(0));
+    if (!settings)
+      return;
+    Module.deferRewrite(statementRange(*Context, stmt, stmt), ModuleFinaliser::BusTransactions, [this, settings](Rewriter &rewrite) {
+      std::string kwargs = spellSettings(settings, &rewrite);
+      return kwargs.empty() ? kwargs : "spi.init(" + kwargs + ")";
+    });
+  }
+
+  // A statement that is a transfer() or transfer16() of its own, or one assigned to a variable.
+  bool transferOf(const clang::Stmt* stmt, Transfer &transfer) {
+    const auto *expr = dyn_cast<clang::Expr>(stmt);
+    if (!expr)
+      return false;
+    expr = expr->IgnoreImplicit();
+    transfer.Target = nullptr;
+    if (const auto *assign = dyn_cast<clang::BinaryOperator>(expr)) {
+      if (assign->getOpcode() != BO_Assign || !isa<clang::DeclRefExpr>(assign->getLHS()->IgnoreParens()) ||
+          !assign->getLHS()->getType()->isIntegerType())
+        return false;
+      transfer.Target = assign->getLHS();
+      expr = assign->getRHS()->IgnoreImpCasts();
+    }
+    const auto *call = dyn_cast<clang::CallExpr>(expr);
+    const auto *method = call ? dyn_cast_or_null<clang::CXXMethodDecl>(call->getDirectCallee()) : nullptr;
+    if (!method || !isSPI(method) || call->getNumArgs() != 1 || call->getArg(0)->HasSideEffects(*Context) ||
+        (method->getName() != "transfer" && method->getName() != "transfer16"))
+      return false;
+    transfer.Call = call;
+    transfer.Wide = method->getName() == "transfer16";
+    return true;
+  }
+
+  static bool readsAny(const clang::Expr* expr, const std::set<const clang::Decl*> &decls) {
+    ReferencedDeclCollector collector;
+    collector.TraverseStmt(const_cast<clang::Expr*>(expr));
+    for (const clang::Decl* decl : collector.Referenced)
+      if (decls.count(decl))
+        return true;
+    return false;
+  }
+
+  // Consecutive transfer statements send one buffer. A transfer whose byte depends on what an
+  // earlier one received ends the run, since all bytes go out before any are read.
+  bool transferRun(const clang::CompoundStmt* block, size_t index) {
+    std::vector<const clang::Stmt*> stmts(block->body_begin(), block->body_end());
+    std::vector<Transfer> run;
+    std::set<const clang::Decl*> received;
+    for (size_t next = index; next < stmts.size(); ++next) {
+      Transfer transfer;
+      if (!transferOf(stmts[next], transfer) || readsAny(transfer.Call->getArg(0), received))
+        break;
+      if (transfer.Target)
+        received.insert(cast<clang::DeclRefExpr>(transfer.Target->IgnoreParens())->getDecl());
+      run.push_back(transfer);
+    }
+    if (run.empty())
+      return false;
+
+    std::vector<std::pair<const clang::Expr*, Part>> slots;
+    std::vector<int64_t> bytes;
+    bool allConstant = true;
+    for (const Transfer &transfer : run) {
+      Consumed.insert(transfer.Call);
+      const clang::Expr* arg = transfer.Call->getArg(0);
+      MathOptimiser::Value value;
+      bool constant = Optimiser.evaluate(arg, value) && !value.IsFloat;
+      allConstant &= constant;
+      if (transfer.Wide) {
+        slots.push_back({constant ? nullptr : arg, HighByte});
+        bytes.push_back(constant ? value.Int >> 8 & 0xff : 0);
+      }
+      slots.push_back({constant ? nullptr : arg, transfer.Wide ? LowByte : Byte});
+      bytes.push_back(constant ? value.Int & 0xff : 0);
+    }
+    std::string bus = defineBus();
+    std::string tx = defineTxBuffer("_SPI", bytes, allConstant);
+    std::string rx;
+    for (const Transfer &transfer : run)
+      if (transfer.Target && rx.empty())
+        rx = defineRxBuffer("_SPI", bytes.size());
+
+    std::string indent = indentOf(*Context, stmts[index]);
+    Module.deferRewrite(statementRange(*Context, stmts[index], stmts[index + run.size() - 1]), ModuleFinaliser::BusTransactions,
+                        [this, run, slots, bus, tx, rx, indent](Rewriter &rewrite) {
+      std::vector<std::string> lines;
+      for (size_t i = 0; i < slots.size(); ++i)
+        if (slots[i].first)
+          lines.push_back(tx + "[" + std::to_string(i) + "] = " + spellSlot(rewrite, slots[i].first, slots[i].second));
+      lines.push_back(rx.empty() ? bus + ".write(" + tx + ")" : bus + ".write_readinto(" + tx + ", " + rx + ")");
+      size_t offset = 0;
+      for (const Transfer &transfer : run) {
+        if (transfer.Target) {
+          std::string slot = rx + "[" + std::to_string(offset) + "]";
+          std::string value = transfer.Wide ? slot + " << 8 | " + rx + "[" + std::to_string(offset + 1) + "]" : slot;
+          QualType type = transfer.Target->getType();
+          if (!IntegerRanges::Range::of(0, transfer.Wide ? 65535 : 255).within(Ranges.typeRange(type)))
+            value = Ranges.wrap(value, type);
+          lines.push_back(text(rewrite, transfer.Target) + " = " + value);
+        }
+        offset += transfer.Wide ? 2 : 1;
+      }
+      return joinLines(lines, indent);
+    });
+    return true;
+  }
+
+  std::string spellSlot(Rewriter &rewrite, const clang::Expr* value, Part part) {
+    if (part == Byte)
+      return byteText(rewrite, value);
+    std::string word = parenthesize(text(rewrite, value));
+    return part == HighByte ? word + " >> 8 & 0xff" : word + " & 0xff";
+  }
+
+  bool transferLoop(const clang::CallExpr* call) {
+    const auto *method = cast<clang::CXXMethodDecl>(call->getDirectCallee());
+    const clang::Stmt* body;
+    const clang::ForStmt* loop = loopAround(call, body);
+    const clang::VarDecl* var;
+    int64_t first, count;
+    if (!loop || method->getName() != "transfer" || call->getArg(0)->HasSideEffects(*Context) ||
+        !countedLoop(loop, var, first, count) || count < 1 || count > MaxLoopBytes)
+      return false;
+
+    Consumed.insert(call);
+    std::string bus = defineBus();
+    std::string name = bufferName("_SPI", "TX");
+    Module.addBuffer(name, count);
+    SourceLocation end = loopEnd(loop);
+    MathOptimiser::Value value;
+    if (Optimiser.evaluate(call->getArg(0), value) && !value.IsFloat) {
+      Module.addDefinition(name, name + " = " + byteLiteral({value.Int & 0xff}) + " * " + std::to_string(count));
+      SourceManager &SM = Context->getSourceManager();
+      Module.deferRewrite(CharSourceRange::getCharRange(SM.getExpansionLoc(loop->getBeginLoc()), end), ModuleFinaliser::BusTransactions,
+                          [bus, name](Rewriter &) { return bus + ".write(" + name + ")"; });
+      return true;
+    }
+    Module.addDefinition(name, name + " = bytearray(" + std::to_string(count) + ")");
+    std::string slot = name + "[" + var->getNameAsString() + (first ? " - " + std::to_string(first) : "") + "]";
+    const clang::Expr* arg = call->getArg(0);
+    Module.deferRewrite(statementRange(*Context, call, call), ModuleFinaliser::BusTransactions, [this, slot, arg](Rewriter &rewrite) {
+      return slot + " = " + byteText(rewrite, arg);
+    });
+    Rewrite.InsertText(end, "\n" + indentOf(*Context, loop) + bus + ".write(" + name + ")", true);
+    return true;
+  }
+
+  // SPI.transfer(buf, count) exchanges a whole buffer in place.
+  void transferBuffer(const clang::CallExpr* call, const clang::Stmt* stmt) {
+    const clang::Expr* buffer = call->getArg(0)->IgnoreParenImpCasts();
+    const clang::Expr* size = call->getArg(1);
+    MathOptimiser::Value count;
+    const clang::ConstantArrayType* array = Context->getAsConstantArrayType(buffer->getType());
+    bool whole = array && Optimiser.evaluate(size, count) && !count.IsFloat && count.Int >= 0 &&
+                 array->getSize() == static_cast<uint64_t>(count.Int);
+    std::string bus = defineBus();
+    Module.deferRewrite(statementRange(*Context, stmt, stmt), ModuleFinaliser::BusTransactions, [this, bus, buffer, size, whole](Rewriter &rewrite) {
+      std::string view = text(rewrite, buffer);
+      if (!whole)
+        view = "memoryview(" + view + ")[:" + text(rewrite, size) + "]";
+      return bus + ".write_readinto(" + view + ", " + view + ")";
+    });
+  }
+
+  // A transfer whose result is used inside a larger expression goes through a helper.
+  void transferCall(const clang::CallExpr* call, bool wide) {
+    std::string bus = defineBus();
+    Module.addBuffer(wide ? "_SPI_WORD" : "_SPI_BYTE", wide ? 2 : 1);
+    if (wide)
+      Module.addDefinition("_spi_transfer16", "_SPI_WORD = bytearray(2)\n"
+                           "def _spi_transfer16(w):\n"
+                           "    _SPI_WORD[0] = w >> 8 & 0xff\n"
+                           "    _SPI_WORD[1] = w & 0xff\n"
+                           "    " + bus + ".write_readinto(_SPI_WORD, _SPI_WORD)\n"
+                           "    return _SPI_WORD[0] << 8 | _SPI_WORD[1]");
+    else
+      Module.addDefinition("_spi_transfer", "_SPI_BYTE = bytearray(1)\n"
+                           "def _spi_transfer(b):\n"
+                           "    _SPI_BYTE[0] = b & 0xff\n"
+                           "    " + bus + ".write_readinto(_SPI_BYTE, _SPI_BYTE)\n"
+                           "    return _SPI_BYTE[0]");
+    const clang::Expr* arg = call->getArg(0);
+    Module.deferRewrite(Optimiser.getFileRange(call), ModuleFinaliser::BusTransactions, [this, arg, wide](Rewriter &rewrite) {
+      return std::string(wide ? "_spi_transfer16(" : "_spi_transfer(") + text(rewrite, arg) + ")";
+    });
+  }
+
+  // Longest counted loop of transfer() calls that is turned into one buffer.
+  static constexpr int64_t MaxLoopBytes = 1024;
+
+  bool Scanned = false;
+  std::string Hoisted;
+  std::set<const clang::CallExpr*> Consumed;
 };
 
-//PinMode Class: All Rewriting For PinMode statements done here.
+//Handler for shiftOut() and shiftIn(). Toggling a pin from bytecode for every bit is slow, so pins a
+//hardware SPI bus of the --target port can use get a module-level machine.SPI, and consecutive
+//shiftOut() statements on it are sent as one buffer. Otherwise the bits are clocked out by a
+//@micropython.viper helper writing the GPIO set/clear registers, or, when the target has no such
+//registers, by a @micropython.native helper on Pin objects. A counted loop shifting out an 8 bit
+//array is sent with one call. The pins and bit order must be constants. pinMode() on pins the SPI
+//bus takes is dropped, since machine.Pin() would turn them back into plain GPIOs.
 
-class pinModeVariableHandler : public MatchFinder::MatchCallback {
+class shiftHandler : public busTransferHandler {
 public:
-   pinModeVariableHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   shiftHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser, IntegerRanges &Ranges) : busTransferHandler(Rewrite, Module, Optimiser, Ranges)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* pm = Results.Nodes.getNodeAs<clang::CallExpr>("pinMode");
-    Rewrite.ReplaceText(pm->getBeginLoc(), "Pin.mode");
-    Rewrite.InsertText(pm->getBeginLoc(), "#from machine import pin at start of code\n", true, true);
+    const clang::CallExpr* shiftfinder = Results.Nodes.getNodeAs<clang::CallExpr>("shift");
+    Context = Results.Context;
+    Shift shift;
+    if (Consumed.count(shiftfinder) || !shiftOf(shiftfinder, shift))
+      return;
+    Module.addImport("machine");
+    if (shift.In) {
+      replaceCall(shiftfinder, shiftIn(shift));
+      return;
+    }
+    if (shiftLoop(shiftfinder, shift) || shiftRun(shiftfinder, shift))
+      return;
+    replaceCall(shiftfinder, shiftOut(shift));
+  }
 
+  void onEndOfTranslationUnit() override {
+    if (!Context || BusPins.empty())
+      return;
+    SourceManager &SM = Context->getSourceManager();
+    std::vector<const clang::CallExpr*> pinModes;
+    for (const clang::Decl* decl : Context->getTranslationUnitDecl()->decls())
+      if (const auto *function = dyn_cast<clang::FunctionDecl>(decl))
+        if (function->doesThisDeclarationHaveABody() && SM.isInMainFile(SM.getExpansionLoc(function->getLocation())))
+          collectPinModes(function->getBody(), pinModes);
+    for (const clang::CallExpr* call : pinModes) {
+      MathOptimiser::Value pin;
+      const clang::CompoundStmt* block;
+      size_t index;
+      if (!Optimiser.evaluateOrInitial(call->getArg(0), pin) || pin.IsFloat || !BusPins.count(pin.Int) ||
+          !findStatement(call, block, index) || cast<clang::Expr>(block->body_begin()[index])->IgnoreImplicit() != call)
+        continue;
+      CharSourceRange range = statementRange(*Context, call, call);
+      if (block->size() == 1)
+        replaceConverted(Rewrite, range, "pass");
+      else
+        removeConverted(Rewrite, range);
+    }
+    BusPins.clear();
   }
 
 private:
-  Rewriter &Rewrite;
+  enum Path { HardwareSPI, Viper, Native };
+
+  void collectPinModes(const clang::Stmt* stmt, std::vector<const clang::CallExpr*> &calls) {
+    if (!stmt)
+      return;
+    if (const auto *call = dyn_cast<clang::CallExpr>(stmt)) {
+      const clang::FunctionDecl* callee = call->getDirectCallee();
+      if (callee && callee->getIdentifier() && callee->getName() == "pinMode" && call->getNumArgs() == 2)
+        calls.push_back(call);
+    }
+    for (const clang::Stmt* child : stmt->children())
+      collectPinModes(child, calls);
+  }
+
+  struct Shift {
+    bool In;
+    int64_t Data;
+    int64_t Clock;
+    bool MsbFirst;
+    const clang::Expr* Value;
+    Path Via;
+    int Bus;
+  };
+
+  // shiftOut(dataPin, clockPin, bitOrder, value) or shiftIn(dataPin, clockPin, bitOrder) with
+  // constant pins and order, and how the target can clock it.
+  bool shiftOf(const clang::CallExpr* call, Shift &shift) {
+    const clang::FunctionDecl* callee = call->getDirectCallee();
+    if (!callee || !callee->getIdentifier() || (callee->getName() != "shiftOut" && callee->getName() != "shiftIn"))
+      return false;
+    shift.In = callee->getName() == "shiftIn";
+    if (call->getNumArgs() != (shift.In ? 3u : 4u))
+      return false;
+    MathOptimiser::Value data, clock, order;
+    if (!Optimiser.evaluateOrInitial(call->getArg(0), data) || data.IsFloat || !Optimiser.evaluateOrInitial(call->getArg(1), clock) ||
+        clock.IsFloat || !Optimiser.evaluate(call->getArg(2), order) || order.IsFloat)
+      return false;
+    shift.Data = data.Int;
+    shift.Clock = clock.Int;
+    shift.MsbFirst = order.Int != 0;
+    shift.Value = shift.In ? nullptr : call->getArg(3);
+    shift.Via = pathFor(shift, shift.Bus);
+    return true;
+  }
+
+  static bool contains(const std::vector<int> &pins, int64_t pin) {
+    return std::find(pins.begin(), pins.end(), pin) != pins.end();
+  }
+
+  // Arduino clocks data on the rising edge with the clock idling low, which is SPI mode 0.
+  static Path pathFor(const Shift &shift, int &bus) {
+    const TargetInfo *target = targetInfo();
+    bus = -1;
+    if (target && (shift.MsbFirst || target->SPILsbFirst)) {
+      bus = target->AnySPIBus;
+      for (const SPIBusPins &pins : target->SPIBuses)
+        if (contains(pins.Sck, shift.Clock) && contains(shift.In ? pins.Miso : pins.Mosi, shift.Data))
+          bus = pins.Id;
+      if (bus != -1)
+        return HardwareSPI;
+    }
+    if (target && target->GpioSet && shift.Data >= 0 && shift.Data < 32 && shift.Clock >= 0 && shift.Clock < 32)
+      return Viper;
+    return Native;
+  }
+
+  std::string spiBus(const Shift &shift) {
+    BusPins.insert(shift.Clock);
+    BusPins.insert(shift.Data);
+    std::string name = "_SHIFT_SPI" + std::to_string(shift.Clock) + "_" + std::to_string(shift.Data) + (shift.MsbFirst ? "" : "_LSB");
+    Module.addDefinition(name, name + " = machine.SPI(" + std::to_string(shift.Bus) +
+                         ", baudrate=1000000, polarity=0, phase=0, firstbit=machine.SPI." + (shift.MsbFirst ? "MSB" : "LSB") +
+                         ", sck=machine.Pin(" + std::to_string(shift.Clock) + "), " + (shift.In ? "miso" : "mosi") +
+                         "=machine.Pin(" + std::to_string(shift.Data) + "))");
+    return name;
+  }
+
+  std::string pin(int64_t number) {
+    std::string name = "_SHIFT_PIN" + std::to_string(number);
+    Module.addDefinition(name, name + " = machine.Pin(" + std::to_string(number) + ")");
+    return name;
+  }
+
+  static std::string hex(uint32_t value) { return "0x" + llvm::utohexstr(value, true); }
+
+  // The loop over the bits of one byte in the helpers below; Indent is that of the loop.
+  static std::string bitLoop(StringRef indent, StringRef setData, StringRef clearData, StringRef pulseClock) {
+    std::string inner = indent.str() + "    ";
+    return indent.str() + "for i in range(8):\n" +
+           inner + "if value & (0x80 >> i if msb else 1 << i):\n" +
+           inner + "    " + setData.str() + "\n" +
+           inner + "else:\n" +
+           inner + "    " + clearData.str() + "\n" +
+           pulseClock.str();
+  }
+
+  // Defines the helper that clocks out one byte (or, with Buffer, n bytes of a buffer) and returns
+  // the arguments it takes before the value.
+  std::string defineShiftOut(const Shift &shift, bool buffer) {
+    std::string name = buffer ? "_shift_out_buf" : "_shift_out";
+    std::string msb = shift.MsbFirst ? "1" : "0";
+    std::string indent = buffer ? "        " : "    ";
+    if (shift.Via == Viper) {
+      const TargetInfo *target = targetInfo();
+      std::string pulse = indent + "    out_set[0] = clock\n" + indent + "    out_clr[0] = clock";
+      Module.addDefinition(name, "@micropython.viper\n"
+                           "def " + name + "(data: int, clock: int, msb: int, " + (buffer ? "buf: ptr8, n: int" : "value: int") + "):\n"
+                           "    out_set = ptr32(" + hex(target->GpioSet) + ")\n"
+                           "    out_clr = ptr32(" + hex(target->GpioClear) + ")\n" +
+                           (buffer ? "    for j in range(n):\n        value = buf[j]\n" : "") +
+                           bitLoop(indent, "out_set[0] = data", "out_clr[0] = data", pulse));
+      return name + "(1 << " + std::to_string(shift.Data) + ", 1 << " + std::to_string(shift.Clock) + ", " + msb;
+    }
+    name += "_pins";
+    std::string pulse = indent + "    clock.value(1)\n" + indent + "    clock.value(0)";
+    Module.addDefinition(name, "@micropython.native\n"
+                         "def " + name + "(data, clock, msb, " + (buffer ? "buf, n" : "value") + "):\n" +
+                         (buffer ? "    for j in range(n):\n        value = buf[j]\n" : "") +
+                         bitLoop(indent, "data.value(1)", "data.value(0)", pulse));
+    return name + "(" + pin(shift.Data) + ", " + pin(shift.Clock) + ", " + msb;
+  }
+
+  // What a shiftOut() call that isn't part of a run or loop becomes, up to its value argument.
+  std::string shiftOut(const Shift &shift) {
+    if (shift.Via != HardwareSPI)
+      return defineShiftOut(shift, false) + ", ";
+    std::string bus = spiBus(shift);
+    std::string name = "_shift_out_spi" + bus.substr(10);
+    Module.addDefinition("_SHIFT_OUT", "_SHIFT_OUT = bytearray(1)");
+    Module.addBuffer("_SHIFT_OUT", 1);
+    Module.addDefinition(name, "def " + name + "(value):\n"
+                         "    _SHIFT_OUT[0] = value & 0xff\n"
+                         "    " + bus + ".write(_SHIFT_OUT)");
+    return name + "(";
+  }
+
+  std::string shiftIn(const Shift &shift) {
+    std::string msb = shift.MsbFirst ? "1" : "0";
+    if (shift.Via == HardwareSPI) {
+      std::string bus = spiBus(shift);
+      std::string name = "_shift_in_spi" + bus.substr(10);
+      Module.addDefinition("_SHIFT_IN", "_SHIFT_IN = bytearray(1)");
+      Module.addBuffer("_SHIFT_IN", 1);
+      Module.addDefinition(name, "def " + name + "():\n"
+                           "    " + bus + ".readinto(_SHIFT_IN)\n"
+                           "    return _SHIFT_IN[0]");
+      return name + "(";
+    }
+    if (shift.Via == Viper) {
+      const TargetInfo *target = targetInfo();
+      Module.addDefinition("_shift_in", "@micropython.viper\n"
+                           "def _shift_in(data: int, clock: int, msb: int) -> int:\n"
+                           "    out_set = ptr32(" + hex(target->GpioSet) + ")\n"
+                           "    out_clr = ptr32(" + hex(target->GpioClear) + ")\n"
+                           "    gpio_in = ptr32(" + hex(target->GpioIn) + ")\n"
+                           "    value = 0\n"
+                           "    for i in range(8):\n"
+                           "        out_set[0] = clock\n"
+                           "        if gpio_in[0] & data:\n"
+                           "            value |= 0x80 >> i if msb else 1 << i\n"
+                           "        out_clr[0] = clock\n"
+                           "    return value");
+      return "_shift_in(1 << " + std::to_string(shift.Data) + ", 1 << " + std::to_string(shift.Clock) + ", " + msb;
+    }
+    Module.addDefinition("_shift_in_pins", "@micropython.native\n"
+                         "def _shift_in_pins(data, clock, msb):\n"
+                         "    value = 0\n"
+                         "    for i in range(8):\n"
+                         "        clock.value(1)\n"
+                         "        if data.value():\n"
+                         "            value |= 0x80 >> i if msb else 1 << i\n"
+                         "        clock.value(0)\n"
+                         "    return value");
+    return "_shift_in_pins(" + pin(shift.Data) + ", " + pin(shift.Clock) + ", " + msb;
+  }
+
+  // Prefix is the call up to the value argument; the value keeps its converted text.
+  void replaceCall(const clang::CallExpr* call, const std::string &prefix) {
+    const clang::Expr* value = call->getNumArgs() == 4 ? call->getArg(3) : nullptr;
+    Module.deferRewrite(Optimiser.getFileRange(call), ModuleFinaliser::BusTransactions, [this, prefix, value](Rewriter &rewrite) {
+      return prefix + (value ? text(rewrite, value) : "") + ")";
+    });
+  }
+
+  // Consecutive shiftOut() statements on the same hardware SPI pins, as in a chain of 74HC595s,
+  // are sent as one buffer.
+  bool shiftRun(const clang::CallExpr* call, const Shift &shift) {
+    const clang::CompoundStmt* block;
+    size_t index;
+    if (shift.Via != HardwareSPI || !findStatement(call, block, index))
+      return false;
+    std::vector<const clang::Stmt*> stmts(block->body_begin(), block->body_end());
+    std::vector<const clang::Expr*> values;
+    std::vector<int64_t> bytes;
+    bool allConstant = true;
+    size_t next = index;
+    for (; next < stmts.size(); ++next) {
+      const auto *expr = dyn_cast<clang::Expr>(stmts[next]);
+      const auto *stmt = expr ? dyn_cast<clang::CallExpr>(expr->IgnoreImplicit()) : nullptr;
+      Shift other;
+      if (!stmt || !shiftOf(stmt, other) || other.In || other.Data != shift.Data ||
+          other.Clock != shift.Clock || other.MsbFirst != shift.MsbFirst || other.Value->HasSideEffects(*Context))
+        break;
+      MathOptimiser::Value value;
+      bool constant = Optimiser.evaluate(other.Value, value) && !value.IsFloat;
+      values.push_back(constant ? nullptr : other.Value);
+      bytes.push_back(constant ? value.Int & 0xff : 0);
+      allConstant &= constant;
+      Consumed.insert(stmt);
+    }
+    if (next == index)
+      return false;
+    std::string bus = spiBus(shift);
+    std::string tx = defineTxBuffer("_SHIFT", bytes, allConstant);
+    std::string indent = indentOf(*Context, stmts[index]);
+    Module.deferRewrite(statementRange(*Context, stmts[index], stmts[next - 1]), ModuleFinaliser::BusTransactions,
+                        [this, values, bus, tx, indent](Rewriter &rewrite) {
+      std::vector<std::string> lines;
+      for (size_t i = 0; i < values.size(); ++i)
+        if (values[i])
+          lines.push_back(tx + "[" + std::to_string(i) + "] = " + byteText(rewrite, values[i]));
+      lines.push_back(bus + ".write(" + tx + ")");
+      return joinLines(lines, indent);
+    });
+    return true;
+  }
+
+  // for (i = first; i < end; i++) shiftOut(data, clock, order, buf[i]); over an 8 bit array sends
+  // the slice with one call.
+  bool shiftLoop(const clang::CallExpr* call, const Shift &shift) {
+    const clang::Stmt* body;
+    const clang::ForStmt* loop = loopAround(call, body);
+    const clang::VarDecl* var;
+    int64_t first, count;
+    if (!loop || !countedLoop(loop, var, first, count) || count < 1)
+      return false;
+    const auto *element = dyn_cast<clang::ArraySubscriptExpr>(shift.Value->IgnoreParenImpCasts());
+    const auto *ref = element ? dyn_cast<clang::DeclRefExpr>(element->getBase()->IgnoreParenImpCasts()) : nullptr;
+    const clang::ConstantArrayType* array = ref ? Context->getAsConstantArrayType(ref->getType()) : nullptr;
+    if (!array || !isVar(element->getIdx(), var) || Context->getTypeSize(array->getElementType()) != 8 ||
+        first < 0 || array->getSize().ult(static_cast<uint64_t>(first + count)))
+      return false;
+
+    Consumed.insert(call);
+    std::string buffer = ref->getDecl()->getNameAsString();
+    if (first != 0 || array->getSize() != static_cast<uint64_t>(count))
+      buffer = "memoryview(" + buffer + ")[" + std::to_string(first) + ":" + std::to_string(first + count) + "]";
+    std::string send = shift.Via == HardwareSPI ? spiBus(shift) + ".write(" + buffer + ")"
+                                                : defineShiftOut(shift, true) + ", " + buffer + ", " + std::to_string(count) + ")";
+    SourceManager &SM = Context->getSourceManager();
+    Module.deferRewrite(CharSourceRange::getCharRange(SM.getExpansionLoc(loop->getBeginLoc()), loopEnd(loop)),
+                        ModuleFinaliser::BusTransactions, [send](Rewriter &) { return send; });
+    return true;
+  }
+
+  std::set<const clang::CallExpr*> Consumed;
+  std::set<int64_t> BusPins;
 };
 
-//Handler for Void Loop() Class: All Rewriting For void loop statements done here. Void loop() is rewritten as While True:
+//Handler for tone() and noTone(). The tone plays at half duty on the pin's machine.PWM, which is
+//created once at module level. A duration is ended by a one-shot machine.Timer, like the timer
+//interrupt ends it on the board, so loop() keeps running meanwhile. Each pin has its own end time;
+//the one timer is set for the earliest, stops every tone that is due and is set again.
 
-class loopExprHandler : public MatchFinder::MatchCallback {
+class toneHandler : public MatchFinder::MatchCallback {
 public:
-   loopExprHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   toneHandler(ModuleFinaliser &Module, MathOptimiser &Optimiser) : Module(Module), Optimiser(Optimiser)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::FunctionDecl* loop = Results.Nodes.getNodeAs<clang::FunctionDecl>("loopexpr");
-    Rewrite.RemoveText(loop->getLocation()); 
-    Rewrite.ReplaceText(loop->getBeginLoc(), "While True:");
-    Rewrite.ReplaceText(loop->getLocation(), " ");
+    const clang::CallExpr* tonefinder = Results.Nodes.getNodeAs<clang::CallExpr>("tone");
+    bool stop = tonefinder->getDirectCallee()->getName() == "noTone";
+    if (tonefinder->getNumArgs() < (stop ? 1u : 2u))
+      return;
+    // tone(pin, frequency) fills in a duration of 0, which plays until noTone().
+    const clang::Expr* duration = nullptr;
+    MathOptimiser::Value value;
+    if (!stop && tonefinder->getNumArgs() == 3 && !isa<clang::CXXDefaultArgExpr>(tonefinder->getArg(2)) &&
+        !(Optimiser.evaluate(tonefinder->getArg(2), value) && !value.IsFloat && value.Int == 0))
+      duration = tonefinder->getArg(2);
+    defineTone();
+    Module.deferRewrite(Optimiser.getFileRange(tonefinder), ModuleFinaliser::Peripherals, [this, tonefinder, stop, duration](Rewriter &Rewrite) {
+      std::string pwm = pinPWM(Rewrite, tonefinder->getArg(0));
+      if (stop)
+        return "_no_tone(" + pwm + ")";
+      return "_tone(" + pwm + ", " + text(Rewrite, tonefinder->getArg(1)) + (duration ? ", " + text(Rewrite, duration) : "") + ")";
+    });
   }
 
 private:
-  Rewriter &Rewrite;
+  void defineTone() {
+    const TargetInfo *target = targetInfo();
+    Module.addImport("machine");
+    Module.addImport("utime");
+    Module.addDefinition("_TONE_TIMER", "_TONE_TIMER = machine.Timer(" + std::to_string(target ? target->TimerId : -1) + ")");
+    Module.addDefinition("_tone", "_TONE_ENDS = {}\n"
+                         "def _tone_stop(timer=None):\n"
+                         "    _TONE_TIMER.deinit()\n"
+                         "    now = utime.ticks_ms()\n"
+                         "    wait = None\n"
+                         "    for pwm, end in list(_TONE_ENDS.items()):\n"
+                         "        left = utime.ticks_diff(end, now)\n"
+                         "        if left <= 0:\n"
+                         "            pwm.duty_u16(0)\n"
+                         "            _TONE_ENDS.pop(pwm, None)\n"
+                         "        elif wait is None or left < wait:\n"
+                         "            wait = left\n"
+                         "    if wait is not None:\n"
+                         "        _TONE_TIMER.init(mode=machine.Timer.ONE_SHOT, period=wait, callback=_tone_stop)\n"
+                         "def _tone(pwm, frequency, duration=0):\n"
+                         "    pwm.freq(frequency)\n"
+                         "    pwm.duty_u16(32768)\n"
+                         "    if duration:\n"
+                         "        _TONE_ENDS[pwm] = utime.ticks_add(utime.ticks_ms(), duration)\n"
+                         "    else:\n"
+                         "        _TONE_ENDS.pop(pwm, None)\n"
+                         "    _tone_stop()\n"
+                         "def _no_tone(pwm):\n"
+                         "    pwm.duty_u16(0)\n"
+                         "    if _TONE_ENDS.pop(pwm, None) is not None:\n"
+                         "        _tone_stop()");
+  }
+
+  std::string pinPWM(Rewriter &Rewrite, const clang::Expr* pin) {
+    MathOptimiser::Value value;
+    if (Optimiser.evaluateOrInitial(pin, value) && !value.IsFloat)
+      return Module.addPinObject("PWM", MathOptimiser::formatValue(value), true);
+    return Module.addPinObject("PWM", text(Rewrite, pin), false);
+  }
+
+  std::string text(Rewriter &Rewrite, const clang::Expr* expr) {
+    return Rewrite.getRewrittenText(Optimiser.getFileRange(expr));
+  }
+
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
 };
 
 //Handler for delay() function: delay() is rewritten as time.sleep_ms
 
-class delayHandler : public MatchFinder::MatchCallback {
+class delayMicrosecondsHandler : public MatchFinder::MatchCallback {
 public:
-   delayHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   delayMicrosecondsHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* delayfinder = Results.Nodes.getNodeAs<clang::CallExpr>("delay");
-    Rewrite.ReplaceText(delayfinder->getBeginLoc(), "utime.sleep_ms");
+    const clang::CallExpr* delayMicrosecondsfinder = Results.Nodes.getNodeAs<clang::CallExpr>("delayMicroseconds");
+    Edits.replaceToken(Results, delayMicrosecondsfinder->getBeginLoc(), "utime.sleep_us");
+    Module.addImport("utime");
+  }
+
+private:
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
+};
+
+//Handler for delay() function: delay() is rewritten as time.sleep_ms
+
+class millisHandler : public MatchFinder::MatchCallback {
+public:
+   millisHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::CallExpr* millisfinder = Results.Nodes.getNodeAs<clang::CallExpr>("millis");
+    Edits.replaceToken(Results, millisfinder->getBeginLoc(), "utime.ticks_ms");
+    Module.addImport("utime");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
 };
 
-//Handler for Void Setup() Class: Void Setup is Deleted as It does not occur in Micropython Statements
+//Handler for delay() function: delay() is rewritten as time.sleep_ms
 
-class setupHandler : public MatchFinder::MatchCallback {
+class microsHandler : public MatchFinder::MatchCallback {
 public:
-   setupHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   microsHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::FunctionDecl* setupfinder = Results.Nodes.getNodeAs<clang::FunctionDecl>("setupfunc"); 
-    Rewrite.RemoveText(setupfinder->getLocation());
-    Rewrite.RemoveText(setupfinder->getBeginLoc());
-    Rewrite.ReplaceText(setupfinder->getBeginLoc(), " ");
+    const clang::CallExpr* microsfinder = Results.Nodes.getNodeAs<clang::CallExpr>("micros");
+    Edits.replaceToken(Results, microsfinder->getBeginLoc(), "utime.ticks_us");
+    Module.addImport("utime");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
 };
 
+//Handler for character literals in comparisons: read() of a serial port gives the byte as an int, so
+//in c == '$' the literal becomes the character's code. A literal compared with a variable that was set
+//from a character literal itself stays a one character string, which is what isAlpha() and friends match.
 
-//Handler for CompoundStatements: Curly Braces are not required in Micropython and Can be removed. Since  project with improper indentation might become hard to understand
-// it will insert a # (comment statement) before each {}
+class charCompareHandler : public MatchFinder::MatchCallback {
+public:
+   charCompareHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
-class compoundStmtHandler : public MatchFinder::MatchCallback {
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::BinaryOperator* comparefinder = Results.Nodes.getNodeAs<clang::BinaryOperator>("charCompare");
+    const clang::Expr* lhs = comparefinder->getLHS()->IgnoreParenImpCasts();
+    const clang::Expr* rhs = comparefinder->getRHS()->IgnoreParenImpCasts();
+    if (holdsCharacter(lhs) && holdsCharacter(rhs))
+      return;
+    for (const clang::Expr* side : {lhs, rhs})
+      if (const auto *literal = dyn_cast<clang::CharacterLiteral>(side))
+        if (!literal->getBeginLoc().isMacroID())
+          Edits.replaceToken(Results, literal->getLocation(), std::to_string(literal->getValue()));
+  }
+
+private:
+  static bool holdsCharacter(const clang::Expr* expr) {
+    if (isa<clang::CharacterLiteral>(expr))
+      return true;
+    const auto *ref = dyn_cast<clang::DeclRefExpr>(expr);
+    const auto *var = ref ? dyn_cast<clang::VarDecl>(ref->getDecl()) : nullptr;
+    return var && var->getInit() && isa<clang::CharacterLiteral>(var->getInit()->IgnoreParenImpCasts());
+  }
+
+  TokenEdits &Edits;
+};
+
+//Handler for SoftwareSerial: a SoftwareSerial object becomes a machine.UART the target has spare on its
+//pins, or a _SoftUART whose receiver timestamps edges in a hard pin interrupt and decodes them when read. A
+//while (port.available()) loop that reads one byte per pass reads everything waiting with one readinto().
+
+class softwareSerialHandler : public busTransferHandler {
 public:
-   compoundStmtHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   softwareSerialHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser, IntegerRanges &Ranges) : busTransferHandler(Rewrite, Module, Optimiser, Ranges)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* compoundstmtfinder = Results.Nodes.getNodeAs<clang::Stmt>("compoundstmt");
-    Rewrite.InsertText(compoundstmtfinder->getBeginLoc(), "#", true, true);
-    Rewrite.InsertText(compoundstmtfinder->getEndLoc(), "#", true, true);
+    Context = Results.Context;
+    if (const clang::VarDecl* serialvar = Results.Nodes.getNodeAs<clang::VarDecl>("serialVar")) {
+      declarePort(serialvar);
+      return;
+    }
+    const clang::CXXMemberCallExpr* serialfinder = Results.Nodes.getNodeAs<clang::CXXMemberCallExpr>("serial");
+    const auto *ref = dyn_cast<clang::DeclRefExpr>(serialfinder->getImplicitObjectArgument()->IgnoreImpCasts());
+    const clang::VarDecl* var = ref ? dyn_cast<clang::VarDecl>(ref->getDecl()) : nullptr;
+    if (Consumed.count(serialfinder) || !var || !Ports.count(var->getCanonicalDecl()) || !serialfinder->getMethodDecl()->getIdentifier())
+      return;
+    Port &port = Ports[var->getCanonicalDecl()];
+    StringRef method = serialfinder->getMethodDecl()->getName();
+    if (method == "begin" && serialfinder->getNumArgs() == 1) {
+      convertBegin(port, serialfinder);
+    } else if (method == "available") {
+      if (!readLoop(port, var, serialfinder))
+        replaceCall(serialfinder, port.Name + ".any()");
+    } else if (method == "read") {
+      defineByteHelpers();
+      replaceCall(serialfinder, "_serial_read(" + port.Name + ")");
+    } else if (method == "end") {
+      replaceCall(serialfinder, port.Name + ".deinit()");
+    } else if (method == "listen" || method == "isListening" || method == "stopListening") {
+      // Every port receives all the time, so there is no port to switch to.
+      replaceCall(serialfinder, "True");
+    } else if (method == "write" || method == "print" || method == "println") {
+      convertWrite(port, serialfinder, method);
+    }
+  }
+
+private:
+  struct Port {
+    std::string Name;
+    // Constructor arguments without the baud rate, which begin() gives.
+    std::string Arguments;
+    bool Hardware = false;
+    std::vector<const clang::CXXMemberCallExpr*> Begins;
+    // The baud rate every begin() sets, when they all set the same constant one.
+    std::string Baud;
+  };
+
+  void declarePort(const clang::VarDecl* var) {
+    const auto *construct = dyn_cast_or_null<clang::CXXConstructExpr>(var->getInit());
+    if (!construct || construct->getNumArgs() < 2)
+      return;
+    MathOptimiser::Value rx, tx, invert;
+    bool constantPins = Optimiser.evaluateOrInitial(construct->getArg(0), rx) && !rx.IsFloat &&
+                        Optimiser.evaluateOrInitial(construct->getArg(1), tx) && !tx.IsFloat;
+    bool inverted = construct->getNumArgs() == 3 && !isa<clang::CXXDefaultArgExpr>(construct->getArg(2));
+    if (inverted && (!Optimiser.evaluateOrInitial(construct->getArg(2), invert) || invert.IsFloat))
+      return;
+    inverted = inverted && invert.Int != 0;
+
+    Port &port = Ports[var->getCanonicalDecl()];
+    port.Name = var->getNameAsString();
+    int uart = constantPins ? spareUART(rx.Int, tx.Int) : -1;
+    Module.addImport("machine");
+    if (uart >= 0) {
+      port.Hardware = true;
+      port.Arguments = "tx=machine.Pin(" + std::to_string(tx.Int) + "), rx=machine.Pin(" + std::to_string(rx.Int) + ")" +
+                       (inverted ? ", invert=machine.UART.INV_TX | machine.UART.INV_RX" : "");
+      UsedUARTs.insert(uart);
+    } else {
+      defineSoftUART();
+      // The received bytes, and the edge times and levels waiting to be decoded.
+      Module.addBuffer(var->getNameAsString() + "._buf", 64);
+      Module.addBuffer(var->getNameAsString() + "._times", 128 * 4);
+      Module.addBuffer(var->getNameAsString() + "._levels", 128);
+    }
+    SourceManager &SM = Context->getSourceManager();
+    CharSourceRange range = CharSourceRange::getCharRange(SM.getExpansionLoc(var->getBeginLoc()), statementEnd(*Context, construct));
+    const clang::Expr* rxPin = construct->getArg(0);
+    const clang::Expr* txPin = construct->getArg(1);
+    Module.deferRewrite(range, ModuleFinaliser::Peripherals, [this, var, uart, rxPin, txPin, inverted](Rewriter &rewrite) {
+      Port &port = Ports[var->getCanonicalDecl()];
+      std::string baud = port.Baud.empty() ? "9600" : port.Baud;
+      if (uart >= 0)
+        return port.Name + " = machine.UART(" + std::to_string(uart) + ", " + baud + ", " + port.Arguments + ")";
+      return port.Name + " = _SoftUART(" + text(rewrite, rxPin) + ", " + text(rewrite, txPin) + ", " + baud +
+             (inverted ? ", True" : "") + ")";
+    });
+  }
+
+  // The first UART that isn't taken yet and can use both pins.
+  int spareUART(int64_t rx, int64_t tx) {
+    const TargetInfo *target = targetInfo();
+    if (!target)
+      return -1;
+    auto allows = [](const std::vector<int> &pins, int64_t pin) {
+      return pins.empty() || std::find(pins.begin(), pins.end(), pin) != pins.end();
+    };
+    for (const UARTPins &uart : target->UARTs)
+      if (!UsedUARTs.count(uart.Id) && allows(uart.Tx, tx) && allows(uart.Rx, rx))
+        return uart.Id;
+    return -1;
+  }
+
+  // begin(baud) goes into the constructor when every begin() uses the same constant rate, otherwise
+  // it sets the rate with init().
+  void convertBegin(Port &port, const clang::CXXMemberCallExpr* begin) {
+    MathOptimiser::Value baud;
+    std::string rate = Optimiser.evaluateOrInitial(begin->getArg(0), baud) && !baud.IsFloat ? std::to_string(baud.Int) : "";
+    if (port.Begins.empty())
+      port.Baud = rate;
+    else if (port.Baud != rate)
+      port.Baud = "";
+    port.Begins.push_back(begin);
+    const clang::CompoundStmt* block;
+    size_t index;
+    bool statement = findStatement(begin, block, index) && cast<clang::Expr>(block->body_begin()[index])->IgnoreImplicit() == begin;
+    CharSourceRange range = statement ? statementRange(*Context, begin, begin) : Optimiser.getFileRange(begin);
+    Port *owner = &port;
+    Module.deferRewrite(range, ModuleFinaliser::Peripherals, [this, owner, begin, statement, range](Rewriter &rewrite) {
+      if (statement && !owner->Baud.empty()) {
+        removeConverted(rewrite, range);
+        return std::string();
+      }
+      std::string init = owner->Name + ".init(" + text(rewrite, begin->getArg(0)) + (owner->Hardware ? ", " + owner->Arguments : "") + ")";
+      return statement ? init + ";" : init;
+    });
+  }
+
+  void replaceCall(const clang::CXXMemberCallExpr* call, std::string replacement) {
+    Module.deferRewrite(Optimiser.getFileRange(call), ModuleFinaliser::Peripherals, [replacement](Rewriter &) {
+      return replacement;
+    });
+  }
+
+  // write(byte), write(string), print(x) and println(x); print() with a base or a number of digits is left alone.
+  void convertWrite(Port &port, const clang::CXXMemberCallExpr* call, StringRef method) {
+    bool line = method == "println";
+    if (call->getNumArgs() == 0) {
+      if (line)
+        replaceCall(call, port.Name + ".write(\"\\r\\n\")");
+      return;
+    }
+    if (call->getNumArgs() > 2 || (call->getNumArgs() == 2 && !isa<clang::CXXDefaultArgExpr>(call->getArg(1))))
+      return;
+    const clang::Expr* value = call->getArg(0);
+    QualType type = value->IgnoreImpCasts()->getType();
+    bool string = isa<clang::StringLiteral>(value->IgnoreImpCasts()) ||
+                  (type->isPointerType() && type->getPointeeType()->isCharType());
+    bool byte = method == "write" ? !string : type->isCharType();
+    if (method == "write" && !string && !value->getType()->isIntegerType())
+      return;
+    if (byte && !line)
+      defineByteHelpers();
+    std::string name = port.Name;
+    Module.deferRewrite(Optimiser.getFileRange(call), ModuleFinaliser::Peripherals,
+                        [this, name, value, type, string, byte, line](Rewriter &rewrite) {
+      std::string arg = text(rewrite, value);
+      if (byte && !line)
+        return "_serial_write(" + name + ", " + arg + ")";
+      if (byte)
+        arg = "chr(" + arg + ")";
+      else if (type->isRealFloatingType())
+        arg = "\"%.2f\" % " + arg;
+      else if (!string)
+        arg = "str(" + arg + ")";
+      if (line)
+        arg += isa<clang::StringLiteral>(value->IgnoreImpCasts()) ? " \"\\r\\n\"" : " + \"\\r\\n\"";
+      return name + ".write(" + arg + ")";
+    });
+  }
+
+  // while (port.available()) whose body starts by reading the byte into a local and reads nothing
+  // else from the port: the bytes waiting are read with one readinto() and the body runs for each.
+  bool readLoop(Port &port, const clang::VarDecl* var, const clang::CXXMemberCallExpr* available) {
+    const clang::Expr* cond = Optimiser.climbCasts(available);
+    auto parents = Context->getParents(*cond);
+    if (const auto *compare = parents.empty() ? nullptr : parents[0].get<clang::BinaryOperator>()) {
+      MathOptimiser::Value zero;
+      if ((compare->getOpcode() != BO_GT && compare->getOpcode() != BO_NE) || Optimiser.climbCasts(compare->getLHS()) != cond ||
+          !Optimiser.evaluate(compare->getRHS(), zero) || zero.IsFloat || zero.Int != 0)
+        return false;
+      cond = Optimiser.climbCasts(compare);
+      parents = Context->getParents(*cond);
+    }
+    const clang::WhileStmt* loop = parents.empty() ? nullptr : parents[0].get<clang::WhileStmt>();
+    const auto *body = loop ? dyn_cast<clang::CompoundStmt>(loop->getBody()) : nullptr;
+    if (!body || body->body_empty() || Optimiser.climbCasts(loop->getCond()) != cond)
+      return false;
+
+    // char c = port.read(); as the first statement.
+    const auto *decl = dyn_cast<clang::DeclStmt>(body->body_front());
+    const auto *byte = decl && decl->isSingleDecl() ? dyn_cast<clang::VarDecl>(decl->getSingleDecl()) : nullptr;
+    const auto *read = byte && byte->getInit() ? dyn_cast<clang::CXXMemberCallExpr>(byte->getInit()->IgnoreImpCasts()) : nullptr;
+    if (!read || !read->getMethodDecl()->getIdentifier() || read->getMethodDecl()->getName() != "read" || read->getNumArgs() != 0)
+      return false;
+    unsigned reads = 0;
+    bool exits = false;
+    scanBody(body, var, false, reads, exits);
+    if (reads != 1 || exits)
+      return false;
+    Consumed.insert(read);
+
+    std::string rx = defineRxBuffer("_SERIAL", 64);
+    Module.addDefinition(rx + "_VIEW", rx + "_VIEW = memoryview(" + rx + ")");
+    SourceManager &SM = Context->getSourceManager();
+    std::string header = "for " + byte->getNameAsString() + " in " + rx + "_VIEW[:" + port.Name + ".readinto(" + rx + ") or 0]: ";
+    Module.deferRewrite(CharSourceRange::getCharRange(SM.getExpansionLoc(loop->getBeginLoc()), SM.getExpansionLoc(body->getBeginLoc())),
+                        ModuleFinaliser::Peripherals, [header](Rewriter &) { return header; });
+    CharSourceRange first = statementRange(*Context, decl, decl);
+    Module.deferRewrite(first, ModuleFinaliser::Peripherals, [first](Rewriter &rewrite) {
+      removeConverted(rewrite, first);
+      return std::string();
+    });
+    return true;
+  }
+
+  // Counts the calls on the port that take bytes from it, and notes a break, return or goto that
+  // would leave bytes read by readinto() unprocessed.
+  static void scanBody(const clang::Stmt* stmt, const clang::VarDecl* var, bool nested, unsigned &reads, bool &exits) {
+    if (!stmt)
+      return;
+    if (isa<clang::ReturnStmt>(stmt) || isa<clang::GotoStmt>(stmt) || (isa<clang::BreakStmt>(stmt) && !nested))
+      exits = true;
+    if (const auto *call = dyn_cast<clang::CXXMemberCallExpr>(stmt))
+      if (isVar(call->getImplicitObjectArgument(), var) && call->getMethodDecl()->getIdentifier()) {
+        StringRef method = call->getMethodDecl()->getName();
+        if (method == "read" || method == "peek" || method == "available" || method.startswith("readBytes") ||
+            method.startswith("parse") || method.startswith("find"))
+          ++reads;
+      }
+    bool inner = nested || isa<clang::ForStmt>(stmt) || isa<clang::WhileStmt>(stmt) || isa<clang::DoStmt>(stmt) ||
+                 isa<clang::SwitchStmt>(stmt);
+    for (const clang::Stmt* child : stmt->children())
+      scanBody(child, var, inner, reads, exits);
+  }
+
+  void defineByteHelpers() {
+    Module.addBuffer("_SERIAL_BYTE", 1);
+    Module.addDefinition("_serial_read", "_SERIAL_BYTE = bytearray(1)\n"
+                         "def _serial_read(port):\n"
+                         "    if port.readinto(_SERIAL_BYTE, 1):\n"
+                         "        return _SERIAL_BYTE[0]\n"
+                         "    return -1\n"
+                         "def _serial_write(port, value):\n"
+                         "    _SERIAL_BYTE[0] = value & 0xff\n"
+                         "    return port.write(_SERIAL_BYTE)");
+  }
+
+  // A hard pin interrupt only stamps each edge of the receive line with utime.ticks_us() into a
+  // ring of 128 edges; any() and readinto() decode the bytes whose stop bit has passed into a 64 byte
+  // ring buffer, sampling the level in the middle of each bit the way SoftwareSerial does. write()
+  // keeps interrupts off for one byte at a time only.
+  void defineSoftUART() {
+    Module.addImport("array");
+    Module.addImport("utime");
+    Module.addDefinition("_SoftUART", "class _SoftUART:\n"
+                         "    def __init__(self, rx, tx, baudrate=9600, invert=False):\n"
+                         "        self._invert = 1 if invert else 0\n"
+                         "        self._rx = machine.Pin(rx, machine.Pin.IN, machine.Pin.PULL_UP)\n"
+                         "        self._tx = machine.Pin(tx, machine.Pin.OUT, value=1 - self._invert)\n"
+                         "        self._times = array.array('i', [0] * 128)\n"
+                         "        self._levels = bytearray(128)\n"
+                         "        self._edge_head = 0\n"
+                         "        self._edge_tail = 0\n"
+                         "        self._buf = bytearray(64)\n"
+                         "        self._head = 0\n"
+                         "        self._tail = 0\n"
+                         "        self.init(baudrate)\n"
+                         "    def init(self, baudrate):\n"
+                         "        self._bit = 1000000 // baudrate\n"
+                         "        self._rx.irq(self._edge, machine.Pin.IRQ_RISING | machine.Pin.IRQ_FALLING, hard=True)\n"
+                         "    def deinit(self):\n"
+                         "        self._rx.irq(None)\n"
+                         "    @micropython.native\n"
+                         "    def _edge(self, pin):\n"
+                         "        head = self._edge_head\n"
+                         "        following = (head + 1) % 128\n"
+                         "        if following != self._edge_tail:\n"
+                         "            self._times[head] = utime.ticks_us()\n"
+                         "            self._levels[head] = pin.value() ^ self._invert\n"
+                         "            self._edge_head = following\n"
+                         "    @micropython.native\n"
+                         "    def _decode(self):\n"
+                         "        bit = self._bit\n"
+                         "        tail = self._edge_tail\n"
+                         "        while tail != self._edge_head:\n"
+                         "            if self._levels[tail]:\n"
+                         "                tail = (tail + 1) % 128\n"
+                         "                continue\n"
+                         "            start = self._times[tail]\n"
+                         "            if utime.ticks_diff(utime.ticks_us(), start) < 9 * bit + bit // 2:\n"
+                         "                break\n"
+                         "            at = utime.ticks_add(start, bit + bit // 2)\n"
+                         "            edge = (tail + 1) % 128\n"
+                         "            level = 0\n"
+                         "            value = 0\n"
+                         "            for i in range(8):\n"
+                         "                while edge != self._edge_head and utime.ticks_diff(self._times[edge], at) <= 0:\n"
+                         "                    level = self._levels[edge]\n"
+                         "                    edge = (edge + 1) % 128\n"
+                         "                value |= level << i\n"
+                         "                at = utime.ticks_add(at, bit)\n"
+                         "            while edge != self._edge_head and utime.ticks_diff(self._times[edge], at) <= 0:\n"
+                         "                edge = (edge + 1) % 128\n"
+                         "            tail = edge\n"
+                         "            head = (self._head + 1) % 64\n"
+                         "            if head != self._tail:\n"
+                         "                self._buf[self._head] = value\n"
+                         "                self._head = head\n"
+                         "        self._edge_tail = tail\n"
+                         "    def any(self):\n"
+                         "        self._decode()\n"
+                         "        return (self._head - self._tail) % 64\n"
+                         "    def readinto(self, buf, nbytes=-1):\n"
+                         "        self._decode()\n"
+                         "        n = 0\n"
+                         "        limit = len(buf) if nbytes < 0 else nbytes\n"
+                         "        while n < limit and self._tail != self._head:\n"
+                         "            buf[n] = self._buf[self._tail]\n"
+                         "            self._tail = (self._tail + 1) % 64\n"
+                         "            n += 1\n"
+                         "        return n or None\n"
+                         "    @micropython.native\n"
+                         "    def write(self, buf):\n"
+                         "        if isinstance(buf, str):\n"
+                         "            buf = buf.encode()\n"
+                         "        bit = self._bit\n"
+                         "        for value in buf:\n"
+                         "            value = ((value << 1) | 0x200) ^ (0x3ff if self._invert else 0)\n"
+                         "            state = machine.disable_irq()\n"
+                         "            at = utime.ticks_us()\n"
+                         "            for i in range(10):\n"
+                         "                self._tx.value((value >> i) & 1)\n"
+                         "                at = utime.ticks_add(at, bit)\n"
+                         "                while utime.ticks_diff(at, utime.ticks_us()) > 0:\n"
+                         "                    pass\n"
+                         "            machine.enable_irq(state)\n"
+                         "        return len(buf)");
+  }
+
+  std::map<const clang::VarDecl*, Port> Ports;
+  std::set<const clang::CXXMemberCallExpr*> Consumed;
+  std::set<int> UsedUARTs;
+};
+
+//Handler for EEPROM: EEPROM becomes a module-level _EEPROM object keeping the whole image in a
+//bytearray, so read(), write(), update(), length() and EEPROM[i] work on RAM and keep their names.
+//Changed 64 byte pages are written to a file a second after the first change instead of on every
+//byte. get() and put() of a variable become struct.unpack_from() and struct.pack_into() with the
+//layout the variable has on the board.
+
+class eepromHandler : public MatchFinder::MatchCallback {
+public:
+   eepromHandler(ModuleFinaliser &Module, MathOptimiser &Optimiser) : Module(Module), Optimiser(Optimiser)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    Context = Results.Context;
+    defineImage();
+    const clang::CXXMemberCallExpr* eepromfinder = Results.Nodes.getNodeAs<clang::CXXMemberCallExpr>("eeprom");
+    if (!eepromfinder || !eepromfinder->getMethodDecl()->getIdentifier() || eepromfinder->getNumArgs() != 2)
+      return;
+    StringRef method = eepromfinder->getMethodDecl()->getName();
+    bool get = method == "get";
+    if (!get && method != "put")
+      return;
+    // get() fills its argument in, which only works as a statement of its own.
+    auto parents = Context->getParents(*eepromfinder);
+    if (get && (parents.empty() || !parents[0].get<clang::CompoundStmt>()))
+      return;
+    const clang::Expr* value = eepromfinder->getArg(1);
+    std::string format;
+    std::vector<std::string> fields;
+    unsigned bools = 0;
+    if (!layout(value->IgnoreImpCasts()->getType(), "", format, fields, bools) || fields.size() > 32)
+      return;
+    const clang::Expr* address = eepromfinder->getArg(0);
+    Module.deferRewrite(Optimiser.getFileRange(eepromfinder), ModuleFinaliser::Peripherals,
+                        [this, get, address, value, format, fields, bools](Rewriter &Rewrite) {
+      std::string base = Rewrite.getRewrittenText(Optimiser.getFileRange(value));
+      std::string call = "EEPROM." + std::string(get ? "get" : "put") + "(\"<" + format + "\", " +
+                         Rewrite.getRewrittenText(Optimiser.getFileRange(address));
+      std::string targets;
+      for (const std::string &field : fields)
+        targets += (targets.empty() ? "" : ", ") + base + field;
+      if (!get)
+        return call + ", " + targets + ")";
+      if (bools)
+        call += ", " + std::to_string(bools);
+      return targets + " = " + call + ")" + (fields.size() == 1 ? "[0]" : "");
+    });
+  }
+
+private:
+  // The struct format of a value as the board stores it (AVR packs structs without padding) and the
+  // suffix that reaches each of its fields. A char array is one bytes field. MicroPython's struct has
+  // no '?', so a bool is a 'B' byte and its bit in bools has get() turn it back into a bool.
+  bool layout(QualType type, const std::string &path, std::string &format, std::vector<std::string> &fields, unsigned &bools) {
+    type = type.getCanonicalType().getUnqualifiedType();
+    if (const auto *array = Context->getAsConstantArrayType(type)) {
+      uint64_t size = array->getSize().getZExtValue();
+      if (array->getElementType()->isCharType()) {
+        format += std::to_string(size) + "s";
+        fields.push_back(path);
+        return true;
+      }
+      for (uint64_t i = 0; i < size; ++i)
+        if (!layout(array->getElementType(), path + "[" + std::to_string(i) + "]", format, fields, bools))
+          return false;
+      return true;
+    }
+    if (const auto *record = type->getAsRecordDecl()) {
+      const auto *cxxRecord = dyn_cast<clang::CXXRecordDecl>(record);
+      if (record->isUnion() || (cxxRecord && cxxRecord->getNumBases()))
+        return false;
+      for (const clang::FieldDecl* field : record->fields())
+        if (field->isBitField() || !layout(field->getType(), path + "." + field->getNameAsString(), format, fields, bools))
+          return false;
+      return !record->field_empty();
+    }
+    char letter = 0;
+    if (type->isBooleanType()) {
+      letter = 'B';
+      if (fields.size() < 32)
+        bools |= 1u << fields.size();
+    } else if (type->isRealFloatingType()) {
+      letter = TargetIntWidth == 32 && Context->getTypeSize(type) == 64 ? 'd' : 'f';
+    } else if (type->isIntegerType()) {
+      bool isSigned = type->isSignedIntegerOrEnumerationType();
+      switch (targetIntegerWidth(*Context, type)) {
+      case 8: letter = isSigned ? 'b' : 'B'; break;
+      case 16: letter = isSigned ? 'h' : 'H'; break;
+      case 32: letter = isSigned ? 'i' : 'I'; break;
+      case 64: letter = isSigned ? 'q' : 'Q'; break;
+      default: return false;
+      }
+    } else {
+      return false;
+    }
+    format += letter;
+    fields.push_back(path);
+    return true;
+  }
+
+  void defineImage() {
+    if (Module.hasDefinition("EEPROM"))
+      return;
+    const TargetInfo *target = targetInfo();
+    // A timer of its own, next to the one tone() uses.
+    int timer = target && target->TimerId >= 0 ? target->TimerId + 1 : -1;
+    Module.addImport("machine");
+    Module.addImport("micropython");
+    Module.addImport("struct");
+    Module.addDefinition("EEPROM", "class _EEPROM:\n"
+                         "    def __init__(self, path, size):\n"
+                         "        self._path = path\n"
+                         "        self._dirty = 0\n"
+                         "        self._timer = machine.Timer(" + std::to_string(timer) + ")\n"
+                         "        self._flush = self.flush\n"
+                         "        self.image = bytearray(b'\\xff') * size\n"
+                         "        try:\n"
+                         "            with open(path, 'rb') as f:\n"
+                         "                f.readinto(self.image)\n"
+                         "            self._saved = True\n"
+                         "        except OSError:\n"
+                         "            self._saved = False\n"
+                         "    def __getitem__(self, idx):\n"
+                         "        return self.image[idx]\n"
+                         "    def __setitem__(self, idx, value):\n"
+                         "        self.update(idx, value)\n"
+                         "    def read(self, idx):\n"
+                         "        return self.image[idx]\n"
+                         "    def write(self, idx, value):\n"
+                         "        self.update(idx, value)\n"
+                         "    def update(self, idx, value):\n"
+                         "        value &= 0xff\n"
+                         "        if self.image[idx] != value:\n"
+                         "            self.image[idx] = value\n"
+                         "            self._touch(idx, 1)\n"
+                         "    def length(self):\n"
+                         "        return len(self.image)\n"
+                         "    def get(self, fmt, idx, bools=0):\n"
+                         "        values = struct.unpack_from(fmt, self.image, idx)\n"
+                         "        if bools:\n"
+                         "            values = tuple(bool(v) if bools >> i & 1 else v for i, v in enumerate(values))\n"
+                         "        return values\n"
+                         "    def put(self, fmt, idx, *values):\n"
+                         "        size = struct.calcsize(fmt)\n"
+                         "        old = self.image[idx:idx + size]\n"
+                         "        struct.pack_into(fmt, self.image, idx, *values)\n"
+                         "        if self.image[idx:idx + size] != old:\n"
+                         "            self._touch(idx, size)\n"
+                         "    def _touch(self, idx, size):\n"
+                         "        if not self._dirty:\n"
+                         "            self._timer.init(mode=machine.Timer.ONE_SHOT, period=1000, callback=self._due)\n"
+                         "        for page in range(idx >> 6, ((idx + size - 1) >> 6) + 1):\n"
+                         "            self._dirty |= 1 << page\n"
+                         "    def _due(self, timer):\n"
+                         "        micropython.schedule(self._flush, None)\n"
+                         "    def flush(self, _=None):\n"
+                         "        if not self._dirty:\n"
+                         "            return\n"
+                         "        image = memoryview(self.image)\n"
+                         "        with open(self._path, 'r+b' if self._saved else 'wb') as f:\n"
+                         "            if not self._saved:\n"
+                         "                f.write(image)\n"
+                         "            else:\n"
+                         "                for page in range((len(image) + 63) >> 6):\n"
+                         "                    if self._dirty >> page & 1:\n"
+                         "                        f.seek(page << 6)\n"
+                         "                        f.write(image[page << 6:(page + 1) << 6])\n"
+                         "        self._saved = True\n"
+                         "        self._dirty = 0\n"
+                         "EEPROM = _EEPROM('eeprom.bin', " + std::to_string(EepromSize.getValue()) + ")");
+    Module.addBuffer("EEPROM.image", EepromSize);
   }
 
-private:
-  Rewriter &Rewrite;
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+  ASTContext *Context = nullptr;
 };
 
-//Handler for power expression. converts pow to math.pow
+//Handler for critical sections: ATOMIC_BLOCK() and noInterrupts()/interrupts() pairs become
+//machine.disable_irq(), with machine.enable_irq() in a finally. A section around a single read or
+//write of a variable that fits a small int is dropped: MicroPython can't be interrupted halfway
+//through one, and the IRQs would be held off for nothing.
 
-class powerHandler : public MatchFinder::MatchCallback {
+class criticalSectionHandler : public MatchFinder::MatchCallback {
 public:
-   powerHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   criticalSectionHandler(Rewriter &Rewrite, ModuleFinaliser &Module) : Rewrite(Rewrite), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* powfinder = Results.Nodes.getNodeAs<clang::Stmt>("pow");
-    Rewrite.InsertText(powfinder->getBeginLoc(), "math.", true, true);
+    Context = Results.Context;
+    if (const clang::ForStmt* atomicfinder = Results.Nodes.getNodeAs<clang::ForStmt>("atomic"))
+      convertBlock(atomicfinder);
+    else if (const clang::AsmStmt* irqfinder = Results.Nodes.getNodeAs<clang::AsmStmt>("irq"))
+      convertPair(irqfinder);
   }
 
 private:
-  Rewriter &Rewrite;
-};
-
-//Handler for square root expression. converts sqrt to math.sqrt
+  // ATOMIC_BLOCK(type) is a for loop that runs once, started by __iCliRetVal().
+  void convertBlock(const clang::ForStmt* loop) {
+    const auto *init = dyn_cast_or_null<clang::DeclStmt>(loop->getInit());
+    const auto *body = dyn_cast<clang::CompoundStmt>(loop->getBody());
+    if (!init || !body)
+      return;
+    bool atomic = false;
+    for (const clang::Decl* decl : init->decls())
+      if (const auto *var = dyn_cast<clang::VarDecl>(decl))
+        if (var->getName() == "__ToDo" && var->getInit())
+          if (const auto *call = dyn_cast<clang::CallExpr>(var->getInit()->IgnoreImpCasts()))
+            atomic = call->getDirectCallee() && call->getDirectCallee()->getName() == "__iCliRetVal";
+    if (!atomic)
+      return;
+    SourceManager &SM = Context->getSourceManager();
+    SourceLocation begin = SM.getExpansionLoc(loop->getBeginLoc());
+    if (body->size() == 1 && singleAccess(body->body_front())) {
+      const clang::Stmt* only = body->body_front();
+      CharSourceRange inner = statementRange(*Context, only, only);
+      Module.deferRewrite(CharSourceRange::getCharRange(begin, statementEnd(*Context, loop)), ModuleFinaliser::Peripherals,
+                          [inner](Rewriter &rewrite) { return rewrite.getRewrittenText(inner); });
+      return;
+    }
+    std::string state = stateName();
+    std::string indent = indentOf(*Context, loop);
+    Module.addImport("machine");
+    replaceConverted(Rewrite, CharSourceRange::getCharRange(begin, SM.getExpansionLoc(body->getBeginLoc())),
+                     state + " = machine.disable_irq()\n" + indent + "try: ");
+    Rewrite.InsertTextAfterToken(SM.getExpansionLoc(body->getEndLoc()),
+                                 "\n" + indent + "finally:\n" + indent + "    machine.enable_irq(" + state + ")");
+  }
 
-class sqrtHandler : public MatchFinder::MatchCallback {
-public:
-   sqrtHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // noInterrupts() is cli() and interrupts() is sei(), each one asm statement.
+  void convertPair(const clang::AsmStmt* irq) {
+    const auto *gcc = dyn_cast<clang::GCCAsmStmt>(irq);
+    StringRef instruction = gcc ? gcc->getAsmString()->getString().trim() : "";
+    if (instruction != "cli" && instruction != "sei")
+      return;
+    bool disable = instruction == "cli";
+    auto parents = Context->getParents(*irq);
+    const clang::CompoundStmt* block = parents.empty() ? nullptr : parents[0].get<clang::CompoundStmt>();
+    std::vector<const clang::Stmt*> stmts;
+    size_t index = 0;
+    if (block) {
+      stmts.assign(block->body_begin(), block->body_end());
+      index = std::find(stmts.begin(), stmts.end(), irq) - stmts.begin();
+    }
+    // The first sei after a cli in the same block closes it; the pair is converted when the cli is matched.
+    size_t other = stmts.size();
+    if (disable) {
+      for (size_t i = index + 1; i < stmts.size() && other == stmts.size(); ++i)
+        if (isInstruction(stmts[i], "cli"))
+          break;
+        else if (isInstruction(stmts[i], "sei"))
+          other = i;
+    } else {
+      for (size_t i = index; i-- > 0 && other == stmts.size();)
+        if (isInstruction(stmts[i], "sei"))
+          break;
+        else if (isInstruction(stmts[i], "cli"))
+          other = i;
+      if (other != stmts.size())
+        return;
+    }
+    Module.addImport("machine");
+    if (other == stmts.size()) {
+      defineGlobalState();
+      replaceConverted(Rewrite, statementRange(*Context, irq, irq), disable ? "_no_interrupts()" : "_interrupts()");
+      return;
+    }
+    const clang::Stmt* end = stmts[other];
+    if (other == index + 1 || (other == index + 2 && singleAccess(stmts[index + 1]))) {
+      removeConverted(Rewrite, statementRange(*Context, irq, irq));
+      removeConverted(Rewrite, statementRange(*Context, end, end));
+      return;
+    }
+    std::string state = stateName();
+    std::string indent = indentOf(*Context, irq);
+    replaceConverted(Rewrite, statementRange(*Context, irq, irq), state + " = machine.disable_irq()\n" + indent + "try:");
+    SourceManager &SM = Context->getSourceManager();
+    FileID file = SM.getFileID(SM.getExpansionLoc(irq->getBeginLoc()));
+    unsigned first = SM.getExpansionLineNumber(stmts[index + 1]->getBeginLoc());
+    unsigned last = SM.getExpansionLineNumber(stmts[other - 1]->getEndLoc());
+    for (unsigned line = first; line <= last; ++line)
+      Rewrite.InsertTextBefore(SM.translateLineCol(file, line, 1), "    ");
+    replaceConverted(Rewrite, statementRange(*Context, end, end), "finally:\n" + indent + "    machine.enable_irq(" + state + ")");
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* sqrtfinder = Results.Nodes.getNodeAs<clang::Stmt>("sqrt");
-    Rewrite.InsertText(sqrtfinder->getBeginLoc(), "math.", true, true);
+  static bool isInstruction(const clang::Stmt* stmt, StringRef instruction) {
+    const auto *gcc = dyn_cast<clang::GCCAsmStmt>(stmt);
+    return gcc && gcc->getAsmString()->getString().trim() == instruction;
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // x = y, x = constant or T x = y, where x and y fit a small int and at most one of them can be
+  // seen by an interrupt handler.
+  bool singleAccess(const clang::Stmt* stmt) {
+    const clang::Expr* value = nullptr;
+    unsigned shared = 0;
+    if (const auto *decl = dyn_cast<clang::DeclStmt>(stmt)) {
+      const auto *var = decl->isSingleDecl() ? dyn_cast<clang::VarDecl>(decl->getSingleDecl()) : nullptr;
+      if (!var || !var->getInit() || !smallInt(var->getType()) || var->hasGlobalStorage())
+        return false;
+      value = var->getInit();
+    } else if (const auto *assign = dyn_cast<clang::BinaryOperator>(stmt)) {
+      const auto *target = dyn_cast<clang::DeclRefExpr>(assign->getLHS()->IgnoreParenImpCasts());
+      const auto *var = target ? dyn_cast<clang::VarDecl>(target->getDecl()) : nullptr;
+      if (assign->getOpcode() != BO_Assign || !var || !smallInt(var->getType()))
+        return false;
+      shared += var->hasGlobalStorage();
+      value = assign->getRHS();
+    } else {
+      return false;
+    }
+    value = value->IgnoreParenImpCasts();
+    clang::Expr::EvalResult constant;
+    if (value->EvaluateAsInt(constant, *Context))
+      return true;
+    const auto *source = dyn_cast<clang::DeclRefExpr>(value);
+    const auto *var = source ? dyn_cast<clang::VarDecl>(source->getDecl()) : nullptr;
+    if (!var || !smallInt(var->getType()))
+      return false;
+    return shared + var->hasGlobalStorage() <= 1;
+  }
 
-//Handler for sin expression. converts sin to math.sin
+  // Ints of up to 30 bits are small ints on every port, so they are stored without allocating.
+  bool smallInt(QualType type) {
+    return type->isIntegralOrEnumerationType() && targetIntegerWidth(*Context, type) <= 30;
+  }
 
-class sinHandler : public MatchFinder::MatchCallback {
-public:
-   sinHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // irq_state, irq_state1, ... so nested sections each restore their own state.
+  std::string stateName() {
+    std::string name = "irq_state" + (Sections ? std::to_string(Sections) : std::string());
+    ++Sections;
+    return name;
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* sinfinder = Results.Nodes.getNodeAs<clang::Stmt>("sin");
-    Rewrite.InsertText(sinfinder->getBeginLoc(), "math.", true, true);
+  // noInterrupts() and interrupts() that don't pair up within a block keep the state at module level,
+  // starting from interrupts being on.
+  void defineGlobalState() {
+    Module.addDefinition("_IRQ_STATE", "_IRQ_STATE = [machine.disable_irq()]\n"
+                         "machine.enable_irq(_IRQ_STATE[0])\n"
+                         "def _no_interrupts():\n"
+                         "    _IRQ_STATE[0] = machine.disable_irq()\n"
+                         "def _interrupts():\n"
+                         "    machine.enable_irq(_IRQ_STATE[0])");
   }
 
-private:
   Rewriter &Rewrite;
+  ModuleFinaliser &Module;
+  ASTContext *Context = nullptr;
+  unsigned Sections = 0;
 };
 
-//Handler for cos expression. converts cos to math.cos
+//Handler for attachInterrupt() and detachInterrupt(): the function becomes a machine.Pin.irq()
+//handler, and the volatile variables it shares with the rest of the sketch are lowered so the
+//handler doesn't need the heap. A variable that fits a small int stays a module global, declared
+//global in every function that assigns it; a wider integer or a float takes a slot in a
+//preallocated array.array, and an array becomes an array.array. Whatever in a handler may still
+//allocate is reported.
 
-class cosHandler : public MatchFinder::MatchCallback {
+class interruptHandler : public MatchFinder::MatchCallback {
 public:
-   cosHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   interruptHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser, IntegerRanges &Ranges) : Rewrite(Rewrite), Module(Module), Optimiser(Optimiser), Ranges(Ranges)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* cosfinder = Results.Nodes.getNodeAs<clang::Stmt>("cos");
-    Rewrite.InsertText(cosfinder->getBeginLoc(), "math.", true, true);
+    const clang::CallExpr* interruptfinder = Results.Nodes.getNodeAs<clang::CallExpr>("interrupt");
+    Context = Results.Context;
+    bool attach = interruptfinder->getDirectCallee()->getName() == "attachInterrupt";
+    if (interruptfinder->getNumArgs() != (attach ? 3u : 1u))
+      return;
+    const clang::FunctionDecl* isr = nullptr;
+    MathOptimiser::Value mode;
+    if (attach) {
+      const clang::Expr* target = interruptfinder->getArg(1)->IgnoreParenImpCasts();
+      if (const auto *address = dyn_cast<clang::UnaryOperator>(target))
+        target = address->getSubExpr()->IgnoreParenImpCasts();
+      const auto *ref = dyn_cast<clang::DeclRefExpr>(target);
+      isr = ref ? dyn_cast<clang::FunctionDecl>(ref->getDecl()) : nullptr;
+      if (!isr || !isr->getDefinition() || !Optimiser.evaluate(interruptfinder->getArg(2), mode) || mode.IsFloat)
+        return;
+      isr = isr->getDefinition();
+      lowerShared(isr);
+    }
+
+    // digitalPinToInterrupt(p) gives back p; a bare interrupt number is one of the Uno's, 0 on pin 2 and 1 on pin 3.
+    const clang::Expr* pin = interruptfinder->getArg(0);
+    bool byNumber = true;
+    if (const auto *choice = dyn_cast<clang::ConditionalOperator>(pin->IgnoreParenImpCasts()))
+      if (const auto *test = dyn_cast<clang::BinaryOperator>(choice->getCond()->IgnoreParenImpCasts()))
+        if (test->getOpcode() == BO_EQ) {
+          pin = test->getLHS()->IgnoreParenImpCasts();
+          byNumber = false;
+        }
+    MathOptimiser::Value number;
+    bool constant = Optimiser.evaluateOrInitial(pin, number) && !number.IsFloat;
+    std::string fixedPin = !constant ? "" : std::to_string(byNumber && (number.Int == 0 || number.Int == 1) ? number.Int + 2 : number.Int);
+
+    // The modes are LOW, CHANGE, FALLING and RISING, 0 to 3.
+    std::string trigger;
+    if (attach)
+      trigger = mode.Int == 3 ? "machine.Pin.IRQ_RISING" : mode.Int == 2 ? "machine.Pin.IRQ_FALLING" :
+                mode.Int == 1 ? "machine.Pin.IRQ_RISING | machine.Pin.IRQ_FALLING" : "machine.Pin.IRQ_LOW_LEVEL";
+    Module.addImport("machine");
+    Module.deferRewrite(Optimiser.getFileRange(interruptfinder), ModuleFinaliser::Peripherals, [this, pin, fixedPin, isr, trigger](Rewriter &rewrite) {
+      std::string object = "machine.Pin(" + (fixedPin.empty() ? rewrite.getRewrittenText(Optimiser.getFileRange(pin)) : fixedPin) + ")";
+      if (!isr)
+        return object + ".irq(None)";
+      // MicroPython passes the pin to the handler; the Arduino function takes nothing.
+      std::string name = isr->getNameAsString();
+      Module.addDefinition("_isr_" + name, "def _isr_" + name + "(pin):\n    " + name + "()");
+      return object + ".irq(_isr_" + name + ", " + trigger + (Hard.count(isr) ? ", hard=True" : "") + ")";
+    });
   }
 
 private:
-  Rewriter &Rewrite;
-};
-
-//Handler for tan expression. converts tan to math.tan
+  enum Lowering { Global, Slot, Array, Unlowered };
+
+  void lowerShared(const clang::FunctionDecl* isr) {
+    if (!Analysed.insert(isr).second)
+      return;
+    indexReferences();
+    Module.addImport("micropython");
+    Module.addDefinition("_EMERGENCY_EXCEPTION_BUF", "micropython.alloc_emergency_exception_buf(100)");
+    std::set<const clang::FunctionDecl*> visited{isr};
+    std::set<const clang::VarDecl*> shared;
+    Findings.clear();
+    inspect(isr->getBody(), visited, shared);
+    for (const clang::VarDecl* var : shared)
+      if (lower(var) == Unlowered)
+        report(var->getLocation(), var->getName().str() + " can't be kept in a preallocated container");
+    // Only a handler that can't allocate may run as a hard interrupt, as it does on the board; any
+    // other one is scheduled to run between bytecodes.
+    if (Findings.empty()) {
+      Hard.insert(isr);
+      notes() << "isr: " << isr->getName() << "() runs without allocating, as a hard interrupt\n";
+    }
+    for (const std::string &finding : Findings)
+      notes() << "isr: " << isr->getName() << "(): " << finding << "\n";
+    if (!Findings.empty())
+      notes() << "isr: " << isr->getName() << "() runs as a soft interrupt, scheduled after the interrupt returns\n";
+  }
 
-class tanHandler : public MatchFinder::MatchCallback {
-public:
-   tanHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // Walks a handler and the sketch functions it calls for the volatile globals they use and for
+  // anything that may allocate.
+  void inspect(const clang::Stmt* stmt, std::set<const clang::FunctionDecl*> &visited, std::set<const clang::VarDecl*> &shared) {
+    if (!stmt)
+      return;
+    SourceLocation loc = stmt->getBeginLoc();
+    if (const auto *ref = dyn_cast<clang::DeclRefExpr>(stmt)) {
+      const auto *var = dyn_cast<clang::VarDecl>(ref->getDecl());
+      if (var && var->hasGlobalStorage() && isMainFile(var) && Context->getBaseElementType(var->getType()).isVolatileQualified())
+        shared.insert(var->getCanonicalDecl());
+    } else if (isa<clang::BinaryOperator>(stmt) || isa<clang::UnaryOperator>(stmt)) {
+      const auto *expr = cast<clang::Expr>(stmt);
+      bool arithmetic = false;
+      if (const auto *binary = dyn_cast<clang::BinaryOperator>(stmt))
+        arithmetic = binary->isAdditiveOp() || binary->isMultiplicativeOp() || binary->isShiftOp() || binary->isCompoundAssignmentOp();
+      else
+        arithmetic = cast<clang::UnaryOperator>(stmt)->isIncrementDecrementOp() || cast<clang::UnaryOperator>(stmt)->getOpcode() == UO_Minus;
+      if (arithmetic && expr->getType()->isRealFloatingType())
+        report(loc, "float arithmetic allocates a float");
+      else if (arithmetic && expr->getType()->isIntegerType() && !Ranges.range(expr).within(IntegerRanges::Range::of(-(1 << 30), (1 << 30) - 1)))
+        report(loc, "the result may not fit a small int and allocate a long int");
+    } else if (const auto *conversion = dyn_cast<clang::ImplicitCastExpr>(stmt)) {
+      if (conversion->getCastKind() == CK_IntegralToFloating)
+        report(loc, "converting to float allocates a float");
+    } else if (const auto *call = dyn_cast<clang::CallExpr>(stmt)) {
+      const clang::FunctionDecl* callee = call->getDirectCallee();
+      const clang::FunctionDecl* body = callee ? callee->getDefinition() : nullptr;
+      if (body && isMainFile(body)) {
+        if (visited.insert(body).second)
+          inspect(body->getBody(), visited, shared);
+      } else if (!callee || isa<clang::CXXMethodDecl>(callee) || !isAllocationFree(callee->getName())) {
+        report(loc, "calls " + (callee ? callee->getNameAsString() : std::string("a function")) + "(), which may allocate");
+      }
+    } else if (isa<clang::CXXConstructExpr>(stmt) || isa<clang::CXXNewExpr>(stmt)) {
+      report(loc, "creates an object");
+    }
+    for (const clang::Stmt* child : stmt->children())
+      inspect(child, visited, shared);
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* tanfinder = Results.Nodes.getNodeAs<clang::Stmt>("tan");
-    Rewrite.InsertText(tanfinder->getBeginLoc(), "math.", true, true);
+  // Core functions whose conversion reads or writes a peripheral without making new objects.
+  static bool isAllocationFree(StringRef name) {
+    static const std::set<std::string> Names = {
+        "digitalRead", "digitalWrite", "analogRead", "analogWrite", "micros", "millis", "delayMicroseconds",
+        "bitRead", "bitSet", "bitClear", "bitToggle", "bitWrite", "bit", "lowByte", "highByte",
+        "min", "max", "abs", "constrain", "sq"};
+    return Names.count(name.str()) != 0;
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // Where the finding is in the sketch: a joined .ino sketch's #line directives map it back to its tab.
+  void report(SourceLocation loc, const std::string &message) {
+    SourceManager &SM = Context->getSourceManager();
+    PresumedLoc where = SM.getPresumedLoc(SM.getExpansionLoc(loc));
+    if (where.isInvalid())
+      return;
+    std::string finding = llvm::sys::path::filename(where.getFilename()).str() + " line " + std::to_string(where.getLine()) + ": " + message;
+    if (std::find(Findings.begin(), Findings.end(), finding) == Findings.end())
+      Findings.push_back(finding);
+  }
 
-//Handler for delay() function: delay() is rewritten as time.sleep_ms
+  bool isMainFile(const clang::Decl* decl) {
+    SourceManager &SM = Context->getSourceManager();
+    return SM.isInMainFile(SM.getExpansionLoc(decl->getLocation()));
+  }
 
-class delayMicrosecondsHandler : public MatchFinder::MatchCallback {
-public:
-   delayMicrosecondsHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  Lowering lower(const clang::VarDecl* var) {
+    auto found = Lowered.find(var);
+    if (found != Lowered.end())
+      return found->second;
+    Lowering &lowering = Lowered[var];
+    lowering = Unlowered;
+    QualType type = var->getType();
+    if (const auto *array = Context->getAsConstantArrayType(type)) {
+      char code = typeCode(array->getElementType());
+      if (code && lowerArray(var, code, array->getSize().getZExtValue()))
+        lowering = Array;
+    } else if (type->isIntegralOrEnumerationType() && targetIntegerWidth(*Context, type) <= 30) {
+      lowering = Global;
+      for (const Reference &reference : References[var])
+        if (reference.Write)
+          declareGlobal(reference.Function, var->getNameAsString());
+    } else if (char code = typeCode(type)) {
+      if (lowerSlot(var, code))
+        lowering = Slot;
+    }
+    return lowering;
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* delayMicrosecondsfinder = Results.Nodes.getNodeAs<clang::CallExpr>("delayMicroseconds");
-    Rewrite.ReplaceText(delayMicrosecondsfinder->getBeginLoc(), "utime.sleep_us");
+  // The array.array type code for what the variable holds on the board. 32 bits are 'i'/'I', whose
+  // items are 4 bytes on every port, where 'l'/'L' follow the port's C long.
+  char typeCode(QualType type) {
+    type = type.getCanonicalType();
+    if (type->isRealFloatingType())
+      return TargetIntWidth == 32 && Context->getTypeSize(type) == 64 ? 'd' : 'f';
+    if (!type->isIntegralOrEnumerationType())
+      return 0;
+    bool isSigned = type->isSignedIntegerOrEnumerationType();
+    switch (targetIntegerWidth(*Context, type)) {
+    case 8: return isSigned ? 'b' : 'B';
+    case 16: return isSigned ? 'h' : 'H';
+    case 32: return isSigned ? 'i' : 'I';
+    case 64: return isSigned ? 'q' : 'Q';
+    }
+    return 0;
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // The declaration with its ';', when it declares nothing else.
+  CharSourceRange declarationRange(const clang::VarDecl* var) {
+    SourceManager &SM = Context->getSourceManager();
+    SourceLocation end = Lexer::findLocationAfterToken(SM.getExpansionLoc(var->getEndLoc()), tok::semi, SM, Context->getLangOpts(), false);
+    if (end.isInvalid())
+      return CharSourceRange();
+    return CharSourceRange::getCharRange(SM.getExpansionLoc(var->getBeginLoc()), end);
+  }
 
-//Handler for delay() function: delay() is rewritten as time.sleep_ms
+  // Bytes per item of an array.array with the given type code.
+  static size_t itemSize(char code) {
+    switch (code) {
+    case 'b':
+    case 'B':
+      return 1;
+    case 'h':
+    case 'H':
+      return 2;
+    case 'q':
+    case 'Q':
+    case 'd':
+      return 8;
+    default:
+      return 4;
+    }
+  }
 
-class millisHandler : public MatchFinder::MatchCallback {
-public:
-   millisHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  bool lowerArray(const clang::VarDecl* var, char code, uint64_t size) {
+    CharSourceRange range = declarationRange(var);
+    if (range.isInvalid())
+      return false;
+    std::string values = "[0] * " + std::to_string(size);
+    if (const auto *list = dyn_cast_or_null<clang::InitListExpr>(var->getInit())) {
+      values = "[";
+      for (uint64_t i = 0; i < size; ++i) {
+        MathOptimiser::Value value;
+        if (i < list->getNumInits() && (!Optimiser.evaluate(list->getInit(i), value)))
+          return false;
+        values += (i ? ", " : "") + (i < list->getNumInits() ? MathOptimiser::formatValue(value) : std::string(code == 'f' || code == 'd' ? "0.0" : "0"));
+      }
+      values += "]";
+    }
+    Module.addImport("array");
+    Module.addBuffer(var->getNameAsString(), size * itemSize(code));
+    replaceConverted(Rewrite, range, var->getNameAsString() + " = array.array('" + std::string(1, code) + "', " + values + ")");
+    return true;
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* millisfinder = Results.Nodes.getNodeAs<clang::CallExpr>("millis");
-    Rewrite.ReplaceText(millisfinder->getBeginLoc(), "utime.ticks_ms");
+  bool lowerSlot(const clang::VarDecl* var, char code) {
+    CharSourceRange range = declarationRange(var);
+    MathOptimiser::Value initial;
+    if (range.isInvalid() || (var->getInit() && !Optimiser.evaluate(var->getInit(), initial)))
+      return false;
+    static const std::map<char, std::string> Suffixes = {{'i', "INT32"}, {'I', "UINT32"}, {'q', "INT64"},
+                                                         {'Q', "UINT64"}, {'f', "FLOAT"}, {'d', "DOUBLE"}};
+    std::string name = "_ISR_" + Suffixes.at(code);
+    std::vector<std::string> &values = SlotValues[code];
+    std::string slot = name + "[" + std::to_string(values.size()) + "]";
+    values.push_back(var->getInit() ? MathOptimiser::formatValue(initial) : code == 'f' || code == 'd' ? "0.0" : "0");
+    std::string list;
+    for (const std::string &value : values)
+      list += (list.empty() ? "" : ", ") + value;
+    Module.addImport("array");
+    Module.replaceDefinition(name, name + " = array.array('" + std::string(1, code) + "', [" + list + "])");
+    Module.addBuffer(name, values.size() * itemSize(code));
+    removeConverted(Rewrite, range);
+    for (const Reference &reference : References[var])
+      Rewrite.ReplaceText(Optimiser.getFileRange(reference.Ref), slot);
+    return true;
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // Adds the name to the global statement at the top of the function's body.
+  void declareGlobal(const clang::FunctionDecl* function, const std::string &name) {
+    std::set<std::string> &names = Globals[function];
+    bool first = names.empty();
+    names.insert(name);
+    const auto *body = dyn_cast_or_null<clang::CompoundStmt>(function->getBody());
+    if (!first || !body)
+      return;
+    SourceManager &SM = Context->getSourceManager();
+    SourceLocation start = Lexer::getLocForEndOfToken(SM.getExpansionLoc(body->getLBracLoc()), 0, SM, Context->getLangOpts());
+    std::string indent = body->body_empty() ? Lexer::getIndentationForLine(SM.getExpansionLoc(function->getBeginLoc()), SM).str() + "    "
+                                            : indentOf(*Context, body->body_front());
+    Module.deferRewrite(CharSourceRange::getCharRange(start, start), ModuleFinaliser::Peripherals, [this, function, indent](Rewriter &) {
+      std::string list;
+      for (const std::string &name : Globals[function])
+        list += (list.empty() ? "" : ", ") + name;
+      return "\n" + indent + "global " + list;
+    });
+  }
 
-//Handler for delay() function: delay() is rewritten as time.sleep_ms
+  struct Reference {
+    const clang::DeclRefExpr* Ref;
+    const clang::FunctionDecl* Function;
+    bool Write;
+  };
+
+  // Every use of a global in the functions of the sketch, and whether it assigns the variable.
+  void indexReferences() {
+    if (Indexed)
+      return;
+    Indexed = true;
+    for (const clang::Decl* decl : Context->getTranslationUnitDecl()->decls())
+      if (const auto *function = dyn_cast<clang::FunctionDecl>(decl))
+        if (function->doesThisDeclarationHaveABody() && isMainFile(function))
+          collect(function->getBody(), function);
+  }
 
-class microsHandler : public MatchFinder::MatchCallback {
-public:
-   microsHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  void collect(const clang::Stmt* stmt, const clang::FunctionDecl* function) {
+    if (!stmt)
+      return;
+    if (const auto *ref = dyn_cast<clang::DeclRefExpr>(stmt))
+      if (const auto *var = dyn_cast<clang::VarDecl>(ref->getDecl()))
+        if (var->hasGlobalStorage())
+          References[var->getCanonicalDecl()].push_back({ref, function, isAssigned(ref)});
+    for (const clang::Stmt* child : stmt->children())
+      collect(child, function);
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* microsfinder = Results.Nodes.getNodeAs<clang::CallExpr>("micros");
-    Rewrite.ReplaceText(microsfinder->getBeginLoc(), "utime.ticks_us");
+  bool isAssigned(const clang::DeclRefExpr* ref) {
+    const clang::Expr* target = Optimiser.climbCasts(ref);
+    auto parents = Context->getParents(*target);
+    if (parents.empty())
+      return false;
+    if (const auto *binary = parents[0].get<clang::BinaryOperator>())
+      return binary->isAssignmentOp() && binary->getLHS() == target;
+    if (const auto *unary = parents[0].get<clang::UnaryOperator>())
+      return unary->isIncrementDecrementOp();
+    return false;
   }
 
-private:
   Rewriter &Rewrite;
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+  IntegerRanges &Ranges;
+  ASTContext *Context = nullptr;
+  bool Indexed = false;
+  std::set<const clang::FunctionDecl*> Analysed;
+  // Handlers with nothing that may allocate, which are registered with hard=True.
+  std::set<const clang::FunctionDecl*> Hard;
+  std::vector<std::string> Findings;
+  std::map<const clang::VarDecl*, Lowering> Lowered;
+  std::map<const clang::VarDecl*, std::vector<Reference>> References;
+  std::map<char, std::vector<std::string>> SlotValues;
+  std::map<const clang::FunctionDecl*, std::set<std::string>> Globals;
 };
 
-//Handler for delay() function: delay() is rewritten as time.sleep_ms
+//Handler for pulseIn() function: pulseIn() is rewritten as machine.time_pulse_us, or reads a pulse captured by a pin interrupt with --pulse-capture
 
 class pulseInHandler : public MatchFinder::MatchCallback {
 public:
-   pulseInHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   pulseInHandler(ModuleFinaliser &Module, MathOptimiser &Optimiser) : Module(Module), Optimiser(Optimiser)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* pulseInfinder = Results.Nodes.getNodeAs<clang::CallExpr>("pulseIn");
-    Rewrite.ReplaceText(pulseInfinder->getBeginLoc(), "machine.time_pulse_us");
+    if (pulseInfinder->getNumArgs() < 2)
+      return;
+    // pulseIn(pin, state) fills in the default timeout of one second, which is time_pulse_us's default too.
+    const clang::Expr* timeout = nullptr;
+    if (pulseInfinder->getNumArgs() == 3 && !isa<clang::CXXDefaultArgExpr>(pulseInfinder->getArg(2)))
+      timeout = pulseInfinder->getArg(2);
+    MathOptimiser::Value pin, state, limit;
+    bool constantPin = Optimiser.evaluateOrInitial(pulseInfinder->getArg(0), pin) && !pin.IsFloat;
+    bool constantState = Optimiser.evaluateOrInitial(pulseInfinder->getArg(1), state) && !state.IsFloat;
+    bool constantTimeout = !timeout || (Optimiser.evaluateOrInitial(timeout, limit) && !limit.IsFloat);
+    Module.addImport("machine");
+    if (PulseCapture && constantPin && constantState && constantTimeout) {
+      std::string capture = defineCapture(pin.Int, state.Int != 0, timeout ? limit.Int : 1000000);
+      Module.deferRewrite(Optimiser.getFileRange(pulseInfinder), ModuleFinaliser::Peripherals, [capture](Rewriter &) {
+        return capture + ".read()";
+      });
+      return;
+    }
+    Module.deferRewrite(Optimiser.getFileRange(pulseInfinder), ModuleFinaliser::Peripherals,
+                        [this, pulseInfinder, timeout, pin, state, constantPin, constantState](Rewriter &Rewrite) {
+      std::string pinObject = constantPin ? inputPin(pin.Int) : "machine.Pin(" + text(Rewrite, pulseInfinder->getArg(0)) + ", machine.Pin.IN)";
+      std::string level = constantState ? std::to_string(state.Int != 0) : text(Rewrite, pulseInfinder->getArg(1));
+      // time_pulse_us returns -2 or -1 on a timeout where pulseIn returns 0.
+      return "max(machine.time_pulse_us(" + pinObject + ", " + level + (timeout ? ", " + text(Rewrite, timeout) : "") + "), 0)";
+    });
   }
 
 private:
-  Rewriter &Rewrite;
+  std::string inputPin(int64_t number) {
+    std::string name = "_PULSE_PIN" + std::to_string(number);
+    Module.addDefinition(name, name + " = machine.Pin(" + std::to_string(number) + ", machine.Pin.IN)");
+    return name;
+  }
+
+  // A pin whose pulses are timed by an edge interrupt. The interrupt keeps only the newest pulse
+  // that ended, and read() takes it, so the loop gets the latest measurement instead of blocking
+  // until one is over or working through a backlog of stale ones.
+  std::string defineCapture(int64_t number, bool high, int64_t timeout) {
+    Module.addImport("utime");
+    Module.addDefinition("_PulseCapture", "class _PulseCapture:\n"
+                         "    def __init__(self, pin, level, timeout):\n"
+                         "        self._level = level\n"
+                         "        self._timeout = timeout\n"
+                         "        self._start = None\n"
+                         "        self._width = 0\n"
+                         "        self._pin = machine.Pin(pin, machine.Pin.IN)\n"
+                         "        self._pin.irq(self._edge, machine.Pin.IRQ_RISING | machine.Pin.IRQ_FALLING)\n"
+                         "    def _edge(self, pin):\n"
+                         "        now = utime.ticks_us()\n"
+                         "        if pin.value() == self._level:\n"
+                         "            self._start = now\n"
+                         "        elif self._start is not None:\n"
+                         "            width = utime.ticks_diff(now, self._start)\n"
+                         "            self._start = None\n"
+                         "            if width <= self._timeout:\n"
+                         "                self._width = width\n"
+                         "    def read(self):\n"
+                         "        state = machine.disable_irq()\n"
+                         "        width = self._width\n"
+                         "        self._width = 0\n"
+                         "        machine.enable_irq(state)\n"
+                         "        return width");
+    std::string name = "_PULSE" + std::to_string(number) + (high ? "_HIGH" : "_LOW");
+    if (timeout != 1000000)
+      name += "_" + std::to_string(timeout);
+    Module.addDefinition(name, name + " = _PulseCapture(" + std::to_string(number) + ", " + std::to_string(high) + ", " + std::to_string(timeout) + ")");
+    return name;
+  }
+
+  std::string text(Rewriter &Rewrite, const clang::Expr* expr) {
+    return Rewrite.getRewrittenText(Optimiser.getFileRange(expr));
+  }
+
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
 };
 
 //Handler for PinMode Pin. converts pin number  to p<pinNumber>
 
 class pinModePinHandler : public MatchFinder::MatchCallback {
 public:
-   pinModePinHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   pinModePinHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::Stmt* pinModePinfinder = Results.Nodes.getNodeAs<clang::Stmt>("pinModePin");
-    Rewrite.InsertText(pinModePinfinder->getBeginLoc(), "p", true, true);
+    Edits.insertBefore(Results, pinModePinfinder->getBeginLoc(), "p");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
 };
 //Handler for INPUT keyword converts to IN
 
 class inputHandler : public MatchFinder::MatchCallback {
 public:
-   inputHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   inputHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::Stmt* inputfinder = Results.Nodes.getNodeAs<clang::Stmt>("INPUT");
-        Rewrite.ReplaceText(inputfinder->getBeginLoc(), "IN");
+        Edits.replaceToken(Results, inputfinder->getBeginLoc(), "IN");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
 };
  //Handler for OUTPUT keyword converts to OUT
 
 class outputHandler : public MatchFinder::MatchCallback {
 public:
-   outputHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   outputHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::Stmt* outputfinder = Results.Nodes.getNodeAs<clang::Stmt>("OUTPUT");
-    Rewrite.ReplaceText(outputfinder->getBeginLoc(), "OUT");
+    Edits.replaceToken(Results, outputfinder->getBeginLoc(), "OUT");
 
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
 };
 //Handler for INPUT_PULLUP keyword converts to PULL_UP
 
 class inputpullupHandler : public MatchFinder::MatchCallback {
 public:
-   inputpullupHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   inputpullupHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::Stmt* inputpullupfinder = Results.Nodes.getNodeAs<clang::Stmt>("INPUT_PULLUP");
-    Rewrite.ReplaceText(inputpullupfinder->getBeginLoc(), "PULL_UP");
+    Edits.replaceToken(Results, inputpullupfinder->getBeginLoc(), "PULL_UP");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
  
 };
 
@@ -350,382 +5526,1382 @@ private:
 
 class isAlphaHandler : public MatchFinder::MatchCallback {
 public:
-   isAlphaHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isAlphaHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* isAlphafinder = Results.Nodes.getNodeAs<clang::CallExpr>("isAlpha");
-    Rewrite.ReplaceText(isAlphafinder->getBeginLoc(), "ure.match");
-    Rewrite.InsertText(isAlphafinder->getBeginLoc(), "#import ure at start of code\n", true, true);
-
+    Edits.replaceToken(Results, isAlphafinder->getBeginLoc(), "ure.match");
+    Module.addImport("ure");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
 };
 
 //Handler for variable in isAlpha function: regex is inserted
 
 class isAlphaVarHandler : public MatchFinder::MatchCallback {
 public:
-   isAlphaVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isAlphaVarHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::DeclRefExpr* isAlphaVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isAlphaVar");
-    Rewrite.InsertText(isAlphaVarfinder->getBeginLoc(), "'[A-Za-z]', ");
+    Edits.insertBefore(Results, isAlphaVarfinder->getBeginLoc(), "'[A-Za-z]', ");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
 };
 
 //Handler for isAlphaNumeric function: rewritten as ure.match()
 
 class isAlphaNumericHandler : public MatchFinder::MatchCallback {
 public:
-   isAlphaNumericHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isAlphaNumericHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* isAlphaNumericfinder = Results.Nodes.getNodeAs<clang::CallExpr>("isAlphaNumeric");
-    Rewrite.ReplaceText(isAlphaNumericfinder->getBeginLoc(), "ure.match");
-    Rewrite.InsertText(isAlphaNumericfinder->getBeginLoc(), "#import ure at start of code\n", true, true);
-
+    Edits.replaceToken(Results, isAlphaNumericfinder->getBeginLoc(), "ure.match");
+    Module.addImport("ure");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
 };
 
 //Handler for variable in isAlphaNumeric function: regex is inserted
 
 class isAlphaNumericVarHandler : public MatchFinder::MatchCallback {
 public:
-   isAlphaNumericVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isAlphaNumericVarHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::DeclRefExpr* isAlphaNumericVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isAlphaNumericVar");
-    Rewrite.InsertText(isAlphaNumericVarfinder->getBeginLoc(), "'[A-Za-z0-9]', ");
+    Edits.insertBefore(Results, isAlphaNumericVarfinder->getBeginLoc(), "'[A-Za-z0-9]', ");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
 };
 
 //Handler for isAscii function: isAscii is rewritten as ure.match()
 
 class isAsciiHandler : public MatchFinder::MatchCallback {
 public:
-   isAsciiHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isAsciiHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* isAsciifinder = Results.Nodes.getNodeAs<clang::CallExpr>("isAscii");
-    Rewrite.ReplaceText(isAsciifinder->getBeginLoc(), "ure.match");
-    Rewrite.InsertText(isAsciifinder->getBeginLoc(), "#import ure at start of code\n", true, true);
-
+    Edits.replaceToken(Results, isAsciifinder->getBeginLoc(), "ure.match");
+    Module.addImport("ure");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
 };
 
 //Handler for variable in isAscii function: regex is inserted.
 
 class isAsciiVarHandler : public MatchFinder::MatchCallback {
 public:
-   isAsciiVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isAsciiVarHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::DeclRefExpr* isAsciiVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isAsciiVar");
-    Rewrite.InsertText(isAsciiVarfinder->getBeginLoc(), "'\\w\\W' ");
+    Edits.insertBefore(Results, isAsciiVarfinder->getBeginLoc(), "'\\w\\W' ");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
 };
 
 //Handler for isDigit function: isDigit is rewritten as ure.match()
 
 class isDigitHandler : public MatchFinder::MatchCallback {
 public:
-   isDigitHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isDigitHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* isDigitfinder = Results.Nodes.getNodeAs<clang::CallExpr>("isDigit");
-    Rewrite.ReplaceText(isDigitfinder->getBeginLoc(), "ure.match");
-    Rewrite.InsertText(isDigitfinder->getBeginLoc(), "#import ure at start of code\n", true, true);
-
+    Edits.replaceToken(Results, isDigitfinder->getBeginLoc(), "ure.match");
+    Module.addImport("ure");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
 };
 
 //Handler for variable in isDigit function: regex is inserted.
 
 class isDigitVarHandler : public MatchFinder::MatchCallback {
 public:
-   isDigitVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isDigitVarHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::DeclRefExpr* isDigitVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isDigitVar");
-    Rewrite.InsertText(isDigitVarfinder->getBeginLoc(), "'\\d' ");
+    Edits.insertBefore(Results, isDigitVarfinder->getBeginLoc(), "'\\d' ");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
 };
 
 //Handler for isLowerCase function: isLowerCase is rewritten as ure.match()
 
 class isLowerCaseHandler : public MatchFinder::MatchCallback {
 public:
-   isLowerCaseHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isLowerCaseHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* isLowerCasefinder = Results.Nodes.getNodeAs<clang::CallExpr>("isLowerCase");
-    Rewrite.ReplaceText(isLowerCasefinder->getBeginLoc(), "ure.match");
-    Rewrite.InsertText(isLowerCasefinder->getBeginLoc(), "#import ure at start of code\n", true, true);
-
+    Edits.replaceToken(Results, isLowerCasefinder->getBeginLoc(), "ure.match");
+    Module.addImport("ure");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
 };
 
 //Handler for variable in isLowerCase function: regex is inserted.
 
 class isLowerCaseVarHandler : public MatchFinder::MatchCallback {
 public:
-   isLowerCaseVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isLowerCaseVarHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::DeclRefExpr* isLowerCaseVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isLowerCaseVar");
-    Rewrite.InsertText(isLowerCaseVarfinder->getBeginLoc(), "'[a-z]', ");
+    Edits.insertBefore(Results, isLowerCaseVarfinder->getBeginLoc(), "'[a-z]', ");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
 };
 
 //Handler for isPunct function: isPunct is rewritten as ure.match
 
 class isPunctHandler : public MatchFinder::MatchCallback {
 public:
-   isPunctHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isPunctHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* isPunctfinder = Results.Nodes.getNodeAs<clang::CallExpr>("isPunct");
-    Rewrite.ReplaceText(isPunctfinder->getBeginLoc(), "ure.match");
-    Rewrite.InsertText(isPunctfinder->getBeginLoc(), "#import ure at start of code\n", true, true);
-
+    Edits.replaceToken(Results, isPunctfinder->getBeginLoc(), "ure.match");
+    Module.addImport("ure");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
 };
 
 //Handler for variable in isPunct function: regex is inserted.
 
 class isPunctVarHandler : public MatchFinder::MatchCallback {
 public:
-   isPunctVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isPunctVarHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::DeclRefExpr* isPunctVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isPunctVar");
-    Rewrite.InsertText(isPunctVarfinder->getBeginLoc(), "'\\W' ");
+    Edits.insertBefore(Results, isPunctVarfinder->getBeginLoc(), "'\\W' ");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
 };
 
 //Handler for isSpace function: isSpace is rewritten as ure.match
 
 class isSpaceHandler : public MatchFinder::MatchCallback {
 public:
-   isSpaceHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isSpaceHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* isSpacefinder = Results.Nodes.getNodeAs<clang::CallExpr>("isSpace");
-    Rewrite.ReplaceText(isSpacefinder->getBeginLoc(), "ure.match");
-    Rewrite.InsertText(isSpacefinder->getBeginLoc(), "#import ure at start of code\n", true, true);
-
+    Edits.replaceToken(Results, isSpacefinder->getBeginLoc(), "ure.match");
+    Module.addImport("ure");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
 };
 
 //Handler for variable in isSpace function: regex is inserted.
 
 class isSpaceVarHandler : public MatchFinder::MatchCallback {
 public:
-   isSpaceVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isSpaceVarHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::DeclRefExpr* isSpaceVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isSpaceVar");
-    Rewrite.InsertText(isSpaceVarfinder->getBeginLoc(), "'\\f\\n\\r\\t\\v\\s', ");
+    Edits.insertBefore(Results, isSpaceVarfinder->getBeginLoc(), "'\\f\\n\\r\\t\\v\\s', ");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
 };
 
 //Handler for isUpperCase function: isUpperCase is rewritten as ure.match
 
 class isUpperCaseHandler : public MatchFinder::MatchCallback {
 public:
-   isUpperCaseHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isUpperCaseHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* isUpperCasefinder = Results.Nodes.getNodeAs<clang::CallExpr>("isUpperCase");
-    Rewrite.ReplaceText(isUpperCasefinder->getBeginLoc(), "ure.match");
-    Rewrite.InsertText(isUpperCasefinder->getBeginLoc(), "#import ure at start of code\n", true, true);
-
+    Edits.replaceToken(Results, isUpperCasefinder->getBeginLoc(), "ure.match");
+    Module.addImport("ure");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
 };
 
 //Handler for variable in isUpperCase function: regex is inserted.
 
 class isUpperCaseVarHandler : public MatchFinder::MatchCallback {
 public:
-   isUpperCaseVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isUpperCaseVarHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::DeclRefExpr* isUpperCaseVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isUpperCaseVar");
-    Rewrite.InsertText(isUpperCaseVarfinder->getBeginLoc(), "'[A-Z]', ");
+    Edits.insertBefore(Results, isUpperCaseVarfinder->getBeginLoc(), "'[A-Z]', ");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
 };
 
 //Handler for isWhitespace function: isWhitespace is rewritten as ure.match
 
 class isWhitespaceHandler : public MatchFinder::MatchCallback {
 public:
-   isWhitespaceHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isWhitespaceHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* isWhitespacefinder = Results.Nodes.getNodeAs<clang::CallExpr>("isWhitespace");
-    Rewrite.ReplaceText(isWhitespacefinder->getBeginLoc(), "ure.match");
-    Rewrite.InsertText(isWhitespacefinder->getBeginLoc(), "#import ure at start of code\n", true, true);
-
+    Edits.replaceToken(Results, isWhitespacefinder->getBeginLoc(), "ure.match");
+    Module.addImport("ure");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
 };
 
 //Handler for variable in isWhitespace function: regex is inserted.
 
 class isWhitespaceVarHandler : public MatchFinder::MatchCallback {
 public:
-   isWhitespaceVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   isWhitespaceVarHandler(TokenEdits &Edits) : Edits(Edits)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::DeclRefExpr* isWhitespaceVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isWhitespaceVar");
-    Rewrite.InsertText(isWhitespaceVarfinder->getBeginLoc(), "'\\s\\t', ");
+    Edits.insertBefore(Results, isWhitespaceVarfinder->getBeginLoc(), "'\\s\\t', ");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
 };
 
-//Handler for analogRead function: analogRead is converted to ADC.read_u16
+//Handler for analogRead function: analogRead is converted to read_u16() on the pin's machine.ADC,
+//created once at module level. read_u16() is shifted down to the 10 bit range of analogRead().
+//A0 and up count from channel 0, as on the Uno.
 
 class analogReadHandler : public MatchFinder::MatchCallback {
 public:
-   analogReadHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   analogReadHandler(ModuleFinaliser &Module, MathOptimiser &Optimiser) : Module(Module), Optimiser(Optimiser)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* analogReadfinder = Results.Nodes.getNodeAs<clang::CallExpr>("analogRead");
-    Rewrite.ReplaceText(analogReadfinder->getBeginLoc(), "ADC.read_u16");
-    Rewrite.InsertText(analogReadfinder->getBeginLoc(), "#import machine at start of code\n", true, true);
-
+    if (analogReadfinder->getNumArgs() != 1)
+      return;
+    const TargetInfo *target = targetInfo();
+    bool channels = !target || target->AdcChannels;
+    Module.deferRewrite(Optimiser.getFileRange(analogReadfinder), ModuleFinaliser::Peripherals, [this, analogReadfinder, channels](Rewriter &Rewrite) {
+      const clang::Expr* pin = analogReadfinder->getArg(0);
+      MathOptimiser::Value value;
+      std::string adc;
+      if (Optimiser.evaluateOrInitial(pin, value) && !value.IsFloat) {
+        if (channels && value.Int >= 14)
+          value.Int -= 14;
+        adc = Module.addPinObject("ADC", MathOptimiser::formatValue(value), true, channels);
+      } else {
+        adc = Module.addPinObject("ADC", Rewrite.getRewrittenText(Optimiser.getFileRange(pin)), false, channels);
+      }
+      return "(" + adc + ".read_u16() >> 6)";
+    });
   }
 
 private:
-  Rewriter &Rewrite;
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
 };
 
-//Handler for analogRead function: analogRead is converted to machine.PWM
+//Handler for analogWrite function: analogWrite is converted to duty_u16() on the pin's machine.PWM,
+//created once at module level. The 8 bit value is shifted up to 16 bits; a constant is scaled
+//exactly so 255 is fully on.
 
 class analogWriteHandler : public MatchFinder::MatchCallback {
 public:
-   analogWriteHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   analogWriteHandler(ModuleFinaliser &Module, MathOptimiser &Optimiser, IntegerRanges &Ranges) : Module(Module), Optimiser(Optimiser), Ranges(Ranges)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* analogWritefinder = Results.Nodes.getNodeAs<clang::CallExpr>("analogWrite");
-    Rewrite.ReplaceText(analogWritefinder->getBeginLoc(), "machine.PWM");
-    Rewrite.InsertText(analogWritefinder->getBeginLoc(), "#import machine at start of code\n", true, true);
-
+    if (analogWritefinder->getNumArgs() != 2)
+      return;
+    Module.deferRewrite(Optimiser.getFileRange(analogWritefinder), ModuleFinaliser::Peripherals, [this, analogWritefinder](Rewriter &Rewrite) {
+      const clang::Expr* pin = analogWritefinder->getArg(0);
+      const clang::Expr* duty = analogWritefinder->getArg(1);
+      MathOptimiser::Value value;
+      std::string pwm;
+      if (Optimiser.evaluateOrInitial(pin, value) && !value.IsFloat)
+        pwm = Module.addPinObject("PWM", MathOptimiser::formatValue(value), true);
+      else
+        pwm = Module.addPinObject("PWM", text(Rewrite, pin), false);
+      if (Optimiser.evaluate(duty, value) && !value.IsFloat)
+        return pwm + ".duty_u16(" + std::to_string((value.Int & 0xff) * 257) + ")";
+      // A float argument is truncated on the board; fixed point code already hands over an int. The
+      // 8 bit level is scaled by 257 like a constant one, so 255 is fully on.
+      std::string level = text(Rewrite, duty);
+      const auto *cast = dyn_cast<clang::ImplicitCastExpr>(duty);
+      if (cast && cast->getCastKind() == CK_FloatingToIntegral && !Optimiser.isClaimed(cast->getSubExpr()))
+        level = "int(" + level + ")";
+      if (!Ranges.range(duty).within(IntegerRanges::Range::of(0, 255)))
+        level = IntegerRanges::wrap(level, 8, false);
+      return pwm + ".duty_u16(" + parenthesize(level) + " * 257)";
+    });
   }
 
 private:
-  Rewriter &Rewrite;
+  std::string text(Rewriter &Rewrite, const clang::Expr* expr) {
+    return Rewrite.getRewrittenText(Optimiser.getFileRange(expr));
+  }
+
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+  IntegerRanges &Ranges;
 };
 
 //Handler for digitalRead function: digitalRead is converted to Pin.value. Whether it is read or write is determined by the number of Arguments
 
 class digitalReadHandler : public MatchFinder::MatchCallback {
 public:
-   digitalReadHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   digitalReadHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* digitalReadfinder = Results.Nodes.getNodeAs<clang::CallExpr>("digitalRead");
-    Rewrite.ReplaceText(digitalReadfinder->getBeginLoc(), "Pin.value");
+    Edits.replaceToken(Results, digitalReadfinder->getBeginLoc(), "Pin.value");
+    Module.addImport("machine", "Pin");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
 };
 
 //Handler for digitalWrite function: digitalWrite is converted to Pin.value. Whether it is read or write is determined by the number of Arguments.
 
 class digitalWriteHandler : public MatchFinder::MatchCallback {
 public:
-   digitalWriteHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   digitalWriteHandler(TokenEdits &Edits, ModuleFinaliser &Module) : Edits(Edits), Module(Module)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::CallExpr* digitalWritefinder = Results.Nodes.getNodeAs<clang::CallExpr>("digitalWrite");
-    Rewrite.ReplaceText(digitalWritefinder->getBeginLoc(), "Pin.value");
+    Edits.replaceToken(Results, digitalWritefinder->getBeginLoc(), "Pin.value");
+    Module.addImport("machine", "Pin");
   }
 
 private:
-  Rewriter &Rewrite;
+  TokenEdits &Edits;
+  ModuleFinaliser &Module;
 };
 
 //Handler for the constant Pi. Pi is converted to math.pi
 
 class piHandler : public MatchFinder::MatchCallback {
 public:
-   piHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+   piHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser) : Rewrite(Rewrite), Module(Module), Optimiser(Optimiser)  {}
 
 virtual void run(const MatchFinder::MatchResult &Results) {
     const clang::DeclRefExpr* pifinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("PI");
+    if (Optimiser.isOptimised(pifinder))
+      return;
     Rewrite.ReplaceText(pifinder->getBeginLoc(), "math.pi");
+    Module.addImport("math");
+  }
+
+private:
+  Rewriter &Rewrite;
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+};
+
+//Handler for the constant e. e is converted to math.e
+
+class eulerHandler : public MatchFinder::MatchCallback {
+public:
+   eulerHandler(Rewriter &Rewrite, ModuleFinaliser &Module, MathOptimiser &Optimiser) : Rewrite(Rewrite), Module(Module), Optimiser(Optimiser)  {}
+
+virtual void run(const MatchFinder::MatchResult &Results) {
+    const clang::DeclRefExpr* eulerfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("EULER");
+    if (Optimiser.isOptimised(eulerfinder))
+      return;
+    Rewrite.ReplaceText(eulerfinder->getBeginLoc(), "math.e");
+    Module.addImport("math");
+  }
+
+private:
+  Rewriter &Rewrite;
+  ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
+};
+
+//FootprintEstimator Class: Estimates the RAM the converted module needs on a 32 bit port, to catch
+//a MemoryError before the sketch reaches a board: the module globals, the buffers handlers
+//preallocate, the string constants, and what each function allocates every time it runs (floats,
+//long ints, String objects, local arrays, calls that may allocate). Objects are rounded up to the
+//16 byte blocks the MicroPython heap hands out. Bytecode is not counted.
+
+class FootprintEstimator {
+public:
+  FootprintEstimator(ModuleFinaliser &Module, IntegerRanges &Ranges) : Module(Module), Ranges(Ranges) {}
+
+  // Prints the report to OS and returns the bytes loop() needs: what the module keeps plus one pass
+  // through loop() and what it calls.
+  size_t estimate(ASTContext &Ctx, llvm::raw_ostream &OS) {
+    Context = &Ctx;
+    SourceManager &SM = Ctx.getSourceManager();
+    const FunctionDecl *Loop = nullptr;
+    std::vector<const FunctionDecl *> Functions;
+    unsigned Globals = 0;
+    size_t GlobalBytes = 0;
+    for (const Decl *D : Ctx.getTranslationUnitDecl()->decls()) {
+      if (!SM.isInMainFile(SM.getExpansionLoc(D->getLocation())))
+        continue;
+      if (const auto *FD = dyn_cast<FunctionDecl>(D)) {
+        if (!FD->doesThisDeclarationHaveABody())
+          continue;
+        Functions.push_back(FD);
+        if (FD->getNameAsString() == "loop" && FD->getNumParams() == 0)
+          Loop = FD;
+      } else if (const auto *VD = dyn_cast<VarDecl>(D)) {
+        if (!VD->isFileVarDecl() || !VD->isReferenced())
+          continue;
+        ++Globals;
+        // Each global is a slot in the module's dict, plus its object unless it is a small int.
+        GlobalBytes += 8 + valueBytes(VD, VD->getType());
+      }
+    }
+    OS << "footprint: " << Globals << " globals, " << GlobalBytes << " bytes\n";
+
+    unsigned Definitions = 0;
+    size_t DefinitionBytes = 0;
+    for (const std::string &Definition : Module.definitions())
+      DefinitionBytes += definitionBytes(Definition, Definitions);
+    OS << "footprint: " << Definitions << " converter definitions (helpers, classes, peripheral objects), "
+       << DefinitionBytes << " bytes\n";
+
+    size_t BufferBytes = 0;
+    for (const auto &Buffer : Module.buffers())
+      BufferBytes += 16 + blocks(Buffer.second);
+    OS << "footprint: " << Module.buffers().size() << " preallocated buffers, " << BufferBytes << " bytes\n";
+
+    StringCollector Strings;
+    for (const FunctionDecl *FD : Functions)
+      Strings.TraverseDecl(const_cast<FunctionDecl *>(FD));
+    size_t StringBytes = 0;
+    for (const std::string &Text : Strings.Texts)
+      StringBytes += Text.size() + 4;
+    OS << "footprint: " << Strings.Texts.size() << " string constants, " << StringBytes << " bytes\n";
+
+    std::set<const FunctionDecl *> PerPass;
+    if (Loop)
+      reach(Loop, PerPass);
+    size_t PassBytes = 0;
+    for (const FunctionDecl *FD : Functions) {
+      std::map<Site, unsigned> Sites;
+      count(FD->getBody(), Sites);
+      unsigned Total = 0;
+      size_t Bytes = 0;
+      std::string Kinds;
+      for (const auto &Found : Sites) {
+        Total += Found.second;
+        Bytes += Found.second * siteBytes(Found.first);
+        Kinds += (Kinds.empty() ? "" : ", ") + std::to_string(Found.second) + " " + siteName(Found.first);
+      }
+      if (PerPass.count(FD))
+        PassBytes += Bytes;
+      if (Total)
+        OS << "footprint: " << FD->getNameAsString() << "(): " << Total << " allocations per call (" << Kinds
+           << "), " << Bytes << " bytes\n";
+    }
+
+    size_t Static = GlobalBytes + DefinitionBytes + BufferBytes + StringBytes;
+    OS << "footprint: heap estimate " << Static + PassBytes << " bytes: " << Static << " kept by the module and "
+       << PassBytes << " allocated by each pass through loop()\n";
+    return Static + PassBytes;
+  }
+
+private:
+  enum Site { Float, LongInt, String, List, Object, Call };
+
+  static const char *siteName(Site S) {
+    static const char *Names[] = {"float", "long int", "String", "list", "object", "call that may allocate"};
+    return Names[S];
+  }
+
+  static size_t siteBytes(Site S) { return S == Float || S == LongInt || S == Call ? 16 : 32; }
+
+  static size_t blocks(size_t Bytes) { return (Bytes + 15) / 16 * 16; }
+
+  // Core functions whose conversion allocates nothing on the way. Unlike the interrupt handler's
+  // list this has delay(): sleeping is fine for the heap, but not in a handler.
+  static bool allocationFree(StringRef Name) {
+    static const std::set<std::string> Names = {
+        "digitalRead", "digitalWrite", "analogRead", "analogWrite", "micros", "millis", "delay", "delayMicroseconds",
+        "bitRead", "bitSet", "bitClear", "bitToggle", "bitWrite", "bit", "lowByte", "highByte",
+        "min", "max", "abs", "constrain", "sq"};
+    return Names.count(Name.str()) != 0;
+  }
+
+  // The heap a module-level definition keeps, counting each name it binds in Bound: a dict slot per
+  // name, a function object per def, a type with its methods per class, and an object per peripheral
+  // (machine.PWM, machine.Pin...) or converter class instance (_PulseCapture, _SoftUART, _EEPROM) it
+  // creates. Preallocated buffers are left to the buffer count.
+  static size_t definitionBytes(StringRef Definition, unsigned &Bound) {
+    size_t Bytes = 0;
+    StringRef Rest = Definition;
+    while (!Rest.empty()) {
+      StringRef Line;
+      std::tie(Line, Rest) = Rest.split('\n');
+      if (Line.empty())
+        continue;
+      if (isspace(static_cast<unsigned char>(Line.front()))) {
+        if (Line.trim().startswith("def "))
+          Bytes += 48;
+        continue;
+      }
+      if (Line.startswith("def ")) {
+        ++Bound;
+        Bytes += 8 + 48;
+      } else if (Line.startswith("class ")) {
+        ++Bound;
+        Bytes += 8 + 64;
+      } else if (Line.contains(" = ")) {
+        ++Bound;
+        Bytes += 8;
+        StringRef Value = Line.split(" = ").second;
+        for (size_t At = Value.find('('); At != StringRef::npos; At = Value.find('(', At + 1)) {
+          StringRef Callee = Value.take_front(At);
+          Callee = Callee.substr(Callee.find_last_of(" ([,") + 1);
+          StringRef Class = Callee.rsplit('.').second.empty() ? Callee : Callee.rsplit('.').second;
+          Class = Class.ltrim('_');
+          if (!Class.empty() && isupper(static_cast<unsigned char>(Class.front())))
+            Bytes += 32;
+        }
+        if (Value.startswith("{") || Value.startswith("["))
+          Bytes += 32;
+      }
+    }
+    return Bytes;
+  }
+
+  class StringCollector : public RecursiveASTVisitor<StringCollector> {
+  public:
+    bool VisitStringLiteral(StringLiteral *S) {
+      if (S->getCharByteWidth() == 1)
+        Texts.insert(S->getString().str());
+      return true;
+    }
+
+    // Equal literals share one interned string.
+    std::set<std::string> Texts;
+  };
+
+  // The heap a global's value takes: a float or an integer that outgrows a small int is an object
+  // of its own, an array a list of items, and a class instance an object with its attributes.
+  size_t valueBytes(const VarDecl *Var, QualType T) {
+    if (const ConstantArrayType *Array = Context->getAsConstantArrayType(T)) {
+      uint64_t Size = Array->getSize().getZExtValue();
+      QualType Element = Array->getElementType();
+      if (Element->isCharType() || (Element->isIntegerType() && Context->getTypeSize(Element) == 8))
+        return 16 + blocks(Size);
+      return 16 + blocks(4 * Size) + Size * valueBytes(nullptr, Element);
+    }
+    if (T->isRealFloatingType())
+      return 16;
+    if (T->isIntegerType() && !T->isBooleanType()) {
+      IntegerRanges::Range Range = Var ? Ranges.variableRange(Var) : Ranges.typeRange(T);
+      if (Range.isEmpty() && Var)
+        Range = Ranges.typeRange(T);
+      return Range.within(IntegerRanges::Range::of(-(1 << 30), (1 << 30) - 1)) ? 0 : 16;
+    }
+    if (T->isRecordType())
+      return 32;
+    return 0;
+  }
+
+  // Collects Function and the sketch functions it calls.
+  void reach(const FunctionDecl *Function, std::set<const FunctionDecl *> &Reached) {
+    if (!Reached.insert(Function).second)
+      return;
+    std::vector<const Stmt *> Work = {Function->getBody()};
+    while (!Work.empty()) {
+      const Stmt *S = Work.back();
+      Work.pop_back();
+      if (!S)
+        continue;
+      if (const auto *CE = dyn_cast<CallExpr>(S))
+        if (const FunctionDecl *Callee = CE->getDirectCallee())
+          if (const FunctionDecl *Definition = Callee->getDefinition())
+            if (Context->getSourceManager().isInMainFile(Context->getSourceManager().getExpansionLoc(Definition->getLocation())))
+              reach(Definition, Reached);
+      for (const Stmt *Child : S->children())
+        Work.push_back(Child);
+    }
+  }
+
+  static bool isString(QualType T) {
+    const CXXRecordDecl *Record = T->getAsCXXRecordDecl();
+    return Record && Record->getName() == "String";
+  }
+
+  // Counts what a function body allocates each time it runs.
+  void count(const Stmt *S, std::map<Site, unsigned> &Sites) {
+    if (!S)
+      return;
+    if (isa<BinaryOperator>(S) || isa<UnaryOperator>(S)) {
+      const auto *E = cast<Expr>(S);
+      bool Arithmetic = false;
+      if (const auto *BO = dyn_cast<BinaryOperator>(S))
+        Arithmetic = BO->isAdditiveOp() || BO->isMultiplicativeOp() || BO->isShiftOp() || BO->isCompoundAssignmentOp();
+      else
+        Arithmetic = cast<UnaryOperator>(S)->isIncrementDecrementOp() || cast<UnaryOperator>(S)->getOpcode() == UO_Minus;
+      if (Arithmetic && E->getType()->isRealFloatingType())
+        ++Sites[Float];
+      else if (Arithmetic && E->getType()->isIntegerType() && !Ranges.range(E).within(IntegerRanges::Range::of(-(1 << 30), (1 << 30) - 1)))
+        ++Sites[LongInt];
+    } else if (const auto *Cast = dyn_cast<ImplicitCastExpr>(S)) {
+      if (Cast->getCastKind() == CK_IntegralToFloating)
+        ++Sites[Float];
+    } else if (const auto *DS = dyn_cast<DeclStmt>(S)) {
+      for (const Decl *D : DS->decls())
+        if (const auto *VD = dyn_cast<VarDecl>(D))
+          if (VD->hasLocalStorage() && Context->getAsConstantArrayType(VD->getType()))
+            ++Sites[List];
+    } else if (const auto *Construct = dyn_cast<CXXConstructExpr>(S)) {
+      if (!Construct->isElidable() && !Construct->getConstructor()->isTrivial())
+        ++Sites[isString(Construct->getType()) ? String : Object];
+    } else if (const auto *Operator = dyn_cast<CXXOperatorCallExpr>(S)) {
+      if (isString(Operator->getType()) || (Operator->getNumArgs() && isString(Operator->getArg(0)->getType())))
+        ++Sites[String];
+    } else if (const auto *CE = dyn_cast<CallExpr>(S)) {
+      const FunctionDecl *Callee = CE->getDirectCallee();
+      const auto *Member = dyn_cast<CXXMemberCallExpr>(S);
+      SourceManager &SM = Context->getSourceManager();
+      if (Member && isString(Member->getImplicitObjectArgument()->getType()))
+        ++Sites[String];
+      else if (!Callee || (!SM.isInMainFile(SM.getExpansionLoc(Callee->getLocation())) && (Member || !allocationFree(Callee->getName()))))
+        ++Sites[Call];
+    } else if (isa<CXXNewExpr>(S)) {
+      ++Sites[Object];
+    }
+    for (const Stmt *Child : S->children())
+      count(Child, Sites);
+  }
+
+  ModuleFinaliser &Module;
+  IntegerRanges &Ranges;
+  ASTContext *Context = nullptr;
+};
+
+static std::string prototypeFor(StringRef Header);
+
+//CostModel Class: Estimates what each statement of the converted file costs the MicroPython VM,
+//read from the emitted text: names that are looked up in the module or builtins dict, attribute
+//lookups, calls and heap allocations (float results, lists, bytearrays, match objects, strings
+//built at run time). Statements in a function or in the While True: body are annotated with their
+//estimate, and each of those blocks gets a summary of its hottest lines and the rewrites that would
+//make them cheaper. The weights only rank statements against each other; they are not cycles.
+
+class CostModel {
+  friend class LoopLocaliser;
+
+public:
+  // Returns Python with the statements that run repeatedly annotated, and prints the summaries to OS.
+  std::string annotate(StringRef Python, llvm::raw_ostream &OS) {
+    std::vector<Line> Lines;
+    std::vector<Scope> Scopes(1);
+    Scopes[0].Name = "module";
+    // Headers of the open blocks, as (indent, scope); the module level is never closed.
+    std::vector<std::pair<int, size_t>> Open = {{-1, 0}};
+    char Triple = 0;
+    bool Continued = false;
+    size_t Start = 0;
+    while (true) {
+      size_t End = Python.find('\n', Start);
+      Line L;
+      L.Text = Python.slice(Start, End).str();
+      L.Code = codeOf(L.Text, Triple);
+      // A comment can't be added to a line that ends inside a string or with a backslash.
+      L.InString = Triple != 0;
+      StringRef Code = StringRef(L.Code).trim();
+      L.Continues = !L.InString && Code.endswith("\\");
+      if (Continued) {
+        // The rest of the statement above, whatever its indent.
+        L.Owner = Lines.back().Owner;
+        if (Scopes[L.Owner].hasLocals())
+          collectNames(tokens(Code), Scopes[L.Owner]);
+      } else if (!Code.empty()) {
+        int Indent = static_cast<int>(L.Code.find_first_not_of(" \t"));
+        while (Open.back().first >= Indent)
+          Open.pop_back();
+        L.Owner = Open.back().second;
+        Scope Block;
+        const Scope &Outer = Scopes[L.Owner];
+        if (Code.startswith("def ")) {
+          StringRef Name = Code.drop_front(4).split('(').first.trim();
+          Block.Name = (Outer.Kind == Scope::Class ? Outer.Name + "." : "") + Name.str() + "()";
+          for (std::string &Param : parameters(Code, true))
+            Block.Locals.insert(Param);
+          Block.Kind = Scope::Function;
+        } else if (Code.startswith("class ")) {
+          Block.Name = Code.drop_front(6).split('(').first.split(':').first.trim().str();
+          Block.Kind = Scope::Class;
+        } else if ((Code.startswith("While True") || Code.startswith("while True")) &&
+                   (Outer.Kind == Scope::Module || Outer.Name == "loop()")) {
+          // The loop, at module level or in the function LoopLocaliser puts it in.
+          Block.Name = "While True:";
+          Block.Kind = Scope::Loop;
+          Block.InFunction = Outer.Kind == Scope::Function;
+          Block.Locals = Outer.Locals;
+          Block.Globals = Outer.Globals;
+        } else if (Indent == 0 && !Code.endswith(";") && isFunctionHeader(Code)) {
+          // A sketch function whose braces were commented out.
+          StringRef Declarator = Code.split('(').first.rtrim();
+          Block.Name = Declarator.substr(Declarator.find_last_of(" *&") + 1).str() + "()";
+          for (std::string &Param : parameters(Code, false))
+            Block.Locals.insert(Param);
+          Block.Kind = Scope::Function;
+        }
+        if (!Block.Name.empty()) {
+          L.Header = true;
+          Open.push_back({Indent, Scopes.size()});
+          Scopes.push_back(Block);
+        } else if (Scopes[L.Owner].hasLocals()) {
+          collectNames(tokens(Code), Scopes[L.Owner]);
+        }
+      } else {
+        L.Owner = Open.back().second;
+      }
+      Continued = L.Continues;
+      Lines.push_back(L);
+      if (End == StringRef::npos)
+        break;
+      Start = End + 1;
+    }
+
+    std::string Annotated;
+    for (size_t I = 0; I < Lines.size(); ++I) {
+      Line &L = Lines[I];
+      Scope &S = Scopes[L.Owner];
+      Annotated += L.Text;
+      if (!L.Header && (S.Kind == Scope::Function || S.Kind == Scope::Loop)) {
+        measure(tokens(StringRef(L.Code).trim()), S, L);
+        if (L.Continues && I + 1 < Lines.size()) {
+          // The line the statement ends on carries its cost.
+          Lines[I + 1].Cost += L.Cost;
+          for (const auto &Call : L.Calls)
+            Lines[I + 1].Calls[Call.first] += Call.second;
+        } else if (L.Cost.total() && !L.InString) {
+          Annotated += "  # cost " + std::to_string(L.Cost.total()) + ": " + describe(L.Cost);
+          S.Cost += L.Cost;
+          S.Lines.push_back(I);
+        }
+      }
+      if (I + 1 < Lines.size())
+        Annotated += "\n";
+    }
+
+    for (Scope &S : Scopes)
+      if (!S.Lines.empty())
+        summarise(S, Lines, OS);
+    return Annotated;
+  }
+
+private:
+  // What one statement does that costs more than reading a local.
+  struct Counts {
+    unsigned Globals = 0, Attributes = 0, Calls = 0, Allocations = 0;
+
+    // A dict lookup is about three times a local access, a call with its frame about six and an
+    // allocation, with its share of the garbage collections it leads to, about ten.
+    unsigned total() const { return 3 * Globals + 3 * Attributes + 6 * Calls + 10 * Allocations; }
+
+    Counts &operator+=(const Counts &Other) {
+      Globals += Other.Globals;
+      Attributes += Other.Attributes;
+      Calls += Other.Calls;
+      Allocations += Other.Allocations;
+      return *this;
+    }
+  };
+
+  struct Scope {
+    enum Kinds { Module, Class, Function, Loop } Kind = Module;
+    std::string Name;
+    bool InFunction = false;
+    std::set<std::string> Locals;
+    std::set<std::string> Globals;
+    Counts Cost;
+
+    bool hasLocals() const { return Kind == Function || InFunction; }
+    // The lines with a cost, by index.
+    std::vector<size_t> Lines;
+  };
+
+  struct Line {
+    std::string Text;
+    std::string Code;
+    size_t Owner = 0;
+    bool Header = false;
+    bool InString = false;
+    bool Continues = false;
+    Counts Cost;
+    // How often each name is called, e.g. Pin.value or math.sin.
+    std::map<std::string, unsigned> Calls;
+  };
+
+  struct Token {
+    enum Kinds { Name, Number, String, Operator } Kind;
+    std::string Text;
+    size_t Offset;
+  };
+
+  // Text with its comment cut off and the contents of its string literals blanked, so "#" and "//"
+  // inside a string are not taken for comments; the code keeps its offsets. Triple quoted strings
+  // carry over to the next lines in Triple. A "//" is Python's floor division unless it follows
+  // the end of a statement.
+  static std::string codeOf(StringRef Text, char &Triple) {
+    std::string Code = Text.str();
+    auto blank = [&](size_t From, size_t To) {
+      for (size_t I = From; I < To && I < Code.size(); ++I)
+        Code[I] = ' ';
+    };
+    size_t I = 0;
+    if (Triple) {
+      size_t End = Text.find(std::string(3, Triple));
+      if (End == StringRef::npos)
+        return "";
+      blank(0, End);
+      I = End + 3;
+      Triple = 0;
+    }
+    for (; I < Code.size(); ++I) {
+      char C = Code[I];
+      if (C == '/' && I + 1 < Code.size() && Code[I + 1] == '/') {
+        StringRef Before = StringRef(Code).substr(0, I).rtrim();
+        if (Before.empty() || StringRef(";{}:,").contains(Before.back()))
+          C = '#';
+      }
+      if (C == '#') {
+        Code.resize(I);
+        break;
+      }
+      if (C != '"' && C != '\'')
+        continue;
+      if (Text.substr(I, 3) == std::string(3, C)) {
+        size_t End = Text.find(std::string(3, C), I + 3);
+        if (End == StringRef::npos) {
+          blank(I + 3, Code.size());
+          Triple = C;
+          break;
+        }
+        blank(I + 3, End);
+        I = End + 2;
+        continue;
+      }
+      size_t End = I + 1;
+      while (End < Code.size() && Code[End] != C)
+        End += Code[End] == '\\' ? 2 : 1;
+      blank(I + 1, End);
+      I = End;
+    }
+    return Code;
+  }
+
+  static std::vector<Token> tokens(StringRef Code) {
+    static const char *const Operators[] = {"**=", "//=", ">>=", "<<=", "->", "**", "//", "<<", ">>", "==", "!=", "<=",
+                                            ">=", "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", ":="};
+    std::vector<Token> Found;
+    size_t I = 0;
+    while (I < Code.size()) {
+      char C = Code[I];
+      size_t End = I + 1;
+      if (isspace(static_cast<unsigned char>(C))) {
+        ++I;
+        continue;
+      }
+      if (isalpha(static_cast<unsigned char>(C)) || C == '_') {
+        while (End < Code.size() && (isalnum(static_cast<unsigned char>(Code[End])) || Code[End] == '_'))
+          ++End;
+        // b"", r"" and f"" are literals, not names.
+        if (End < Code.size() && (Code[End] == '"' || Code[End] == '\'') && End - I <= 2) {
+          I = End;
+          continue;
+        }
+        Found.push_back({Token::Name, Code.slice(I, End).str(), I});
+      } else if (isdigit(static_cast<unsigned char>(C)) || (C == '.' && I + 1 < Code.size() && isdigit(static_cast<unsigned char>(Code[I + 1])))) {
+        bool Hex = Code.substr(I).startswith("0x") || Code.substr(I).startswith("0X");
+        while (End < Code.size() && (isalnum(static_cast<unsigned char>(Code[End])) || Code[End] == '.' || Code[End] == '_' ||
+                                     (!Hex && (Code[End] == '-' || Code[End] == '+') && tolower(Code[End - 1]) == 'e')))
+          ++End;
+        Found.push_back({Token::Number, Code.slice(I, End).str(), I});
+      } else if (C == '"' || C == '\'') {
+        End = std::min(Code.find(C, I + 1), Code.size() - 1) + 1;
+        Found.push_back({Token::String, "", I});
+      } else {
+        for (StringRef Operator : Operators)
+          if (Code.substr(I).startswith(Operator)) {
+            End = I + Operator.size();
+            break;
+          }
+        Found.push_back({Token::Operator, Code.slice(I, End).str(), I});
+      }
+      I = End;
+    }
+    return Found;
+  }
+
+  static bool isPythonKeyword(StringRef Name) {
+    static const std::set<std::string> Keywords = {
+        "and", "as", "assert", "break", "class", "continue", "def", "del", "elif", "else", "except", "False", "finally",
+        "for", "from", "global", "if", "import", "in", "is", "lambda", "None", "nonlocal", "not", "or", "pass", "raise",
+        "return", "True", "try", "while", "While", "with", "yield"};
+    return Keywords.count(Name.str());
+  }
+
+  // What is left of the sketch's C++ declarations. int and float are also Python builtins, which
+  // are names when they are called.
+  static bool isTypeName(StringRef Name) {
+    static const std::set<std::string> Types = {
+        "auto", "bool", "boolean", "byte", "char", "const", "double", "float", "int", "int8_t", "int16_t", "int32_t",
+        "long", "short", "signed", "static", "uint8_t", "uint16_t", "uint32_t", "unsigned", "void", "volatile", "word"};
+    return Types.count(Name.str());
+  }
+
+  static bool isKeyword(StringRef Name) { return isPythonKeyword(Name) || isTypeName(Name); }
+
+  // A sketch function's header: a return type and a name before the parameters, and no call of
+  // an attribute such as machine.freq(...).
+  static bool isFunctionHeader(StringRef Code) {
+    if (prototypeFor(Code).empty())
+      return false;
+    StringRef Declarator = Code.split('(').first.rtrim();
+    return Declarator.find_first_of(" *&") != StringRef::npos && !Declarator.contains('.');
+  }
+
+  static bool isAssignment(const std::vector<Token> &Tokens, size_t I) {
+    static const std::set<std::string> Assignments = {"=", "+=", "-=", "*=", "/=", "//=", "%=", "**=", "&=", "|=", "^=",
+                                                      "<<=", ">>=", ":="};
+    return I + 1 < Tokens.size() && Tokens[I + 1].Kind == Token::Operator && Assignments.count(Tokens[I + 1].Text);
+  }
+
+  // Whether the name at I is stored to rather than read: assigned at the outer level of the
+  // statement, or bound by for or as.
+  static bool isStore(const std::vector<Token> &Tokens, size_t I, int Depth) {
+    if (I > 0 && Tokens[I - 1].Kind == Token::Name && (Tokens[I - 1].Text == "for" || Tokens[I - 1].Text == "as"))
+      return true;
+    return Depth == 0 && isAssignment(Tokens, I);
+  }
+
+  static int nesting(const Token &T) {
+    if (T.Kind != Token::Operator)
+      return 0;
+    return T.Text == "(" || T.Text == "[" || T.Text == "{" ? 1 : T.Text == ")" || T.Text == "]" || T.Text == "}" ? -1 : 0;
+  }
+
+  // The parameters of a def (Python) or of a sketch function header: the name before each
+  // annotation or default, or the last word of each C++ parameter.
+  static std::vector<std::string> parameters(StringRef Header, bool Python) {
+    std::vector<std::string> Names;
+    StringRef List = Header.split('(').second.rsplit(')').first;
+    while (!List.empty()) {
+      StringRef Param;
+      std::tie(Param, List) = List.split(',');
+      Param = Param.split('=').first;
+      if (Python)
+        Param = Param.split(':').first;
+      Param = Param.trim().rtrim("[] ");
+      Param = Param.substr(Param.find_last_of(" *&") + 1);
+      if (!Param.empty() && !isKeyword(Param))
+        Names.push_back(Param.str());
+    }
+    return Names;
+  }
+
+  // A Python function's locals are the names it assigns without a global statement.
+  static void collectNames(const std::vector<Token> &Tokens, Scope &S) {
+    if (!Tokens.empty() && Tokens[0].Text == "global") {
+      for (const Token &T : Tokens)
+        if (T.Kind == Token::Name && T.Text != "global")
+          S.Globals.insert(T.Text);
+      return;
+    }
+    int Depth = 0;
+    for (size_t I = 0; I < Tokens.size(); ++I) {
+      const Token &T = Tokens[I];
+      Depth += nesting(T);
+      if (T.Kind == Token::Name && !isKeyword(T.Text) && (I == 0 || Tokens[I - 1].Text != ".") && isStore(Tokens, I, Depth))
+        S.Locals.insert(T.Text);
+    }
+  }
+
+  // What calling Callee allocates: builtins that build an object, math functions returning a
+  // float, and ure functions, which compile their pattern and return a match object.
+  static unsigned allocations(StringRef Callee) {
+    static const std::set<std::string> Building = {"bytearray", "bytes", "dict", "float", "list", "memoryview", "range",
+                                                   "set", "str", "tuple", "array.array", "struct.pack", "ure.compile"};
+    static const std::set<std::string> Integral = {"math.ceil", "math.floor", "math.trunc", "math.isnan", "math.isinf",
+                                                   "math.isfinite"};
+    if (Building.count(Callee.str()))
+      return 1;
+    if (Callee.startswith("math."))
+      return Integral.count(Callee.str()) ? 0 : 1;
+    if (Callee == "ure.match" || Callee == "ure.search")
+      return 2;
+    StringRef Method = Callee.rsplit('.').second;
+    return Method == "format" || Method == "join" || Method == "decode" || Method == "encode" || Method == "split" ? 1 : 0;
+  }
+
+  // Counts what the statement in L does each time it runs, and the names it calls.
+  static void measure(const std::vector<Token> &Tokens, const Scope &S, Line &L) {
+    static const std::set<std::string> Arithmetic = {"+", "-", "*", "**", "+=", "-=", "*=", "**="};
+    if (Tokens.empty() || Tokens[0].Text == "global")
+      return;
+    bool FloatLiteral = false;
+    for (const Token &T : Tokens)
+      if (T.Kind == Token::Number && T.Text.find_first_of(".eE") != std::string::npos && T.Text.find_first_of("xX") == std::string::npos)
+        FloatLiteral = true;
+
+    Counts &C = L.Cost;
+    int Depth = 0;
+    std::string Chain;
+    for (size_t I = 0; I < Tokens.size(); ++I) {
+      const Token &T = Tokens[I];
+      const Token *Prev = I ? &Tokens[I - 1] : nullptr;
+      const Token *Next = I + 1 < Tokens.size() ? &Tokens[I + 1] : nullptr;
+      bool AfterOperand = Prev && ((Prev->Kind == Token::Name && !isKeyword(Prev->Text)) || Prev->Kind == Token::Number ||
+                                   Prev->Kind == Token::String || Prev->Text == ")" || Prev->Text == "]");
+      if (T.Kind == Token::Name) {
+        // int x = 0 declares x, but int(x) calls the builtin.
+        if (isPythonKeyword(T.Text) || (isTypeName(T.Text) && !(Next && Next->Text == "("))) {
+          Chain.clear();
+          continue;
+        }
+        if (Prev && Prev->Text == ".") {
+          // An attribute of a call's result has no name to look up once.
+          ++C.Attributes;
+          if (!Chain.empty())
+            Chain += "." + T.Text;
+          continue;
+        }
+        Chain = T.Text;
+        if (S.hasLocals() && S.Locals.count(T.Text) && !S.Globals.count(T.Text))
+          continue;
+        // A global is read, written, or both for x += 1.
+        C.Globals += Depth == 0 && isAssignment(Tokens, I) && Next->Text != "=" ? 2 : 1;
+        continue;
+      }
+      Depth += nesting(T);
+      if (T.Text == "(") {
+        if (Prev && ((Prev->Kind == Token::Name && !isPythonKeyword(Prev->Text)) || Prev->Text == ")" || Prev->Text == "]")) {
+          ++C.Calls;
+          if (Prev->Kind == Token::Name && !Chain.empty()) {
+            C.Allocations += allocations(Chain);
+            ++L.Calls[Chain];
+          }
+        }
+      } else if (T.Text == "{" || (T.Text == "[" && !AfterOperand)) {
+        // A list, dict or set display.
+        ++C.Allocations;
+      } else if (T.Text == "/" || T.Text == "/=") {
+        // True division always gives a float.
+        ++C.Allocations;
+      } else if ((T.Text == "+" || T.Text == "%") && AfterOperand &&
+                 (Prev->Kind == Token::String || (Next && Next->Kind == Token::String))) {
+        // A string built at run time.
+        ++C.Allocations;
+      } else if (FloatLiteral && AfterOperand && Arithmetic.count(T.Text)) {
+        ++C.Allocations;
+      }
+      if (T.Text != ".")
+        Chain.clear();
+    }
+  }
+
+  static std::string plural(unsigned N, StringRef What) {
+    return std::to_string(N) + " " + What.str() + (N == 1 ? "" : "s");
   }
 
-private:
-  Rewriter &Rewrite;
+  static std::string describe(const Counts &C) {
+    std::string Text;
+    auto add = [&](unsigned N, StringRef What) {
+      if (N)
+        Text += (Text.empty() ? "" : ", ") + plural(N, What);
+    };
+    add(C.Globals, "global lookup");
+    add(C.Attributes, "attribute lookup");
+    add(C.Calls, "call");
+    add(C.Allocations, "allocation");
+    return Text;
+  }
+
+  // Prints the cost of one block, its three hottest lines and what would make it cheaper.
+  static void summarise(const Scope &S, const std::vector<Line> &Lines, llvm::raw_ostream &OS) {
+    bool Loop = S.Kind == Scope::Loop;
+    StringRef Each = Loop ? "per pass" : "per call";
+    OS << "cost: " << S.Name << " " << S.Cost.total() << " " << Each << " (" << describe(S.Cost) << ")\n";
+    std::vector<size_t> Hottest = S.Lines;
+    std::stable_sort(Hottest.begin(), Hottest.end(),
+                     [&](size_t A, size_t B) { return Lines[A].Cost.total() > Lines[B].Cost.total(); });
+    Hottest.resize(std::min<size_t>(Hottest.size(), 3));
+    for (size_t I : Hottest)
+      OS << "cost:   line " << I + 1 << ", " << Lines[I].Cost.total() << ": " << StringRef(Lines[I].Text).trim() << "\n";
+
+    std::map<std::string, unsigned> Calls;
+    for (size_t I : S.Lines)
+      for (const auto &Call : Lines[I].Calls)
+        Calls[Call.first] += Call.second;
+    bool Math = false;
+    for (const auto &Call : Calls) {
+      StringRef Callee = Call.first;
+      if (Callee.startswith("math.") && allocations(Callee))
+        Math = true;
+      if (Callee == "ure.match" || Callee == "ure.search")
+        OS << "cost:   hint: " << Callee << "() compiles its pattern on every call; ure.compile() it once and call "
+           << Callee.drop_front(4) << "() on the result\n";
+      else if (Callee.contains('.') && (Loop || Call.second > 1))
+        OS << "cost:   hint: " << Callee << " is looked up " << plural(Call.second, "time") << " " << Each
+           << "; look it up once " << (Loop ? "before the loop" : "at the top of the function") << "\n";
+    }
+    if (Loop && !S.InFunction && S.Cost.Globals)
+      OS << "cost:   hint: the loop runs at module level, where every name is a dict lookup (" << S.Cost.Globals
+         << " " << Each << "); in a function they would be locals\n";
+    if (Math && !FixedPointMath)
+      OS << "cost:   hint: each math function returns a new float; --fixed-point keeps floats with a known range in integers\n";
+  }
 };
 
-//Handler for the constant e. e is converted to math.e
+//LoopLocaliser Class: MicroPython finds a module global, and each attribute of a dotted name such as
+//utime.sleep_ms or Pin.value, with a dict lookup every time the While True: body uses it. The body is
+//wrapped in a function, loop(), whose prologue binds what the loop calls and the globals it only reads
+//to locals, which the VM reads from the frame; globals the loop assigns get a global statement. Only
+//names that keep their value while the loop runs are bound: imports, module-level definitions and
+//the constants hoisted in front of the loop, sketch functions, builtins, and globals that nothing
+//but setup() writes, and none whose name the body assigns. A return, which ends one pass of loop(),
+//becomes continue.
 
-class eulerHandler : public MatchFinder::MatchCallback {
+class LoopLocaliser {
 public:
-   eulerHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  LoopLocaliser(const ModuleFinaliser &Module, MathOptimiser &Optimiser) : Module(Module), Optimiser(Optimiser) {}
+
+  void localise(ASTContext &Context, Rewriter &Rewrite, llvm::raw_ostream &OS) {
+    const FunctionDecl *Loop = Optimiser.getLoop();
+    if (!Loop || !Loop->getBody())
+      return;
+    SourceManager &SM = Context.getSourceManager();
+    CharSourceRange Range = CharSourceRange::getCharRange(
+        SM.getExpansionLoc(Loop->getBeginLoc()),
+        Lexer::getLocForEndOfToken(SM.getExpansionLoc(Loop->getEndLoc()), 0, SM, Context.getLangOpts()));
+    Rewriter::RewriteOptions Opts;
+    Opts.IncludeInsertsAtBeginOfRange = false;
+    int Size = Rewrite.getRangeSize(Range, Opts);
+    if (Size < 0)
+      return;
+    // What handlers put in front of the loop (the hoisted constants) stays at module level.
+    std::string Text = Rewrite.getRewrittenText(Range);
+    StringRef Hoisted = StringRef(Text).drop_back(Size);
+    std::vector<std::string> Lines;
+    StringRef Rest = StringRef(Text).take_back(Size);
+    while (true) {
+      StringRef Line;
+      std::tie(Line, Rest) = Rest.split('\n');
+      Lines.push_back(Line.str());
+      if (Rest.empty())
+        break;
+    }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::DeclRefExpr* eulerfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("EULER");
-    Rewrite.ReplaceText(eulerfinder->getBeginLoc(), "math.e");
+    std::set<std::string> Callable = Module.boundNames();
+    std::set<std::string> Constant;
+    for (const char *Builtin : {"abs", "bytearray", "bytes", "chr", "divmod", "float", "int", "len", "max", "min", "ord",
+                                "pow", "print", "range", "round", "str"})
+      Callable.insert(Builtin);
+    for (const Decl *D : Context.getTranslationUnitDecl()->decls()) {
+      if (!SM.isInMainFile(SM.getExpansionLoc(D->getLocation())))
+        continue;
+      if (const auto *FD = dyn_cast<FunctionDecl>(D)) {
+        if (FD->doesThisDeclarationHaveABody() && FD != Loop)
+          Callable.insert(FD->getNameAsString());
+      } else if (const auto *VD = dyn_cast<VarDecl>(D)) {
+        if (VD->isFileVarDecl() && Optimiser.isInvariantGlobal(VD))
+          Constant.insert(VD->getNameAsString());
+      }
+    }
+    while (!Hoisted.empty()) {
+      StringRef Line;
+      std::tie(Line, Hoisted) = Hoisted.split('\n');
+      if (Line.contains(" = "))
+        Constant.insert(Line.split(" = ").first.trim().str());
+    }
+
+    // A return ends the pass, which in the function is a continue, unless it is in a loop of its own.
+    std::vector<int> Nested;
+    char Triple = 0;
+    for (size_t N = 1; N < Lines.size(); ++N) {
+      std::string Code = CostModel::codeOf(Lines[N], Triple);
+      std::vector<CostModel::Token> Tokens = CostModel::tokens(Code);
+      if (Tokens.empty())
+        continue;
+      int Indent = static_cast<int>(Code.find_first_not_of(" \t"));
+      while (!Nested.empty() && Nested.back() >= Indent)
+        Nested.pop_back();
+      if (Tokens[0].Text == "for" || Tokens[0].Text == "while" || Tokens[0].Text == "do")
+        Nested.push_back(Indent);
+      for (auto T = Tokens.rbegin(); T != Tokens.rend(); ++T) {
+        if (T->Kind != CostModel::Token::Name || T->Text != "return")
+          continue;
+        if (!Nested.empty()) {
+          OS << "loop: not moved into a function, a return inside a nested loop would end the program there\n";
+          return;
+        }
+        Lines[N].replace(T->Offset, T->Text.size(), "continue");
+      }
+    }
+
+    // Every use of a name that can be bound, and the names the body refers to, which the locals
+    // must not shadow.
+    struct Use {
+      size_t Line;
+      size_t Offset;
+      size_t Length;
+      std::string Name;
+    };
+    std::vector<Use> Uses;
+    std::set<std::string> Taken = {"loop"};
+    // A name the body assigns is local to the whole function, so the prologue can't read it.
+    std::set<std::string> Stored;
+    Triple = 0;
+    for (size_t N = 0; N < Lines.size(); ++N) {
+      std::vector<CostModel::Token> Tokens = CostModel::tokens(CostModel::codeOf(Lines[N], Triple));
+      int Depth = 0;
+      for (size_t I = 0; I < Tokens.size(); ++I) {
+        const CostModel::Token &T = Tokens[I];
+        Depth += CostModel::nesting(T);
+        if (T.Kind != CostModel::Token::Name || CostModel::isPythonKeyword(T.Text) || (I && Tokens[I - 1].Text == "."))
+          continue;
+        Taken.insert(T.Text);
+        if (CostModel::isStore(Tokens, I, Depth) || CostModel::isAssignment(Tokens, I)) {
+          Stored.insert(T.Text);
+          continue;
+        }
+        size_t Last = I;
+        std::string Name = T.Text;
+        while (Last + 2 < Tokens.size() && Tokens[Last + 1].Text == "." && Tokens[Last + 2].Kind == CostModel::Token::Name) {
+          Last += 2;
+          Name += "." + Tokens[Last].Text;
+        }
+        bool Called = Last + 1 < Tokens.size() && Tokens[Last + 1].Text == "(";
+        // A function or a bound method, or a global read as it is.
+        bool Bindable = Last > I ? Called && (Callable.count(T.Text) || Constant.count(T.Text))
+                                 : Called ? Callable.count(T.Text) : Constant.count(T.Text);
+        if (Bindable)
+          Uses.push_back({N, T.Offset, Tokens[Last].Offset + Tokens[Last].Text.size() - T.Offset, Name});
+      }
+    }
+    Uses.erase(std::remove_if(Uses.begin(), Uses.end(),
+                              [&](const Use &U) { return Stored.count(StringRef(U.Name).split('.').first.str()); }),
+               Uses.end());
+    if (Uses.empty())
+      return;
+
+    // A bound method is named after the method, and a global gets a leading underscore (or loses
+    // it, as _K0 does), unless the body already uses that name.
+    std::map<std::string, std::string> Locals;
+    for (const Use &U : Uses) {
+      if (Locals.count(U.Name))
+        continue;
+      StringRef Name = U.Name;
+      std::string Local = Name.contains('.') ? Name.rsplit('.').second.str()
+                          : Name.startswith("_") ? Name.drop_front().str() : "_" + U.Name;
+      if (Taken.count(Local) && Name.contains('.')) {
+        Local = U.Name;
+        std::replace(Local.begin(), Local.end(), '.', '_');
+      }
+      while (Taken.count(Local))
+        Local += "_";
+      Taken.insert(Local);
+      Locals[U.Name] = Local;
+    }
+
+    std::vector<std::string> Body = Lines;
+    for (auto U = Uses.rbegin(); U != Uses.rend(); ++U)
+      Body[U->Line].replace(U->Offset, U->Length, Locals[U->Name]);
+
+    WriteCollector Writes;
+    Writes.TraverseDecl(const_cast<FunctionDecl *>(Loop));
+    std::string Globals;
+    for (const VarDecl *VD : Writes.Written)
+      if (VD->isFileVarDecl() && Taken.count(VD->getNameAsString()))
+        Globals += (Globals.empty() ? "" : ", ") + VD->getNameAsString();
+
+    std::vector<std::string> Prologue;
+    if (!Globals.empty())
+      Prologue.push_back("global " + Globals);
+    std::string Bindings;
+    for (const auto &Binding : Locals) {
+      Prologue.push_back(Binding.second + " = " + Binding.first);
+      Bindings += (Bindings.empty() ? "" : ", ") + Prologue.back();
+    }
+    std::string Function = "def loop():\n";
+    for (const std::string &Line : Prologue)
+      Function += "    " + Line + "\n";
+    for (const std::string &Line : Body)
+      Function += (StringRef(Line).trim().empty() ? "" : "    ") + Line + "\n";
+    Function += "loop()";
+    replaceConverted(Rewrite, Range, Function);
+
+    // The dict lookups the body does each pass at module level, and those left in the function.
+    CostModel::Scope Before, After;
+    Before.Kind = CostModel::Scope::Loop;
+    After.Kind = CostModel::Scope::Function;
+    char BeforeTriple = 0, AfterTriple = 0;
+    for (const std::string &Line : Prologue)
+      CostModel::collectNames(CostModel::tokens(Line), After);
+    for (size_t N = 0; N < Body.size(); ++N)
+      CostModel::collectNames(CostModel::tokens(CostModel::codeOf(Body[N], AfterTriple)), After);
+    unsigned Removed = 0, Total = 0;
+    AfterTriple = 0;
+    for (size_t N = 0; N < Body.size(); ++N) {
+      CostModel::Line Old, New;
+      CostModel::measure(CostModel::tokens(CostModel::codeOf(Lines[N], BeforeTriple)), Before, Old);
+      CostModel::measure(CostModel::tokens(CostModel::codeOf(Body[N], AfterTriple)), After, New);
+      Total += Old.Cost.Globals + Old.Cost.Attributes;
+      Removed += Old.Cost.Globals + Old.Cost.Attributes - New.Cost.Globals - New.Cost.Attributes;
+    }
+    OS << "loop: " << Removed << " of " << Total << " dict lookups per pass are now local reads (" << Bindings << ")\n";
   }
 
 private:
-  Rewriter &Rewrite;
+  const ModuleFinaliser &Module;
+  MathOptimiser &Optimiser;
 };
 
 // Implementation of the ASTConsumer interface for reading an AST produced
@@ -733,12 +6909,12 @@ private:
 // the AST.
 class MyASTConsumer : public ASTConsumer {
 public:
-  MyASTConsumer(Rewriter &R) : HandlerForIf(R), HandlerForFor(R), HandlerForpinMode(R), HandlerForLoopExpr(R), HandlerForDelay(R), HandlerForSetup(R), HandlerForCompoundStmt(R), 
-  HandlerForPower(R), HandlerForSqrt(R), HandlerForSin(R), HandlerForCos(R), HandlerForTan(R), HandlerForDelayMicroseconds(R), HandlerForMillis(R), HandlerForMicros(R), HandlerForPulseIn(R),
-  HandlerForPinModePin(R), HandlerForINPUT(R), HandlerForOUTPUT(R), HandlerForINPUTPULLUP(R), HandlerForIsAlpha(R),HandlerForIsAlphaVar(R), HandlerForIsAlphaNumeric(R), 
-  HandlerForIsAlphaNumericVar(R), HandlerForIsAscii(R), HandlerForIsAsciiVar(R), HandlerForIsDigit(R), HandlerForIsDigitVar(R), HandlerForIsLowerCase(R), HandlerForIsLowerCaseVar(R),
-   HandlerForIsPunct(R), HandlerForIsPunctVar(R), HandlerForIsSpace(R), HandlerForIsSpaceVar(R), HandlerForIsUpperCase(R), HandlerForIsUpperCaseVar(R), HandlerForIsWhitespace(R), HandlerForIsWhitespaceVar(R),
-   HandlerForAnalogRead(R), HandlerForAnalogWrite(R), HandlerForDigitalRead(R), HandlerForDigitalWrite(R), HandlerForPi(R), HandlerForEuler(R){
+  MyASTConsumer(Rewriter &R) : Rewrite(R), HandlerForIf(R), HandlerForFor(R), HandlerForpinMode(Edits, Module), HandlerForLoopExpr(R), HandlerForDelay(Edits, Module), HandlerForSetup(R), HandlerForCompoundStmt(R), 
+  HandlerForPower(R, Module, Optimiser), HandlerForSqrt(R, Module, Optimiser), HandlerForSin(R, Module, Optimiser), HandlerForCos(R, Module, Optimiser), HandlerForTan(R, Module, Optimiser), HandlerForConstantFold(R, Optimiser), HandlerForLoopInvariant(R, Module, Optimiser), HandlerForCoreHelper(Module, Optimiser), HandlerForIntegerWrap(Module, Optimiser, Ranges), HandlerForFixedPoint(Module, Optimiser, FixedPoint), HandlerForWire(R, Module, Optimiser, Ranges), HandlerForSPI(R, Module, Optimiser, Ranges), HandlerForShift(R, Module, Optimiser, Ranges), HandlerForTone(Module, Optimiser), HandlerForSoftwareSerial(R, Module, Optimiser, Ranges), HandlerForCharCompare(Edits), HandlerForEEPROM(Module, Optimiser), HandlerForCriticalSection(R, Module), HandlerForInterrupt(R, Module, Optimiser, Ranges), HandlerForDelayMicroseconds(Edits, Module), HandlerForMillis(Edits, Module), HandlerForMicros(Edits, Module), HandlerForPulseIn(Module, Optimiser),
+  HandlerForPinModePin(Edits), HandlerForINPUT(Edits), HandlerForOUTPUT(Edits), HandlerForINPUTPULLUP(Edits), HandlerForIsAlpha(Edits, Module),HandlerForIsAlphaVar(Edits), HandlerForIsAlphaNumeric(Edits, Module), 
+  HandlerForIsAlphaNumericVar(Edits), HandlerForIsAscii(Edits, Module), HandlerForIsAsciiVar(Edits), HandlerForIsDigit(Edits, Module), HandlerForIsDigitVar(Edits), HandlerForIsLowerCase(Edits, Module), HandlerForIsLowerCaseVar(Edits),
+   HandlerForIsPunct(Edits, Module), HandlerForIsPunctVar(Edits), HandlerForIsSpace(Edits, Module), HandlerForIsSpaceVar(Edits), HandlerForIsUpperCase(Edits, Module), HandlerForIsUpperCaseVar(Edits), HandlerForIsWhitespace(Edits, Module), HandlerForIsWhitespaceVar(Edits),
+   HandlerForAnalogRead(Module, Optimiser), HandlerForAnalogWrite(Module, Optimiser, Ranges), HandlerForDigitalRead(Edits, Module), HandlerForDigitalWrite(Edits, Module), HandlerForPi(R, Module, Optimiser), HandlerForEuler(R, Module, Optimiser){
     // Add a simple matcher for finding 'if' statements.
     Matcher.addMatcher(ifStmt().bind("ifStmt"), &HandlerForIf);
 
@@ -764,7 +6940,7 @@ public:
 
 //Add A matcher for PinMode
 
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
 	callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("pinMode")))).bind("pinMode"), &HandlerForpinMode);
 
 //Add A matcher for void_loop function of Arduino
@@ -773,7 +6949,7 @@ Matcher.addMatcher(
   functionDecl(isExpansionInMainFile(), hasName("loop"), parameterCountIs(0)).bind("loopexpr"), &HandlerForLoopExpr); 
 
  //Add A matcher for delay() function
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("delay")))).bind("delay"), &HandlerForDelay);
 
  //Add A matcher to delete Void Setup() 
@@ -804,108 +6980,175 @@ Matcher.addMatcher(
 Matcher.addMatcher(
   stmt(isExpansionInMainFile(), has(declRefExpr(throughUsingDecl(hasName("tan"))))).bind("tan"), &HandlerForTan);
 
-//Add a matcher to convert delayMicroseconds() to its Micropython equivalent.
+//Add a matcher for pure math that can be evaluated at conversion time
+Matcher.addMatcher(
+  expr(isExpansionInMainFile(), anyOf(binaryOperator(), unaryOperator(), callExpr(callee(functionDecl(hasAnyName("pow", "sqrt", "sin", "cos", "tan", "map", "min", "max", "abs", "constrain",
+  "sq", "radians", "degrees", "lowByte", "highByte", "bitRead", "bit")))))).bind("foldable"), &HandlerForConstantFold);
+
+//Add a matcher for loop invariant math inside void loop()
 Matcher.addMatcher(
+  expr(isExpansionInMainFile(), hasAncestor(functionDecl(hasName("loop"), parameterCountIs(0))), anyOf(binaryOperator(), unaryOperator(), callExpr(callee(functionDecl(hasAnyName("pow", "sqrt", "sin", "cos", "tan", "map", "min", "max", "abs", "constrain",
+  "sq", "radians", "degrees", "lowByte", "highByte", "bitRead", "bit")))))).bind("invariant"), &HandlerForLoopInvariant);
+
+//Add a matcher for the Arduino core helpers, spelled out as inline expressions
+Matcher.addMatcher(
+  callExpr(isExpansionInMainFile(), callee(functionDecl(hasAnyName("map", "min", "max", "abs", "constrain", "sq", "radians", "degrees",
+  "lowByte", "highByte", "bitRead", "bitSet", "bitClear", "bitToggle", "bitWrite", "bit")))).bind("coreHelper"), &HandlerForCoreHelper);
+
+//Add a matcher for integer arithmetic and stores that can overflow their C type
+Matcher.addMatcher(
+  expr(isExpansionInMainFile(), hasType(isInteger()), anyOf(binaryOperator(), unaryOperator(), castExpr())).bind("integerOp"), &HandlerForIntegerWrap);
+
+//Add matchers for the float variables the --fixed-point mode keeps as scaled integers
+Matcher.addMatcher(
+  declRefExpr(isExpansionInMainFile(), to(varDecl(hasType(realFloatingType())))).bind("fixedRef"), &HandlerForFixedPoint);
+Matcher.addMatcher(
+  varDecl(isExpansionInMainFile(), hasType(realFloatingType())).bind("fixedVar"), &HandlerForFixedPoint);
+
+//Add a matcher for calls on Wire, so whole I2C transactions become single machine.I2C calls
+Matcher.addMatcher(
+  cxxMemberCallExpr(isExpansionInMainFile(), on(hasType(cxxRecordDecl(hasName("TwoWire"))))).bind("wire"), &HandlerForWire);
+
+//Add a matcher for calls on SPI, so transactions and runs of transfers become buffered machine.SPI calls
+Matcher.addMatcher(
+  callExpr(isExpansionInMainFile(), callee(cxxMethodDecl(ofClass(hasName("SPIClass"))))).bind("spi"), &HandlerForSPI);
+
+//Add a matcher for shiftOut() and shiftIn(), clocked by hardware SPI or a compiled helper
+Matcher.addMatcher(
+  callExpr(isExpansionInMainFile(), callee(functionDecl(hasAnyName("shiftOut", "shiftIn")))).bind("shift"), &HandlerForShift);
+
+//Add a matcher to convert tone() and noTone() to PWM on the pin
+Matcher.addMatcher(
+  callExpr(isExpansionInMainFile(), callee(functionDecl(hasAnyName("tone", "noTone")))).bind("tone"), &HandlerForTone);
+
+//Add matchers to convert SoftwareSerial objects and their calls to a UART
+Matcher.addMatcher(
+  varDecl(isExpansionInMainFile(), hasType(cxxRecordDecl(hasName("SoftwareSerial")))).bind("serialVar"), &HandlerForSoftwareSerial);
+Matcher.addMatcher(
+  cxxMemberCallExpr(isExpansionInMainFile(), on(hasType(cxxRecordDecl(hasName("SoftwareSerial"))))).bind("serial"), &HandlerForSoftwareSerial);
+
+//Add a matcher to compare character literals with bytes as the character's code
+TokenMatcher.addMatcher(
+  binaryOperator(isExpansionInMainFile(), isComparisonOperator(), hasEitherOperand(ignoringParenImpCasts(characterLiteral()))).bind("charCompare"), &HandlerForCharCompare);
+
+//Add matchers to keep EEPROM in a RAM image and convert get()/put() to struct packing
+Matcher.addMatcher(
+  declRefExpr(isExpansionInMainFile(), to(varDecl(hasName("EEPROM"), hasType(cxxRecordDecl(hasName("EEPROMClass")))))).bind("eepromRef"), &HandlerForEEPROM);
+Matcher.addMatcher(
+  cxxMemberCallExpr(isExpansionInMainFile(), on(hasType(cxxRecordDecl(hasName("EEPROMClass"))))).bind("eeprom"), &HandlerForEEPROM);
+
+//Add matchers to convert ATOMIC_BLOCK() and noInterrupts()/interrupts() to machine.disable_irq()/enable_irq()
+Matcher.addMatcher(
+  forStmt(isExpansionInMainFile(), hasLoopInit(declStmt(has(varDecl(hasName("__ToDo")))))).bind("atomic"), &HandlerForCriticalSection);
+Matcher.addMatcher(
+  asmStmt(isExpansionInMainFile()).bind("irq"), &HandlerForCriticalSection);
+
+//Add a matcher to convert attachInterrupt()/detachInterrupt() to Pin.irq() and lower the volatile state the handler shares
+Matcher.addMatcher(
+  callExpr(isExpansionInMainFile(), callee(functionDecl(hasAnyName("attachInterrupt", "detachInterrupt")))).bind("interrupt"), &HandlerForInterrupt);
+
+//Add a matcher to convert delayMicroseconds() to its Micropython equivalent.
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("delayMicroseconds")))).bind("delayMicroseconds"), &HandlerForDelayMicroseconds);
 
 //Add a matcher to convert millis() to its Micropython equivalent.
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("millis")))).bind("millis"), &HandlerForMillis);
 
 //Add a matcher to convert micros() to its Micropython equivalent.
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("micros")))).bind("micros"), &HandlerForMicros);
 
-  //Add a matcher to convert micros() to its Micropython equivalent.
+  //Add a matcher to convert pulseIn() and pulseInLong() to its Micropython equivalent.
 Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("pulseIn")))).bind("pulseIn"), &HandlerForPulseIn);
+  callExpr(isExpansionInMainFile(), callee(functionDecl(hasAnyName("pulseIn", "pulseInLong")))).bind("pulseIn"), &HandlerForPulseIn);
 
   //Add a matcher to convert pin numbers to pin numbers with prefix 'p' inside Pin.Mode.
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   stmt(isExpansionInMainFile(), hasAncestor(callExpr(callee(functionDecl(hasName("pinMode"))))), has(integerLiteral())).bind("pinModePin"), &HandlerForPinModePin);
 
     //Add a matcher to convert INPUT to IN. pinmode uses Pin.Mode(PIN.IN)
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   stmt(isExpansionInMainFile(), declRefExpr(to(varDecl(hasName("INPUT"))))).bind("INPUT"), &HandlerForINPUT);
 
 //Add a matcher to convert Output to OUT. pinmode uses Pin.Mode(PIN.OUT)
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   stmt(isExpansionInMainFile(), declRefExpr(to(varDecl(hasName("OUTPUT"))))).bind("OUTPUT"), &HandlerForOUTPUT);
 
 //Add a matcher to convert INPUT_PULLUP to PULLUP pinmode uses Pin.Mode(PIN.PULL_UP)
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   stmt(isExpansionInMainFile(), declRefExpr(to(varDecl(hasName("INPUT_PULLUP"))))).bind("INPUT_PULLUP"), &HandlerForINPUTPULLUP);
 
 //Add a matcher to convert isAlpha to ure.match()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isAlpha")))).bind("isAlpha"), &HandlerForIsAlpha);
 
 //Add a matcher to add the regex string inside the isAlpha()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isAlpha")))))).bind("isAlphaVar"), &HandlerForIsAlphaVar);
 
 //Add a matcher to convert isAlphaNumeric to ure.match()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isAlphaNumeric")))).bind("isAlphaNumeric"), &HandlerForIsAlphaNumeric);
 
 //Add a matcher to add the regex string inside the isAlphaNumeric()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isAlphaNumeric")))))).bind("isAlphaNumericVar"), &HandlerForIsAlphaNumericVar);
 
 //Add a matcher to convert isAscii to ure.match()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isAscii")))).bind("isAscii"), &HandlerForIsAscii);
 
 //Add a matcher to add the regex string inside the isAscii()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isAscii")))))).bind("isAsciiVar"), &HandlerForIsAsciiVar);
 
 //Add a matcher to convert isDigit to ure.match()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isDigit")))).bind("isDigit"), &HandlerForIsDigit);
 
 //Add a matcher to add the regex string inside the isDigit()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isDigit")))))).bind("isDigitVar"), &HandlerForIsDigitVar);
 
 //Add a matcher to convert isLowerCase to ure.match()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isLowerCase")))).bind("isLowerCase"), &HandlerForIsLowerCase);
 
 //Add a matcher to add the regex string inside the isLowerCase()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isLowerCase")))))).bind("isLowerCaseVar"), &HandlerForIsLowerCaseVar);
 
 //Add a matcher to convert isPunct to ure.match()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isPunct")))).bind("isPunct"), &HandlerForIsPunct);
 
 //Add a matcher to add the regex string inside the isPunct()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isPunct")))))).bind("isPunctVar"), &HandlerForIsPunctVar);
 
 //Add a matcher to convert isSpace to ure.match()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isSpace")))).bind("isSpace"), &HandlerForIsSpace);
 
 //Add a matcher to add the regex string inside the isSpace()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isSpace")))))).bind("isSpaceVar"), &HandlerForIsSpaceVar);
 
 //Add a matcher to convert isUpperCase to ure.match()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isUpperCase")))).bind("isUpperCase"), &HandlerForIsUpperCase);
 
 //Add a matcher to add the regex string inside the isUpperCase()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isUpperCase")))))).bind("isUpperCaseVar"), &HandlerForIsUpperCaseVar);
 
 //Add a matcher to convert isWhitespace to ure.match()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isWhitespace")))).bind("isWhitespace"), &HandlerForIsWhitespace);
 
 //Add a matcher to add the regex string inside the isWhitespace()
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isWhitespace")))))).bind("isWhitespaceVar"), &HandlerForIsWhitespaceVar);
 //Add a matcher to convert analogRead to its micropython equivalent.
 Matcher.addMatcher(
@@ -916,11 +7159,11 @@ Matcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("analogWrite")))).bind("analogWrite"), &HandlerForAnalogWrite);
 
 //Add a matcher to convert digitalRead to its micropython equivalent.
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("digitalRead")))).bind("digitalRead"), &HandlerForDigitalRead);
 
 //Add a matcher to convert digitalWrite to its micropython equivalent.
-Matcher.addMatcher(
+TokenMatcher.addMatcher(
   callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("digitalWrite")))).bind("digitalWrite"), &HandlerForDigitalWrite);
 
 //Add a matcher to convert the constant Pi to its micropython equivalent.
@@ -934,12 +7177,75 @@ Matcher.addMatcher(
   }
 
   void HandleTranslationUnit(ASTContext &Context) override {
-    // Run the matchers when we have the whole TU parsed.
+    // Work out which math can be folded or hoisted, which integers can overflow and which floats
+    // can be fixed point before any handler rewrites them.
+    Optimiser.analyse(Context);
+    Ranges.analyse(Context, Optimiser);
+    FixedPoint.plan(Context, Optimiser, Ranges, Module);
+
+    // Rename single tokens first, all at once, then run the other matchers over the whole TU, or
+    // over the functions given to convertOnly().
+    if (!Only.empty())
+      Context.setTraversalScope(Only);
+    TokenMatcher.matchAST(Context);
+    Edits.apply(Rewrite, notes());
     Matcher.matchAST(Context);
+    if (!Only.empty())
+      Context.setTraversalScope({Context.getTranslationUnitDecl()});
+
+    // Emit the import block and drop dead code once every handler has run.
+    Module.finalise(Context, Rewrite);
+    if (Full) {
+      Spliceable = Module.isWithin(*Full);
+      if (!Spliceable)
+        return;
+    }
 
+    const FunctionDecl *Loop = Optimiser.getLoop();
+    if (CacheLookups && (!Full || std::count(Only.begin(), Only.end(), Loop)))
+      LoopLocaliser(Full ? *Full : Module, Optimiser).localise(Context, Rewrite, notes());
+
+    if (!Full && (Footprint || RamBudget)) {
+      size_t Estimate = FootprintEstimator(Module, Ranges).estimate(Context, notes());
+      if (RamBudget && Estimate > RamBudget) {
+        DiagnosticsEngine &Diags = Context.getDiagnostics();
+        Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Error, "the converted sketch needs about %0 bytes of heap, over the --ram-budget of %1"))
+            << static_cast<unsigned>(Estimate) << static_cast<unsigned>(RamBudget);
+      }
+    }
+  }
+
+  // Every matcher is limited to the main file, so the bodies in the header shim (SPI.h,
+  // EEPROM.h, WString.h, atomic.h...) are skipped by the parser unless a handler needs them.
+  // Sema still keeps constexpr bodies, which the optimiser evaluates (min, max, bit...).
+  bool shouldSkipFunctionBody(Decl *D) override {
+    const SourceManager &SM = D->getASTContext().getSourceManager();
+    return !SM.isInMainFile(SM.getExpansionLoc(D->getLocation()));
+  }
+
+  // Converts only Functions, for --watch, whose other functions keep the text they got from a
+  // conversion of the whole sketch that built FullModule. The analyses still see the whole TU.
+  void convertOnly(std::vector<Decl *> Functions, const ModuleFinaliser &FullModule) {
+    Only = std::move(Functions);
+    Full = &FullModule;
   }
 
+  // Whether the functions converted alone needed no import, definition or buffer the full
+  // conversion didn't have, so their text can replace the old one.
+  bool spliceable() const { return Spliceable; }
+
+  const ModuleFinaliser &module() const { return Module; }
+
 private:
+  Rewriter &Rewrite;
+  ModuleFinaliser Module;
+  std::vector<Decl *> Only;
+  const ModuleFinaliser *Full = nullptr;
+  bool Spliceable = true;
+  TokenEdits Edits;
+  MathOptimiser Optimiser;
+  IntegerRanges Ranges;
+  FixedPointLowering FixedPoint;
   IfStmtHandler HandlerForIf;
   IncrementForLoopHandler HandlerForFor;
   pinModeVariableHandler HandlerForpinMode;
@@ -952,6 +7258,20 @@ private:
   sinHandler HandlerForSin;
   cosHandler HandlerForCos;
   tanHandler HandlerForTan;
+  constantFoldHandler HandlerForConstantFold;
+  loopInvariantHandler HandlerForLoopInvariant;
+  coreHelperHandler HandlerForCoreHelper;
+  integerWrapHandler HandlerForIntegerWrap;
+  fixedPointHandler HandlerForFixedPoint;
+  wireHandler HandlerForWire;
+  spiHandler HandlerForSPI;
+  shiftHandler HandlerForShift;
+  toneHandler HandlerForTone;
+  softwareSerialHandler HandlerForSoftwareSerial;
+  charCompareHandler HandlerForCharCompare;
+  eepromHandler HandlerForEEPROM;
+  criticalSectionHandler HandlerForCriticalSection;
+  interruptHandler HandlerForInterrupt;
   delayMicrosecondsHandler HandlerForDelayMicroseconds;
   millisHandler HandlerForMillis;
   microsHandler HandlerForMicros;
@@ -986,41 +7306,863 @@ private:
   eulerHandler HandlerForEuler;
 
 
+  MatchFinder TokenMatcher;
   MatchFinder Matcher;
 };
 
-// For each source file provided to the tool, a new FrontendAction is created.
-class MyFrontendAction : public ASTFrontendAction {
-public:
-  MyFrontendAction() {}
-  void EndSourceFileAction() override {
+//Sketch Class: An Arduino sketch given as a .ino file or a sketch folder. Its tabs are joined into
+//one C++ file in memory the way arduino-builder prepares a sketch: Arduino.h is included, the
+//functions the tabs define get prototypes ahead of the first definition, and #line directives map
+//every line back to its tab. The joined file is only ever seen through the overlay file system.
+
+struct Sketch {
+  // <folder>/<main tab>.cpp, beside the tabs so that includes relative to them still resolve.
+  std::string Path;
+  std::string Source;
+  // Offset and length of each piece of text the tool added; they are dropped from the output.
+  std::vector<std::pair<unsigned, unsigned>> Generated;
+};
+
+static std::vector<Sketch> Sketches;
+
+static bool isSketchTab(StringRef Path) {
+  StringRef Extension = llvm::sys::path::extension(Path);
+  return Extension == ".ino" || Extension == ".pde";
+}
+
+// Lists the tabs of the sketch Input names, main tab first. A sketch folder holds <folder>.ino and
+// the other tabs, which the IDE appends in alphabetical order. A .ino file that isn't the main tab
+// of its folder is converted on its own.
+static std::vector<std::string> sketchTabs(StringRef Input) {
+  SmallString<256> Path(Input);
+  llvm::sys::fs::make_absolute(Path);
+  llvm::sys::path::remove_dots(Path, true);
+  bool IsFolder = llvm::sys::fs::is_directory(Path);
+  SmallString<256> Folder(IsFolder ? Path.str() : llvm::sys::path::parent_path(Path));
+
+  std::string Main;
+  for (const char *Extension : {".ino", ".pde"}) {
+    SmallString<256> Candidate(Folder);
+    llvm::sys::path::append(Candidate, llvm::sys::path::filename(Folder) + Extension);
+    if (llvm::sys::fs::exists(Candidate)) {
+      Main = std::string(Candidate);
+      break;
+    }
+  }
+  if (!IsFolder && Path.str() != Main)
+    return {std::string(Path)};
+  if (Main.empty())
+    return {};
+
+  std::vector<std::string> Tabs;
+  std::error_code EC;
+  for (llvm::sys::fs::directory_iterator It(Folder, EC), End; It != End && !EC; It.increment(EC))
+    if (isSketchTab(It->path()) && It->path() != Main)
+      Tabs.push_back(It->path());
+  std::sort(Tabs.begin(), Tabs.end());
+  Tabs.insert(Tabs.begin(), Main);
+  return Tabs;
+}
+
+// Blanks out comments, preprocessor lines and the contents of string and character literals, so
+// the braces and semicolons left belong to the code. Offsets and newlines are kept.
+static std::string blankNonCode(StringRef Text) {
+  std::string Code = Text.str();
+  auto blank = [&](size_t From, size_t To) {
+    for (size_t I = From; I < To && I < Code.size(); ++I)
+      if (Code[I] != '\n')
+        Code[I] = ' ';
+  };
+  bool LineStart = true;
+  for (size_t I = 0; I < Code.size(); ++I) {
+    char C = Code[I];
+    char Next = I + 1 < Code.size() ? Code[I + 1] : '\0';
+    size_t End = I;
+    if (C == '/' && Next == '/') {
+      End = std::min(Code.find('\n', I), Code.size());
+    } else if (C == '/' && Next == '*') {
+      End = Code.find("*/", I + 2);
+      End = End == std::string::npos ? Code.size() : End + 2;
+    } else if (C == '#' && LineStart) {
+      End = Code.find('\n', I);
+      while (End != std::string::npos && Code[End - 1] == '\\')
+        End = Code.find('\n', End + 1);
+      End = std::min(End, Code.size());
+    } else if (C == '"' || C == '\'') {
+      End = I + 1;
+      while (End < Code.size() && Code[End] != C && Code[End] != '\n')
+        End += Code[End] == '\\' ? 2 : 1;
+      blank(I + 1, End);
+      I = std::min(End, Code.size());
+      LineStart = false;
+      continue;
+    } else {
+      if (C == '\n')
+        LineStart = true;
+      else if (!isspace(static_cast<unsigned char>(C)))
+        LineStart = false;
+      continue;
+    }
+    blank(I, End);
+    I = End - 1;
+  }
+  return Code;
+}
+
+// Returns the prototype for a file scope declaration that opens a brace, or "" when it isn't a
+// plain function definition. Templates, member functions defined outside their class, default
+// arguments and macros such as ISR(vector) are left alone, as arduino-builder does.
+static std::string prototypeFor(StringRef Header) {
+  std::string Prototype;
+  for (char C : Header.trim()) {
+    if (!isspace(static_cast<unsigned char>(C)))
+      Prototype += C;
+    else if (Prototype.back() != ' ')
+      Prototype += ' ';
+  }
+  StringRef Text(Prototype);
+  if (!Text.endswith(")") || Text.contains('=') || Text.contains("::") || Text.startswith("template") ||
+      Text.startswith("extern"))
+    return "";
+
+  int Depth = 0;
+  size_t Open = Text.size();
+  while (Open-- > 0) {
+    Depth += Text[Open] == ')' ? 1 : Text[Open] == '(' ? -1 : 0;
+    if (Depth == 0)
+      break;
+  }
+  StringRef Declarator = Text.substr(0, Open).rtrim();
+  size_t NameStart = Declarator.find_last_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_");
+  if (Open == StringRef::npos || NameStart == StringRef::npos || NameStart + 1 == Declarator.size() ||
+      Declarator.substr(0, NameStart + 1).trim().empty())
+    return "";
+  return Prototype + ";";
+}
+
+struct FunctionDefinition {
+  size_t Begin;
+  std::string Prototype;
+};
+
+static std::vector<FunctionDefinition> findFunctionDefinitions(StringRef Text) {
+  std::string Code = blankNonCode(Text);
+  std::vector<FunctionDefinition> Found;
+  size_t Start = 0;
+  int Depth = 0;
+  for (size_t I = 0; I < Code.size(); ++I) {
+    if (Code[I] == '{') {
+      if (Depth++ == 0) {
+        StringRef Header = StringRef(Code).slice(Start, I);
+        std::string Prototype = prototypeFor(Header);
+        if (!Prototype.empty())
+          Found.push_back({Start + Header.find_first_not_of(" \t\r\n"), Prototype});
+      }
+    } else if (Code[I] == '}') {
+      if (Depth > 0 && --Depth == 0)
+        Start = I + 1;
+    } else if (Code[I] == ';' && Depth == 0) {
+      Start = I + 1;
+    }
+  }
+  return Found;
+}
+
+static std::string lineDirective(unsigned Line, StringRef File) {
+  std::string Escaped;
+  for (char C : File) {
+    if (C == '\\' || C == '"')
+      Escaped += '\\';
+    Escaped += C;
+  }
+  return "#line " + std::to_string(Line) + " \"" + Escaped + "\"\n";
+}
+
+// Reads the tabs of the sketch Input names and joins them into Result.
+static bool loadSketch(StringRef Input, Sketch &Result) {
+  std::vector<std::string> Tabs = sketchTabs(Input);
+  if (Tabs.empty()) {
+    llvm::errs() << "sketch: " << Input << " has no main .ino tab\n";
+    return false;
+  }
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> Buffers;
+  std::vector<std::vector<FunctionDefinition>> Definitions;
+  for (const std::string &Tab : Tabs) {
+    auto Buffer = llvm::MemoryBuffer::getFile(Tab);
+    if (!Buffer) {
+      llvm::errs() << "sketch: cannot read " << Tab << ": " << Buffer.getError().message() << "\n";
+      return false;
+    }
+    Definitions.push_back(findFunctionDefinitions((*Buffer)->getBuffer()));
+    Buffers.push_back(std::move(*Buffer));
+  }
+
+  auto lineOf = [](StringRef Text, size_t Offset) { return 1 + static_cast<unsigned>(Text.take_front(Offset).count('\n')); };
+  std::string Prototypes;
+  for (size_t I = 0; I < Tabs.size(); ++I)
+    for (const FunctionDefinition &Definition : Definitions[I])
+      Prototypes += lineDirective(lineOf(Buffers[I]->getBuffer(), Definition.Begin), Tabs[I]) + Definition.Prototype + "\n";
+
+  Result.Path = Tabs.front() + ".cpp";
+  auto generate = [&](StringRef Text) {
+    Result.Generated.push_back({static_cast<unsigned>(Result.Source.size()), static_cast<unsigned>(Text.size())});
+    Result.Source += Text.str();
+  };
+  generate("#include \"Arduino.h\"\n");
+  for (size_t I = 0; I < Tabs.size(); ++I) {
+    StringRef Text = Buffers[I]->getBuffer();
+    generate(lineDirective(1, Tabs[I]));
+    if (!Prototypes.empty() && !Definitions[I].empty()) {
+      size_t LineStart = Text.take_front(Definitions[I].front().Begin).rfind('\n') + 1;
+      Result.Source += Text.take_front(LineStart).str();
+      generate(Prototypes + lineDirective(lineOf(Text, LineStart), Tabs[I]));
+      Text = Text.drop_front(LineStart);
+      Prototypes.clear();
+    }
+    Result.Source += Text.str();
+    if (!Text.empty() && !Text.endswith("\n"))
+      generate("\n");
+  }
+  return true;
+}
+
+// Returns the converted main file, before --cost annotates it.
+static std::string rewrittenText(Rewriter &TheRewriter) {
    SourceManager &SM = TheRewriter.getSourceMgr();
-   llvm::errs() << "** EndSourceFileAction for: "
+   notes() << "** EndSourceFileAction for: "
                  << SM.getFileEntryForID(SM.getMainFileID())->getName() << "\n";
+    // Drop the include, prototypes and #line directives added to a joined .ino sketch.
+    for (const Sketch &S : Sketches) {
+      if (S.Path != SM.getFileEntryForID(SM.getMainFileID())->getName())
+        continue;
+      SourceLocation Start = SM.getLocForStartOfFile(SM.getMainFileID());
+      for (const auto &Text : S.Generated)
+        removeConverted(TheRewriter, CharSourceRange::getCharRange(Start.getLocWithOffset(Text.first),
+                                                                   Start.getLocWithOffset(Text.first + Text.second)));
+    }
+    std::string Python;
+    llvm::raw_string_ostream Out(Python);
+    TheRewriter.getEditBuffer(SM.getMainFileID()).write(Out);
+    return Out.str();
+}
+
+// Adds the --cost comments to a converted file.
+static std::string annotatedText(const std::string &Python) {
+  if (Cost)
+    return CostModel().annotate(Python, notes());
+  return Python;
+}
+
+// Returns the converted main file.
+static std::string convertedText(Rewriter &TheRewriter) {
+  return annotatedText(rewrittenText(TheRewriter));
+}
+
+// Prints a converted file and writes it to output.txt.
+static void emitConverted(StringRef Python) {
 //Now emit the Rewritten Buffer
-    TheRewriter.getEditBuffer(TheRewriter.getSourceMgr().getMainFileID())
-        .write(llvm::outs());
+    llvm::outs() << Python;
 
 std::error_code error_code;
         llvm::raw_fd_ostream outFile("output.txt", error_code, llvm::sys::fs::F_None);
-     TheRewriter.getEditBuffer(SM.getMainFileID()).write(outFile); // --> this will write the result>
+     outFile << Python; // --> this will write the result>
     outFile.close();
+}
+
+// The Python module a file converts to: Blink for Blink.cpp or for a joined Blink.ino.cpp.
+static std::string moduleName(StringRef Source) {
+  StringRef Stem = llvm::sys::path::stem(Source);
+  if (isSketchTab(Stem))
+    Stem = llvm::sys::path::stem(Stem);
+  std::string Name;
+  for (char C : Stem)
+    Name += isalnum(static_cast<unsigned char>(C)) ? C : '_';
+  if (Name.empty() || isdigit(static_cast<unsigned char>(Name[0])))
+    Name.insert(0, "_");
+  return Name;
+}
+
+// Writes a converted file as <module>.py and, with --mpy, precompiles it to <module>.mpy.
+static bool emitModule(StringRef Source, StringRef Python) {
+  std::string Module = moduleName(Source);
+  std::error_code EC;
+  llvm::raw_fd_ostream File(Module + ".py", EC, llvm::sys::fs::F_None);
+  if (EC) {
+    llvm::errs() << "mpy: cannot write " << Module << ".py: " << EC.message() << "\n";
+    return false;
+  }
+  File << Python;
+  File.close();
+  if (!EmitMpy)
+    return true;
+
+  llvm::ErrorOr<std::string> Program = llvm::sys::findProgramByName(MpyCross);
+  if (!Program) {
+    llvm::errs() << "mpy: cannot find " << MpyCross << "\n";
+    return false;
+  }
+  std::vector<std::string> Args = {*Program, "-o", Module + ".mpy"};
+  if (!MpyArch.empty())
+    Args.push_back("-march=" + MpyArch);
+  if (MpyEmit != "bytecode") {
+    Args.push_back("-X");
+    Args.push_back("emit=" + MpyEmit);
+  }
+  Args.push_back(Module + ".py");
+  std::vector<StringRef> Argv(Args.begin(), Args.end());
+  std::string Error;
+  if (llvm::sys::ExecuteAndWait(*Program, Argv, llvm::None, {}, 0, 0, &Error) != 0) {
+    llvm::errs() << "mpy: " << MpyCross << " failed on " << Module << ".py" << (Error.empty() ? "" : ": " + Error) << "\n";
+    return false;
+  }
+  return true;
+}
+
+// Writes --frozen-manifest: a manifest.py that freezes the converted modules into the firmware.
+static bool writeManifest(const std::vector<std::string> &Modules) {
+  SmallString<256> Folder;
+  llvm::sys::fs::current_path(Folder);
+  std::error_code EC;
+  llvm::raw_fd_ostream Manifest(FrozenManifest, EC, llvm::sys::fs::F_None);
+  if (EC) {
+    llvm::errs() << "mpy: cannot write " << FrozenManifest << ": " << EC.message() << "\n";
+    return false;
+  }
+  Manifest << "# Freezes the sketches converted by micropy-convert into the firmware. Include it from\n"
+              "# the board's manifest.py with include(\"" << FrozenManifest << "\").\n";
+  for (const std::string &Module : Modules)
+    Manifest << "module(\"" << Module << ".py\", base_path=r\"" << Folder << "\")\n";
+  return true;
+}
 
+// For each source file provided to the tool, a new FrontendAction is created.
+class MyFrontendAction : public ASTFrontendAction {
+public:
+  MyFrontendAction(std::string &Python) : Python(Python) {}
+  void EndSourceFileAction() override {
+    Python = convertedText(TheRewriter);
   }
 
   std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
                                                  StringRef file) override {
     TheRewriter.setSourceMgr(CI.getSourceManager(), CI.getLangOpts());
+    // Lets the parser ask MyASTConsumer::shouldSkipFunctionBody about each body.
+    CI.getFrontendOpts().SkipFunctionBodies = SkipHeaderBodies;
     return std::make_unique<MyASTConsumer>(TheRewriter);
   }
 
 private:
   Rewriter TheRewriter;
+  std::string &Python;
+};
+
+// Creates the action for one file, which leaves the converted file in Python. Each file has its
+// own Rewriter, so files can be converted on separate threads.
+class MyFrontendActionFactory : public FrontendActionFactory {
+public:
+  MyFrontendActionFactory(std::string &Python) : Python(Python) {}
+  std::unique_ptr<FrontendAction> create() override { return std::make_unique<MyFrontendAction>(Python); }
+
+private:
+  std::string &Python;
+};
+
+//Conversion: what converting one file produced, kept until the files before it are printed.
+
+struct Conversion {
+  std::string Python;
+  std::string Notes;
+  int Result = 0;
+};
+
+//EmbeddedHeader: one file of the Arduino header shim, compiled in from ArduinoHeaders.inc, which
+//EmbedHeaders.cmake generates from the Arduino-headerfiles folder at build time.
+
+struct EmbeddedHeader {
+  const char *Name;
+  const unsigned char *Data;
+  size_t Size;
+};
+
+#include "ArduinoHeaders.inc"
+
+// Where the embedded headers appear to be. It comes first on the include path, so a sketch in any
+// folder finds "Arduino.h" there.
+static const char EmbeddedHeaderDir[] = "/micropy-convert/arduino";
+
+// The real file system with the embedded headers and the joined sketches laid over it; reading
+// them touches no disk.
+static llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> overlayFileSystem() {
+  auto Files = llvm::makeIntrusiveRefCnt<llvm::vfs::InMemoryFileSystem>();
+  for (const EmbeddedHeader &Header : EmbeddedHeaders) {
+    // Each array ends in a 0 past Size, as the SourceManager wants.
+    StringRef Data(reinterpret_cast<const char *>(Header.Data), Header.Size);
+    Files->addFile(std::string(EmbeddedHeaderDir) + "/" + Header.Name, 0, llvm::MemoryBuffer::getMemBuffer(Data, Header.Name));
+  }
+  for (const Sketch &S : Sketches)
+    Files->addFile(S.Path, 0, llvm::MemoryBuffer::getMemBufferCopy(S.Source, S.Path));
+  // A physical file system of its own: the shared one follows the process working directory, which
+  // ClangTool changes while it runs a file.
+  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> Disk(llvm::vfs::createPhysicalFileSystem().release());
+  auto Overlay = llvm::makeIntrusiveRefCnt<llvm::vfs::OverlayFileSystem>(Disk);
+  Overlay->pushOverlay(Files);
+  return Overlay;
+}
+
+//SaveWatcher: Tells when Input was saved: the file, or a tab of a sketch. Each poll only looks at the
+//tabs it knows of; the folder is listed again when its own time changes, as it does when a tab is
+//added, removed or saved by renaming a new file over it.
+
+class SaveWatcher {
+public:
+  SaveWatcher(StringRef Input) : Input(Input.str()) {
+    if (isSketchTab(Input) || llvm::sys::fs::is_directory(Input)) {
+      SmallString<256> Path(Input);
+      llvm::sys::fs::make_absolute(Path);
+      Folder = llvm::sys::fs::is_directory(Path) ? Path.str().str() : llvm::sys::path::parent_path(Path).str();
+      FolderTime = modified(Folder);
+    }
+    Files = Folder.empty() ? std::vector<std::string>{this->Input} : sketchTabs(Input);
+    for (const std::string &File : Files)
+      Times.push_back(modified(File));
+  }
+
+  // Whether a tab was saved, added or removed since the last call.
+  bool saved() {
+    std::vector<std::string> Listed = Files;
+    if (!Folder.empty()) {
+      llvm::sys::TimePoint<> Time = modified(Folder);
+      if (Time != FolderTime) {
+        FolderTime = Time;
+        Listed = sketchTabs(Input);
+      }
+    }
+    std::vector<llvm::sys::TimePoint<>> Now;
+    for (const std::string &File : Listed)
+      Now.push_back(modified(File));
+    bool Changed = Listed != Files || Now != Times;
+    Files = std::move(Listed);
+    Times = std::move(Now);
+    return Changed;
+  }
+
+private:
+  static llvm::sys::TimePoint<> modified(StringRef Path) {
+    llvm::sys::fs::file_status Status;
+    if (llvm::sys::fs::status(Path, Status))
+      return llvm::sys::TimePoint<>();
+    return Status.getLastModificationTime();
+  }
+
+  std::string Input;
+  std::string Folder;
+  llvm::sys::TimePoint<> FolderTime;
+  std::vector<std::string> Files;
+  std::vector<llvm::sys::TimePoint<>> Times;
+};
+
+//FunctionFacts Class: What the conversion of the rest of a sketch depends on in one function: the
+//globals, functions and library names it refers to, the text of each store to a global and of each
+//call that sets a bus or an interrupt up. Shared is set for a function that can't be converted
+//alone: one that uses a volatile global (interrupt handlers lower those everywhere), or whose
+//handlers number what they create across the sketch (critical sections, Wire and SPI buffers).
+
+class FunctionFacts : public RecursiveASTVisitor<FunctionFacts> {
+public:
+  FunctionFacts(ASTContext &Context) : Context(Context) {}
+
+  bool VisitCallExpr(CallExpr *E) {
+    if (const auto *Callee = dyn_cast<DeclRefExpr>(E->getCallee()->IgnoreParenImpCasts()))
+      Callees.insert(Callee);
+    const FunctionDecl *F = E->getDirectCallee();
+    if (!F || !F->getIdentifier())
+      return true;
+    static const std::set<std::string> Numbered = {"noInterrupts", "interrupts", "__iCliRetVal"};
+    static const std::set<std::string> Setup = {"begin", "setClock", "beginTransaction", "attachInterrupt", "detachInterrupt"};
+    const auto *Method = dyn_cast<CXXMethodDecl>(F);
+    StringRef Class = Method ? Method->getParent()->getName() : "";
+    if (Numbered.count(F->getName().str()) || Class == "TwoWire" || Class == "SPIClass")
+      Shared = true;
+    bool Stores = Setup.count(F->getName().str());
+    for (unsigned I = 0; I < E->getNumArgs() && I < F->getNumParams(); ++I)
+      Stores |= F->getParamDecl(I)->getType()->isReferenceType() && isGlobal(E->getArg(I));
+    if (Stores)
+      Facts.insert("calls " + text(E));
+    return true;
+  }
+
+  bool VisitDeclRefExpr(DeclRefExpr *E) {
+    const ValueDecl *D = E->getDecl();
+    if (const auto *VD = dyn_cast<VarDecl>(D)) {
+      if (!VD->hasGlobalStorage())
+        return true;
+      Shared |= Context.getBaseElementType(VD->getType()).isVolatileQualified();
+    } else if (const auto *FD = dyn_cast<FunctionDecl>(D)) {
+      if (!Callees.count(E))
+        AddressTaken.insert(FD->getCanonicalDecl());
+    }
+    Facts.insert("uses " + D->getQualifiedNameAsString());
+    return true;
+  }
+
+  bool VisitMemberExpr(MemberExpr *E) {
+    Facts.insert("uses " + E->getMemberDecl()->getQualifiedNameAsString());
+    return true;
+  }
+
+  bool VisitBinaryOperator(BinaryOperator *E) {
+    if (E->isAssignmentOp() && isGlobal(E->getLHS()))
+      Facts.insert("stores " + text(E));
+    return true;
+  }
+
+  bool VisitUnaryOperator(UnaryOperator *E) {
+    if ((E->isIncrementDecrementOp() || E->getOpcode() == UO_AddrOf) && isGlobal(E->getSubExpr()))
+      Facts.insert("stores " + text(E));
+    return true;
+  }
+
+  // Collects the facts of one function, returning their hash.
+  size_t collect(FunctionDecl *F) {
+    Facts.clear();
+    Shared = false;
+    TraverseDecl(F);
+    return llvm::hash_combine_range(Facts.begin(), Facts.end());
+  }
+
+  bool Shared = false;
+  // Functions passed by address anywhere, such as interrupt handlers.
+  std::set<const FunctionDecl *> AddressTaken;
+
+private:
+  bool isGlobal(const Expr *E) {
+    E = E->IgnoreParenImpCasts();
+    if (const auto *ME = dyn_cast<MemberExpr>(E))
+      return isGlobal(ME->getBase());
+    if (const auto *ASE = dyn_cast<ArraySubscriptExpr>(E))
+      return isGlobal(ASE->getBase());
+    const auto *DRE = dyn_cast<DeclRefExpr>(E);
+    const auto *VD = DRE ? dyn_cast<VarDecl>(DRE->getDecl()) : nullptr;
+    return VD && VD->hasGlobalStorage();
+  }
+
+  std::string text(const Expr *E) {
+    const SourceManager &SM = Context.getSourceManager();
+    CharSourceRange Range = SM.getExpansionRange(E->getSourceRange());
+    return Lexer::getSourceText(Range, SM, Context.getLangOpts()).str();
+  }
+
+  ASTContext &Context;
+  std::set<std::string> Facts;
+  std::set<const DeclRefExpr *> Callees;
+};
+
+//SketchFunction: A function defined in a watched sketch, as the last conversion saw it: hashes of
+//its source and of its facts, and the text it was converted to.
+
+struct SketchFunction {
+  std::string Name;
+  size_t Source = 0;
+  size_t Facts = 0;
+  bool Shared = false;
+  std::string Python;
+};
+
+// The functions defined in the main file, in order, with the range each one's text covers, and a
+// summary of each. Outside is the hash of the rest of the file: globals, types and prototypes.
+static std::vector<SketchFunction> summariseFunctions(ASTContext &Context, std::vector<std::pair<FunctionDecl *, CharSourceRange>> &Functions, size_t &Outside) {
+  SourceManager &SM = Context.getSourceManager();
+  const LangOptions &LangOpts = Context.getLangOpts();
+  for (Decl *D : Context.getTranslationUnitDecl()->decls()) {
+    auto *FD = dyn_cast<FunctionDecl>(D);
+    if (!FD || !FD->doesThisDeclarationHaveABody() || !SM.isInMainFile(SM.getExpansionLoc(FD->getLocation())))
+      continue;
+    SourceLocation Begin = SM.getExpansionLoc(FD->getBeginLoc());
+    SourceLocation End = Lexer::getLocForEndOfToken(SM.getExpansionLoc(FD->getEndLoc()), 0, SM, LangOpts);
+    if (End.isValid() && SM.isInMainFile(Begin))
+      Functions.push_back({FD, CharSourceRange::getCharRange(Begin, End)});
+  }
+
+  StringRef File = SM.getBufferData(SM.getMainFileID());
+  FunctionFacts Facts(Context);
+  std::vector<SketchFunction> Summaries;
+  std::string Rest;
+  unsigned From = 0;
+  for (const auto &Function : Functions) {
+    unsigned Begin = SM.getFileOffset(Function.second.getBegin()), End = SM.getFileOffset(Function.second.getEnd());
+    Rest += File.slice(From, Begin).str();
+    From = End;
+    SketchFunction Summary;
+    Summary.Name = Function.first->getNameAsString() + ": " + Function.first->getType().getAsString();
+    Summary.Source = llvm::hash_value(File.slice(Begin, End));
+    Summary.Facts = Facts.collect(Function.first);
+    Summary.Shared = Facts.Shared;
+    Summaries.push_back(Summary);
+  }
+  Rest += File.substr(From).str();
+  Outside = llvm::hash_value(Rest);
+  for (size_t I = 0; I < Functions.size(); ++I)
+    Summaries[I].Shared |= Facts.AddressTaken.count(Functions[I].first->getCanonicalDecl()) != 0;
+  return Summaries;
+}
+
+//IncrementalConverter: Converts a watched sketch after each save, keeping the last text of the
+//functions that didn't change. Functions that changed are converted alone when their facts are the
+//same as before and they need no import, definition or buffer the last full conversion didn't
+//have; their new text replaces the old one. Anything else converts the whole sketch again.
+
+class IncrementalConverter {
+public:
+  // Returns the converted file, before --cost annotates it. Done says how much was converted.
+  std::string convert(ASTContext &Context, std::string &Done) {
+    std::vector<std::pair<FunctionDecl *, CharSourceRange>> Current;
+    size_t NewOutside = 0;
+    std::vector<SketchFunction> Summaries = summariseFunctions(Context, Current, NewOutside);
+
+    // The matchers run over the changed functions and everything in the main file that isn't a
+    // function, which handlers may need to have seen (SoftwareSerial ports, volatile globals...).
+    SourceManager &SM = Context.getSourceManager();
+    std::vector<Decl *> Only;
+    unsigned Changed = 0;
+    bool Whole = !Module || FixedPointMath || NewOutside != Outside || Summaries.size() != Functions.size();
+    size_t Next = 0;
+    for (Decl *D : Context.getTranslationUnitDecl()->decls()) {
+      if (Whole)
+        break;
+      if (!SM.isInMainFile(SM.getExpansionLoc(D->getLocation())))
+        continue;
+      if (Next == Current.size() || D != Current[Next].first) {
+        Only.push_back(D);
+        continue;
+      }
+      const SketchFunction &Old = Functions[Next], &New = Summaries[Next];
+      ++Next;
+      if (New.Name != Old.Name || New.Facts != Old.Facts || New.Shared != Old.Shared) {
+        Whole = true;
+      } else if (New.Source != Old.Source) {
+        Whole = New.Shared;
+        Only.push_back(D);
+        ++Changed;
+      }
+    }
+
+    if (!Whole && !Changed) {
+      for (size_t I = 0; I < Summaries.size(); ++I)
+        Summaries[I].Python = Functions[I].Python;
+      Done = "nothing to convert again";
+    } else if (!Whole && splice(Context, Current, Summaries, Only)) {
+      Done = "converted " + std::to_string(Changed) + (Changed == 1 ? " function" : " functions") + " alone";
+    } else {
+      Rewriter Rewrite(SM, Context.getLangOpts());
+      MyASTConsumer Consumer(Rewrite);
+      Consumer.HandleTranslationUnit(Context);
+      for (size_t I = 0; I < Summaries.size(); ++I)
+        Summaries[I].Python = Rewrite.getRewrittenText(Current[I].second);
+      Python = rewrittenText(Rewrite);
+      Module = std::make_unique<ModuleFinaliser>(Consumer.module());
+      Outside = NewOutside;
+      Done = "converted the whole sketch";
+    }
+    Functions = std::move(Summaries);
+    return Python;
+  }
+
+private:
+  // Converts the changed functions and puts their text in place of the old one, in the order the
+  // functions come in. False when the result can't be used.
+  bool splice(ASTContext &Context, const std::vector<std::pair<FunctionDecl *, CharSourceRange>> &Current,
+              std::vector<SketchFunction> &Summaries, const std::vector<Decl *> &Only) {
+    Rewriter Rewrite(Context.getSourceManager(), Context.getLangOpts());
+    MyASTConsumer Consumer(Rewrite);
+    Consumer.convertOnly(Only, *Module);
+    Consumer.HandleTranslationUnit(Context);
+    if (!Consumer.spliceable())
+      return false;
+    std::string Spliced = Python;
+    size_t At = 0;
+    for (size_t I = 0; I < Summaries.size(); ++I) {
+      const std::string &Old = Functions[I].Python;
+      At = Spliced.find(Old, At);
+      if (At == std::string::npos)
+        return false;
+      Summaries[I].Python = Summaries[I].Source == Functions[I].Source ? Old : Rewrite.getRewrittenText(Current[I].second);
+      Spliced.replace(At, Old.size(), Summaries[I].Python);
+      At += Summaries[I].Python.size();
+    }
+    Python = std::move(Spliced);
+    return true;
+  }
+
+  // The module the last full conversion built, and what the last conversion gave.
+  std::unique_ptr<ModuleFinaliser> Module;
+  size_t Outside = 0;
+  std::vector<SketchFunction> Functions;
+  std::string Python;
 };
 
+// Converts Input, then converts it again each time it is saved. The sketch is kept as an ASTUnit
+// whose preamble, the Arduino headers it includes, is precompiled once; each later conversion only
+// parses the sketch itself, and IncrementalConverter converts only the functions that changed when
+// nothing the other functions depend on did. Saves are polled for every 10 ms, which adds at most
+// that much to the time to a new module; a poll stats the folder and the tabs, without listing the
+// folder.
+static int watchSketch(StringRef Input, const std::string &Source, const CompilationDatabase &Compilations, const char *Argv0) {
+  std::vector<CompileCommand> Commands = Compilations.getCompileCommands(Source);
+  if (Commands.empty()) {
+    llvm::errs() << "watch: no compile command for " << Source << "\n";
+    return 1;
+  }
+  CommandLineArguments Args = Commands.front().CommandLine;
+  Args = getClangSyntaxOnlyAdjuster()(Args, Source);
+  Args = getClangStripOutputAdjuster()(Args, Source);
+  Args = getInsertArgumentAdjuster(("-I" + std::string(EmbeddedHeaderDir)).c_str(), ArgumentInsertPosition::BEGIN)(Args, Source);
+  Args.insert(Args.begin() + 1, "-resource-dir=" + CompilerInvocation::GetResourcesPath(Argv0, reinterpret_cast<void *>(&watchSketch)));
+  std::vector<const char *> Argv;
+  for (const std::string &Arg : Args)
+    Argv.push_back(Arg.c_str());
+
+  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS = overlayFileSystem();
+  llvm::IntrusiveRefCntPtr<DiagnosticsEngine> Diags = CompilerInstance::createDiagnostics(new DiagnosticOptions());
+  std::shared_ptr<CompilerInvocation> Invocation = createInvocationFromCommandLine(Argv, Diags, FS);
+  if (!Invocation)
+    return 1;
+  auto PCHContainerOps = std::make_shared<PCHContainerOperations>();
+  auto Start = std::chrono::steady_clock::now();
+  std::unique_ptr<ASTUnit> AST = ASTUnit::LoadFromCompilerInvocation(
+      Invocation, PCHContainerOps, Diags, new FileManager(FileSystemOptions(), FS), false, CaptureDiagsKind::None,
+      /*PrecompilePreambleAfterNParses=*/1);
+  if (!AST)
+    return 1;
+
+  SaveWatcher Watcher(Input);
+  IncrementalConverter Converter;
+  bool Failed = false;
+  while (true) {
+    // A save that doesn't compile keeps the last good output.txt, .py and .mpy; Clang has
+    // printed why.
+    if (Failed || AST->getDiagnostics().hasErrorOccurred()) {
+      llvm::errs() << "watch: " << Input << " has errors, keeping the last conversion\n";
+    } else {
+      std::string Done;
+      std::string Python = annotatedText(Converter.convert(AST->getASTContext(), Done));
+      emitConverted(Python);
+      if (EmitMpy)
+        emitModule(Source, Python);
+      auto Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - Start);
+      llvm::errs() << "watch: " << Done << " in " << Elapsed.count() << " ms\n";
+    }
+
+    while (!Watcher.saved())
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    Start = std::chrono::steady_clock::now();
+
+    // The file manager caches what it read, so the saved text is handed to the reparse directly.
+    std::unique_ptr<llvm::MemoryBuffer> Main;
+    for (Sketch &S : Sketches) {
+      if (S.Path != Source)
+        continue;
+      Sketch Reloaded;
+      if (!loadSketch(Input, Reloaded))
+        return 1;
+      S = std::move(Reloaded);
+      Main = llvm::MemoryBuffer::getMemBufferCopy(S.Source, S.Path);
+    }
+    if (!Main) {
+      auto Buffer = llvm::MemoryBuffer::getFile(Source);
+      if (!Buffer) {
+        llvm::errs() << "watch: cannot read " << Source << ": " << Buffer.getError().message() << "\n";
+        return 1;
+      }
+      Main = std::move(*Buffer);
+    }
+    // The reparse takes ownership of the remapped buffer.
+    Failed = AST->Reparse(PCHContainerOps, {{Source, Main.release()}}, FS);
+  }
+}
+
 int main(int argc, const char **argv) {
   CommonOptionsParser op(argc, argv, MatcherSampleCategory);
-  ClangTool Tool(op.getCompilations(), op.getSourcePathList());
+  // .ino files and sketch folders are converted as the joined file loadSketch() builds.
+  std::vector<std::string> Sources;
+  for (const std::string &Input : op.getSourcePathList()) {
+    if (!isSketchTab(Input) && !llvm::sys::fs::is_directory(Input)) {
+      Sources.push_back(Input);
+      continue;
+    }
+    Sketch S;
+    if (!loadSketch(Input, S))
+      return 1;
+    Sources.push_back(S.Path);
+    Sketches.push_back(std::move(S));
+  }
+  if (MpyEmit != "bytecode" && MpyEmit != "native" && MpyEmit != "viper") {
+    llvm::errs() << "mpy: --mpy-emit is bytecode, native or viper\n";
+    return 1;
+  }
+  if (MpyEmit != "bytecode" && MpyArch.empty()) {
+    llvm::errs() << "mpy: --mpy-emit=" << MpyEmit << " needs --mpy-arch\n";
+    return 1;
+  }
+  bool WriteModules = EmitMpy || !FrozenManifest.empty();
+  if (Watch) {
+    if (Sources.size() != 1) {
+      llvm::errs() << "watch: give exactly one sketch to watch\n";
+      return 1;
+    }
+    return watchSketch(op.getSourcePathList().front(), Sources.front(), op.getCompilations(), argv[0]);
+  }
 
-  return Tool.run(newFrontendActionFactory<MyFrontendAction>().get());
+  // Workers take the next file until none are left. Each file gets its own tool, file system and
+  // rewriter; its output and notes are printed once every file is converted, in input order.
+  std::vector<Conversion> Conversions(Sources.size());
+  std::atomic<size_t> Next(0);
+  auto convert = [&]() {
+    for (size_t I; (I = Next++) < Sources.size();) {
+      Conversion &C = Conversions[I];
+      llvm::raw_string_ostream Notes(C.Notes);
+      TextDiagnosticPrinter Diagnostics(Notes, new DiagnosticOptions());
+      NotesStream = Jobs == 1 ? nullptr : &Notes;
+      ClangTool Tool(op.getCompilations(), {Sources[I]}, std::make_shared<PCHContainerOperations>(), overlayFileSystem());
+      Tool.appendArgumentsAdjuster(getInsertArgumentAdjuster(("-I" + std::string(EmbeddedHeaderDir)).c_str(), ArgumentInsertPosition::BEGIN));
+      if (Jobs != 1)
+        Tool.setDiagnosticConsumer(&Diagnostics);
+      MyFrontendActionFactory Factory(C.Python);
+      C.Result = Tool.run(&Factory);
+      NotesStream = nullptr;
+      Notes.flush();
+      if (Jobs == 1 && !C.Python.empty()) {
+        emitConverted(C.Python);
+        if (WriteModules && !emitModule(Sources[I], C.Python))
+          C.Result = 1;
+      }
+    }
+  };
+  unsigned Threads = Jobs ? Jobs : std::thread::hardware_concurrency();
+  Threads = std::max(1u, std::min(Threads, static_cast<unsigned>(Sources.size())));
+  std::vector<std::thread> Workers;
+  for (unsigned I = 1; I < Threads; ++I)
+    Workers.emplace_back(convert);
+  convert();
+  for (std::thread &Worker : Workers)
+    Worker.join();
+
+  int Result = 0;
+  std::vector<std::string> Modules;
+  for (size_t I = 0; I < Conversions.size(); ++I) {
+    Conversion &C = Conversions[I];
+    if (Jobs != 1) {
+      llvm::errs() << C.Notes;
+      if (!C.Python.empty()) {
+        emitConverted(C.Python);
+        if (WriteModules && !emitModule(Sources[I], C.Python))
+          C.Result = 1;
+      }
+    }
+    if (!C.Python.empty())
+      Modules.push_back(moduleName(Sources[I]));
+    Result = std::max(Result, C.Result);
+  }
+  if (!FrozenManifest.empty() && !writeManifest(Modules))
+    Result = std::max(Result, 1);
+  return Result;
 }